@@ -0,0 +1,246 @@
+#include "ChatConnection.h"
+#include "ChatClient.h"
+
+#include <deque>
+
+namespace
+{
+template<class... Ts> struct Overloaded : Ts... { using Ts::operator()...; };
+template<class... Ts> Overloaded(Ts...) -> Overloaded<Ts...>;
+}
+
+// ChatClient сетевого потока: обработчики только складывают события в очередь GUI
+class GuiChatClient : public user_chat::ChatClient
+{
+    ChatConnection &m_connection;
+
+    // События, не поместившиеся в очередь; порядок сохраняется
+    std::deque<ChatEvent> m_overflow;
+    boost::asio::steady_timer m_retryTimer;
+    bool m_isRetryArmed = false;
+
+public:
+    GuiChatClient(ChatConnection &connection, const std::string &userName)
+        : ChatClient(userName), m_connection(connection), m_retryTimer(context())
+    {
+    }
+
+    void onConnected(const boost::system::error_code &ec) override
+    {
+        ChatClient::onConnected(ec);
+        push(ChatEventConnection{!ec});
+    }
+
+    void onDisconnected() override
+    {
+        push(ChatEventConnection{false});
+    }
+
+    void onUsersListReceived(std::vector<user_chat::UserStatus> &users) override
+    {
+        push(ChatEventUsersList{users});
+    }
+
+    void onPresenceChanged(const std::vector<user_chat::UserStatus> &changes) override
+    {
+        push(ChatEventPresence{changes});
+    }
+
+    void onMessageReceived(const user_chat::PacketMessage &packet) override
+    {
+        push(ChatEventMessage{userNameById(packet.getSenderId()), packet.getMessageText()});
+    }
+
+    void onAuthError(user_chat::AuthError error) override
+    {
+        push(ChatEventAuthError{error});
+    }
+
+    void onHistoryReceived(user_chat::ServerPacketHistory &packet) override
+    {
+        push(std::move(packet));
+    }
+
+    void onSearchResult(user_chat::ServerPacketSearchResult &packet) override
+    {
+        push(std::move(packet));
+    }
+
+private:
+    void push(ChatEvent &&event)
+    {
+        if (m_overflow.empty() && m_connection.tryPost(std::move(event)))
+        {
+            return;
+        }
+        m_overflow.push_back(std::move(event));
+        armRetry();
+    }
+
+    // GUI не успевает: повторяем позже, не блокируя сетевой поток
+    void armRetry()
+    {
+        if (m_isRetryArmed)
+        {
+            return;
+        }
+        m_isRetryArmed = true;
+        m_retryTimer.expires_after(std::chrono::milliseconds(5));
+        m_retryTimer.async_wait([this](const boost::system::error_code &ec)
+                                {
+                                    m_isRetryArmed = false;
+                                    if (ec)
+                                    {
+                                        return;
+                                    }
+                                    while (!m_overflow.empty() && m_connection.tryPost(std::move(m_overflow.front())))
+                                    {
+                                        m_overflow.pop_front();
+                                    }
+                                    if (!m_overflow.empty())
+                                    {
+                                        armRetry();
+                                    }
+                                });
+    }
+};
+
+ChatConnection::ChatConnection(QObject *parent)
+    : QObject(parent)
+    , m_events(kQueueCapacity)
+{
+    m_frameTimer.setSingleShot(true);
+    connect(&m_frameTimer, &QTimer::timeout, this, &ChatConnection::drain);
+}
+
+ChatConnection::~ChatConnection()
+{
+    stop();
+}
+
+void ChatConnection::start(const QString &host, const QString &port, const QString &userName,
+                           const QString &password, bool isRegistration)
+{
+    stop();
+
+    m_userName = userName;
+    m_client = std::make_shared<GuiChatClient>(*this, userName.toStdString());
+    m_client->setPassword(password.toStdString(), isRegistration);
+
+    ReconnectPolicy policy;
+    policy.m_isEnabled = true;
+    m_client->setReconnectPolicy(policy);
+
+    m_thread = std::thread([client = m_client, host = host.toStdString(), port = port.toStdString()]
+                           {
+                               client->run(host, port);
+                           });
+}
+
+void ChatConnection::stop()
+{
+    if (!m_client)
+    {
+        return;
+    }
+
+    boost::asio::post(m_client->context(), [client = m_client]
+                      {
+                          client->close();
+                          client->context().stop();
+                      });
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+    // Прерванные операции держат shared_ptr на клиента в его же io_context: без их выполнения
+    // клиент и контекст ссылаются друг на друга и не освобождаются
+    m_client->context().restart();
+    m_client->context().poll();
+    m_client.reset();
+}
+
+void ChatConnection::sendMessage(const QString &receiverName, const QString &text)
+{
+    if (m_client)
+    {
+        m_client->sendMessage(receiverName.toStdString(), text.toStdString());
+    }
+}
+
+void ChatConnection::requestHistory(const QString &peerName, quint64 beforeMessageId)
+{
+    if (m_client)
+    {
+        m_client->requestHistory(peerName.toStdString(), beforeMessageId);
+    }
+}
+
+void ChatConnection::search(const QString &query)
+{
+    if (m_client)
+    {
+        m_client->search(query.toStdString());
+    }
+}
+
+// Один запланированный разбор очереди на все события, пришедшие до него
+bool ChatConnection::tryPost(ChatEvent &&event)
+{
+    if (!m_events.tryPush(std::move(event)))
+    {
+        return false;
+    }
+    if (!m_isDrainScheduled.exchange(true, std::memory_order_acq_rel))
+    {
+        QMetaObject::invokeMethod(this, [this] { drain(); }, Qt::QueuedConnection);
+    }
+    return true;
+}
+
+void ChatConnection::drain()
+{
+    // Не чаще раза в кадр: ранний вызов переносится на конец кадра
+    if (m_sinceDrain.isValid() && m_sinceDrain.elapsed() < kFrameMs)
+    {
+        if (!m_frameTimer.isActive())
+        {
+            m_frameTimer.start(kFrameMs - int(m_sinceDrain.elapsed()));
+        }
+        return;
+    }
+    m_sinceDrain.start();
+
+    // Сброс до разбора: событие, добавленное во время разбора, запланирует следующий
+    m_isDrainScheduled.store(false, std::memory_order_release);
+
+    int count = 0;
+    while (count < kMaxEventsPerFrame)
+    {
+        std::optional<ChatEvent> event = m_events.tryPop();
+        if (!event)
+        {
+            return;
+        }
+        dispatch(*event);
+        count++;
+    }
+
+    // Бюджет кадра исчерпан - остаток в следующем кадре
+    m_isDrainScheduled.store(true, std::memory_order_release);
+    m_frameTimer.start(kFrameMs);
+}
+
+void ChatConnection::dispatch(ChatEvent &event)
+{
+    std::visit(Overloaded{
+                   [this](ChatEventConnection &e) { emit connectionChanged(e.m_isConnected); },
+                   [this](ChatEventUsersList &e) { emit usersListReceived(e.m_users); },
+                   [this](ChatEventPresence &e) { emit presenceChanged(e.m_changes); },
+                   [this](ChatEventMessage &e) { emit messageReceived(QString::fromStdString(e.m_senderName), QString::fromStdString(e.m_text)); },
+                   [this](ChatEventAuthError &e) { emit authFailed(int(e.m_error)); },
+                   [this](user_chat::ServerPacketHistory &e) { emit historyReceived(e); },
+                   [this](user_chat::ServerPacketSearchResult &e) { emit searchResultReceived(e); },
+               },
+               event);
+}
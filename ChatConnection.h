@@ -0,0 +1,86 @@
+#pragma once
+
+#include "ChatClientPackets.h"
+#include "SpscQueue.h"
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QTimer>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+
+class GuiChatClient;
+
+// События сетевого потока для GUI (имена уже разрешены по справочнику ChatClient)
+struct ChatEventConnection { bool m_isConnected = false; };
+struct ChatEventUsersList { std::vector<user_chat::UserStatus> m_users; };
+struct ChatEventPresence { std::vector<user_chat::UserStatus> m_changes; };
+struct ChatEventMessage { std::string m_senderName; std::string m_text; };
+struct ChatEventAuthError { user_chat::AuthError m_error; };
+
+using ChatEvent = std::variant<ChatEventConnection,
+                               ChatEventUsersList,
+                               ChatEventPresence,
+                               ChatEventMessage,
+                               ChatEventAuthError,
+                               user_chat::ServerPacketHistory,
+                               user_chat::ServerPacketSearchResult>;
+
+// Соединение с сервером для GUI.
+// ChatClient работает в собственном потоке со своим io_context. Разобранные пакеты передаются
+// в GUI через SpscQueue, а GUI разбирает очередь не чаще раза в кадр и не больше
+// kMaxEventsPerFrame событий за раз - всплеск сообщений не забивает цикл событий Qt.
+// Сигналы испускаются в потоке GUI.
+class ChatConnection : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ChatConnection(QObject *parent = nullptr);
+    ~ChatConnection();
+
+    // Пустой пароль - вход без пароля (PacketHi)
+    void start(const QString &host, const QString &port, const QString &userName,
+               const QString &password = QString(), bool isRegistration = false);
+    void stop();
+
+    const QString &userName() const { return m_userName; }
+
+    // Можно вызывать из потока GUI
+    void sendMessage(const QString &receiverName, const QString &text);
+    void requestHistory(const QString &peerName, quint64 beforeMessageId = 0);
+    void search(const QString &query);
+
+    // Только сетевой поток: false - очередь полна
+    bool tryPost(ChatEvent &&event);
+
+signals:
+    void connectionChanged(bool isConnected);
+    void usersListReceived(const std::vector<user_chat::UserStatus> &users);
+    void presenceChanged(const std::vector<user_chat::UserStatus> &changes);
+    void messageReceived(const QString &senderName, const QString &text);
+    void authFailed(int error); // user_chat::AuthError
+    void historyReceived(const user_chat::ServerPacketHistory &packet);
+    void searchResultReceived(const user_chat::ServerPacketSearchResult &packet);
+
+private:
+    static constexpr int kFrameMs = 16;
+    static constexpr int kMaxEventsPerFrame = 2000;
+    static constexpr size_t kQueueCapacity = 64 * 1024;
+
+    void drain();
+    void dispatch(ChatEvent &event);
+
+    std::shared_ptr<GuiChatClient>  m_client;
+    std::thread                     m_thread;
+    SpscQueue<ChatEvent>            m_events;
+    std::atomic<bool>               m_isDrainScheduled{false};
+    QElapsedTimer                   m_sinceDrain;
+    QTimer                          m_frameTimer;
+    QString                         m_userName;
+};
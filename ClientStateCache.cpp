@@ -0,0 +1,197 @@
+#include "ClientStateCache.h"
+
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <cstring>
+
+namespace
+{
+const char kMagic[8] = {'U', 'C', 'S', 'T', 'A', 'T', 'E', '1'};
+
+// Файл пишется и читается на одной машине - порядок байт родной
+struct Header
+{
+    char    m_magic[8];
+    quint32 m_userCount;
+    quint32 m_lineCount;
+    qint32  m_scrollValue;
+    quint32 m_isFollowingTail;
+    quint32 m_peerOffset;       // строки - смещение и длина в блоке строк
+    quint32 m_peerSize;
+    quint32 m_stringsSize;
+    quint32 m_reserved;
+};
+
+struct UserEntry
+{
+    quint32 m_userId;
+    quint16 m_status;
+    quint16 m_nameSize;
+    quint32 m_nameOffset;
+};
+
+struct LineEntry
+{
+    quint64 m_messageId;
+    qint64  m_timestampMs;
+    quint32 m_senderOffset;
+    quint32 m_textOffset;
+    quint32 m_textSize;
+    quint16 m_senderSize;
+    quint8  m_isOutgoing;
+    quint8  m_reserved;
+};
+
+static_assert(sizeof(Header) == 40, "cache layout");
+static_assert(sizeof(UserEntry) == 12, "cache layout");
+static_assert(sizeof(LineEntry) == 32, "cache layout");
+
+void appendString(QByteArray &strings, const QString &value, quint32 &offset, quint32 &size)
+{
+    QByteArray utf8 = value.toUtf8();
+    offset = quint32(strings.size());
+    size = quint32(utf8.size());
+    strings.append(utf8);
+}
+}
+
+QString ClientStateCache::defaultPath(const QString &userName)
+{
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation);
+    QDir().mkpath(dir);
+    return dir + QStringLiteral("/state-") + userName + QStringLiteral(".cache");
+}
+
+bool ClientStateCache::load(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly) || file.size() < qint64(sizeof(Header)))
+    {
+        return false;
+    }
+    const uchar *data = file.map(0, file.size());
+    if (!data)
+    {
+        return false;
+    }
+
+    Header header;
+    std::memcpy(&header, data, sizeof(header));
+    quint64 tablesSize = quint64(header.m_userCount) * sizeof(UserEntry) + quint64(header.m_lineCount) * sizeof(LineEntry);
+    if (std::memcmp(header.m_magic, kMagic, sizeof(kMagic)) != 0
+        || sizeof(Header) + tablesSize + header.m_stringsSize != quint64(file.size()))
+    {
+        return false;
+    }
+
+    const uchar *users = data + sizeof(Header);
+    const uchar *lines = users + size_t(header.m_userCount) * sizeof(UserEntry);
+    const char *strings = reinterpret_cast<const char *>(lines + size_t(header.m_lineCount) * sizeof(LineEntry));
+    auto isInside = [&header](quint32 offset, quint32 size)
+    {
+        return quint64(offset) + size <= header.m_stringsSize;
+    };
+
+    m_users.clear();
+    m_users.reserve(header.m_userCount);
+    for (quint32 i = 0; i < header.m_userCount; i++)
+    {
+        UserEntry entry;
+        std::memcpy(&entry, users + i * sizeof(UserEntry), sizeof(entry));
+        if (!isInside(entry.m_nameOffset, entry.m_nameSize) || entry.m_status > user_chat::cst_offline)
+        {
+            return false;
+        }
+        m_users.push_back(user_chat::UserStatus{entry.m_userId,
+                                                std::string(strings + entry.m_nameOffset, entry.m_nameSize),
+                                                user_chat::ClientStatus(entry.m_status)});
+    }
+
+    m_lines.clear();
+    m_lines.reserve(header.m_lineCount);
+    for (quint32 i = 0; i < header.m_lineCount; i++)
+    {
+        LineEntry entry;
+        std::memcpy(&entry, lines + i * sizeof(LineEntry), sizeof(entry));
+        if (!isInside(entry.m_senderOffset, entry.m_senderSize) || !isInside(entry.m_textOffset, entry.m_textSize))
+        {
+            return false;
+        }
+        ChatLine line;
+        line.m_messageId = entry.m_messageId;
+        line.m_timestampMs = entry.m_timestampMs;
+        line.m_senderName = QString::fromUtf8(strings + entry.m_senderOffset, int(entry.m_senderSize));
+        line.m_text = QString::fromUtf8(strings + entry.m_textOffset, int(entry.m_textSize));
+        line.m_isOutgoing = entry.m_isOutgoing != 0;
+        m_lines.push_back(std::move(line));
+    }
+
+    if (!isInside(header.m_peerOffset, header.m_peerSize))
+    {
+        return false;
+    }
+    m_currentPeer = QString::fromUtf8(strings + header.m_peerOffset, int(header.m_peerSize));
+    m_scrollValue = header.m_scrollValue;
+    m_isFollowingTail = header.m_isFollowingTail != 0;
+    return true;
+}
+
+bool ClientStateCache::save(const QString &path) const
+{
+    Header header = {};
+    std::memcpy(header.m_magic, kMagic, sizeof(kMagic));
+    header.m_userCount = quint32(m_users.size());
+    header.m_scrollValue = m_scrollValue;
+    header.m_isFollowingTail = m_isFollowingTail ? 1 : 0;
+
+    QByteArray strings;
+    appendString(strings, m_currentPeer, header.m_peerOffset, header.m_peerSize);
+
+    std::vector<UserEntry> users;
+    users.reserve(m_users.size());
+    for (const user_chat::UserStatus &user : m_users)
+    {
+        UserEntry entry = {};
+        entry.m_userId = user.m_userId;
+        entry.m_status = quint16(user.m_status);
+        entry.m_nameOffset = quint32(strings.size());
+        entry.m_nameSize = quint16(qMin<size_t>(user.m_playerName.size(), 0xFFFF));
+        strings.append(user.m_playerName.data(), int(entry.m_nameSize));
+        users.push_back(entry);
+    }
+
+    // Только последние kMaxLines строк
+    size_t firstLine = m_lines.size() > size_t(kMaxLines) ? m_lines.size() - kMaxLines : 0;
+    std::vector<LineEntry> lines;
+    lines.reserve(m_lines.size() - firstLine);
+    for (size_t i = firstLine; i < m_lines.size(); i++)
+    {
+        const ChatLine &line = m_lines[i];
+        LineEntry entry = {};
+        entry.m_messageId = line.m_messageId;
+        entry.m_timestampMs = line.m_timestampMs;
+        entry.m_isOutgoing = line.m_isOutgoing ? 1 : 0;
+        quint32 senderSize = 0;
+        appendString(strings, line.m_senderName.left(0xFFFF / 4), entry.m_senderOffset, senderSize);
+        entry.m_senderSize = quint16(senderSize);
+        appendString(strings, line.m_text, entry.m_textOffset, entry.m_textSize);
+        lines.push_back(entry);
+    }
+    header.m_lineCount = quint32(lines.size());
+    header.m_stringsSize = quint32(strings.size());
+
+    // QSaveFile подменяет файл целиком только после успешной записи
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        return false;
+    }
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(users.data()), qint64(users.size() * sizeof(UserEntry)));
+    file.write(reinterpret_cast<const char *>(lines.data()), qint64(lines.size() * sizeof(LineEntry)));
+    file.write(strings);
+    return file.commit();
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "ChatClientPackets.h"
+#include "MessageListModel.h"
+
+#include <QString>
+
+#include <vector>
+
+// Состояние клиента между запусками: последний список пользователей, последние строки беседы,
+// собеседник и положение прокрутки. Файл - заголовок, таблицы записей фиксированного размера
+// и блок строк UTF-8; читается через QFile::map без разбора потока, поэтому окно заполняется
+// до подключения к серверу. Живые данные сервера потом заменяют кэш (UsersListModel::setUsers).
+// Повреждённый или чужой файл просто игнорируется.
+class ClientStateCache
+{
+public:
+    static constexpr int kMaxLines = 500;
+
+    // Файл для пользователя в каталоге данных приложения
+    static QString defaultPath(const QString &userName);
+
+    bool load(const QString &path);
+    bool save(const QString &path) const;
+
+    std::vector<user_chat::UserStatus>  m_users;
+    std::vector<ChatLine>               m_lines;
+    QString                             m_currentPeer;
+    int                                 m_scrollValue = 0;
+    bool                                m_isFollowingTail = true;
+};
@@ -1,11 +1,214 @@
 #include "MainWindow.h"
 #include "./ui_MainWindow.h"
+#include "ChatConnection.h"
+#include "ClientStateCache.h"
+#include "MessageDelegate.h"
+#include "MessageListModel.h"
+#include "Registration.h"
+#include "UsersFilterModel.h"
+#include "UsersListModel.h"
+
+#include <QCloseEvent>
+#include <QDateTime>
+#include <QScrollBar>
+#include <QTimer>
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
     , ui(new Ui::MainWindow)
 {
     ui->setupUi(this);
+
+    m_messageModel = new MessageListModel(this);
+    ui->messageView->setModel(m_messageModel);
+    ui->messageView->setItemDelegate(new MessageDelegate(ui->messageView));
+
+    // Пока все строки в одну строку, вид не спрашивает размер у каждой
+    ui->messageView->setUniformItemSizes(m_messageModel->isUniform());
+    connect(m_messageModel, &MessageListModel::uniformChanged, ui->messageView, &QListView::setUniformItemSizes);
+
+    connect(ui->messageView->verticalScrollBar(), &QScrollBar::valueChanged, this, [this](int value)
+            {
+                m_isFollowingTail = value == ui->messageView->verticalScrollBar()->maximum();
+            });
+    connect(m_messageModel, &QAbstractItemModel::rowsInserted, this, &MainWindow::scrollToBottomIfFollowing);
+
+    // Сеть работает в своём потоке, сигналы приходят уже в поток GUI пачками раз в кадр
+    m_connection = new ChatConnection(this);
+    connect(m_connection, &ChatConnection::messageReceived, this, [this](const QString &senderName, const QString &text)
+            {
+                m_messageModel->appendMessage(0, QDateTime::currentMSecsSinceEpoch(), senderName, text, false);
+                if (m_currentPeer.isEmpty())
+                {
+                    m_currentPeer = senderName;
+                }
+            });
+    connect(m_connection, &ChatConnection::connectionChanged, this, [this](bool isConnected)
+            {
+                statusBar()->showMessage(isConnected ? tr("Connected as %1").arg(m_connection->userName()) : tr("Disconnected"));
+            });
+    connect(m_connection, &ChatConnection::authFailed, this, &MainWindow::onAuthFailed);
+    connect(ui->messageEdit, &QLineEdit::returnPressed, this, &MainWindow::sendCurrentMessage);
+
+    m_usersModel = new UsersListModel(this);
+    m_usersFilter = new UsersFilterModel(m_usersModel, this);
+    ui->usersView->setModel(m_usersFilter);
+    connect(m_connection, &ChatConnection::usersListReceived, m_usersModel, &UsersListModel::setUsers);
+    connect(m_connection, &ChatConnection::presenceChanged, m_usersModel, &UsersListModel::applyChanges);
+    connect(ui->filterEdit, &QLineEdit::textChanged, m_usersFilter, &UsersFilterModel::setFilterText);
+    connect(ui->usersView, &QListView::activated, this, [this](const QModelIndex &index)
+            {
+                m_currentPeer = index.data().toString();
+                ui->messageEdit->setFocus();
+            });
+}
+
+void MainWindow::signIn(const QString &host, const QString &port, const QString &userName)
+{
+    m_host = host;
+    m_port = port;
+
+    // Сначала то, что было при прошлом запуске, - окно рисуется, не дожидаясь ни пароля, ни сети
+    if (!userName.isEmpty())
+    {
+        setWindowTitle(userName);
+        m_cachePath = ClientStateCache::defaultPath(userName);
+        loadStateCache();
+    }
+    askCredentials(userName, QString());
+}
+
+// Диалог модален только для окна: окно уже показано и продолжает перерисовываться
+void MainWindow::askCredentials(const QString &userName, const QString &error)
+{
+    auto *registration = new Registration(userName, this);
+    registration->setAttribute(Qt::WA_DeleteOnClose);
+    registration->setWindowModality(Qt::WindowModal);
+    if (!error.isEmpty())
+    {
+        registration->setError(error);
+    }
+    connect(registration, &QDialog::accepted, this, [this, registration]
+            {
+                connectToServer(registration->userName(), registration->password(), registration->isRegistration());
+            });
+    connect(registration, &QDialog::rejected, this, &QWidget::close);
+    registration->open();
+}
+
+void MainWindow::connectToServer(const QString &userName, const QString &password, bool isRegistration)
+{
+    setWindowTitle(userName);
+
+    // Кэш принадлежит имени, под которым окно заполнено сейчас
+    QString cachePath = ClientStateCache::defaultPath(userName);
+    if (cachePath != m_cachePath)
+    {
+        saveStateCache();
+        m_messageModel->clear();
+        m_usersModel->clear();
+        m_cachePath = cachePath;
+        loadStateCache();
+    }
+
+    m_connection->start(m_host, m_port, userName, password, isRegistration);
+}
+
+void MainWindow::onAuthFailed(int error)
+{
+    m_connection->stop();
+
+    QString text;
+    switch (error)
+    {
+    case user_chat::aer_auth_required:
+        text = tr("The server requires a password.");
+        break;
+    case user_chat::aer_already_registered:
+        text = tr("This name is already registered.");
+        break;
+    case user_chat::aer_invalid_name:
+        text = tr("The name must not contain spaces; the password must not be empty.");
+        break;
+    default:
+        text = tr("Wrong user name or password.");
+        break;
+    }
+    askCredentials(m_connection->userName(), text);
+}
+
+void MainWindow::closeEvent(QCloseEvent *event)
+{
+    saveStateCache();
+    QMainWindow::closeEvent(event);
+}
+
+void MainWindow::loadStateCache()
+{
+    ClientStateCache cache;
+    if (!cache.load(m_cachePath))
+    {
+        return;
+    }
+
+    m_usersModel->setUsers(cache.m_users);
+    m_messageModel->prependHistory(std::move(cache.m_lines));
+    m_currentPeer = cache.m_currentPeer;
+
+    // Прокрутку можно восстановить только после раскладки строк
+    m_isFollowingTail = cache.m_isFollowingTail;
+    int scrollValue = cache.m_scrollValue;
+    QTimer::singleShot(0, this, [this, scrollValue]
+                       {
+                           if (m_isFollowingTail)
+                           {
+                               ui->messageView->scrollToBottom();
+                           }
+                           else
+                           {
+                               ui->messageView->verticalScrollBar()->setValue(scrollValue);
+                           }
+                       });
+}
+
+void MainWindow::saveStateCache()
+{
+    if (m_cachePath.isEmpty())
+    {
+        return;
+    }
+
+    ClientStateCache cache;
+    cache.m_users = m_usersModel->users();
+    int rowCount = m_messageModel->rowCount();
+    for (int row = qMax(0, rowCount - ClientStateCache::kMaxLines); row < rowCount; row++)
+    {
+        cache.m_lines.push_back(m_messageModel->line(row));
+    }
+    cache.m_currentPeer = m_currentPeer;
+    cache.m_scrollValue = ui->messageView->verticalScrollBar()->value();
+    cache.m_isFollowingTail = m_isFollowingTail;
+    cache.save(m_cachePath);
+}
+
+void MainWindow::sendCurrentMessage()
+{
+    QString text = ui->messageEdit->text();
+    if (text.isEmpty() || m_currentPeer.isEmpty())
+    {
+        return;
+    }
+    m_connection->sendMessage(m_currentPeer, text);
+    m_messageModel->appendMessage(0, QDateTime::currentMSecsSinceEpoch(), m_connection->userName(), text, true);
+    ui->messageEdit->clear();
+}
+
+void MainWindow::scrollToBottomIfFollowing()
+{
+    if (m_isFollowingTail)
+    {
+        ui->messageView->scrollToBottom();
+    }
 }
 
 MainWindow::~MainWindow()
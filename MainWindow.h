@@ -2,6 +2,11 @@
 
 #include <QMainWindow>
 
+class ChatConnection;
+class MessageListModel;
+class UsersFilterModel;
+class UsersListModel;
+
 QT_BEGIN_NAMESPACE
 namespace Ui {
 class MainWindow;
@@ -16,6 +21,30 @@ public:
     MainWindow(QWidget *parent = nullptr);
     ~MainWindow();
 
+    // Окно заполняется из кэша userName, затем поверх него открывается Registration;
+    // отказ от входа закрывает окно
+    void signIn(const QString &host, const QString &port, const QString &userName);
+
+protected:
+    void closeEvent(QCloseEvent *event) override;
+
 private:
+    void askCredentials(const QString &userName, const QString &error);
+    void connectToServer(const QString &userName, const QString &password, bool isRegistration);
+    void onAuthFailed(int error);
+    void loadStateCache();
+    void saveStateCache();
+    void scrollToBottomIfFollowing();
+    void sendCurrentMessage();
+
     Ui::MainWindow *ui;
+    MessageListModel *m_messageModel;
+    UsersListModel *m_usersModel;
+    UsersFilterModel *m_usersFilter;
+    ChatConnection *m_connection;
+    QString m_currentPeer; // Собеседник, которому уходят сообщения из messageEdit
+    QString m_cachePath;   // Файл ClientStateCache текущего пользователя
+    QString m_host;
+    QString m_port;
+    bool m_isFollowingTail = true; // Вид прокручен к последнему сообщению
 };
@@ -0,0 +1,95 @@
+#include "MessageDelegate.h"
+#include "MessageListModel.h"
+
+#include <QAbstractItemView>
+#include <QDateTime>
+#include <QPainter>
+#include <QtMath>
+
+MessageDelegate::MessageDelegate(QAbstractItemView *view)
+    : QStyledItemDelegate(view)
+    , m_view(view)
+    , m_layouts(4096) // раскладок; видимых строк намного меньше
+{
+}
+
+QString MessageDelegate::lineText(const QModelIndex &index) const
+{
+    qint64 timestampMs = index.data(MessageListModel::TimestampRole).toLongLong();
+    QString time = timestampMs != 0 ? QDateTime::fromMSecsSinceEpoch(timestampMs).toString(QStringLiteral("HH:mm ")) : QString();
+    return time + index.data(MessageListModel::SenderRole).toString() + QStringLiteral(": ") + index.data(Qt::DisplayRole).toString();
+}
+
+int MessageDelegate::textWidth() const
+{
+    return qMax(1, m_view->viewport()->width() - 2 * kMargin);
+}
+
+MessageDelegate::CachedLayout *MessageDelegate::layoutFor(const QModelIndex &index, const QFont &font, int width) const
+{
+    quint64 key = index.data(MessageListModel::KeyRole).toULongLong();
+    CachedLayout *cached = m_layouts.object(key);
+    if (cached && cached->m_width == width)
+    {
+        return cached;
+    }
+
+    auto layout = std::make_unique<QTextLayout>(lineText(index), font);
+    QTextOption textOption;
+    textOption.setWrapMode(QTextOption::WrapAtWordBoundaryOrAnywhere);
+    layout->setTextOption(textOption);
+
+    qreal height = 0;
+    layout->beginLayout();
+    for (QTextLine line = layout->createLine(); line.isValid(); line = layout->createLine())
+    {
+        line.setLineWidth(width);
+        line.setPosition(QPointF(0, height));
+        height += line.height();
+    }
+    layout->endLayout();
+
+    cached = new CachedLayout;
+    cached->m_width = width;
+    cached->m_height = qCeil(height);
+    cached->m_layout = std::move(layout);
+    m_layouts.insert(key, cached);
+    return cached;
+}
+
+QSize MessageDelegate::sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const
+{
+    int width = textWidth();
+    if (index.data(MessageListModel::IsSimpleRole).toBool())
+    {
+        // Быстрый путь: высота не зависит от текста
+        return QSize(width, option.fontMetrics.lineSpacing() + 2 * kMargin);
+    }
+    return QSize(width, layoutFor(index, option.font, width)->m_height + 2 * kMargin);
+}
+
+void MessageDelegate::paint(QPainter *painter, const QStyleOptionViewItem &option, const QModelIndex &index) const
+{
+    QStyleOptionViewItem opt = option;
+    initStyleOption(&opt, index);
+    opt.text.clear();
+    m_view->style()->drawControl(QStyle::CE_ItemViewItem, &opt, painter, m_view);
+
+    painter->save();
+    bool isOutgoing = index.data(MessageListModel::IsOutgoingRole).toBool();
+    painter->setPen(opt.palette.color(opt.state & QStyle::State_Selected ? QPalette::HighlightedText
+                                      : (isOutgoing ? QPalette::Link : QPalette::Text)));
+
+    QRect textRect = option.rect.adjusted(kMargin, kMargin, -kMargin, -kMargin);
+    if (index.data(MessageListModel::IsSimpleRole).toBool())
+    {
+        // Строка длиннее ширины вида (узкое окно) обрезается с многоточием
+        QString text = option.fontMetrics.elidedText(lineText(index), Qt::ElideRight, textRect.width());
+        painter->drawText(textRect, Qt::AlignLeft | Qt::AlignVCenter | Qt::TextSingleLine, text);
+    }
+    else
+    {
+        layoutFor(index, option.font, textWidth())->m_layout->draw(painter, textRect.topLeft());
+    }
+    painter->restore();
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <QCache>
+#include <QStyledItemDelegate>
+#include <QTextLayout>
+
+#include <memory>
+
+class QAbstractItemView;
+
+// Отрисовка строк MessageListModel.
+// Простые строки (IsSimpleRole) имеют высоту в одну строку шрифта и рисуются без раскладки.
+// Для остальных QTextLayout строится при первом показе и кэшируется по ключу строки и ширине.
+class MessageDelegate : public QStyledItemDelegate
+{
+    Q_OBJECT
+
+public:
+    explicit MessageDelegate(QAbstractItemView *view);
+
+    void paint(QPainter *painter, const QStyleOptionViewItem &option, const QModelIndex &index) const override;
+    QSize sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const override;
+
+    // Сброс кэша, например после смены шрифта
+    void invalidateLayouts() { m_layouts.clear(); }
+
+private:
+    struct CachedLayout
+    {
+        int                             m_width = 0;
+        int                             m_height = 0;
+        std::unique_ptr<QTextLayout>    m_layout;
+    };
+
+    static constexpr int kMargin = 2;
+
+    QString lineText(const QModelIndex &index) const;
+    int textWidth() const;
+    CachedLayout *layoutFor(const QModelIndex &index, const QFont &font, int width) const;
+
+    QAbstractItemView *m_view;
+    mutable QCache<quint64, CachedLayout> m_layouts;
+};
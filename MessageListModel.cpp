@@ -0,0 +1,185 @@
+#include "MessageListModel.h"
+
+#include <iterator>
+
+MessageListModel::MessageListModel(QObject *parent)
+    : QAbstractListModel(parent)
+{
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(16);
+    connect(&m_flushTimer, &QTimer::timeout, this, &MessageListModel::flushPending);
+}
+
+int MessageListModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : int(m_lines.size());
+}
+
+QVariant MessageListModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= int(m_lines.size()))
+    {
+        return QVariant();
+    }
+
+    const ChatLine &line = m_lines[size_t(index.row())];
+    switch (role)
+    {
+    case Qt::DisplayRole:
+        return line.m_text;
+    case KeyRole:
+        return line.m_key;
+    case MessageIdRole:
+        return line.m_messageId;
+    case TimestampRole:
+        return line.m_timestampMs;
+    case SenderRole:
+        return line.m_senderName;
+    case IsOutgoingRole:
+        return line.m_isOutgoing;
+    case IsSimpleRole:
+        return line.m_isSimple;
+    default:
+        return QVariant();
+    }
+}
+
+QHash<int, QByteArray> MessageListModel::roleNames() const
+{
+    QHash<int, QByteArray> roles = QAbstractListModel::roleNames();
+    roles[KeyRole] = "key";
+    roles[MessageIdRole] = "messageId";
+    roles[TimestampRole] = "timestamp";
+    roles[SenderRole] = "sender";
+    roles[IsOutgoingRole] = "isOutgoing";
+    roles[IsSimpleRole] = "isSimple";
+    return roles;
+}
+
+void MessageListModel::appendMessage(quint64 messageId, qint64 timestampMs, const QString &senderName, const QString &text, bool isOutgoing)
+{
+    ChatLine line;
+    line.m_messageId = messageId;
+    line.m_timestampMs = timestampMs;
+    line.m_senderName = senderName;
+    line.m_text = text;
+    line.m_isOutgoing = isOutgoing;
+    m_pending.push_back(std::move(line));
+
+    if (!m_flushTimer.isActive())
+    {
+        m_flushTimer.start();
+    }
+}
+
+// Вся пачка - один beginInsertRows/endInsertRows, вид пересчитывает раскладку один раз
+void MessageListModel::flushPending()
+{
+    m_flushTimer.stop();
+    if (m_pending.empty())
+    {
+        return;
+    }
+
+    bool wasUniform = isUniform();
+    int first = int(m_lines.size());
+    beginInsertRows(QModelIndex(), first, first + int(m_pending.size()) - 1);
+    for (ChatLine &line : m_pending)
+    {
+        prepareLine(line);
+        m_lines.push_back(std::move(line));
+    }
+    endInsertRows();
+    m_pending.clear();
+
+    trimOldest();
+    updateUniform(wasUniform);
+}
+
+void MessageListModel::prependHistory(std::vector<ChatLine> &&lines)
+{
+    if (lines.empty())
+    {
+        return;
+    }
+
+    bool wasUniform = isUniform();
+    beginInsertRows(QModelIndex(), 0, int(lines.size()) - 1);
+    for (ChatLine &line : lines)
+    {
+        prepareLine(line);
+    }
+    m_lines.insert(m_lines.begin(), std::make_move_iterator(lines.begin()), std::make_move_iterator(lines.end()));
+    endInsertRows();
+
+    updateUniform(wasUniform);
+}
+
+void MessageListModel::clear()
+{
+    bool wasUniform = isUniform();
+    beginResetModel();
+    m_lines.clear();
+    m_pending.clear();
+    m_complexCount = 0;
+    endResetModel();
+    updateUniform(wasUniform);
+}
+
+quint64 MessageListModel::firstMessageId() const
+{
+    for (const ChatLine &line : m_lines)
+    {
+        if (line.m_messageId != 0)
+        {
+            return line.m_messageId;
+        }
+    }
+    return 0;
+}
+
+void MessageListModel::setMaxRows(int maxRows)
+{
+    m_maxRows = maxRows;
+    bool wasUniform = isUniform();
+    trimOldest();
+    updateUniform(wasUniform);
+}
+
+void MessageListModel::prepareLine(ChatLine &line)
+{
+    line.m_key = m_nextKey++;
+    line.m_isSimple = line.m_text.size() <= kMaxSimpleLength && !line.m_text.contains(QLatin1Char('\n'));
+    if (!line.m_isSimple)
+    {
+        m_complexCount++;
+    }
+}
+
+void MessageListModel::trimOldest()
+{
+    int excess = int(m_lines.size()) - m_maxRows;
+    if (excess <= 0)
+    {
+        return;
+    }
+
+    beginRemoveRows(QModelIndex(), 0, excess - 1);
+    for (int i = 0; i < excess; i++)
+    {
+        if (!m_lines.front().m_isSimple)
+        {
+            m_complexCount--;
+        }
+        m_lines.pop_front();
+    }
+    endRemoveRows();
+}
+
+void MessageListModel::updateUniform(bool wasUniform)
+{
+    if (wasUniform != isUniform())
+    {
+        emit uniformChanged(isUniform());
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <QAbstractListModel>
+#include <QString>
+#include <QTimer>
+
+#include <deque>
+#include <vector>
+
+// Строка беседы
+struct ChatLine
+{
+    quint64 m_key = 0;          // локальный ключ строки (кэш раскладки в MessageDelegate)
+    quint64 m_messageId = 0;    // id в истории сервера, 0 - неизвестен
+    qint64  m_timestampMs = 0;
+    QString m_senderName;
+    QString m_text;
+    bool    m_isOutgoing = false;
+    bool    m_isSimple = true;  // одна короткая строка: высота известна без раскладки текста
+};
+
+// Модель сообщений беседы для QListView.
+// Новые сообщения копятся и добавляются в модель одним rowsInserted раз в кадр;
+// самые старые строки сверх maxRows удаляются, чтобы память не росла с беседой.
+// Пока все строки простые (isUniform), вид может включить setUniformItemSizes.
+class MessageListModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+public:
+    enum Roles
+    {
+        KeyRole = Qt::UserRole + 1,
+        MessageIdRole,
+        TimestampRole,
+        SenderRole,
+        IsOutgoingRole,
+        IsSimpleRole,
+    };
+
+    static constexpr int kMaxSimpleLength = 120;
+
+    explicit MessageListModel(QObject *parent = nullptr);
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+    QHash<int, QByteArray> roleNames() const override;
+
+    // Сообщение появится в модели при следующем сбросе пачки
+    void appendMessage(quint64 messageId, qint64 timestampMs, const QString &senderName, const QString &text, bool isOutgoing);
+
+    // Более ранняя страница истории (по возрастанию id) вставляется в начало сразу
+    void prependHistory(std::vector<ChatLine> &&lines);
+
+    void clear();
+
+    const ChatLine &line(int row) const { return m_lines[size_t(row)]; }
+    quint64 firstMessageId() const;
+
+    bool isUniform() const { return m_complexCount == 0; }
+
+    int maxRows() const { return m_maxRows; }
+    void setMaxRows(int maxRows);
+
+    // Задержка сброса пачки, по умолчанию - кадр
+    void setBatchInterval(int milliseconds) { m_flushTimer.setInterval(milliseconds); }
+
+public slots:
+    void flushPending();
+
+signals:
+    void uniformChanged(bool isUniform);
+
+private:
+    void prepareLine(ChatLine &line);
+    void trimOldest();
+    void updateUniform(bool wasUniform);
+
+    std::deque<ChatLine>    m_lines;
+    std::vector<ChatLine>   m_pending;
+    QTimer                  m_flushTimer;
+    quint64                 m_nextKey = 1;
+    int                     m_complexCount = 0;
+    int                     m_maxRows = 100000;
+};
@@ -1,3 +1,53 @@
 #include "Registration.h"
+#include "./ui_Registration.h"
 
-Registration::Registration() {}
+#include <QPushButton>
+
+Registration::Registration(const QString &userName, QWidget *parent)
+    : QDialog(parent)
+    , ui(new Ui::Registration)
+{
+    ui->setupUi(this);
+    ui->userNameEdit->setText(userName);
+    ui->errorLabel->hide();
+    if (!userName.isEmpty())
+    {
+        ui->passwordEdit->setFocus();
+    }
+
+    connect(ui->userNameEdit, &QLineEdit::textChanged, this, &Registration::updateOkButton);
+    updateOkButton();
+}
+
+Registration::~Registration()
+{
+    delete ui;
+}
+
+QString Registration::userName() const
+{
+    return ui->userNameEdit->text().trimmed();
+}
+
+QString Registration::password() const
+{
+    return ui->passwordEdit->text();
+}
+
+bool Registration::isRegistration() const
+{
+    return ui->registerCheckBox->isChecked();
+}
+
+void Registration::setError(const QString &text)
+{
+    ui->errorLabel->setText(text);
+    ui->errorLabel->setVisible(!text.isEmpty());
+    ui->passwordEdit->clear();
+    ui->passwordEdit->setFocus();
+}
+
+void Registration::updateOkButton()
+{
+    ui->buttonBox->button(QDialogButtonBox::Ok)->setEnabled(!userName().isEmpty());
+}
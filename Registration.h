@@ -1,10 +1,32 @@
 #pragma once
 
-#include <QObject>
-#include <QWidget>
+#include <QDialog>
 
-class Registration
+QT_BEGIN_NAMESPACE
+namespace Ui {
+class Registration;
+}
+QT_END_NAMESPACE
+
+// Вход по имени и паролю; с отмеченным "Register" имя сначала регистрируется на сервере.
+// Пустой пароль - вход без пароля (сервер без файла учётных данных).
+class Registration : public QDialog
 {
+    Q_OBJECT
+
 public:
-    Registration();
+    explicit Registration(const QString &userName, QWidget *parent = nullptr);
+    ~Registration();
+
+    QString userName() const;
+    QString password() const;
+    bool isRegistration() const;
+
+    // Повторный показ после отказа сервера
+    void setError(const QString &text);
+
+private:
+    void updateOkButton();
+
+    Ui::Registration *ui;
 };
@@ -1,7 +1,11 @@
 #pragma once
 #include "ChatClientPackets.h"
 #include "ChatClientPacketUtils.h"
+#include "LatencyHistogram.h"
+#include "MessageIdWindow.h"
 #include "TcpClient.h"
+#include <deque>
+#include <unordered_map>
 
 namespace user_chat
 {
@@ -9,82 +13,575 @@ namespace user_chat
 class ChatClient : public TcpClient
 {
     std::string m_userName;
+    uint32_t m_userId = 0;                      // id, выданный сервером в ServerPacketWelcome
+
+    // Справочник id <-> имя; имена приходят в списке пользователей и в дельтах при появлении id
+    std::vector<std::string> m_userNames;       // индекс - id
+    std::unordered_map<std::string, uint32_t> m_userIds;
+    // id на сервере плотные (UserRegistry выдаёт освобождённые повторно), больший id - испорченный пакет
+    static constexpr uint32_t kMaxUserId = 1u << 20;
+
+    // Возобновление сессии: токен и версия присутствия из последнего ServerPacketWelcome
+    uint64_t m_resumeToken = 0;
+    uint64_t m_presenceVersion = 0;
+    uint64_t m_snapshotVersion = 0;             // версия, к которой относится принимаемый список
+    std::vector<UserStatus> m_pendingUsersList; // части списка до пакета с m_hasMore = false
+
+    // Вход по паролю (пусто - PacketHi); после первого успешного входа регистрация не повторяется
+    std::string m_password;
+    bool m_isRegistration = false;
+
+    // Замер задержки: PacketPing раз в m_pingInterval и сразу после входа.
+    // Смещение часов сервера берётся по ответу с наименьшим RTT за последние kClockWindowPings пингов
+    static constexpr uint32_t kClockWindowPings = 8;
+    boost::asio::steady_timer m_pingTimer;
+    std::chrono::milliseconds m_pingInterval{10000};
+    bool m_isPingTimerArmed = false;
+    int64_t m_serverClockOffsetUs = 0;          // часы сервера минус свои
+    bool m_hasServerClockOffset = false;
+    uint64_t m_bestRttUs = UINT64_MAX;
+    uint32_t m_windowPings = 0;
+    LatencyHistogram m_rttHistogram;
+    LatencyHistogram m_deliveryHistogram;       // от отправки сообщения до получения (по m_sentAtUs)
+
+    // Сообщения нумеруются; неподтверждённые повторяются после возобновления сессии, если их номер
+    // больше ServerPacketWelcome::m_lastMessageId. Хранятся не больше окна повторов сервера
+    struct SentMessage
+    {
+        uint64_t        m_messageId;
+        OutgoingPacket  m_packet;
+    };
+    uint64_t m_lastMessageId = 0;
+    std::deque<SentMessage> m_unconfirmedMessages;
 
 public:
-    ChatClient(const std::string& userName) : m_userName(userName) {}
+    ChatClient(const std::string& userName) : m_userName(userName), m_pingTimer(context()) {}
+    ChatClient(boost::asio::io_context& context, const std::string& userName)
+        : TcpClient(context), m_userName(userName), m_pingTimer(context) {}
+
+    const std::string& userName() const { return m_userName; }
+
+    // Вызывать до run(); isRegistration - зарегистрировать имя при первом подключении
+    void setPassword(const std::string& password, bool isRegistration = false)
+    {
+        m_password = password;
+        m_isRegistration = isRegistration;
+    }
+    uint32_t userId() const { return m_userId; }
+    uint64_t resumeToken() const { return m_resumeToken; }
+    uint64_t presenceVersion() const { return m_presenceVersion; }
+
+    // Вызывать до run(); 0 - только пинг при входе и sendPing()
+    void setPingInterval(std::chrono::milliseconds interval) { m_pingInterval = interval; }
+
+    // Гистограммы доступны только из потока io_context
+    const LatencyHistogram& rttHistogram() const { return m_rttHistogram; }
+    const LatencyHistogram& deliveryHistogram() const { return m_deliveryHistogram; }
+
+    // Текущее время по часам сервера (0 - смещение ещё не известно)
+    uint64_t serverTimeUs() const
+    {
+        return m_hasServerClockOffset ? uint64_t(int64_t(monotonicNowUs()) + m_serverClockOffsetUs) : 0;
+    }
 
     template <class PacketT>
     void sendPacket(PacketT& packet)
     {
-        //create TCP packet (Envelope) лучше отказаться
-        PacketSizeCalculator sizeCalculator;
-        sizeCalculator.addSize(uint16_t{});  // Размер TCP пакета
-        sizeCalculator.addSize(uint16_t{});  // Тип пакета
-        sizeCalculator.addSize(packet);      // Поля пакета
+        TRACE_SPAN("send_packet");
+        size_t packetSize;
+        uint8_t* buffer;
+        try
+        {
+            TRACE_SPAN("encode");
+            buffer = createPacket(packet, packetSize);
+        }
+        catch (const std::exception& e)
+        {
+            // Например, текст длиннее поля u16: пакет не отправляется, поток io_context продолжает работу
+            LOG_ERR("ChatClient: cannot encode packet: " << e.what());
+            return;
+        }
+        TcpClient::sendPacket(buffer, packetSize);
+    }
 
-        size_t packetSize = sizeCalculator.getSize();
-        uint8_t* buffer = new uint8_t[packetSize];
-        PacketWriter writer(buffer, packetSize);
+    // Справочник доступен только из потока io_context (например, в обработчиках on...)
+    const std::string& userNameById( uint32_t userId ) const
+    {
+        static const std::string empty;
+        return userId < m_userNames.size() ? m_userNames[userId] : empty;
+    }
 
-        writer.write(static_cast<uint16_t>(packetSize));
-        writer.write(static_cast<uint16_t>(PacketType()));
-        writer.write(packet);
+    uint32_t userIdByName( const std::string& userName ) const
+    {
+        auto it = m_userIds.find(userName);
+        return it == m_userIds.end() ? 0 : it->second;
+    }
 
-        TcpClient::sendPacket(buffer, packetSize);
+    // Можно вызывать из любого потока
+    void sendMessage(const std::string& receiverName, const std::string& messageText)
+    {
+        boost::asio::post(context(), [self = shared_from_this(), this, receiverName, messageText]
+                          {
+                              uint32_t receiverId = userIdByName(receiverName);
+                              if (receiverId == 0)
+                              {
+                                  LOG_ERR("ChatClient: unknown receiver " << receiverName);
+                                  return;
+                              }
+                              PacketMessage packet{m_userId, receiverId, messageText, serverTimeUs(), ++m_lastMessageId};
+                              sendMessagePacket(packet, m_lastMessageId);
+                          });
+    }
+
+    void sendMessage(uint32_t receiverId, const std::string& messageText)
+    {
+        boost::asio::post(context(), [self = shared_from_this(), this, receiverId, messageText]
+                          {
+                              PacketMessage packet{m_userId, receiverId, messageText, serverTimeUs(), ++m_lastMessageId};
+                              sendMessagePacket(packet, m_lastMessageId);
+                          });
+    }
+
+    // Внеочередной замер RTT; можно вызывать из любого потока
+    void sendPing()
+    {
+        boost::asio::post(context(), [self = shared_from_this(), this]
+                          {
+                              PacketPing packet{monotonicNowUs()};
+                              sendPacket(packet);
+                          });
+    }
+
+    // Страница истории беседы с peerName; ответ - onHistoryReceived()
+    void requestHistory(const std::string& peerName, uint64_t beforeMessageId = 0, uint16_t count = 50)
+    {
+        boost::asio::post(context(), [self = shared_from_this(), this, peerName, beforeMessageId, count]
+                          {
+                              PacketHistoryRequest packet{peerName, beforeMessageId, count};
+                              sendPacket(packet);
+                          });
+    }
+
+    // Поиск по своей истории; ответ - onSearchResult()
+    void search(const std::string& query, uint16_t maxHits = 20)
+    {
+        boost::asio::post(context(), [self = shared_from_this(), this, query, maxHits]
+                          {
+                              PacketSearchRequest packet{query, maxHits};
+                              sendPacket(packet);
+                          });
+    }
+
+    // Комнаты: ответ на создание и вход - onRoomJoined(), ошибки - onRoomError()
+    void createRoom(const std::string& roomName)
+    {
+        boost::asio::post(context(), [self = shared_from_this(), this, roomName]
+                          {
+                              PacketRoomCreate packet{roomName};
+                              sendPacket(packet);
+                          });
+    }
+
+    void joinRoom(const std::string& roomName)
+    {
+        boost::asio::post(context(), [self = shared_from_this(), this, roomName]
+                          {
+                              PacketRoomJoin packet{roomName};
+                              sendPacket(packet);
+                          });
+    }
+
+    void leaveRoom(uint32_t roomId)
+    {
+        boost::asio::post(context(), [self = shared_from_this(), this, roomId]
+                          {
+                              PacketRoomLeave packet{roomId};
+                              sendPacket(packet);
+                          });
+    }
+
+    void sendRoomMessage(uint32_t roomId, const std::string& messageText)
+    {
+        boost::asio::post(context(), [self = shared_from_this(), this, roomId, messageText]
+                          {
+                              PacketRoomMessage packet{roomId, m_userId, messageText, ++m_lastMessageId};
+                              sendMessagePacket(packet, m_lastMessageId);
+                          });
+    }
+
+    void setStatus(ClientStatus status)
+    {
+        boost::asio::post(context(), [self = shared_from_this(), this, status]
+                          {
+                              PacketClientStatus packet{status};
+                              sendPacket(packet);
+                          });
     }
 
     void onConnected(const boost::system::error_code& ec) override
     {
         if (!ec)
         {
-            LOG("Successfully connected to the server!");
-            PacketHi packet{m_userName};
-            sendPacket(packet);
+            LOG_DBG("Successfully connected to the server!");
+            m_pendingUsersList.clear();
+
+            if (m_resumeToken != 0)
+            {
+                PacketResume packet{m_userName, m_resumeToken, m_presenceVersion};
+                sendPacket(packet);
+            }
+            else
+            {
+                sendLogin();
+            }
         } else
         {
             LOG_ERR("Error connecting: " << ec.message());
         }
     }
 
-    void onPacketReceived(const uint8_t* data, size_t dataSize)
+    void onPacketReceived(const uint8_t* data, size_t dataSize) override
     {
-        user_chat::PacketReader reader(data, data + dataSize);
+        TRACE_SPAN("dispatch");
+        try
+        {
+            user_chat::PacketReader reader(data, data + dataSize, true); // Текст от сервера выводится в интерфейс - проверяем и здесь
 
-        std::string userName;
-        reader.read(userName);
-        if (userName.empty()) {
             PacketType packetType;
             reader.read(reinterpret_cast<uint16_t&>(packetType));
 
             switch (packetType) {
+            case spt_welcome: {
+                ServerPacketWelcome packet;
+                reader.read(packet);
+                m_userId = packet.m_userId;
+                m_resumeToken = packet.m_resumeToken;
+                m_isRegistration = false;
+                m_snapshotVersion = packet.m_presenceVersion;
+                resendUnconfirmedMessages(packet.m_isResumed, packet.m_lastMessageId);
+
+                // Сервер мог перезапуститься - часы сервера оцениваем заново
+                m_hasServerClockOffset = false;
+                m_bestRttUs = UINT64_MAX;
+                m_windowPings = 0;
+                PacketPing ping{monotonicNowUs()};
+                sendPacket(ping);
+                armPingTimer();
+                break;
+            }
+            case spt_pong: {
+                ServerPacketPong packet;
+                reader.read(packet);
+                onPong(packet);
+                break;
+            }
             case spt_users_list: {
                 ServerPacketUsersList packet;
                 reader.read(packet);
-                // Вызываем метод обработки списка пользователей
-               onUsersListReceived(packet.m_usersList);
+                checkUserIds(packet.m_usersList);
+                m_pendingUsersList.insert(m_pendingUsersList.end(),
+                                          std::make_move_iterator(packet.m_usersList.begin()),
+                                          std::make_move_iterator(packet.m_usersList.end()));
+                if (!packet.m_hasMore)
+                {
+                    m_presenceVersion = m_snapshotVersion;
+                    // Полный список заменяет справочник: id удалённых пользователей могли быть выданы снова
+                    m_userNames.clear();
+                    m_userIds.clear();
+                    for (UserStatus& user : m_pendingUsersList)
+                    {
+                        rememberUser(user);
+                    }
+                    // Вызываем метод обработки списка пользователей
+                    onUsersListReceived(m_pendingUsersList);
+                    m_pendingUsersList.clear();
+                }
+                break;
+            }
+            case spt_presence_delta: {
+                ServerPacketPresenceDelta packet;
+                reader.read(packet);
+                checkUserIds(packet.m_changes);
+                if (packet.m_toVersion <= m_presenceVersion)
+                {
+                    break; // Уже учтено в списке или дельте при входе
+                }
+                if (packet.m_fromVersion > m_presenceVersion)
+                {
+                    LOG_ERR("ChatClient presence gap: " << m_presenceVersion << " vs " << packet.m_fromVersion);
+                }
+                // Дельта содержит итоговые статусы на m_toVersion, поэтому перекрытие версий безопасно
+                m_presenceVersion = packet.m_toVersion;
+                for (UserStatus& change : packet.m_changes)
+                {
+                    rememberUser(change);
+                }
+                onPresenceChanged(packet.m_changes);
+                break;
+            }
+            case cpt_message: {
+                PacketMessage packet;
+                reader.read(packet);
+                if (packet.getSentAtUs() != 0 && m_hasServerClockOffset)
+                {
+                    uint64_t nowUs = serverTimeUs();
+                    m_deliveryHistogram.record(nowUs > packet.getSentAtUs() ? nowUs - packet.getSentAtUs() : 0);
+                }
+                onMessageReceived(packet);
+                break;
+            }
+            case spt_history: {
+                ServerPacketHistory packet;
+                reader.read(packet);
+                onHistoryReceived(packet);
+                break;
+            }
+            case spt_room_joined: {
+                ServerPacketRoomJoined packet;
+                reader.read(packet);
+                onRoomJoined(packet);
+                break;
+            }
+            case spt_room_error: {
+                ServerPacketRoomError packet;
+                reader.read(packet);
+                onRoomError(packet);
+                break;
+            }
+            case cpt_room_message: {
+                PacketRoomMessage packet;
+                reader.read(packet);
+                onRoomMessage(packet);
+                break;
+            }
+            case spt_search_result: {
+                ServerPacketSearchResult packet;
+                reader.read(packet);
+                onSearchResult(packet);
+                break;
+            }
+            case spt_server_busy: {
+                ServerPacketServerBusy packet;
+                reader.read(packet);
+                LOG_DBG("ChatClient: server busy, retry after " << packet.m_retryAfterMs << "ms");
+                onServerBusy(packet.m_retryAfterMs);
+                closeSocket();
+                scheduleReconnect(std::chrono::milliseconds(packet.m_retryAfterMs));
+                break;
+            }
+            case spt_rate_limited: {
+                ServerPacketRateLimited packet;
+                reader.read(packet);
+                LOG_DBG("ChatClient: rate limited, retry after " << packet.m_retryAfterMs << "ms");
+                onRateLimited(packet.m_retryAfterMs);
+                break;
+            }
+            case spt_auth_error: {
+                ServerPacketAuthError packet;
+                reader.read(packet);
+                if (packet.m_error == aer_auth_required && m_resumeToken != 0 && !m_password.empty())
+                {
+                    // Токен истёк, а сервер требует пароль - обычный вход
+                    m_resumeToken = 0;
+                    sendLogin();
+                    break;
+                }
+                LOG_ERR("ChatClient: authentication failed for " << packet.m_userName << ", error " << packet.m_error);
+                onAuthError(packet.m_error);
                 break;
             }
-                // Добаввить обработку других типов пакетов -? предлагает qtCreator
-            case cpt_undefined:
-            case cpt_hi:
-            case cpt_message:
-            case cpt_status:
             case spt_already_exists:
-            case spt_user_status:
+                LOG_ERR("ChatClient: user " << m_userName << " already exists");
+                onUserAlreadyExists();
+                break;
+            default:
+                LOG_ERR("ChatClient: unexpected packet type " << packetType);
                 break;
             }
-        } else {
-            PacketType packetType;
-            reader.read(reinterpret_cast<uint16_t&>(packetType));
+        }
+        catch (const std::exception& e)
+        {
+            LOG_ERR("ChatClient: invalid packet: " << e.what());
         }
     }
 
-    void onUsersListReceived(std::vector<UserStatus>& m_usersList)
+    // Полный список пользователей (вход или возобновление без дельты); имена заполнены всегда
+    virtual void onUsersListReceived(std::vector<UserStatus>& m_usersList)
     {
         // Обработка списка пользователей
     }
 
+    // Изменения статусов после последнего списка (по одной записи на пользователя); имена заполнены из справочника
+    virtual void onPresenceChanged(const std::vector<UserStatus>& changes) {}
+
+    // Имя отправителя - userNameById(packet.getSenderId())
+    virtual void onMessageReceived(const PacketMessage& packet) {}
+
+    virtual void onHistoryReceived(ServerPacketHistory& packet) {}
+
+    virtual void onSearchResult(ServerPacketSearchResult& packet) {}
+
+    // Пароль не принят или сервер требует пароль
+    virtual void onAuthError(AuthError error) {}
+
+    virtual void onRoomJoined(const ServerPacketRoomJoined& packet) {}
+    virtual void onRoomError(const ServerPacketRoomError& packet) {}
+
+    // Имя отправителя - userNameById(packet.m_senderId)
+    virtual void onRoomMessage(const PacketRoomMessage& packet) {}
+
+    virtual void onUserAlreadyExists() {}
+
+    // Сервер отклонил вход из-за перегрузки; при включённой ReconnectPolicy клиент повторит сам
+    virtual void onServerBusy(uint32_t retryAfterMs) {}
+
+    // Сервер отбрасывает сообщения сверх разрешённой частоты; уже отправленные после этого тоже потеряны
+    virtual void onRateLimited(uint32_t retryAfterMs) {}
+
+private:
+    // Пакет кодируется один раз: тот же буфер уходит и при повторе
+    template <class PacketT>
+    void sendMessagePacket(PacketT& packet, uint64_t messageId)
+    {
+        TRACE_SPAN("send_packet");
+        OutgoingPacket outgoing;
+        try
+        {
+            TRACE_SPAN("encode");
+            outgoing.m_data.reset(createPacket(packet, outgoing.m_size));
+        }
+        catch (const std::exception& e)
+        {
+            LOG_ERR("ChatClient: cannot encode message: " << e.what());
+            return;
+        }
+        m_unconfirmedMessages.push_back(SentMessage{messageId, outgoing});
+        if (m_unconfirmedMessages.size() > MessageIdWindow::kWindowSize)
+        {
+            m_unconfirmedMessages.pop_front();
+        }
+        TcpClient::sendPacket(std::move(outgoing));
+    }
+
+    // Новый вход - сервер начал нумерацию заново, и что из отправленного дошло, неизвестно:
+    // повтор мог бы задвоить сообщения, поэтому неподтверждённые отбрасываются
+    void resendUnconfirmedMessages(bool isResumed, uint64_t lastMessageId)
+    {
+        if (!isResumed)
+        {
+            m_unconfirmedMessages.clear();
+            return;
+        }
+        while (!m_unconfirmedMessages.empty() && m_unconfirmedMessages.front().m_messageId <= lastMessageId)
+        {
+            m_unconfirmedMessages.pop_front();
+        }
+        for (const SentMessage& message : m_unconfirmedMessages)
+        {
+            TcpClient::sendPacket(message.m_packet);
+        }
+    }
+
+    void onPong(const ServerPacketPong& packet)
+    {
+        uint64_t nowUs = monotonicNowUs();
+        uint64_t rttUs = nowUs > packet.m_clientTimeUs ? nowUs - packet.m_clientTimeUs : 0;
+        m_rttHistogram.record(rttUs);
+
+        // Чем меньше RTT, тем точнее оценка: ответ сервера пришёлся на середину интервала
+        if (rttUs <= m_bestRttUs)
+        {
+            m_bestRttUs = rttUs;
+            m_serverClockOffsetUs = int64_t(packet.m_serverTimeUs) - int64_t(packet.m_clientTimeUs + rttUs / 2);
+            m_hasServerClockOffset = true;
+        }
+        // Новое окно - чтобы оценка следовала за дрейфом часов
+        if (++m_windowPings >= kClockWindowPings)
+        {
+            m_windowPings = 0;
+            m_bestRttUs = UINT64_MAX;
+        }
+    }
+
+    void armPingTimer()
+    {
+        if (m_isPingTimerArmed || m_pingInterval.count() == 0)
+        {
+            return;
+        }
+        // Таймер не продлевает жизнь клиента
+        m_isPingTimerArmed = true;
+        m_pingTimer.expires_after(m_pingInterval);
+        m_pingTimer.async_wait([weak = weak_from_this(), this](const boost::system::error_code& ec)
+                               {
+                                   auto self = weak.lock();
+                                   if (!self)
+                                   {
+                                       return;
+                                   }
+                                   m_isPingTimerArmed = false;
+                                   if (ec || isStopped())
+                                   {
+                                       return;
+                                   }
+                                   PacketPing packet{monotonicNowUs()};
+                                   sendPacket(packet);
+                                   armPingTimer();
+                               });
+    }
 
+    // PacketHi, PacketRegister или PacketLogin - в зависимости от setPassword()
+    void sendLogin()
+    {
+        if (m_password.empty())
+        {
+            PacketHi packet{m_userName};
+            sendPacket(packet);
+        }
+        else if (m_isRegistration)
+        {
+            PacketRegister packet{m_userName, m_password};
+            sendPacket(packet);
+        }
+        else
+        {
+            PacketLogin packet{m_userName, m_password};
+            sendPacket(packet);
+        }
+    }
+
+    // Проверяется до изменения справочника, чтобы испорченный пакет не оставил его наполовину обновлённым
+    static void checkUserIds( const std::vector<UserStatus>& users )
+    {
+        for (const UserStatus& user : users)
+        {
+            if (user.m_userId > kMaxUserId)
+            {
+                throw std::runtime_error("user id out of range: " + std::to_string(user.m_userId));
+            }
+        }
+    }
+
+    // Запоминает имя, пришедшее с id, или подставляет известное, если сервер его не передал
+    void rememberUser( UserStatus& user )
+    {
+        if (user.m_playerName.empty())
+        {
+            user.m_playerName = userNameById(user.m_userId);
+            return;
+        }
+
+        if (user.m_userId >= m_userNames.size())
+        {
+            m_userNames.resize(user.m_userId + 1);
+        }
+        std::string& name = m_userNames[user.m_userId];
+        if (!name.empty() && name != user.m_playerName)
+        {
+            m_userIds.erase(name);
+        }
+        name = user.m_playerName;
+        m_userIds[name] = user.m_userId;
+    }
 };
 }
-
@@ -1,29 +1,77 @@
 #pragma once
 
+#include <algorithm>
 #include <cstring>
 #include <cassert>
 #include <cstdint>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
-#
+#include "TextValidation.h"
+
 namespace user_chat
 {
 
+// Поля объекта (класса с fields()) передаются с ключом: байт (номер поля << 3) | тип значения.
+// Номер поля - его позиция в fields(), начиная с 1. Поле с номером, неизвестным получателю
+// (добавлено более новой версией), пропускается по длине без разбора; отсутствующее поле
+// (отправитель старее) остаётся со значением по умолчанию. Поэтому новые поля добавляются
+// только в конец fields(), а существующие не удаляются, не переставляются и не меняют тип.
+//
+// Значения: bool, uint16_t, uint32_t, uint64_t - little-endian фиксированной длины;
+// строка - [u16 длина][байты]; вектор - [u16 длина в байтах][u16 число элементов][элементы];
+// вложенный объект (поле или элемент вектора) - [u16 длина][поля].
+// Поля пакета идут до конца пакета: [u16 длина][u16 тип][поля].
+enum WireType : uint8_t
+{
+    wt_byte = 0,
+    wt_word,
+    wt_dword,
+    wt_qword,
+    wt_length,  // [u16 длина][данные]
+};
+
+constexpr uint8_t kMaxFieldTag = 31;
+constexpr size_t  kFieldKeySize = 1;
+constexpr uint8_t kWireFixedSize[] = { 1, 2, 4, 8 };
+
+// Объект - всё, кроме чисел, строк и векторов
+template<typename T> struct IsFieldObject : std::true_type {};
+template<> struct IsFieldObject<bool> : std::false_type {};
+template<> struct IsFieldObject<uint16_t> : std::false_type {};
+template<> struct IsFieldObject<uint32_t> : std::false_type {};
+template<> struct IsFieldObject<uint64_t> : std::false_type {};
+template<> struct IsFieldObject<std::string> : std::false_type {};
+template<typename T> struct IsFieldObject<std::vector<T>> : std::false_type {};
+
+template<typename T>
+constexpr WireType wireTypeOf()
+{
+    if constexpr ( std::is_same_v<T, bool> )            return wt_byte;
+    else if constexpr ( std::is_same_v<T, uint16_t> )   return wt_word;
+    else if constexpr ( std::is_same_v<T, uint32_t> )   return wt_dword;
+    else if constexpr ( std::is_same_v<T, uint64_t> )   return wt_qword;
+    else                                                return wt_length;
+}
+
 // Класс для чтения данных из буфера
 class PacketReader
 {
     const uint8_t* m_bufferPtr;
-    const uint8_t* m_bufferEnd;
+    const uint8_t* m_bufferEnd;     // Конец текущего объекта
+    bool m_isValidatingText;
+    uint8_t m_fieldTag = 0;         // Номер последнего запрошенного поля текущего объекта
 
 public:
-    PacketReader(const uint8_t* bufferPtr, const uint8_t* bufferEnd)
-        : m_bufferPtr(bufferPtr), m_bufferEnd(bufferEnd) {}
+    // isValidatingText - строки должны быть корректным UTF-8 без управляющих символов (isValidText)
+    PacketReader(const uint8_t* bufferPtr, const uint8_t* bufferEnd, bool isValidatingText = false)
+        : m_bufferPtr(bufferPtr), m_bufferEnd(bufferEnd), m_isValidatingText(isValidatingText) {}
 
     template<typename First, typename ...Args>
-    void operator()( First& first, Args... tail )
+    void operator()( First& first, Args&... tail )
     {
-        read( first );
+        readField( first );
         (*this)( tail... );
     }
     void operator()() {}
@@ -44,12 +92,30 @@ public:
         m_bufferPtr += 2;
     }
 
+    void read(uint32_t& value) {
+        if (m_bufferPtr + 4 > m_bufferEnd) {
+            throw std::runtime_error("Buffer length too small (uint32_t)");
+        }
+        value = uint32_t(m_bufferPtr[0]) | (uint32_t(m_bufferPtr[1]) << 8) | (uint32_t(m_bufferPtr[2]) << 16) | (uint32_t(m_bufferPtr[3]) << 24);
+        m_bufferPtr += 4;
+    }
+
+    void read(uint64_t& value) {
+        uint32_t low, high;
+        read(low);
+        read(high);
+        value = uint64_t(low) | (uint64_t(high) << 32);
+    }
+
     void read(std::string& value) {
         uint16_t length;
         read(length);
         if (m_bufferPtr + length > m_bufferEnd) {
             throw std::runtime_error("Buffer length too small (string)");
         }
+        if (m_isValidatingText && !isValidText(std::string_view(reinterpret_cast<const char*>(m_bufferPtr), length))) {
+            throw std::runtime_error("Invalid text (string)");
+        }
         value.assign(reinterpret_cast<const char*>(m_bufferPtr), length);
         m_bufferPtr += length;
     }
@@ -57,20 +123,101 @@ public:
     template <typename T>
     void read(std::vector<T>& value)
     {
+        const uint8_t* outerEnd = enterNested();
         uint16_t size;
         read(size);
 
-        for (int i=0; i >= size; i++)
+        value.clear();
+        value.reserve(std::min<size_t>(size, m_bufferEnd - m_bufferPtr)); // Элемент занимает хотя бы байт
+        for (int i=0; i < size; i++)
         {
             T element;
-            read(element);
+            readValue(element);
             value.push_back(std::move ( element ));
         }
+        leaveNested(outerEnd);
     }
 
+    // Поля объекта до конца текущего буфера; неизвестные поля в конце пропускаются разом
     template<typename T>
     void read(T& object) {
+        uint8_t outerTag = m_fieldTag;
+        m_fieldTag = 0;
         object.fields(*this);
+        m_fieldTag = outerTag;
+        m_bufferPtr = m_bufferEnd;
+    }
+
+    bool isEnd() const { return m_bufferPtr >= m_bufferEnd; }
+
+private:
+    // Поле со следующим номером. Поля идут по возрастанию номеров: поле с большим номером
+    // означает, что запрошенного нет; с меньшим - повтор или мусор, он пропускается
+    template<typename T>
+    void readField(T& value) {
+        uint8_t tag = ++m_fieldTag;
+        while (m_bufferPtr < m_bufferEnd) {
+            uint8_t key = *m_bufferPtr;
+            if ((key >> 3) > tag) {
+                return;
+            }
+            m_bufferPtr++;
+            if ((key >> 3) == tag) {
+                if ((key & 7) != wireTypeOf<T>()) {
+                    throw std::runtime_error("Field type mismatch");
+                }
+                readValue(value);
+                return;
+            }
+            skipValue(key & 7);
+        }
+    }
+
+    // Пропуск без разбора: проверка границы и сдвиг указателя
+    void skipValue(uint8_t wireType) {
+        size_t size;
+        if (wireType < wt_length) {
+            size = kWireFixedSize[wireType];
+        } else if (wireType == wt_length) {
+            uint16_t length;
+            read(length);
+            size = length;
+        } else {
+            throw std::runtime_error("Unknown wire type");
+        }
+        if (size > size_t(m_bufferEnd - m_bufferPtr)) {
+            throw std::runtime_error("Buffer length too small (skip)");
+        }
+        m_bufferPtr += size;
+    }
+
+    // Вложенный объект - с длиной, чтобы получатель мог пропустить его новые поля
+    template<typename T>
+    void readValue(T& value) {
+        if constexpr (IsFieldObject<T>::value) {
+            const uint8_t* outerEnd = enterNested();
+            read(value);
+            leaveNested(outerEnd);
+        } else {
+            read(value);
+        }
+    }
+
+    // [u16 длина]: буфер сужается до вложенного значения, возвращается прежний конец
+    const uint8_t* enterNested() {
+        uint16_t length;
+        read(length);
+        if (length > size_t(m_bufferEnd - m_bufferPtr)) {
+            throw std::runtime_error("Buffer length too small (nested)");
+        }
+        const uint8_t* outerEnd = m_bufferEnd;
+        m_bufferEnd = m_bufferPtr + length;
+        return outerEnd;
+    }
+
+    void leaveNested(const uint8_t* outerEnd) {
+        m_bufferPtr = m_bufferEnd;
+        m_bufferEnd = outerEnd;
     }
 };
 
@@ -78,15 +225,16 @@ public:
 class PacketWriter {
     uint8_t* m_bufferPtr;
     uint8_t* m_bufferEnd;
+    uint8_t m_fieldTag = 0; // Номер последнего записанного поля текущего объекта
 
 public:
     PacketWriter(uint8_t* bufferPtr, size_t bufferSize)
         : m_bufferPtr(bufferPtr), m_bufferEnd(bufferPtr + bufferSize) {}
 
     template<typename First, typename ...Args>
-    void operator()( First& first, Args... tail )
+    void operator()( First& first, Args&... tail )
     {
-        write( first );
+        writeField( first );
         (*this)( tail... );
     }
     void operator()() {}
@@ -109,7 +257,25 @@ public:
         m_bufferPtr++;
     }
 
+    void write(uint32_t value) {
+        if (m_bufferPtr + 4 > m_bufferEnd) {
+            throw std::runtime_error("Buffer overflow (uint32_t)");
+        }
+        for (int i = 0; i < 4; i++) {
+            *m_bufferPtr = (value >> (8 * i)) & 0x00FF;
+            m_bufferPtr++;
+        }
+    }
+
+    void write(uint64_t value) {
+        write(static_cast<uint32_t>(value & 0xFFFFFFFF));
+        write(static_cast<uint32_t>(value >> 32));
+    }
+
     void write(std::string& value) {
+        if (value.size() > UINT16_MAX) {
+            throw std::runtime_error("String too long");
+        }
         write(static_cast<uint16_t>(value.size()));
         if (m_bufferPtr + value.size() > m_bufferEnd) {
             throw std::runtime_error("Buffer overflow (string)");
@@ -118,9 +284,66 @@ public:
         m_bufferPtr += value.size();
     }
 
+    template <typename T>
+    void write(std::vector<T>& value)
+    {
+        uint8_t* lengthPtr = beginNested();
+        write(static_cast<uint16_t>(value.size()));
+        for (auto& element : value)
+        {
+            writeValue(element);
+        }
+        endNested(lengthPtr);
+    }
+
     template<typename T>
     void write(T& object) {
+        uint8_t outerTag = m_fieldTag;
+        m_fieldTag = 0;
         object.fields(*this);
+        m_fieldTag = outerTag;
+    }
+
+private:
+    template<typename T>
+    void writeField(T& value) {
+        uint8_t tag = ++m_fieldTag;
+        if (tag > kMaxFieldTag) {
+            throw std::runtime_error("Too many fields");
+        }
+        if (m_bufferPtr + kFieldKeySize > m_bufferEnd) {
+            throw std::runtime_error("Buffer overflow (key)");
+        }
+        *m_bufferPtr = uint8_t(tag << 3) | wireTypeOf<T>();
+        m_bufferPtr++;
+        writeValue(value);
+    }
+
+    template<typename T>
+    void writeValue(T& value) {
+        if constexpr (IsFieldObject<T>::value) {
+            uint8_t* lengthPtr = beginNested();
+            write(value);
+            endNested(lengthPtr);
+        } else {
+            write(value);
+        }
+    }
+
+    // Место под длину вложенного значения; заполняется в endNested
+    uint8_t* beginNested() {
+        uint8_t* lengthPtr = m_bufferPtr;
+        write(uint16_t{});
+        return lengthPtr;
+    }
+
+    void endNested(uint8_t* lengthPtr) {
+        size_t length = m_bufferPtr - lengthPtr - sizeof(uint16_t);
+        if (length > UINT16_MAX) {
+            throw std::runtime_error("Nested value too large");
+        }
+        lengthPtr[0] = length & 0x00FF;
+        lengthPtr[1] = (length >> 8) & 0x00FF;
     }
 };
 
@@ -130,9 +353,10 @@ class PacketSizeCalculator {
 
 public:
     template<typename First, typename ...Args>
-    void operator()( First& first, Args... tail )
+    void operator()( First& first, Args&... tail )
     {
-        addSize( first );
+        m_size += kFieldKeySize;
+        addValueSize( first );
         (*this)( tail... );
     }
     void operator()() {}
@@ -141,13 +365,61 @@ public:
 
     void addSize(bool) { m_size += 1; }
     void addSize(uint16_t) { m_size += 2; }
+    void addSize(uint32_t) { m_size += 4; }
+    void addSize(uint64_t) { m_size += 8; }
     void addSize(std::string& value) { m_size += 2 + value.size(); }
 
+    template <typename T>
+    void addSize(std::vector<T>& value)
+    {
+        m_size += 2 + 2;
+        for (auto& element : value)
+        {
+            addValueSize(element);
+        }
+    }
+
     template<typename T>
     void addSize(T& object) {
         object.fields(*this); // Шаблонный вызов для пользовательских объектов
     }
+
+    // Элемент вектора без ключа поля: вложенный объект - вместе с длиной
+    template<typename T>
+    void addElementSize(T& element) { addValueSize(element); }
+
+private:
+    template<typename T>
+    void addValueSize(T& value) {
+        if constexpr (IsFieldObject<T>::value) {
+            m_size += 2;
+        }
+        addSize(value);
+    }
 };
 
+// Сериализация пакета: [длина тела][тип][поля с ключами]; буфер выделяется через new[]
+template<class PacketT>
+uint8_t* createPacket(PacketT& packet, size_t& packetSize)
+{
+    PacketSizeCalculator sizeCalculator;
+    sizeCalculator.addSize(uint16_t{});  // Размер TCP пакета
+    sizeCalculator.addSize(uint16_t{});  // Тип пакета
+    sizeCalculator.addSize(packet);      // Поля пакета
+
+    packetSize = sizeCalculator.getSize();
+    if (packetSize - sizeof(uint16_t) > UINT16_MAX) {
+        throw std::runtime_error("Packet too large");
+    }
+    uint8_t* buffer = new uint8_t[packetSize];
+    PacketWriter writer(buffer, packetSize);
+
+    writer.write(static_cast<uint16_t>(packetSize - sizeof(uint16_t)));
+    writer.write(static_cast<uint16_t>(packet.packetType()));
+    writer.write(packet);
+
+    return buffer;
+}
+
 }
 
@@ -8,6 +8,9 @@
 namespace user_chat
 {
 
+// Поля пакетов передаются с номерами (см. ChatClientPacketUtils.h): новое поле добавляется
+// только в конец fields(), тогда старые и новые клиенты и серверы понимают друг друга.
+
 // Типы пакетов
 enum PacketType : uint16_t
 {
@@ -16,11 +19,36 @@ enum PacketType : uint16_t
     cpt_hi,
     cpt_message,
     cpt_status,
+    cpt_resume,
+    cpt_history_request,
+    cpt_search_request,
+    cpt_room_create,
+    cpt_room_join,
+    cpt_room_leave,
+    cpt_room_message,
+    cpt_register,
+    cpt_login,
+    cpt_ping,
 
     // от сервера к серверу
     spt_already_exists = 100,
     spt_users_list,
     spt_user_status,
+    spt_welcome,
+    spt_presence_delta,
+    spt_server_busy,
+    spt_history,
+    spt_search_result,
+    spt_room_joined,
+    spt_room_error,
+    spt_auth_error,
+    spt_pong,
+    spt_rate_limited,
+
+    // между узлами кластера (ChatServerSettings::m_peers)
+    npt_node_hello = 200,
+    npt_node_presence,
+    npt_node_message,
 };
 
 // Статусы клиента
@@ -36,6 +64,7 @@ struct PacketHi
 {
     std::string m_userName;
 
+    PacketHi() = default;
     PacketHi( std::string userName ) : m_userName(userName) {}
 
     constexpr static PacketType packetType() { return cpt_hi; }
@@ -48,45 +77,59 @@ struct PacketHi
 };
 
 
-// Пакет сообщения
+// Пакет сообщения. Пользователи указываются id из списка пользователей (ServerPacketUsersList);
+// отправитель заполняется сервером по сессии.
+// m_sentAtUs - время отправки по монотонным часам сервера (оценка отправителя по PacketPing), 0 - не указано;
+// получатель по нему считает задержку доставки.
+// m_messageId - номер сообщения у отправителя (возрастает, 0 - без номера); повтор номера сервер отбрасывает.
 class PacketMessage
 {
-    std::string m_senderName;
-    std::string m_receiverName;
+    uint32_t    m_senderId = 0;
+    uint32_t    m_receiverId = 0;
     std::string m_messageText;
+    uint64_t    m_sentAtUs = 0;
+    uint64_t    m_messageId = 0;
 
 public:
     PacketMessage() = default;
-    PacketMessage(const std::string& sender, const std::string& receiver, const std::string& message)
-        : m_senderName(sender), m_receiverName(receiver), m_messageText(message) {}
+    PacketMessage(uint32_t senderId, uint32_t receiverId, const std::string& message, uint64_t sentAtUs = 0, uint64_t messageId = 0)
+        : m_senderId(senderId), m_receiverId(receiverId), m_messageText(message), m_sentAtUs(sentAtUs), m_messageId(messageId) {}
 
     static PacketType packetType() { return cpt_message; }
 
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_senderId, m_receiverId, m_messageText, m_sentAtUs, m_messageId );
+    }
+
+    void setSenderId( uint32_t senderId ) { m_senderId = senderId; }
 
     // Методы для доступа к данным
-    const std::string& getSenderName() const { return m_senderName; }
-    const std::string& getReceiverName() const { return m_receiverName; }
+    uint32_t getSenderId() const { return m_senderId; }
+    uint32_t getReceiverId() const { return m_receiverId; }
     const std::string& getMessageText() const { return m_messageText; }
+    uint64_t getSentAtUs() const { return m_sentAtUs; }
+    uint64_t getMessageId() const { return m_messageId; }
 };
 
-// Пакет статуса клиента
+// Пакет статуса клиента (пользователь определяется по сессии)
 struct PacketClientStatus
 {
-    std::string     m_myName;
-    ClientStatus    m_status;
+    ClientStatus    m_status = cst_online;
 
-    PacketClientStatus( std::string myName, ClientStatus status ) : m_myName(myName), m_status(status) {}
+    PacketClientStatus() = default;
+    PacketClientStatus( ClientStatus status ) : m_status(status) {}
 
     constexpr static PacketType packetType() { return cpt_status; }
 
     template<class ExecutorT>
     void fields( ExecutorT& executor )
     {
-        executor( m_myName, (uint16_t&)m_status );
+        executor( (uint16_t&)m_status );
     }
 
     // Методы для доступа к данным
-    const std::string& getMyName() const { return m_myName; }
     ClientStatus getStatus() const { return m_status; }
 };
 
@@ -99,16 +142,19 @@ struct ServerPacketUserAlreadyExists
     void fields( const ExecutorT& executor ) {}
 };
 
+// Статус пользователя. Имя передаётся один раз вместе с id (в полном списке или в дельте,
+// где пользователь появился впервые); в остальных дельтах m_playerName пуст.
 struct UserStatus
 {
 public:
+    uint32_t        m_userId = 0;
     std::string     m_playerName;
     ClientStatus    m_status = user_chat::cst_not_disturb;
 
     template<class ExecutorT>
     void fields( ExecutorT& executor )
     {
-        executor( m_playerName, reinterpret_cast<uint16_t&>( m_status ) );
+        executor( m_userId, m_playerName, reinterpret_cast<uint16_t&>( m_status ) );
     }
 
     // template<class ExecutorT>
@@ -119,10 +165,11 @@ public:
 };
 
 
-// Пакет списка пользователей
+// Пакет списка пользователей (большой список передаётся несколькими пакетами, последний с m_hasMore = false)
 struct ServerPacketUsersList
 {
     std::vector<UserStatus> m_usersList;
+    bool                    m_hasMore = false;
 
     ServerPacketUsersList() = default;
     ServerPacketUsersList(std::vector<UserStatus>&& usersList) : m_usersList(std::move(usersList)) {}
@@ -132,11 +179,427 @@ struct ServerPacketUsersList
     template<class ExecutorT>
         void fields( ExecutorT& executor )
     {
-        executor( m_usersList );
+        executor( m_usersList, m_hasMore );
     }
 
     const std::vector<UserStatus>& getUsersList() const { return m_usersList; }
 };
 
-}
+// Возобновление сессии после обрыва: вместо PacketHi
+struct PacketResume
+{
+    std::string m_userName;
+    uint64_t    m_resumeToken = 0;
+    uint64_t    m_presenceVersion = 0;  // последняя версия присутствия, известная клиенту
+
+    constexpr static PacketType packetType() { return cpt_resume; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_userName, m_resumeToken, m_presenceVersion );
+    }
+};
+
+// Ответ на PacketHi/PacketResume: id пользователя, токен для следующего возобновления и текущая версия присутствия.
+// Следом идёт либо полный ServerPacketUsersList, либо ServerPacketPresenceDelta.
+// m_isResumed - сессия возобновлена по токену, m_lastMessageId - наибольший принятый номер сообщения клиента:
+// отправленное позже клиент повторяет. При новом входе нумерация сообщений начинается заново.
+struct ServerPacketWelcome
+{
+    uint32_t    m_userId = 0;
+    uint64_t    m_resumeToken = 0;
+    uint64_t    m_presenceVersion = 0;
+    bool        m_isResumed = false;
+    uint64_t    m_lastMessageId = 0;
+
+    constexpr static PacketType packetType() { return spt_welcome; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_userId, m_resumeToken, m_presenceVersion, m_isResumed, m_lastMessageId );
+    }
+};
+
+// Изменения присутствия между версиями (по одной записи на пользователя)
+struct ServerPacketPresenceDelta
+{
+    uint64_t                m_fromVersion = 0;
+    uint64_t                m_toVersion = 0;
+    std::vector<UserStatus> m_changes;
+
+    constexpr static PacketType packetType() { return spt_presence_delta; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_fromVersion, m_toVersion, m_changes );
+    }
+};
+
+// Сервер перегружен входами: клиент должен закрыть соединение и повторить не раньше чем через m_retryAfterMs
+struct ServerPacketServerBusy
+{
+    uint32_t    m_retryAfterMs = 0;
+
+    constexpr static PacketType packetType() { return spt_server_busy; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_retryAfterMs );
+    }
+};
+
+// Запрос страницы истории: до m_count сообщений беседы с m_peerName раньше m_beforeMessageId (0 - самые новые).
+// Собеседник указывается именем: история переживает выдачу id.
+struct PacketHistoryRequest
+{
+    std::string m_peerName;
+    uint64_t    m_beforeMessageId = 0;
+    uint16_t    m_count = 50;
+
+    constexpr static PacketType packetType() { return cpt_history_request; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_peerName, m_beforeMessageId, m_count );
+    }
+};
+
+struct HistoryMessage
+{
+    uint64_t    m_messageId = 0;
+    uint64_t    m_timestampMs = 0;  // время сервера, мс от эпохи
+    std::string m_senderName;
+    std::string m_messageText;
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_messageId, m_timestampMs, m_senderName, m_messageText );
+    }
+};
+
+// Страница истории по возрастанию id; m_hasMore - есть более ранние сообщения
+// (следующая страница запрашивается с m_beforeMessageId = id первого сообщения)
+struct ServerPacketHistory
+{
+    std::string                 m_peerName;
+    uint64_t                    m_beforeMessageId = 0;
+    std::vector<HistoryMessage> m_messages;
+    bool                        m_hasMore = false;
+
+    constexpr static PacketType packetType() { return spt_history; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_peerName, m_beforeMessageId, m_messages, m_hasMore );
+    }
+};
+
+// Поиск по истории своих бесед: все слова запроса должны встретиться в сообщении
+struct PacketSearchRequest
+{
+    std::string m_query;
+    uint16_t    m_maxHits = 20;
+
+    constexpr static PacketType packetType() { return cpt_search_request; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_query, m_maxHits );
+    }
+};
+
+struct SearchHit
+{
+    std::string     m_peerName;     // собеседник: страницу вокруг находки можно запросить PacketHistoryRequest
+    HistoryMessage  m_message;      // текст может быть обрезан
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_peerName, m_message );
+    }
+};
+
+// Результат поиска, лучшие совпадения первыми
+struct ServerPacketSearchResult
+{
+    std::string             m_query;
+    std::vector<SearchHit>  m_hits;
+
+    constexpr static PacketType packetType() { return spt_search_result; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_query, m_hits );
+    }
+};
+
+// Создание комнаты; создатель сразу становится участником (ответ - ServerPacketRoomJoined)
+struct PacketRoomCreate
+{
+    std::string m_roomName;
+
+    constexpr static PacketType packetType() { return cpt_room_create; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_roomName );
+    }
+};
+
+struct PacketRoomJoin
+{
+    std::string m_roomName;
+
+    constexpr static PacketType packetType() { return cpt_room_join; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_roomName );
+    }
+};
+
+struct PacketRoomLeave
+{
+    uint32_t    m_roomId = 0;
+
+    constexpr static PacketType packetType() { return cpt_room_leave; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_roomId );
+    }
+};
+
+// Сообщение в комнату; сервер заполняет отправителя и рассылает тот же пакет всем участникам.
+// m_messageId - как в PacketMessage, нумерация общая с личными сообщениями
+struct PacketRoomMessage
+{
+    uint32_t    m_roomId = 0;
+    uint32_t    m_senderId = 0;
+    std::string m_messageText;
+    uint64_t    m_messageId = 0;
+
+    constexpr static PacketType packetType() { return cpt_room_message; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_roomId, m_senderId, m_messageText, m_messageId );
+    }
+};
+
+// Пользователь стал участником комнаты (после создания или входа)
+struct ServerPacketRoomJoined
+{
+    uint32_t    m_roomId = 0;
+    std::string m_roomName;
+    uint32_t    m_memberCount = 0;
+
+    constexpr static PacketType packetType() { return spt_room_joined; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_roomId, m_roomName, m_memberCount );
+    }
+};
+
+enum RoomError : uint16_t
+{
+    rer_already_exists,
+    rer_not_found,
+    rer_invalid_name,
+    rer_not_member,
+};
+
+struct ServerPacketRoomError
+{
+    std::string m_roomName;     // или пусто, если запрос был по id
+    uint32_t    m_roomId = 0;
+    RoomError   m_error = rer_not_found;
+
+    constexpr static PacketType packetType() { return spt_room_error; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_roomName, m_roomId, reinterpret_cast<uint16_t&>( m_error ) );
+    }
+};
+
+// Регистрация и вход по паролю (если сервер требует пароль, PacketHi без токена отклоняется).
+// Пароль хэшируется на сервере вне потока ввода-вывода; успех - ServerPacketWelcome, ошибка - ServerPacketAuthError.
+struct PacketRegister
+{
+    std::string m_userName;
+    std::string m_password;
+
+    constexpr static PacketType packetType() { return cpt_register; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_userName, m_password );
+    }
+};
+
+struct PacketLogin
+{
+    std::string m_userName;
+    std::string m_password;
+
+    constexpr static PacketType packetType() { return cpt_login; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_userName, m_password );
+    }
+};
+
+enum AuthError : uint16_t
+{
+    aer_auth_required,
+    aer_invalid_credentials,    // нет такого пользователя или неверный пароль
+    aer_already_registered,
+    aer_invalid_name,
+};
+
+struct ServerPacketAuthError
+{
+    std::string m_userName;
+    AuthError   m_error = aer_invalid_credentials;
+
+    constexpr static PacketType packetType() { return spt_auth_error; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_userName, reinterpret_cast<uint16_t&>( m_error ) );
+    }
+};
+
+// Замер задержки: клиент отправляет своё монотонное время, сервер возвращает его вместе со своим.
+// RTT = время получения ответа - m_clientTimeUs; по ответу с наименьшим RTT клиент оценивает
+// смещение часов сервера (m_serverTimeUs соответствует середине интервала).
+struct PacketPing
+{
+    uint64_t m_clientTimeUs = 0;
 
+    constexpr static PacketType packetType() { return cpt_ping; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_clientTimeUs );
+    }
+};
+
+struct ServerPacketPong
+{
+    uint64_t m_clientTimeUs = 0;
+    uint64_t m_serverTimeUs = 0;
+
+    constexpr static PacketType packetType() { return spt_pong; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_clientTimeUs, m_serverTimeUs );
+    }
+};
+
+// Сообщения отправителя отбрасываются: превышена частота (ChatServerSettings::m_messageRate).
+// Приходит один раз на серию отброшенных; следующее сообщение будет принято через m_retryAfterMs
+struct ServerPacketRateLimited
+{
+    uint32_t    m_retryAfterMs = 0;
+
+    constexpr static PacketType packetType() { return spt_rate_limited; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_retryAfterMs );
+    }
+};
+
+// Первый пакет исходящего соединения узла кластера; m_clusterKey должен совпасть с ключом принимающего узла
+struct NodePacketHello
+{
+    uint32_t    m_nodeId = 0;
+    std::string m_clusterKey;
+
+    constexpr static PacketType packetType() { return npt_node_hello; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_nodeId, m_clusterKey );
+    }
+};
+
+// Изменение присутствия пользователя узла-отправителя; m_version растёт с каждым изменением на этом узле
+struct NodeUserStatus
+{
+    std::string     m_userName;
+    ClientStatus    m_status = cst_offline;
+    uint64_t        m_version = 0;
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_userName, reinterpret_cast<uint16_t&>( m_status ), m_version );
+    }
+};
+
+// Пачка изменений присутствия. После подключения узел сначала присылает полный список своих
+// пользователей в сети (m_isFullSync, последний пакет - m_hasMore = false), дальше - только изменения
+struct NodePacketPresence
+{
+    bool                        m_isFullSync = false;
+    bool                        m_hasMore = false;
+    std::vector<NodeUserStatus> m_changes;
+
+    constexpr static PacketType packetType() { return npt_node_presence; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_isFullSync, m_hasMore, m_changes );
+    }
+};
+
+// Сообщение пользователю, подключённому к узлу-получателю. Пользователи указываются именами:
+// id у каждого узла свои. m_ageUs - сколько сообщение уже в пути (часы узлов не сравниваются), 0 - неизвестно
+struct NodePacketMessage
+{
+    std::string m_senderName;
+    std::string m_receiverName;
+    std::string m_messageText;
+    uint64_t    m_ageUs = 0;
+    uint64_t    m_messageId = 0;
+
+    constexpr static PacketType packetType() { return npt_node_message; }
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_senderName, m_receiverName, m_messageText, m_ageUs, m_messageId );
+    }
+};
+
+}
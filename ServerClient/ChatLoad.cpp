@@ -0,0 +1,1208 @@
+// Нагрузочный генератор: сервер и N клиентов в одном процессе.
+// Сценарий transport сравнивает режимы low_latency и throughput по задержке и пропускной способности.
+// Сценарий storm - одновременный вход всех клиентов (перезапуск сервера) с ограничением входов.
+// Сервер шторма может работать отдельно: chat_node --login-rate 1000, chat_load --scenario storm --server HOST:PORT.
+// Сценарий noisy - задержка тихих клиентов, пока несколько соседей заваливают сервер сообщениями,
+// с бюджетом чтения сессии (fair), без него - чтение сокета до would_block (unbounded) и с ограничением
+// частоты сообщений (limited).
+// Сценарий cluster - задержка доставки между парами клиентов на одном сервере (single)
+// и на разных узлах кластера (cluster), где каждое сообщение пересылается узлу получателя.
+// Сценарий idle - память сервера на простаивающее соединение: с собственным буфером чтения (owned)
+// и с буфером из пула только на время разбора (slim). Например: --scenario idle --clients 10000
+// Сценарий tls - потери пропускной способности от TLS в сценарии transport и шторм рукопожатий:
+// клиенты подключаются, обмениваются пакетом и переподключаются с полным рукопожатием (full) или
+// по билету (resumed); задержка отдельного клиента во время шторма - с пулом рукопожатий и без (inline)
+// Сценарий local - сценарий transport через TCP на 127.0.0.1 и через Unix-сокет: задержка и процессорное
+// время процесса (сервер и клиенты) на сообщение. Задержка без очереди: --scenario local --window 1
+
+#include "TcpServer.h"
+#include "TcpClient.h"
+#include "ChatClient.h"
+#include "ChatServer.h"
+#include "ChatClientPacketUtils.h"
+
+#include <openssl/evp.h>
+#include <openssl/x509v3.h>
+
+#include <arpa/inet.h>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <future>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+struct LoadOptions
+{
+    std::string         m_scenario = "transport";
+    std::string         m_mode = "both";
+    size_t              m_clients = 16;
+    size_t              m_messages = 10000;     // на клиента
+    size_t              m_window = 16;          // пакетов "в полёте" на клиента
+    size_t              m_payloadSize = 64;
+    TransportSettings   m_transport;
+
+    // storm
+    double              m_acceptRate = 0;
+    double              m_loginRate = 5000;
+    size_t              m_timeoutSeconds = 120;
+    std::string         m_server;               // HOST:PORT - сервер в другом процессе (chat_node), иначе в этом
+
+    // noisy
+    size_t              m_flooders = 4;
+    size_t              m_floodWindow = 4096;   // сообщений "в полёте" у каждого флудера
+    size_t              m_durationSeconds = 3;
+    double              m_messageRate = 1000;   // limited: сообщений в секунду на пользователя
+
+    // cluster
+    size_t              m_nodes = 2;
+
+    // tls
+    size_t              m_tlsThreads = 1;       // потоков рукопожатий сервера
+};
+
+// Самоподписанный сертификат на 127.0.0.1 и контексты сервера и клиента, которые ему доверяют
+struct TestTls
+{
+    std::shared_ptr<TlsContext> m_server;
+    std::shared_ptr<TlsContext> m_client;
+};
+
+TestTls makeTestTls()
+{
+    std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key( EVP_EC_gen( "P-256" ), EVP_PKEY_free );
+    std::unique_ptr<X509, decltype(&X509_free)> certificate( X509_new(), X509_free );
+    X509* x509 = certificate.get();
+    X509_set_version( x509, 2 );
+    ASN1_INTEGER_set( X509_get_serialNumber( x509 ), 1 );
+    X509_gmtime_adj( X509_getm_notBefore( x509 ), 0 );
+    X509_gmtime_adj( X509_getm_notAfter( x509 ), 24 * 3600 );
+    X509_set_pubkey( x509, key.get() );
+    X509_NAME* name = X509_get_subject_name( x509 );
+    X509_NAME_add_entry_by_txt( name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>( "chat_load" ), -1, -1, 0 );
+    X509_set_issuer_name( x509, name );
+
+    X509V3_CTX extensionContext;
+    X509V3_set_ctx_nodb( &extensionContext );
+    X509V3_set_ctx( &extensionContext, x509, x509, nullptr, nullptr, 0 );
+    X509_EXTENSION* altName = X509V3_EXT_conf_nid( nullptr, &extensionContext, NID_subject_alt_name, "IP:127.0.0.1" );
+    X509_add_ext( x509, altName, -1 );
+    X509_EXTENSION_free( altName );
+    X509_sign( x509, key.get(), EVP_sha256() );
+
+    TestTls tls;
+    tls.m_server = TlsContext::createServer( x509, key.get() );
+    tls.m_client = TlsContext::createClient( "" );
+    if ( !tls.m_server || !tls.m_client || !tls.m_client->addTrustedCertificate( x509 ) )
+    {
+        throw std::runtime_error( "chat_load: cannot create TLS contexts" );
+    }
+    return tls;
+}
+
+// Результаты одного прогона
+struct LoadResult
+{
+    std::vector<uint64_t>   m_latenciesNs;
+    uint64_t                m_bytes = 0;
+    uint64_t                m_packets = 0;
+    uint64_t                m_writes = 0;
+    uint64_t                m_elapsedNs = 0;
+    uint64_t                m_cpuNs = 0;        // user + sys всего процесса
+
+    uint64_t percentile( double p ) const
+    {
+        if ( m_latenciesNs.empty() )
+        {
+            return 0;
+        }
+        size_t index = std::min( m_latenciesNs.size() - 1, size_t( p * m_latenciesNs.size() ) );
+        return m_latenciesNs[index];
+    }
+};
+
+uint64_t processCpuNs()
+{
+    rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    auto toNs = []( const timeval& time ) { return uint64_t( time.tv_sec ) * 1000000000ull + uint64_t( time.tv_usec ) * 1000; };
+    return toNs( usage.ru_utime ) + toNs( usage.ru_stime );
+}
+
+// Пакет нагрузки: [длина][тип][seq][время отправки][заполнение]
+uint8_t* makeLoadPacket( uint64_t seq, size_t payloadSize, size_t& packetSize )
+{
+    payloadSize = std::max( payloadSize, sizeof(uint16_t) + 2 * sizeof(uint64_t) );
+    packetSize = sizeof(uint16_t) + payloadSize;
+
+    uint8_t* buffer = new uint8_t[packetSize];
+    std::memset( buffer, 0, packetSize );
+
+    user_chat::PacketWriter writer( buffer, packetSize );
+    writer.write( static_cast<uint16_t>( payloadSize ) );
+    writer.write( static_cast<uint16_t>( user_chat::cpt_undefined ) );
+
+    uint64_t timestamp = monotonicNowNs();
+    std::memcpy( buffer + 2 * sizeof(uint16_t), &seq, sizeof(seq) );
+    std::memcpy( buffer + 2 * sizeof(uint16_t) + sizeof(seq), &timestamp, sizeof(timestamp) );
+    return buffer;
+}
+
+class EchoSession : public TcpClientSession
+{
+public:
+    using TcpClientSession::TcpClientSession;
+
+    void onPacketReceived( const uint8_t* data, size_t dataSize ) override
+    {
+        size_t packetSize = sizeof(uint16_t) + dataSize;
+        uint8_t* buffer = new uint8_t[packetSize];
+
+        user_chat::PacketWriter writer( buffer, packetSize );
+        writer.write( static_cast<uint16_t>( dataSize ) );
+        std::memcpy( buffer + sizeof(uint16_t), data, dataSize );
+
+        write( buffer, packetSize );
+    }
+};
+
+class EchoServer : public TcpServer
+{
+public:
+    using TcpServer::TcpServer;
+
+protected:
+    std::shared_ptr<TcpClientSession> createSession( StreamSocket&& socket ) override
+    {
+        return std::make_shared<EchoSession>( std::move(socket) );
+    }
+};
+
+class LoadClient : public TcpClient
+{
+    const LoadOptions&  m_options;
+    LoadResult&         m_result;
+    size_t&             m_activeClients;
+    uint64_t            m_sent = 0;
+    uint64_t            m_received = 0;
+
+public:
+    LoadClient( boost::asio::io_context& context, const LoadOptions& options, LoadResult& result, size_t& activeClients )
+        : TcpClient( context ), m_options( options ), m_result( result ), m_activeClients( activeClients )
+    {
+    }
+
+    void onConnected( const boost::system::error_code& ec ) override
+    {
+        if ( ec )
+        {
+            finish();
+            return;
+        }
+
+        while ( m_sent < m_options.m_window && m_sent < m_options.m_messages )
+        {
+            sendNext();
+        }
+    }
+
+    void onPacketReceived( const uint8_t* buffer, size_t bufferSize ) override
+    {
+        if ( bufferSize < sizeof(uint16_t) + 2 * sizeof(uint64_t) )
+        {
+            return;
+        }
+
+        uint64_t timestamp;
+        std::memcpy( &timestamp, buffer + sizeof(uint16_t) + sizeof(uint64_t), sizeof(timestamp) );
+        m_result.m_latenciesNs.push_back( monotonicNowNs() - timestamp );
+        m_received++;
+
+        if ( m_sent < m_options.m_messages )
+        {
+            sendNext();
+        }
+        else if ( m_received == m_options.m_messages )
+        {
+            m_result.m_packets += senderStats().m_packets;
+            m_result.m_writes += senderStats().m_writes;
+            finish();
+        }
+    }
+
+private:
+    void sendNext()
+    {
+        size_t packetSize;
+        uint8_t* packet = makeLoadPacket( m_sent++, m_options.m_payloadSize, packetSize );
+        m_result.m_bytes += packetSize;
+        sendPacket( packet, packetSize );
+    }
+
+    void finish()
+    {
+        close();
+        if ( --m_activeClients == 0 )
+        {
+            context().stop();
+        }
+    }
+};
+
+// localPath непуст - клиенты подключаются к Unix-сокету сервера
+LoadResult runTransportScenario( const LoadOptions& options, TransportMode mode, const TestTls* tls = nullptr, const std::string& localPath = {} )
+{
+    TransportSettings settings = options.m_transport;
+    settings.m_mode = mode;
+
+    EchoServer server( "127.0.0.1", "0" );
+    server.setTransportSettings( settings );
+    if ( tls )
+    {
+        server.setTls( tls->m_server, options.m_tlsThreads );
+    }
+    if ( !localPath.empty() )
+    {
+        server.listenLocal( localPath );
+    }
+    std::thread serverThread( [&server] { server.run(); } );
+
+    LoadResult result;
+    result.m_latenciesNs.reserve( options.m_clients * options.m_messages );
+
+    boost::asio::io_context context;
+    size_t activeClients = options.m_clients;
+    std::vector<std::shared_ptr<LoadClient>> clients;
+    for ( size_t i = 0; i < options.m_clients; i++ )
+    {
+        auto client = std::make_shared<LoadClient>( context, options, result, activeClients );
+        client->setTransportSettings( settings );
+        if ( tls )
+        {
+            client->setTls( tls->m_client );
+        }
+        if ( localPath.empty() )
+        {
+            client->connect( "127.0.0.1", std::to_string( server.localPort() ) );
+        }
+        else
+        {
+            client->connectLocal( localPath );
+        }
+        clients.push_back( client );
+    }
+
+    uint64_t start = monotonicNowNs();
+    uint64_t cpuStart = processCpuNs();
+    context.run();
+    result.m_elapsedNs = monotonicNowNs() - start;
+    result.m_cpuNs = processCpuNs() - cpuStart;
+
+    server.shutdown();
+    serverThread.join();
+
+    std::sort( result.m_latenciesNs.begin(), result.m_latenciesNs.end() );
+    return result;
+}
+
+void printResult( const std::string& name, const LoadOptions& options, const LoadResult& result )
+{
+    double seconds = double( result.m_elapsedNs ) / 1e9;
+    double packetsPerWrite = result.m_writes ? double( result.m_packets ) / double( result.m_writes ) : 0.0;
+
+    std::cout << std::fixed << std::setprecision( 1 )
+              << std::left << std::setw( 16 ) << name
+              << " clients=" << options.m_clients
+              << " msgs=" << result.m_latenciesNs.size()
+              << " time=" << seconds * 1e3 << "ms"
+              << " rate=" << double( result.m_latenciesNs.size() ) / seconds << " msg/s"
+              << " " << double( result.m_bytes ) / seconds / ( 1024 * 1024 ) << " MiB/s"
+              << " rtt_us p50=" << result.percentile( 0.50 ) / 1e3
+              << " p99=" << result.percentile( 0.99 ) / 1e3
+              << " max=" << ( result.m_latenciesNs.empty() ? 0.0 : result.m_latenciesNs.back() / 1e3 )
+              << " pkts/write=" << std::setprecision( 2 ) << packetsPerWrite
+              << " cpu_us/msg=" << ( result.m_latenciesNs.empty() ? 0.0 : double( result.m_cpuNs ) / 1e3 / double( result.m_latenciesNs.size() ) )
+              << std::endl;
+}
+
+// Список пользователей без разбора: вектор читается как байты той же длины ([u16 длина][данные])
+struct UsersListTail
+{
+    std::string m_usersList;
+    bool        m_hasMore = false;
+
+    template<class ExecutorT>
+    void fields( ExecutorT& executor )
+    {
+        executor( m_usersList, m_hasMore );
+    }
+};
+
+// Клиент шторма: отправляет PacketHi и считается вошедшим, получив последний пакет списка пользователей.
+// Не ChatClient: тот держит справочник имён всех пользователей, и N клиентов в одном процессе заняли бы O(N^2) памяти
+class StormClient : public TcpClient
+{
+public:
+    struct Stats
+    {
+        size_t                  m_clients = 0;
+        uint64_t                m_startNs = 0;
+        std::vector<uint64_t>   m_loginNs;
+        uint64_t                m_busy = 0;
+    };
+
+private:
+    std::string m_userName;
+    Stats&      m_stats;
+    bool        m_isLoggedIn = false;
+
+public:
+    StormClient( boost::asio::io_context& context, const std::string& userName, Stats& stats )
+        : TcpClient( context ), m_userName( userName ), m_stats( stats )
+    {
+    }
+
+    void onConnected( const boost::system::error_code& ec ) override
+    {
+        if ( ec )
+        {
+            return;
+        }
+        user_chat::PacketHi packet{ m_userName };
+        size_t packetSize;
+        uint8_t* buffer = user_chat::createPacket( packet, packetSize );
+        sendPacket( buffer, packetSize );
+    }
+
+    void onPacketReceived( const uint8_t* data, size_t dataSize ) override
+    {
+        user_chat::PacketReader reader( data, data + dataSize );
+        uint16_t packetType;
+        reader.read( packetType );
+        if ( packetType == user_chat::spt_users_list )
+        {
+            UsersListTail packet;
+            reader.read( packet );
+            if ( !packet.m_hasMore && !m_isLoggedIn )
+            {
+                m_isLoggedIn = true;
+                m_stats.m_loginNs.push_back( monotonicNowNs() - m_stats.m_startNs );
+                if ( m_stats.m_loginNs.size() == m_stats.m_clients )
+                {
+                    context().stop();
+                }
+            }
+        }
+        else if ( packetType == user_chat::spt_server_busy )
+        {
+            // Как ChatClient: закрыть соединение и повторить не раньше подсказки сервера
+            user_chat::ServerPacketServerBusy packet;
+            reader.read( packet );
+            m_stats.m_busy++;
+            closeSocket();
+            scheduleReconnect( std::chrono::milliseconds( packet.m_retryAfterMs ) );
+        }
+    }
+};
+
+// Поднять лимит дескрипторов: на каждого клиента нужно два (клиент и сессия сервера)
+void raiseFileLimit( size_t required )
+{
+    rlimit limit;
+    if ( getrlimit( RLIMIT_NOFILE, &limit ) != 0 )
+    {
+        return;
+    }
+    if ( limit.rlim_cur < required )
+    {
+        limit.rlim_cur = std::min<rlim_t>( limit.rlim_max, required );
+        setrlimit( RLIMIT_NOFILE, &limit );
+    }
+    if ( limit.rlim_cur < required )
+    {
+        std::cout << "warning: RLIMIT_NOFILE " << limit.rlim_cur << " < " << required << ", clients will be refused" << std::endl;
+    }
+}
+
+void runStormScenario( const LoadOptions& options )
+{
+    // Сервер в этом процессе - по два дескриптора на клиента
+    raiseFileLimit( options.m_clients * ( options.m_server.empty() ? 2 : 1 ) + 64 );
+
+    std::unique_ptr<ChatServer> server;
+    std::thread serverThread;
+    std::string host = "127.0.0.1";
+    std::string port;
+    if ( options.m_server.empty() )
+    {
+        ChatServerSettings settings;
+        settings.m_loginRate = options.m_loginRate;
+        settings.m_loginBurst = uint32_t( std::max( 1.0, options.m_loginRate / 10 ) );
+        settings.m_latencyLogInterval = std::chrono::seconds( 0 );
+
+        server = std::make_unique<ChatServer>( host, "0", settings );
+        server->setAcceptRate( options.m_acceptRate, uint32_t( std::max( 1.0, options.m_acceptRate / 10 ) ) );
+        port = std::to_string( server->localPort() );
+        serverThread = std::thread( [&server] { server->run(); } );
+    }
+    else
+    {
+        size_t colon = options.m_server.rfind( ':' );
+        host = options.m_server.substr( 0, colon );
+        port = options.m_server.substr( colon + 1 );
+    }
+
+    StormClient::Stats stats;
+    stats.m_clients = options.m_clients;
+    stats.m_loginNs.reserve( options.m_clients );
+
+    ReconnectPolicy policy;
+    policy.m_isEnabled = true;
+
+    boost::asio::io_context context;
+    std::vector<std::shared_ptr<StormClient>> clients;
+    for ( size_t i = 0; i < options.m_clients; i++ )
+    {
+        auto client = std::make_shared<StormClient>( context, "user" + std::to_string( i ), stats );
+        client->setReconnectPolicy( policy );
+        client->connect( host, port );
+        clients.push_back( client );
+    }
+
+    boost::asio::steady_timer timeout( context, std::chrono::seconds( options.m_timeoutSeconds ) );
+    timeout.async_wait( [&context]( const boost::system::error_code& ec ) { if ( !ec ) context.stop(); } );
+
+    stats.m_startNs = monotonicNowNs();
+    context.run();
+    uint64_t elapsedNs = monotonicNowNs() - stats.m_startNs;
+
+    uint64_t reconnects = 0;
+    for ( auto& client : clients )
+    {
+        reconnects += client->reconnectCount();
+    }
+
+    if ( server )
+    {
+        server->shutdown();
+        serverThread.join();
+    }
+
+    std::sort( stats.m_loginNs.begin(), stats.m_loginNs.end() );
+    auto percentile = [&stats]( double p ) -> double
+    {
+        if ( stats.m_loginNs.empty() )
+        {
+            return 0;
+        }
+        return stats.m_loginNs[std::min( stats.m_loginNs.size() - 1, size_t( p * stats.m_loginNs.size() ) )] / 1e6;
+    };
+
+    std::cout << std::fixed << std::setprecision( 1 )
+              << "storm clients=" << options.m_clients
+              << " logged_in=" << stats.m_loginNs.size()
+              << ( stats.m_loginNs.size() == options.m_clients ? " recovered" : " TIMEOUT" )
+              << " time=" << elapsedNs / 1e6 << "ms"
+              << " login_ms p50=" << percentile( 0.50 )
+              << " p99=" << percentile( 0.99 )
+              << " max=" << percentile( 1.0 )
+              << " busy=" << stats.m_busy
+              << " reconnects=" << reconnects
+              << std::endl;
+}
+
+// Тихий клиент: сообщение самому себе раз в kIntervalMs, задержка доставки - по m_sentAtUs
+class QuietClient : public user_chat::ChatClient
+{
+    static constexpr int kIntervalMs = 5;
+
+    boost::asio::steady_timer   m_timer;
+    bool                        m_isStarted = false;
+
+public:
+    QuietClient( boost::asio::io_context& context, const std::string& userName )
+        : ChatClient( context, userName ), m_timer( context )
+    {
+    }
+
+    void onUsersListReceived( std::vector<user_chat::UserStatus>& ) override
+    {
+        if ( !m_isStarted )
+        {
+            m_isStarted = true;
+            sendNext();
+        }
+    }
+
+private:
+    void sendNext()
+    {
+        m_timer.expires_after( std::chrono::milliseconds( kIntervalMs ) );
+        m_timer.async_wait( [this]( const boost::system::error_code& ec )
+                            {
+                                if ( ec )
+                                {
+                                    return;
+                                }
+                                sendMessage( userId(), "quiet" );
+                                sendNext();
+                            });
+    }
+};
+
+// Флудер: держит m_window сообщений самому себе "в полёте", на каждое полученное отправляет следующее.
+// Отброшенные сервером по частоте не вернутся: когда сервер снова примет сообщения, окно заполняется заново
+class FloodClient : public user_chat::ChatClient
+{
+    size_t                      m_window;
+    std::string                 m_text;
+    uint64_t&                   m_received;
+    boost::asio::steady_timer   m_timer;
+    bool                        m_isStarted = false;
+
+public:
+    FloodClient( boost::asio::io_context& context, const std::string& userName, size_t window, size_t payloadSize, uint64_t& received )
+        : ChatClient( context, userName ), m_window( window ), m_text( payloadSize, 'x' ), m_received( received ), m_timer( context )
+    {
+    }
+
+    void onUsersListReceived( std::vector<user_chat::UserStatus>& ) override
+    {
+        if ( !m_isStarted )
+        {
+            m_isStarted = true;
+            fillWindow();
+        }
+    }
+
+    void onMessageReceived( const user_chat::PacketMessage& ) override
+    {
+        m_received++;
+        sendMessage( userId(), m_text );
+    }
+
+    void onRateLimited( uint32_t retryAfterMs ) override
+    {
+        m_timer.expires_after( std::chrono::milliseconds( retryAfterMs ) );
+        m_timer.async_wait( [this]( const boost::system::error_code& ec )
+                            {
+                                if ( !ec )
+                                {
+                                    fillWindow();
+                                }
+                            });
+    }
+
+private:
+    void fillWindow()
+    {
+        for ( size_t i = 0; i < m_window; i++ )
+        {
+            sendMessage( userId(), m_text );
+        }
+    }
+};
+
+void runNoisyScenario( const LoadOptions& options, const char* name, size_t readBudgetPackets, double messageRate )
+{
+    raiseFileLimit( ( options.m_clients + options.m_flooders ) * 2 + 64 );
+
+    TransportSettings transport;
+    transport.m_readBudgetPackets = readBudgetPackets;
+    transport.m_isDrainSocket = readBudgetPackets == SIZE_MAX;
+
+    ChatServerSettings settings;
+    settings.m_latencyLogInterval = std::chrono::seconds( 0 );
+    settings.m_messageRate = messageRate;
+    settings.m_messageBurst = uint32_t( std::max( 1.0, messageRate / 10 ) );
+    ChatServer server( "127.0.0.1", "0", settings );
+    server.setTransportSettings( transport );
+    std::thread serverThread( [&server] { server.run(); } );
+
+    boost::asio::io_context context;
+    std::string port = std::to_string( server.localPort() );
+    std::vector<std::shared_ptr<QuietClient>> quietClients;
+    for ( size_t i = 0; i < options.m_clients; i++ )
+    {
+        auto client = std::make_shared<QuietClient>( context, "quiet" + std::to_string( i ) );
+        client->connect( "127.0.0.1", port );
+        quietClients.push_back( client );
+    }
+    // Флудеры в своём потоке: задержка тихих не должна зависеть от очереди на стороне клиентов
+    boost::asio::io_context floodContext;
+    uint64_t floodReceived = 0;
+    std::vector<std::shared_ptr<FloodClient>> flooders;
+    for ( size_t i = 0; i < options.m_flooders; i++ )
+    {
+        auto client = std::make_shared<FloodClient>( floodContext, "flood" + std::to_string( i ), options.m_floodWindow,
+                                                     options.m_payloadSize, floodReceived );
+        client->connect( "127.0.0.1", port );
+        flooders.push_back( client );
+    }
+    auto floodWork = boost::asio::make_work_guard( floodContext );
+    std::thread floodThread( [&floodContext] { floodContext.run(); } );
+
+    boost::asio::steady_timer timeout( context, std::chrono::seconds( options.m_durationSeconds ) );
+    timeout.async_wait( [&context]( const boost::system::error_code& ec ) { if ( !ec ) context.stop(); } );
+    context.run();
+
+    floodContext.stop();
+    floodThread.join();
+
+    server.shutdown();
+    serverThread.join();
+
+    LatencyHistogram delivery;
+    for ( auto& client : quietClients )
+    {
+        delivery.merge( client->deliveryHistogram() );
+    }
+    std::cout << std::fixed << std::setprecision( 1 )
+              << std::left << std::setw( 10 ) << name
+              << " quiet=" << options.m_clients
+              << " flooders=" << options.m_flooders
+              << " flood_rate=" << double( floodReceived ) / double( options.m_durationSeconds ) << " msg/s"
+              << " rate_limited=" << server.rateLimitedMessages()
+              << " quiet_delivery ";
+    delivery.print( std::cout );
+    std::cout << std::endl;
+}
+
+// Клиент пары: раз в kIntervalMs сообщение партнёру, как только тот появится в списке пользователей
+class PairClient : public user_chat::ChatClient
+{
+    static constexpr int kIntervalMs = 5;
+
+    boost::asio::steady_timer   m_timer;
+    std::string                 m_partnerName;
+    std::string                 m_text;
+    bool                        m_isStarted = false;
+
+public:
+    PairClient( boost::asio::io_context& context, const std::string& userName, const std::string& partnerName, size_t payloadSize )
+        : ChatClient( context, userName ), m_timer( context ), m_partnerName( partnerName ), m_text( payloadSize, 'x' )
+    {
+    }
+
+    void onUsersListReceived( std::vector<user_chat::UserStatus>& ) override
+    {
+        if ( !m_isStarted )
+        {
+            m_isStarted = true;
+            sendNext();
+        }
+    }
+
+private:
+    void sendNext()
+    {
+        m_timer.expires_after( std::chrono::milliseconds( kIntervalMs ) );
+        m_timer.async_wait( [this]( const boost::system::error_code& ec )
+                            {
+                                if ( ec )
+                                {
+                                    return;
+                                }
+                                // Партнёр на другом узле виден после рассылки присутствия между узлами
+                                uint32_t partnerId = userIdByName( m_partnerName );
+                                if ( partnerId != 0 )
+                                {
+                                    sendMessage( partnerId, m_text );
+                                }
+                                sendNext();
+                            });
+    }
+};
+
+// Порт, свободный на момент вызова: узлам кластера адреса друг друга нужны до запуска
+std::string freePort()
+{
+    boost::asio::io_context context;
+    tcp::acceptor acceptor( context, tcp::endpoint( boost::asio::ip::make_address( "127.0.0.1" ), 0 ) );
+    return std::to_string( acceptor.local_endpoint().port() );
+}
+
+void runClusterScenario( const LoadOptions& options, const char* name, size_t nodeCount )
+{
+    raiseFileLimit( options.m_clients * 4 + 64 );
+
+    std::vector<std::string> ports;
+    for ( size_t i = 0; i < nodeCount; i++ )
+    {
+        ports.push_back( freePort() );
+    }
+
+    std::vector<std::unique_ptr<ChatServer>> nodes;
+    for ( size_t i = 0; i < nodeCount; i++ )
+    {
+        ChatServerSettings settings;
+        settings.m_latencyLogInterval = std::chrono::seconds( 0 );
+        if ( nodeCount > 1 )
+        {
+            settings.m_nodeId = uint32_t( i + 1 );
+            for ( size_t peer = 0; peer < nodeCount; peer++ )
+            {
+                if ( peer != i )
+                {
+                    settings.m_peers.push_back( ClusterPeer{ uint32_t( peer + 1 ), "127.0.0.1", ports[peer] } );
+                }
+            }
+        }
+        nodes.push_back( std::make_unique<ChatServer>( "127.0.0.1", ports[i], settings ) );
+    }
+    std::vector<std::thread> nodeThreads;
+    for ( auto& node : nodes )
+    {
+        nodeThreads.emplace_back( [&node] { node->run(); } );
+    }
+
+    // Пара i: a<i> на узле i % N, b<i> - на следующем
+    boost::asio::io_context context;
+    std::vector<std::shared_ptr<PairClient>> clients;
+    for ( size_t i = 0; i < options.m_clients; i++ )
+    {
+        std::string first = "a" + std::to_string( i );
+        std::string second = "b" + std::to_string( i );
+        auto a = std::make_shared<PairClient>( context, first, second, options.m_payloadSize );
+        auto b = std::make_shared<PairClient>( context, second, first, options.m_payloadSize );
+        a->connect( "127.0.0.1", ports[i % nodeCount] );
+        b->connect( "127.0.0.1", ports[( i + 1 ) % nodeCount] );
+        clients.push_back( a );
+        clients.push_back( b );
+    }
+
+    boost::asio::steady_timer timeout( context, std::chrono::seconds( options.m_durationSeconds ) );
+    timeout.async_wait( [&context]( const boost::system::error_code& ec ) { if ( !ec ) context.stop(); } );
+    context.run();
+
+    for ( auto& node : nodes )
+    {
+        node->shutdown();
+    }
+    for ( auto& thread : nodeThreads )
+    {
+        thread.join();
+    }
+
+    LatencyHistogram delivery;
+    for ( auto& client : clients )
+    {
+        delivery.merge( client->deliveryHistogram() );
+    }
+    std::cout << std::fixed << std::setprecision( 1 )
+              << std::left << std::setw( 10 ) << name
+              << " nodes=" << nodeCount
+              << " pairs=" << options.m_clients
+              << " rate=" << double( delivery.count() ) / double( options.m_durationSeconds ) << " msg/s"
+              << " delivery ";
+    delivery.print( std::cout );
+    std::cout << std::endl;
+}
+
+// Занято в куче процесса: малые блоки и блоки через mmap
+size_t heapInUse()
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+// Ждёт, пока поток сервера обработает всё, что уже пришло
+void waitServerIdle( ChatServer& server )
+{
+    std::promise<void> done;
+    boost::asio::post( server.context(), [&done] { done.set_value(); } );
+    done.get_future().wait();
+}
+
+// Клиенты - голые сокеты (без объектов в куче): каждый отправляет PacketPing, дожидается ответа и молчит.
+// Прирост кучи после подключения всех - память сервера на сессию, без буферов сокетов в ядре
+void runIdleScenario( const LoadOptions& options, const char* name, bool isSlimIdle )
+{
+    raiseFileLimit( options.m_clients * 2 + 64 );
+
+    TransportSettings transport;
+    transport.m_isSlimIdle = isSlimIdle;
+    ChatServerSettings settings;
+    settings.m_latencyLogInterval = std::chrono::seconds( 0 );
+    ChatServer server( "127.0.0.1", "0", settings );
+    server.setTransportSettings( transport );
+    std::thread serverThread( [&server] { server.run(); } );
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons( server.localPort() );
+    address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+    user_chat::PacketPing ping{ 0 };
+    size_t pingSize;
+    std::unique_ptr<uint8_t[]> pingPacket( user_chat::createPacket( ping, pingSize ) );
+    user_chat::ServerPacketPong pong;
+    size_t pongSize;
+    std::unique_ptr<uint8_t[]> pongPacket( user_chat::createPacket( pong, pongSize ) );
+
+    std::vector<int> sockets;
+    sockets.reserve( options.m_clients );
+    waitServerIdle( server );
+    size_t heapBefore = heapInUse();
+    for ( size_t i = 0; i < options.m_clients; i++ )
+    {
+        int fd = ::socket( AF_INET, SOCK_STREAM, 0 );
+        if ( fd < 0 )
+        {
+            break;
+        }
+        if ( ::connect( fd, reinterpret_cast<sockaddr*>( &address ), sizeof(address) ) != 0 ||
+             ::send( fd, pingPacket.get(), pingSize, 0 ) != ssize_t( pingSize ) )
+        {
+            ::close( fd );
+            break;
+        }
+        size_t received = 0;
+        while ( received < pongSize )
+        {
+            ssize_t result = ::recv( fd, pongPacket.get() + received, pongSize - received, 0 );
+            if ( result <= 0 )
+            {
+                break;
+            }
+            received += size_t( result );
+        }
+        sockets.push_back( fd );
+    }
+    waitServerIdle( server );
+    size_t heapAfter = heapInUse();
+
+    for ( int fd : sockets )
+    {
+        ::close( fd );
+    }
+    server.shutdown();
+    serverThread.join();
+
+    std::cout << std::left << std::setw( 10 ) << name
+              << " sessions=" << sockets.size()
+              << " sizeof(ChatSession)=" << sizeof(ChatSession)
+              << " heap_per_session=" << ( sockets.empty() ? 0 : ( heapAfter - heapBefore ) / sockets.size() ) << " bytes"
+              << std::endl;
+}
+
+// Клиент шторма рукопожатий: подключается, получает эхо одного пакета (к этому времени пришёл и билет)
+// и переподключается, пока не выйдет время
+class HandshakeClient : public TcpClient
+{
+    bool        m_isResumed;
+    uint64_t    m_deadline;
+    size_t&     m_activeClients;
+    bool        m_isFinished = false;
+
+public:
+    uint64_t    m_connections = 0;
+    uint64_t    m_resumed = 0;
+    uint64_t    m_failed = 0;
+
+    HandshakeClient( boost::asio::io_context& context, bool isResumed, uint64_t deadline, size_t& activeClients )
+        : TcpClient( context ), m_isResumed( isResumed ), m_deadline( deadline ), m_activeClients( activeClients )
+    {
+    }
+
+    void onConnected( const boost::system::error_code& ec ) override
+    {
+        if ( ec )
+        {
+            m_failed++;
+            next();
+            return;
+        }
+        m_connections++;
+        m_resumed += isTlsResumed() ? 1 : 0;
+
+        size_t packetSize;
+        uint8_t* packet = makeLoadPacket( 0, 64, packetSize );
+        sendPacket( packet, packetSize );
+    }
+
+    void onPacketReceived( const uint8_t*, size_t ) override
+    {
+        close();
+        next();
+    }
+
+private:
+    void next()
+    {
+        if ( m_isFinished )
+        {
+            return;
+        }
+        if ( monotonicNowNs() >= m_deadline )
+        {
+            m_isFinished = true;
+            close();
+            if ( --m_activeClients == 0 )
+            {
+                context().stop();
+            }
+            return;
+        }
+        if ( !m_isResumed )
+        {
+            resetTlsSession();
+        }
+        // Не из обработчика чтения: он ещё продолжит читать закрытый сокет
+        boost::asio::post( context(), [self = shared_from_this()] { self->reconnect(); } );
+    }
+};
+
+// Клиент с одним пакетом "в полёте" на постоянном соединении: задержка обслуживания во время шторма
+class ProbeClient : public TcpClient
+{
+    LoadResult& m_result;
+    uint64_t    m_deadline;
+    uint64_t    m_sent = 0;
+
+public:
+    ProbeClient( boost::asio::io_context& context, LoadResult& result, uint64_t deadline )
+        : TcpClient( context ), m_result( result ), m_deadline( deadline )
+    {
+    }
+
+    void onConnected( const boost::system::error_code& ec ) override
+    {
+        if ( !ec )
+        {
+            sendNext();
+        }
+    }
+
+    void onPacketReceived( const uint8_t* buffer, size_t bufferSize ) override
+    {
+        uint64_t timestamp;
+        std::memcpy( &timestamp, buffer + sizeof(uint16_t) + sizeof(uint64_t), sizeof(timestamp) );
+        m_result.m_latenciesNs.push_back( monotonicNowNs() - timestamp );
+        if ( monotonicNowNs() < m_deadline )
+        {
+            sendNext();
+        }
+    }
+
+private:
+    void sendNext()
+    {
+        size_t packetSize;
+        uint8_t* packet = makeLoadPacket( m_sent++, 64, packetSize );
+        sendPacket( packet, packetSize );
+    }
+};
+
+void runHandshakeScenario( const LoadOptions& options, const TestTls& tls, const char* name, bool isResumed, size_t handshakeThreads )
+{
+    TransportSettings settings;
+    settings.m_mode = TransportMode::low_latency;
+    EchoServer server( "127.0.0.1", "0" );
+    server.setTransportSettings( settings );
+    server.setTls( tls.m_server, handshakeThreads );
+    std::thread serverThread( [&server] { server.run(); } );
+    std::string port = std::to_string( server.localPort() );
+
+    // Проба - в своём потоке, чтобы её задержку определял сервер, а не очередь клиентов шторма
+    uint64_t deadline = monotonicNowNs() + uint64_t( options.m_durationSeconds ) * 1000000000ull;
+    LoadResult probe;
+    boost::asio::io_context probeContext;
+    auto probeClient = std::make_shared<ProbeClient>( probeContext, probe, deadline );
+    probeClient->setTransportSettings( settings );
+    probeClient->setTls( tls.m_client );
+    probeClient->connect( "127.0.0.1", port );
+    std::thread probeThread( [&probeContext] { probeContext.run(); } );
+
+    boost::asio::io_context context;
+    size_t activeClients = options.m_clients;
+    std::vector<std::shared_ptr<HandshakeClient>> clients;
+    for ( size_t i = 0; i < options.m_clients; i++ )
+    {
+        auto client = std::make_shared<HandshakeClient>( context, isResumed, deadline, activeClients );
+        client->setTransportSettings( settings );
+        client->setTls( tls.m_client );
+        client->connect( "127.0.0.1", port );
+        clients.push_back( client );
+    }
+    uint64_t start = monotonicNowNs();
+    context.run();
+    uint64_t elapsedNs = monotonicNowNs() - start;
+
+    probeClient->close();
+    probeThread.join();
+    server.shutdown();
+    serverThread.join();
+
+    uint64_t connections = 0;
+    uint64_t resumed = 0;
+    uint64_t failed = 0;
+    for ( const auto& client : clients )
+    {
+        connections += client->m_connections;
+        resumed += client->m_resumed;
+        failed += client->m_failed;
+    }
+    std::sort( probe.m_latenciesNs.begin(), probe.m_latenciesNs.end() );
+    const TlsStats& stats = server.tlsStats();
+    std::cout << std::fixed << std::setprecision( 1 )
+              << std::left << std::setw( 16 ) << name
+              << " clients=" << options.m_clients
+              << " handshakes=" << connections
+              << " rate=" << double( connections ) / ( double( elapsedNs ) / 1e9 ) << "/s"
+              << " resumed=" << resumed
+              << " failed=" << failed
+              << " server: handshakes=" << stats.m_handshakes << " resumed=" << stats.m_resumed << " failed=" << stats.m_failed
+              << " probe_rtt_us p50=" << probe.percentile( 0.50 ) / 1e3
+              << " p99=" << probe.percentile( 0.99 ) / 1e3
+              << std::endl;
+}
+
+void printUsage()
+{
+    std::cout << "chat_load [--scenario transport|storm|noisy|cluster|idle|tls|local] [--mode both|low_latency|throughput]\n"
+                 "          [--clients N] [--messages N] [--window N] [--size BYTES]\n"
+                 "          [--flush-bytes BYTES] [--flush-delay-us US]\n"
+                 "          [--login-rate PER_SEC] [--accept-rate PER_SEC] [--timeout-s S] [--server HOST:PORT]\n"
+                 "          [--flooders N] [--flood-window N] [--duration-s S] [--message-rate PER_SEC] [--nodes N]\n"
+                 "          [--tls-threads N]\n";
+}
+
+bool parseOptions( int argc, char* argv[], LoadOptions& options )
+{
+    for ( int i = 1; i < argc; i++ )
+    {
+        std::string arg = argv[i];
+        if ( arg == "--help" || i + 1 >= argc )
+        {
+            return false;
+        }
+
+        std::string value = argv[++i];
+        if ( arg == "--scenario" )              options.m_scenario = value;
+        else if ( arg == "--mode" )             options.m_mode = value;
+        else if ( arg == "--clients" )          options.m_clients = std::stoul( value );
+        else if ( arg == "--messages" )         options.m_messages = std::stoul( value );
+        else if ( arg == "--window" )           options.m_window = std::max<size_t>( 1, std::stoul( value ) );
+        else if ( arg == "--size" )             options.m_payloadSize = std::stoul( value );
+        else if ( arg == "--flush-bytes" )      options.m_transport.m_flushThreshold = std::stoul( value );
+        else if ( arg == "--flush-delay-us" )   options.m_transport.m_flushDelay = std::chrono::microseconds( std::stoul( value ) );
+        else if ( arg == "--login-rate" )       options.m_loginRate = std::stod( value );
+        else if ( arg == "--accept-rate" )      options.m_acceptRate = std::stod( value );
+        else if ( arg == "--timeout-s" )        options.m_timeoutSeconds = std::stoul( value );
+        else if ( arg == "--server" )           options.m_server = value;
+        else if ( arg == "--flooders" )         options.m_flooders = std::stoul( value );
+        else if ( arg == "--flood-window" )     options.m_floodWindow = std::max<size_t>( 1, std::stoul( value ) );
+        else if ( arg == "--duration-s" )       options.m_durationSeconds = std::max<size_t>( 1, std::stoul( value ) );
+        else if ( arg == "--message-rate" )     options.m_messageRate = std::stod( value );
+        else if ( arg == "--nodes" )            options.m_nodes = std::max<size_t>( 2, std::stoul( value ) );
+        else if ( arg == "--tls-threads" )      options.m_tlsThreads = std::stoul( value );
+        else return false;
+    }
+    return options.m_clients > 0;
+}
+
+}
+
+int main( int argc, char* argv[] )
+{
+    LoadOptions options;
+    if ( !parseOptions( argc, argv, options ) )
+    {
+        printUsage();
+        return 1;
+    }
+
+    if ( options.m_scenario == "transport" )
+    {
+        for ( TransportMode mode : { TransportMode::low_latency, TransportMode::throughput } )
+        {
+            if ( options.m_mode == "both" || options.m_mode == toString( mode ) )
+            {
+                printResult( toString( mode ), options, runTransportScenario( options, mode ) );
+            }
+        }
+        return 0;
+    }
+
+    if ( options.m_scenario == "storm" )
+    {
+        runStormScenario( options );
+        return 0;
+    }
+
+    if ( options.m_scenario == "noisy" )
+    {
+        runNoisyScenario( options, "fair", TransportSettings().m_readBudgetPackets, 0 );
+        runNoisyScenario( options, "unbounded", SIZE_MAX, 0 );
+        runNoisyScenario( options, "limited", TransportSettings().m_readBudgetPackets, options.m_messageRate );
+        return 0;
+    }
+
+    if ( options.m_scenario == "idle" )
+    {
+        runIdleScenario( options, "owned", false );
+        runIdleScenario( options, "slim", true );
+        return 0;
+    }
+
+    if ( options.m_scenario == "tls" )
+    {
+        TestTls tls = makeTestTls();
+        for ( TransportMode mode : { TransportMode::low_latency, TransportMode::throughput } )
+        {
+            if ( options.m_mode != "both" && options.m_mode != toString( mode ) )
+            {
+                continue;
+            }
+            LoadResult plain = runTransportScenario( options, mode );
+            LoadResult encrypted = runTransportScenario( options, mode, &tls );
+            printResult( toString( mode ), options, plain );
+            printResult( std::string( toString( mode ) ) + "+tls", options, encrypted );
+            double plainRate = double( plain.m_latenciesNs.size() ) / double( plain.m_elapsedNs );
+            double tlsRate = double( encrypted.m_latenciesNs.size() ) / double( encrypted.m_elapsedNs );
+            std::cout << "tls overhead (" << toString( mode ) << "): " << std::setprecision( 1 )
+                      << ( 1.0 - tlsRate / plainRate ) * 100.0 << "% throughput" << std::endl;
+        }
+        runHandshakeScenario( options, tls, "full", false, options.m_tlsThreads );
+        runHandshakeScenario( options, tls, "resumed", true, options.m_tlsThreads );
+        runHandshakeScenario( options, tls, "full/inline", false, 0 );
+        return 0;
+    }
+
+    if ( options.m_scenario == "local" )
+    {
+        std::string path = "/tmp/chat_load_" + std::to_string( getpid() ) + ".sock";
+        for ( TransportMode mode : { TransportMode::low_latency, TransportMode::throughput } )
+        {
+            if ( options.m_mode == "both" || options.m_mode == toString( mode ) )
+            {
+                printResult( std::string( toString( mode ) ) + "/tcp", options, runTransportScenario( options, mode ) );
+                printResult( std::string( toString( mode ) ) + "/unix", options, runTransportScenario( options, mode, nullptr, path ) );
+            }
+        }
+        return 0;
+    }
+
+    if ( options.m_scenario == "cluster" )
+    {
+        runClusterScenario( options, "single", 1 );
+        runClusterScenario( options, "cluster", options.m_nodes );
+        return 0;
+    }
+
+    printUsage();
+    return 1;
+}
@@ -0,0 +1,118 @@
+// Узел кластера ChatServer. Несколько узлов можно запустить на одной машине:
+//   chat_node --node-id 1 --port 15001 --peer 2@127.0.0.1:15002
+//   chat_node --node-id 2 --port 15002 --peer 1@127.0.0.1:15001
+// Узел соединяется с каждым из --peer, клиенты подключаются к любому узлу.
+// У каждого узла должны быть свои каталог истории и файл снимка.
+
+#include "ChatServer.h"
+
+#include <algorithm>
+#include <csignal>
+#include <iostream>
+#include <string>
+
+namespace
+{
+
+void printUsage()
+{
+    std::cout << "chat_node --node-id N [--address ADDR] [--port PORT] [--peer ID@HOST:PORT]...\n"
+                 "          [--cluster-key KEY] [--history-dir DIR] [--snapshot FILE] [--credentials FILE]\n"
+                 "          [--message-rate PER_SEC] [--message-burst N] [--login-rate PER_SEC] [--accept-rate PER_SEC]\n"
+                 "          [--tls-cert FILE --tls-key FILE] [--tls-ca FILE] [--tls-threads N] [--unix PATH]\n";
+}
+
+bool parsePeer( const std::string& value, ClusterPeer& peer )
+{
+    size_t at = value.find( '@' );
+    size_t colon = value.rfind( ':' );
+    if ( at == std::string::npos || colon == std::string::npos || colon < at )
+    {
+        return false;
+    }
+    peer.m_nodeId = uint32_t( std::stoul( value.substr( 0, at ) ) );
+    peer.m_host = value.substr( at + 1, colon - at - 1 );
+    peer.m_port = value.substr( colon + 1 );
+    return peer.m_nodeId != 0 && !peer.m_host.empty() && !peer.m_port.empty();
+}
+
+bool parseOptions( int argc, char* argv[], std::string& address, std::string& port, ChatServerSettings& settings, double& acceptRate )
+{
+    for ( int i = 1; i < argc; i++ )
+    {
+        std::string arg = argv[i];
+        if ( arg == "--help" || i + 1 >= argc )
+        {
+            return false;
+        }
+
+        std::string value = argv[++i];
+        if ( arg == "--node-id" )               settings.m_nodeId = uint32_t( std::stoul( value ) );
+        else if ( arg == "--address" )          address = value;
+        else if ( arg == "--port" )             port = value;
+        else if ( arg == "--cluster-key" )      settings.m_clusterKey = value;
+        else if ( arg == "--history-dir" )      settings.m_historyDir = value;
+        else if ( arg == "--snapshot" )         settings.m_snapshotFile = value;
+        else if ( arg == "--credentials" )      settings.m_credentialsFile = value;
+        else if ( arg == "--message-rate" )     settings.m_messageRate = std::stod( value );
+        else if ( arg == "--message-burst" )    settings.m_messageBurst = uint32_t( std::stoul( value ) );
+        else if ( arg == "--login-rate" )       settings.m_loginRate = std::stod( value );
+        else if ( arg == "--accept-rate" )      acceptRate = std::stod( value );
+        else if ( arg == "--tls-cert" )         settings.m_tlsCertificateFile = value;
+        else if ( arg == "--tls-key" )          settings.m_tlsPrivateKeyFile = value;
+        else if ( arg == "--tls-ca" )           settings.m_tlsCaFile = value;
+        else if ( arg == "--tls-threads" )      settings.m_tlsHandshakeThreads = size_t( std::stoul( value ) );
+        else if ( arg == "--unix" )             settings.m_localSocketPath = value;
+        else if ( arg == "--peer" )
+        {
+            ClusterPeer peer;
+            if ( !parsePeer( value, peer ) )
+            {
+                return false;
+            }
+            settings.m_peers.push_back( peer );
+        }
+        else return false;
+    }
+    return settings.m_nodeId != 0;
+}
+
+}
+
+int main( int argc, char* argv[] )
+{
+    std::string address = "0.0.0.0";
+    std::string port = "15001";
+    ChatServerSettings settings;
+    double acceptRate = 0;
+    if ( !parseOptions( argc, argv, address, port, settings, acceptRate ) )
+    {
+        printUsage();
+        return 1;
+    }
+    settings.m_traceFile = "chat_trace_" + std::to_string( settings.m_nodeId ) + ".json";
+    if ( settings.m_loginRate > 0 )
+        settings.m_loginBurst = uint32_t( std::max( 1.0, settings.m_loginRate / 10 ) );
+
+    ChatServer server( address, port, settings );
+
+    // Большинство соединений простаивает - буфер чтения им не нужен
+    TransportSettings transport;
+    transport.m_isSlimIdle = true;
+    server.setTransportSettings( transport );
+    server.setAcceptRate( acceptRate, uint32_t( std::max( 1.0, acceptRate / 10 ) ) );
+
+    // Остановка по сигналу: деструктор сервера запишет снимок
+    boost::asio::signal_set signals( server.context(), SIGINT, SIGTERM );
+    signals.async_wait( [&server]( const boost::system::error_code& ec, int )
+                        {
+                            if ( !ec )
+                            {
+                                server.shutdown();
+                            }
+                        });
+
+    LOG( "chat_node: node " << settings.m_nodeId << " on " << address << ":" << port << ", peers " << settings.m_peers.size() );
+    server.run();
+    return 0;
+}
@@ -0,0 +1,451 @@
+// Воспроизведение записи трафика (ChatServerSettings::m_captureFile) против локального ChatServer.
+// Каждое записанное соединение становится соединением клиента; пакеты уходят с исходными интервалами,
+// делёнными на --speed (0 - без пауз). --copies N запускает N копий записи с разными именами
+// пользователей, чтобы получить больше соединений той же формы.
+//
+// Пакеты почти не меняются: PacketResume превращается в PacketHi (токены записи недействительны),
+// к именам копий добавляется "#N", получатель сообщения переводится из id записи в id этого запуска,
+// в m_sentAtUs ставится время отправки - по нему получатель считает задержку доставки.
+// Сообщение пользователю, вход которого ещё не подтверждён, ждёт (до kMaxStallUs), задерживая
+// всё воспроизведение: при ускорении входы не успевают за сообщениями.
+
+#include "ChatServer.h"
+#include "ChatClientPacketUtils.h"
+#include "LatencyHistogram.h"
+#include "TcpClient.h"
+#include "TrafficCapture.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+
+struct ReplayOptions
+{
+    std::string     m_captureFile;
+    double          m_speed = 1.0;
+    size_t          m_copies = 1;
+    size_t          m_timeoutSeconds = 600;
+};
+
+// Общее состояние всех соединений (один поток io_context)
+struct ReplayState
+{
+    // id пользователя в записи -> имя (по записям rk_user на момент пакета)
+    std::unordered_map<uint32_t, std::string>   m_recordedNames;
+    // имя (с суффиксом копии) -> id в этом запуске (из ServerPacketWelcome)
+    std::unordered_map<std::string, uint32_t>   m_replayIds;
+
+    uint64_t            m_frames = 0;
+    uint64_t            m_bytes = 0;
+    uint64_t            m_messagesSent = 0;
+    uint64_t            m_messagesReceived = 0;
+    uint64_t            m_unknownReceivers = 0;
+    LatencyHistogram    m_delivery;
+};
+
+std::string copyName( const std::string& userName, size_t copy )
+{
+    return copy == 0 ? userName : userName + "#" + std::to_string( copy );
+}
+
+template<class PacketT>
+std::vector<uint8_t> encodeBody( PacketT& packet )
+{
+    size_t packetSize;
+    std::unique_ptr<uint8_t[]> buffer( user_chat::createPacket( packet, packetSize ) );
+    return std::vector<uint8_t>( buffer.get() + sizeof(uint16_t), buffer.get() + packetSize );
+}
+
+class ReplayClient : public TcpClient
+{
+    ReplayState&                        m_state;
+    size_t                              m_copy;
+    std::string                         m_userName;     // с суффиксом копии
+    bool                                m_isConnected = false;
+    std::vector<std::vector<uint8_t>>   m_pending;      // пакеты до установления соединения
+
+public:
+    ReplayClient( boost::asio::io_context& context, ReplayState& state, size_t copy )
+        : TcpClient( context ), m_state( state ), m_copy( copy )
+    {
+    }
+
+    // Тело пакета из записи: [тип][поля]; false - получатель ещё не вошёл, повторить позже
+    bool send( const uint8_t* data, size_t size, bool isLastTry )
+    {
+        bool isReady = true;
+        std::vector<uint8_t> body = rewrite( data, size, isLastTry, isReady );
+        if ( !isReady )
+        {
+            return false;
+        }
+        if ( body.empty() )
+        {
+            return true;
+        }
+        if ( !m_isConnected )
+        {
+            m_pending.push_back( std::move( body ) );
+            return true;
+        }
+        sendBody( body );
+        return true;
+    }
+
+    void onConnected( const boost::system::error_code& ec ) override
+    {
+        if ( ec )
+        {
+            LOG_ERR( "chat_replay: connect error: " << ec.message() );
+            return;
+        }
+        m_isConnected = true;
+        for ( auto& body : m_pending )
+        {
+            sendBody( body );
+        }
+        m_pending.clear();
+    }
+
+    void onPacketReceived( const uint8_t* data, size_t size ) override
+    {
+        try
+        {
+            user_chat::PacketReader reader( data, data + size );
+            uint16_t packetType;
+            reader.read( packetType );
+
+            if ( packetType == user_chat::spt_welcome )
+            {
+                user_chat::ServerPacketWelcome packet;
+                reader.read( packet );
+                m_state.m_replayIds[m_userName] = packet.m_userId;
+            }
+            else if ( packetType == user_chat::cpt_message )
+            {
+                user_chat::PacketMessage packet;
+                reader.read( packet );
+                m_state.m_messagesReceived++;
+                if ( packet.getSentAtUs() != 0 )
+                {
+                    uint64_t nowUs = monotonicNowUs();
+                    m_state.m_delivery.record( nowUs > packet.getSentAtUs() ? nowUs - packet.getSentAtUs() : 0 );
+                }
+            }
+        }
+        catch ( const std::exception& e )
+        {
+            LOG_ERR( "chat_replay: invalid packet: " << e.what() );
+        }
+    }
+
+private:
+    void sendBody( const std::vector<uint8_t>& body )
+    {
+        size_t packetSize = sizeof(uint16_t) + body.size();
+        uint8_t* buffer = new uint8_t[packetSize];
+        user_chat::PacketWriter writer( buffer, packetSize );
+        writer.write( static_cast<uint16_t>( body.size() ) );
+        std::memcpy( buffer + sizeof(uint16_t), body.data(), body.size() );
+
+        m_state.m_frames++;
+        m_state.m_bytes += packetSize;
+        sendPacket( buffer, packetSize );
+    }
+
+    std::vector<uint8_t> rewrite( const uint8_t* data, size_t size, bool isLastTry, bool& isReady )
+    {
+        try
+        {
+            user_chat::PacketReader reader( data, data + size );
+            uint16_t packetType;
+            reader.read( packetType );
+
+            switch ( packetType )
+            {
+            case user_chat::cpt_hi: {
+                user_chat::PacketHi packet;
+                reader.read( packet );
+                m_userName = copyName( packet.m_userName, m_copy );
+                packet.m_userName = m_userName;
+                return encodeBody( packet );
+            }
+            case user_chat::cpt_resume: {
+                user_chat::PacketResume resume;
+                reader.read( resume );
+                m_userName = copyName( resume.m_userName, m_copy );
+                user_chat::PacketHi packet{ m_userName };
+                return encodeBody( packet );
+            }
+            case user_chat::cpt_message: {
+                user_chat::PacketMessage packet;
+                reader.read( packet );
+                uint32_t receiverId = 0;
+                auto name = m_state.m_recordedNames.find( packet.getReceiverId() );
+                if ( name != m_state.m_recordedNames.end() )
+                {
+                    auto id = m_state.m_replayIds.find( copyName( name->second, m_copy ) );
+                    receiverId = id == m_state.m_replayIds.end() ? 0 : id->second;
+                    if ( receiverId == 0 && !isLastTry )
+                    {
+                        isReady = false;
+                        return {};
+                    }
+                }
+                if ( receiverId == 0 )
+                {
+                    m_state.m_unknownReceivers++;
+                    return {};
+                }
+                user_chat::PacketMessage replayed{ 0, receiverId, packet.getMessageText(), monotonicNowUs() };
+                m_state.m_messagesSent++;
+                return encodeBody( replayed );
+            }
+            default:
+                return std::vector<uint8_t>( data, data + size );
+            }
+        }
+        catch ( const std::exception& e )
+        {
+            LOG_ERR( "chat_replay: invalid recorded packet: " << e.what() );
+            return {};
+        }
+    }
+};
+
+// Проигрывает записи по времени; при --speed 0 - порциями, чтобы не блокировать ввод-вывод
+class Replayer
+{
+    static constexpr size_t kBatchRecords = 256;
+    static constexpr uint64_t kMaxStallUs = 1000000;
+
+    boost::asio::io_context&            m_context;
+    const ReplayOptions&                m_options;
+    ReplayState&                        m_state;
+    std::string                         m_port;
+    std::vector<traffic_capture::Record> m_records;
+    size_t                              m_cursor = 0;
+    size_t                              m_copyCursor = 0;   // копии текущей записи, которые уже отправлены
+    uint64_t                            m_startUs = 0;
+    uint64_t                            m_stalledSinceUs = 0;
+    uint64_t                            m_stalledUs = 0;    // всего ожидания входа получателей
+    boost::asio::steady_timer           m_timer;
+
+    // (id сессии записи, копия) -> соединение
+    std::unordered_map<uint64_t, std::shared_ptr<ReplayClient>> m_clients;
+    size_t                              m_maxClients = 0;
+
+public:
+    Replayer( boost::asio::io_context& context, const ReplayOptions& options, ReplayState& state,
+              std::vector<traffic_capture::Record>&& records, const std::string& port )
+        : m_context( context ), m_options( options ), m_state( state ), m_port( port ),
+        m_records( std::move( records ) ), m_timer( context )
+    {
+    }
+
+    size_t maxClients() const { return m_maxClients; }
+    uint64_t stalledUs() const { return m_stalledUs; }
+    uint64_t durationUs() const { return m_records.empty() ? 0 : m_records.back().m_timeUs; }
+
+    void start()
+    {
+        m_startUs = monotonicNowUs();
+        pump();
+    }
+
+private:
+    void pump()
+    {
+        uint64_t nowUs = monotonicNowUs();
+        size_t batchEnd = m_cursor + kBatchRecords;
+        while ( m_cursor < m_records.size() )
+        {
+            const traffic_capture::Record& record = m_records[m_cursor];
+            if ( m_options.m_speed > 0 )
+            {
+                uint64_t dueUs = m_startUs + uint64_t( double( record.m_timeUs ) / m_options.m_speed );
+                if ( dueUs > nowUs )
+                {
+                    m_timer.expires_after( std::chrono::microseconds( dueUs - nowUs ) );
+                    m_timer.async_wait( [this]( const boost::system::error_code& ec ) { if ( !ec ) pump(); } );
+                    return;
+                }
+            }
+            else if ( m_cursor == batchEnd )
+            {
+                boost::asio::post( m_context, [this] { pump(); } );
+                return;
+            }
+            if ( !apply( record, nowUs ) )
+            {
+                // Сдвигаем расписание на время ожидания, чтобы не отправлять потом всё разом
+                m_timer.expires_after( std::chrono::microseconds( 500 ) );
+                m_timer.async_wait( [this]( const boost::system::error_code& ec ) { if ( !ec ) pump(); } );
+                return;
+            }
+            m_cursor++;
+        }
+
+        // Даём доставить последние сообщения
+        m_timer.expires_after( std::chrono::seconds( 1 ) );
+        m_timer.async_wait( [this]( const boost::system::error_code& ec ) { if ( !ec ) m_context.stop(); } );
+    }
+
+    bool apply( const traffic_capture::Record& record, uint64_t nowUs )
+    {
+        if ( record.m_kind == traffic_capture::rk_user )
+        {
+            m_state.m_recordedNames[record.m_userId] = std::string( reinterpret_cast<const char*>( record.m_data ), record.m_size );
+            return true;
+        }
+
+        for ( ; m_copyCursor < m_options.m_copies; m_copyCursor++ )
+        {
+            size_t copy = m_copyCursor;
+            uint64_t key = uint64_t( record.m_sessionId ) * m_options.m_copies + copy;
+            auto it = m_clients.find( key );
+            if ( record.m_kind == traffic_capture::rk_closed )
+            {
+                if ( it != m_clients.end() )
+                {
+                    it->second->close();
+                    m_clients.erase( it );
+                }
+                continue;
+            }
+
+            if ( it == m_clients.end() )
+            {
+                auto client = std::make_shared<ReplayClient>( m_context, m_state, copy );
+                client->connect( "127.0.0.1", m_port );
+                it = m_clients.emplace( key, client ).first;
+                m_maxClients = std::max( m_maxClients, m_clients.size() );
+            }
+            bool isLastTry = m_stalledSinceUs != 0 && nowUs - m_stalledSinceUs >= kMaxStallUs;
+            if ( !it->second->send( record.m_data, record.m_size, isLastTry ) )
+            {
+                m_stalledSinceUs = m_stalledSinceUs == 0 ? nowUs : m_stalledSinceUs;
+                return false;
+            }
+            if ( m_stalledSinceUs != 0 )
+            {
+                m_stalledUs += nowUs - m_stalledSinceUs;
+                m_startUs += nowUs - m_stalledSinceUs;
+                m_stalledSinceUs = 0;
+            }
+        }
+        m_copyCursor = 0;
+        return true;
+    }
+};
+
+void printUsage()
+{
+    std::cout << "chat_replay CAPTURE_FILE [--speed X] [--copies N] [--timeout-s S]\n"
+                 "            --speed 1 - as recorded, 10 - ten times faster, 0 - as fast as possible\n";
+}
+
+bool parseOptions( int argc, char* argv[], ReplayOptions& options )
+{
+    if ( argc < 2 || std::string( argv[1] ) == "--help" )
+    {
+        return false;
+    }
+    options.m_captureFile = argv[1];
+    for ( int i = 2; i < argc; i++ )
+    {
+        std::string arg = argv[i];
+        if ( i + 1 >= argc )
+        {
+            return false;
+        }
+
+        std::string value = argv[++i];
+        if ( arg == "--speed" )                 options.m_speed = std::stod( value );
+        else if ( arg == "--copies" )           options.m_copies = std::max<size_t>( 1, std::stoul( value ) );
+        else if ( arg == "--timeout-s" )        options.m_timeoutSeconds = std::stoul( value );
+        else return false;
+    }
+    return options.m_speed >= 0;
+}
+
+}
+
+int main( int argc, char* argv[] )
+{
+    ReplayOptions options;
+    if ( !parseOptions( argc, argv, options ) )
+    {
+        printUsage();
+        return 1;
+    }
+
+    traffic_capture::Reader reader;
+    if ( !reader.open( options.m_captureFile ) )
+    {
+        return 1;
+    }
+    std::vector<traffic_capture::Record> records;
+    traffic_capture::Record record;
+    while ( reader.next( record ) )
+    {
+        records.push_back( record );
+    }
+
+    // На каждое соединение нужно два дескриптора (клиент и сессия сервера)
+    rlimit limit;
+    if ( getrlimit( RLIMIT_NOFILE, &limit ) == 0 )
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &limit );
+    }
+
+    ChatServerSettings settings;
+    settings.m_latencyLogInterval = std::chrono::seconds( 0 );
+    ChatServer server( "127.0.0.1", "0", settings );
+    std::thread serverThread( [&server] { server.run(); } );
+
+    boost::asio::io_context context;
+    ReplayState state;
+    Replayer replayer( context, options, state, std::move( records ), std::to_string( server.localPort() ) );
+
+    boost::asio::steady_timer timeout( context, std::chrono::seconds( options.m_timeoutSeconds ) );
+    timeout.async_wait( [&context]( const boost::system::error_code& ec ) { if ( !ec ) context.stop(); } );
+
+    uint64_t startNs = monotonicNowNs();
+    replayer.start();
+    context.run();
+    double seconds = double( monotonicNowNs() - startNs ) / 1e9;
+
+    server.shutdown();
+    serverThread.join();
+
+    std::cout << std::fixed << std::setprecision( 1 )
+              << "replay speed=" << options.m_speed
+              << " copies=" << options.m_copies
+              << " recorded=" << double( replayer.durationUs() ) / 1e6 << "s"
+              << " time=" << seconds << "s"
+              << " max_connections=" << replayer.maxClients()
+              << " stalled=" << double( replayer.stalledUs() ) / 1e6 << "s"
+              << "\n  frames=" << state.m_frames
+              << " rate=" << double( state.m_frames ) / seconds << " frames/s"
+              << " " << double( state.m_bytes ) / seconds / ( 1024 * 1024 ) << " MiB/s"
+              << "\n  messages sent=" << state.m_messagesSent
+              << " delivered=" << state.m_messagesReceived
+              << " unknown_receiver=" << state.m_unknownReceivers
+              << "\n  delivery ";
+    state.m_delivery.print( std::cout );
+    std::cout << "\n  server dwell ";
+    server.dwellHistogram().print( std::cout );
+    std::cout << std::endl;
+    return 0;
+}
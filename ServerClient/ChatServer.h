@@ -1,52 +1,1592 @@
 #pragma once
 #include "TcpServer.h"
-#include <map>
+#include "ChatClientPackets.h"
+#include "ChatClientPacketUtils.h"
+#include "ClusterLink.h"
+#include "CredentialStore.h"
+#include "HistoryStore.h"
+#include "LatencyHistogram.h"
+#include "MessageIdWindow.h"
+#include "SearchIndex.h"
+#include "ServerSnapshot.h"
+#include "PresenceLog.h"
+#include "TokenBucket.h"
+#include "TrafficCapture.h"
+#include "UserRegistry.h"
+#include "WorkerPool.h"
+#include <chrono>
+#include <deque>
 #include <memory>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+class ChatServer;
 
 class ChatSession : public TcpClientSession {
+    ChatServer& m_server;
+    uint32_t m_userId = 0; // 0 до PacketHi/PacketResume
+    uint32_t m_captureId = 0; // Номер соединения в записи трафика
+    uint32_t m_peerNodeId = 0; // Входящее соединение узла кластера (после NodePacketHello)
+    bool m_isAuthPending = false;     // Пароль проверяется в пуле
+    bool m_isLoginQueued = false;     // Вход ждёт токена в очереди m_pendingLogins
+    std::string m_authenticatedName; // Имя, для которого проверен пароль
+
 public:
-    ChatSession(boost::asio::ip::tcp::socket socket)
-        : TcpClientSession(std::move(socket)) {}
+    ChatSession(StreamSocket socket, ChatServer& server)
+        : TcpClientSession(std::move(socket)), m_server(server) {}
+
+    uint32_t userId() const { return m_userId; }
+    void setUserId(uint32_t userId) { m_userId = userId; }
+
+    uint32_t captureId() const { return m_captureId; }
+    void setCaptureId(uint32_t captureId) { m_captureId = captureId; }
+
+    uint32_t peerNodeId() const { return m_peerNodeId; }
+    void setPeerNodeId(uint32_t nodeId) { m_peerNodeId = nodeId; }
+
+    const std::string& authenticatedName() const { return m_authenticatedName; }
+    void setAuthenticatedName(const std::string& userName) { m_authenticatedName = userName; }
+    bool isAuthPending() const { return m_isAuthPending; }
+    void setAuthPending(bool isPending) { m_isAuthPending = isPending; }
+    bool isLoginQueued() const { return m_isLoginQueued; }
+    void setLoginQueued(bool isQueued) { m_isLoginQueued = isQueued; }
 
-    void start() {
-        readPacketHeader(); // Start reading packets
+    template<class PacketT>
+    void sendPacket(PacketT& packet) {
+        TRACE_SPAN("send_packet");
+        size_t packetSize;
+        uint8_t* buffer;
+        {
+            TRACE_SPAN("encode");
+            buffer = user_chat::createPacket(packet, packetSize);
+        }
+        write(buffer, packetSize);
     }
+
+    void onPacketReceived(const uint8_t* data, size_t dataSize) override;
+    void onDisconnected() override;
+};
+
+struct ChatServerSettings {
+    std::chrono::seconds m_offlineGrace{5};     // Обрыв короче этого не публикуется как offline
+    std::chrono::seconds m_resumeTtl{300};      // Сколько офлайн-пользователь может возобновить сессию
+    size_t m_presenceLogCapacity = 64 * 1024;   // Изменений присутствия в журнале для дельт
+    size_t m_maxDeltaChanges = 512;             // Больше изменений - отправляем полный список
+
+    // Рассылка изменений присутствия пачками раз в m_presenceBatchDelay (0 - сразу)
+    std::chrono::milliseconds m_presenceBatchDelay{20};
+
+    // Допуск входов (PacketHi/PacketResume): ведро токенов и ограниченная очередь ожидания
+    double m_loginRate = 0;                     // Входов в секунду, 0 - без ограничения
+    uint32_t m_loginBurst = 100;
+    size_t m_maxPendingLogins = 10000;
+    std::chrono::milliseconds m_maxLoginWait{2000}; // Дольше - ServerPacketServerBusy
+
+    // Частота сообщений одного пользователя (PacketMessage и PacketRoomMessage): ведро токенов на пользователя.
+    // Лишние сообщения отбрасываются, отправитель получает ServerPacketRateLimited
+    double m_messageRate = 0;                   // Сообщений в секунду, 0 - без ограничения
+    uint32_t m_messageBurst = 50;
+
+    // Каталог истории сообщений (пусто - история не сохраняется)
+    std::string m_historyDir;
+    size_t m_historySegmentSize = 256 * 1024 * 1024;
+
+    // Файл учётных данных (пусто - пароли не нужны, PacketHi принимает любое имя).
+    // Хэши паролей считаются в отдельном пуле: m_authThreads потоков, до m_maxPendingAuth задач в очереди
+    std::string m_credentialsFile;
+    size_t m_authThreads = 2;
+    size_t m_maxPendingAuth = 1024;
+
+    // Снимок пользователей и присутствия для тёплого перезапуска (пусто - не используется).
+    // Читается при старте, пишется раз в m_snapshotInterval и при уничтожении сервера
+    std::string m_snapshotFile;
+    std::chrono::seconds m_snapshotInterval{30};
+
+    // Unix-сокет для клиентов на той же машине (боты, мосты) в дополнение к TCP (пусто - нет)
+    std::string m_localSocketPath;
+
+    // TLS для клиентов (пусто - без TLS): сертификат (цепочка PEM) и ключ. Рукопожатия выполняют
+    // m_tlsHandshakeThreads потоков (0 - поток io_context). Узлы кластера соединяются по TLS с проверкой
+    // сертификата по m_tlsCaFile (пусто - системное хранилище)
+    std::string m_tlsCertificateFile;
+    std::string m_tlsPrivateKeyFile;
+    std::string m_tlsCaFile;
+    size_t m_tlsHandshakeThreads = 1;
+
+    // Запись входящих пакетов для chat_replay (пусто - не пишется)
+    std::string m_captureFile;
+
+    // Строки в пакетах должны быть корректным UTF-8 без управляющих символов, иначе пакет отбрасывается
+    bool m_isValidatingText = true;
+
+    // Время обработки пакетов (от прочтения до отправки ответов) выводится в лог раз в интервал (0 - не выводится)
+    std::chrono::seconds m_latencyLogInterval{60};
+
+    // Сборка с CHAT_TRACE: по SIGUSR1 трасса пакетов пишется в этот файл (пусто - не пишется)
+    std::string m_traceFile = "chat_trace.json";
+
+    // Кластер: id этого узла (0 - одиночный сервер) и остальные узлы. Узел держит исходящее соединение
+    // к каждому, рассылает по ним присутствие своих пользователей и пересылает сообщения узлу получателя
+    uint32_t m_nodeId = 0;
+    std::vector<ClusterPeer> m_peers;
+    std::string m_clusterKey;
 };
 
 class ChatServer : public TcpServer {
-public:
-    ChatServer(const std::string& addr, const std::string& port)
-        : TcpServer(addr, port) {}
+    // Зарегистрированный пользователь; запись живёт m_resumeTtl после отключения
+    struct UserRecord {
+        std::shared_ptr<ChatSession> m_session; // nullptr - соединения нет
+        user_chat::ClientStatus m_status = user_chat::cst_offline; // Опубликованный статус
+        uint64_t m_resumeToken = 0;
+        uint64_t m_introducedVersion = 0; // Версия присутствия, в которой клиентам сообщено имя
+        MessageIdWindow m_messageIds;     // Номера принятых сообщений; сбрасывается при новом входе
+        TokenBucket m_messageBucket;      // Не сбрасывается при входе: переподключение не даёт новых токенов
+        bool m_isRateLimited = false;     // ServerPacketRateLimited отправлен, сообщения отбрасываются
+        uint32_t m_homeNode = 0;          // Узел, к которому подключён пользователь (0 - этот)
+        uint64_t m_remoteVersion = 0;     // Версия последнего изменения от m_homeNode
+        std::vector<uint32_t> m_rooms;
+        std::chrono::steady_clock::time_point m_detachedAt;
+    };
+
+    // Комната: плотный массив id участников для рассылки и битовая карта по id для проверки членства
+    struct RoomRecord {
+        std::vector<uint32_t> m_members;
+        std::vector<uint64_t> m_memberBits;
+
+        bool contains(uint32_t userId) const {
+            size_t word = userId / 64;
+            return word < m_memberBits.size() && ((m_memberBits[word] >> (userId % 64)) & 1);
+        }
+
+        void add(uint32_t userId) {
+            if (userId / 64 >= m_memberBits.size()) {
+                m_memberBits.resize(userId / 64 + 1);
+            }
+            m_memberBits[userId / 64] |= uint64_t(1) << (userId % 64);
+            m_members.push_back(userId);
+        }
+
+        // Порядок участников не важен: удаление - перестановка с последним
+        void remove(uint32_t userId) {
+            m_memberBits[userId / 64] &= ~(uint64_t(1) << (userId % 64));
+            auto it = std::find(m_members.begin(), m_members.end(), userId);
+            *it = m_members.back();
+            m_members.pop_back();
+        }
+    };
+
+    // Вход, ожидающий токена
+    struct PendingLogin {
+        std::weak_ptr<ChatSession> m_session;
+        user_chat::PacketResume m_packet; // PacketHi - это PacketResume без токена
+        std::chrono::steady_clock::time_point m_queuedAt;
+    };
+
+    // Примерный предел тела пакета со списком пользователей (клиент принимает до 16 КБ)
+    static constexpr size_t kMaxUsersListBytes = 12 * 1024;
+    static constexpr size_t kMaxDeltaChangesPerPacket = 256;
+    // Страница истории: сообщений и байт текста в одном ServerPacketHistory
+    static constexpr size_t kMaxHistoryPage = 100;
+    static constexpr size_t kMaxHistoryBytes = 10 * 1024;
+    // Результат поиска: находок и байт текста каждой
+    static constexpr size_t kMaxSearchHits = 20;
+    static constexpr size_t kMaxSearchSnippet = 512;
+    static constexpr size_t kMaxRoomNameSize = 64;
+    // Текст сообщения: вместе с именами и id пакет получателю остаётся в пределах 16 КБ, которые принимает клиент
+    static constexpr size_t kMaxMessageText = 15 * 1024;
+    static constexpr size_t kMaxPasswordSize = 256;
+    static constexpr int kAuthNiceness = 10; // Хэширование паролей не должно отнимать процессор у рассылки сообщений
+    // Пропуск номеров версий присутствия после восстановления из периодического снимка
+    static constexpr uint64_t kSnapshotVersionGap = uint64_t(1) << 32;
+
+    ChatServerSettings m_settings;
+    UserRegistry<UserRecord> m_users;
+    UserRegistry<RoomRecord> m_rooms; // Те же id-индексы для комнат
+    user_chat::PresenceLog m_presence;
+    uint64_t m_broadcastVersion = 0; // Изменения до этой версии уже разосланы
+    std::vector<OutgoingPacket> m_usersListCache; // Закодированный полный список (пусто - устарел)
+    uint64_t m_usersListCacheVersion = 0;
+    boost::asio::steady_timer m_presenceTimer;
+    bool m_isPresenceTimerArmed = false;
+    std::mt19937_64 m_tokenGenerator;
+    boost::asio::steady_timer m_sweepTimer;
 
-    void onClientConnected(std::shared_ptr<ChatSession> session) {
-        int clientId = ++m_nextClientId;
-        m_sessions[clientId] = session;
-        LOG("Client " << clientId << " connected");
+    TokenBucketConfig m_loginLimit;
+    TokenBucket m_loginBucket;
+    std::deque<PendingLogin> m_pendingLogins;
+    boost::asio::steady_timer m_loginTimer;
+    bool m_isLoginTimerArmed = false;
 
-        // Начинаем чтение данных от клиента
-        session->start();
+    std::unique_ptr<HistoryStore> m_history;
+    std::vector<HistoryView> m_historyPage;
+    std::unique_ptr<SearchIndex> m_search; // Есть, только если есть история
+
+    boost::asio::steady_timer m_snapshotTimer;
+    bool m_isSnapshotDirty = false; // Пользователи или присутствие изменились после снимка
+    std::unique_ptr<WorkerPool> m_snapshotWriter; // Один поток записи снимков
+
+    std::unique_ptr<traffic_capture::Writer> m_capture;
+    uint32_t m_lastCaptureId = 0;
+
+    LatencyHistogram m_dwellHistogram; // Время обработки пакетов за текущий интервал лога
+    uint64_t m_duplicateMessages = 0;  // Отброшено повторов сообщений за всё время
+    TokenBucketConfig m_messageLimit;
+    uint64_t m_rateLimitedMessages = 0; // Отброшено сообщений сверх частоты за всё время
+
+    // Узел кластера: исходящее соединение и состояние его входящих соединений
+    struct PeerNode {
+        std::shared_ptr<NodeLink> m_link;
+        uint32_t m_inboundSessions = 0;   // При переподключении старое соединение может закрыться позже нового
+        bool m_isSyncing = false;         // Принимается полный список пользователей узла
+        std::unordered_set<uint32_t> m_syncedUsers;
+        bool m_isLost = true;             // Пользователи узла разосланы как offline
+        std::chrono::steady_clock::time_point m_lostAt;
+    };
+    std::unordered_map<uint32_t, PeerNode> m_peers;
+    std::vector<user_chat::NodeUserStatus> m_pendingGossip; // Изменения своих пользователей до рассылки узлам
+    std::chrono::steady_clock::time_point m_latencyLogAt;
+
+#ifdef CHAT_TRACE
+    boost::asio::signal_set m_traceSignal;
+#endif
+
+    std::unique_ptr<CredentialStore> m_credentials; // Есть, только если нужны пароли
+    Credential m_unknownUserCredential; // Вход под неизвестным именем стоит столько же, сколько с неверным паролем
+    std::unordered_set<std::string> m_pendingRegistrations;
+    std::unique_ptr<WorkerPool> m_authPool; // Последним: потоки пула останавливаются первыми
+
+public:
+    ChatServer(const std::string& addr, const std::string& port, const ChatServerSettings& settings = ChatServerSettings())
+        : TcpServer(addr, port),
+          m_settings(settings),
+          m_presence(settings.m_presenceLogCapacity),
+          m_presenceTimer(context()),
+          m_tokenGenerator(std::random_device{}()),
+          m_sweepTimer(context()),
+          m_loginLimit(TokenBucketConfig::fromRate(settings.m_loginRate, settings.m_loginBurst)),
+          m_loginTimer(context()),
+          m_snapshotTimer(context()),
+          m_messageLimit(TokenBucketConfig::fromRate(settings.m_messageRate, settings.m_messageBurst))
+#ifdef CHAT_TRACE
+          , m_traceSignal(context())
+#endif
+    {
+        if (!settings.m_historyDir.empty()) {
+            m_history = std::make_unique<HistoryStore>(settings.m_historySegmentSize);
+            if (!m_history->open(settings.m_historyDir)) {
+                LOG_ERR("ChatServer: history is disabled");
+                m_history.reset();
+            } else {
+                m_search = std::make_unique<SearchIndex>();
+                m_search->start(settings.m_historyDir, m_history->lastMessageId());
+            }
+        }
+        if (!settings.m_credentialsFile.empty()) {
+            m_credentials = std::make_unique<CredentialStore>();
+            if (!m_credentials->open(settings.m_credentialsFile)) {
+                throw std::runtime_error("ChatServer: cannot open credentials file");
+            }
+            m_unknownUserCredential.m_salt = std::string(Credential::kSaltSize, '\0');
+            m_unknownUserCredential.m_hash = std::string(Credential::kHashSize, '\0');
+            m_unknownUserCredential.m_costN = PasswordHasher::kCostN;
+            m_unknownUserCredential.m_blockSize = PasswordHasher::kBlockSize;
+            m_unknownUserCredential.m_parallelism = PasswordHasher::kParallelism;
+            m_authPool = std::make_unique<WorkerPool>(settings.m_authThreads, settings.m_maxPendingAuth, kAuthNiceness);
+        }
+        if (!settings.m_captureFile.empty()) {
+            m_capture = std::make_unique<traffic_capture::Writer>();
+            if (!m_capture->open(settings.m_captureFile)) {
+                m_capture.reset();
+            }
+        }
+        if (!settings.m_snapshotFile.empty()) {
+            restoreSnapshot();
+            m_snapshotWriter = std::make_unique<WorkerPool>(1, 1);
+            startSnapshotTimer();
+        }
+#ifdef CHAT_TRACE
+        if (!settings.m_traceFile.empty()) {
+            m_traceSignal.add(SIGUSR1);
+            waitTraceSignal();
+        }
+#endif
+        if (!settings.m_localSocketPath.empty()) {
+            listenLocal(settings.m_localSocketPath);
+        }
+        std::shared_ptr<TlsContext> linkTls;
+        if (!settings.m_tlsCertificateFile.empty()) {
+            auto tls = TlsContext::createServer(settings.m_tlsCertificateFile, settings.m_tlsPrivateKeyFile);
+            if (!tls) {
+                throw std::runtime_error("ChatServer: cannot load TLS certificate");
+            }
+            setTls(tls, settings.m_tlsHandshakeThreads);
+            if (!settings.m_peers.empty()) {
+                linkTls = TlsContext::createClient(settings.m_tlsCaFile);
+                if (!linkTls) {
+                    throw std::runtime_error("ChatServer: cannot load TLS CA file");
+                }
+            }
+        }
+        for (const ClusterPeer& peer : settings.m_peers) {
+            if (peer.m_nodeId == 0 || peer.m_nodeId == settings.m_nodeId || m_peers.count(peer.m_nodeId)) {
+                throw std::runtime_error("ChatServer: invalid cluster node id");
+            }
+            uint32_t nodeId = peer.m_nodeId;
+            PeerNode& node = m_peers[nodeId];
+            node.m_link = std::make_shared<NodeLink>(context(), nodeId, [this, nodeId] { sendFullSync(nodeId); });
+            node.m_link->setTls(linkTls);
+            node.m_link->connect(peer.m_host, peer.m_port);
+        }
+        expireRestoredRemoteUsers();
+        startSweepTimer();
     }
 
-    void onClientDisconnected(int clientId) {
-        LOG("Client " << clientId << " disconnected");
-        m_sessions.erase(clientId);
+    // Поток io_context к этому моменту уже остановлен
+    ~ChatServer() {
+        if (m_snapshotWriter) {
+            m_snapshotWriter->stop();
+            ServerSnapshot snapshot;
+            captureSnapshot(snapshot, true);
+            snapshot.write(m_settings.m_snapshotFile);
+        }
     }
 
-    void onPacketReceived(int clientId, const std::vector<uint8_t>& packetData) {
+    uint64_t presenceVersion() const { return m_presence.version(); }
+    size_t pendingLogins() const { return m_pendingLogins.size(); }
+
+    // Интервал dispatch включает разбор пакета и обработчик
+    void onPacketReceived(ChatSession& session, const uint8_t* data, size_t dataSize) {
+        TRACE_SPAN("dispatch");
+        uint64_t receivedAtUs = monotonicNowUs();
         try {
-            auto session = m_sessions.find(clientId);
-            if (session != m_sessions.end()) {
-                session->second->onPacketReceived(packetData);
-            } else {
-                LOG("Error: Client " << clientId << " not found");
+            user_chat::PacketReader reader(data, data + dataSize, m_settings.m_isValidatingText);
+
+            uint16_t packetType;
+            reader.read(packetType);
+            bool isNodePacket = packetType >= user_chat::npt_node_hello;
+            if (m_capture && !isNodePacket) {
+                captureFrame(session, packetType, data, dataSize);
+            }
+
+            if (session.userId() == 0 && session.peerNodeId() == 0 && packetType != user_chat::cpt_hi && packetType != user_chat::cpt_resume &&
+                packetType != user_chat::cpt_register && packetType != user_chat::cpt_login && packetType != user_chat::cpt_ping &&
+                packetType != user_chat::npt_node_hello) {
+                LOG_ERR("ChatServer: packet " << packetType << " before PacketHi");
+                return;
+            }
+            // Повторный вход не расходует токены и места в очереди входов, нужные другим клиентам
+            bool isLoginPacket = packetType == user_chat::cpt_hi || packetType == user_chat::cpt_resume ||
+                                 packetType == user_chat::cpt_register || packetType == user_chat::cpt_login;
+            if (isLoginPacket && (session.userId() != 0 || session.isLoginQueued() || session.isAuthPending())) {
+                LOG_ERR("ChatServer: repeated login packet " << packetType);
+                return;
+            }
+            // Соединение узла принимает только пакеты узлов, клиентское - только клиентские и NodePacketHello
+            bool isAllowed = session.peerNodeId() != 0 ? isNodePacket && packetType != user_chat::npt_node_hello
+                                                       : !isNodePacket || packetType == user_chat::npt_node_hello;
+            if (!isAllowed) {
+                LOG_ERR("ChatServer: packet " << packetType << " is not allowed on this connection");
+                return;
+            }
+
+            // Отбрасывается до разбора: лишнее сообщение стоит только проверки ведра
+            bool isMessage = (packetType == user_chat::cpt_message) | (packetType == user_chat::cpt_room_message);
+            if (isMessage && !consumeMessageToken(session, receivedAtUs * 1000)) {
+                return;
+            }
+
+            switch (packetType) {
+            case user_chat::cpt_hi: {
+                user_chat::PacketHi packet;
+                reader.read(packet);
+                admitLogin(session, user_chat::PacketResume{packet.m_userName});
+                break;
+            }
+            case user_chat::cpt_resume: {
+                user_chat::PacketResume packet;
+                reader.read(packet);
+                admitLogin(session, std::move(packet));
+                break;
+            }
+            case user_chat::cpt_register: {
+                user_chat::PacketRegister packet;
+                reader.read(packet);
+                onRegister(session, packet);
+                break;
+            }
+            case user_chat::cpt_login: {
+                user_chat::PacketLogin packet;
+                reader.read(packet);
+                onLogin(session, packet);
+                break;
+            }
+            case user_chat::cpt_ping: {
+                user_chat::PacketPing packet;
+                reader.read(packet);
+                user_chat::ServerPacketPong pong{packet.m_clientTimeUs, monotonicNowUs()};
+                session.sendPacket(pong);
+                break;
+            }
+            case user_chat::cpt_message: {
+                user_chat::PacketMessage packet;
+                reader.read(packet);
+                onMessage(session, packet);
+                break;
+            }
+            case user_chat::cpt_status: {
+                user_chat::PacketClientStatus packet;
+                reader.read(packet);
+                onStatus(session, packet);
+                break;
+            }
+            case user_chat::cpt_history_request: {
+                user_chat::PacketHistoryRequest packet;
+                reader.read(packet);
+                onHistoryRequest(session, packet);
+                break;
+            }
+            case user_chat::cpt_room_create: {
+                user_chat::PacketRoomCreate packet;
+                reader.read(packet);
+                onRoomCreate(session, packet);
+                break;
+            }
+            case user_chat::cpt_room_join: {
+                user_chat::PacketRoomJoin packet;
+                reader.read(packet);
+                onRoomJoin(session, packet);
+                break;
+            }
+            case user_chat::cpt_room_leave: {
+                user_chat::PacketRoomLeave packet;
+                reader.read(packet);
+                onRoomLeave(session, packet);
+                break;
+            }
+            case user_chat::cpt_room_message: {
+                user_chat::PacketRoomMessage packet;
+                reader.read(packet);
+                onRoomMessage(session, packet);
+                break;
+            }
+            case user_chat::npt_node_hello: {
+                user_chat::NodePacketHello packet;
+                reader.read(packet);
+                onNodeHello(session, packet);
+                break;
+            }
+            case user_chat::npt_node_presence: {
+                user_chat::NodePacketPresence packet;
+                reader.read(packet);
+                onNodePresence(session, packet);
+                break;
+            }
+            case user_chat::npt_node_message: {
+                user_chat::NodePacketMessage packet;
+                reader.read(packet);
+                onNodeMessage(session, packet);
+                break;
+            }
+            case user_chat::cpt_search_request: {
+                user_chat::PacketSearchRequest packet;
+                reader.read(packet);
+                onSearchRequest(session, packet);
+                break;
+            }
+            default:
+                LOG_ERR("ChatServer: unknown packet type " << packetType);
+                break;
             }
         } catch (const std::exception& e) {
-            LOG("Exception while processing packet: " << e.what());
+            LOG_ERR("Exception while processing packet: " << e.what());
+        }
+        m_dwellHistogram.record(monotonicNowUs() - receivedAtUs);
+    }
+
+    const LatencyHistogram& dwellHistogram() const { return m_dwellHistogram; }
+    uint64_t duplicateMessages() const { return m_duplicateMessages; }
+    uint64_t rateLimitedMessages() const { return m_rateLimitedMessages; }
+
+    // Узлы кластера, к которым открыто исходящее соединение
+    size_t connectedNodes() const {
+        return size_t(std::count_if(m_peers.begin(), m_peers.end(), [](const auto& peer) { return peer.second.m_link->isConnected(); }));
+    }
+
+    void onSessionClosed(ChatSession& session) {
+        if (m_capture) {
+            m_capture->recordClosed(session.captureId());
         }
+        if (session.peerNodeId() != 0) {
+            // Пользователи узла станут offline через m_offlineGrace, если он не подключится снова
+            PeerNode& node = m_peers[session.peerNodeId()];
+            if (--node.m_inboundSessions == 0) {
+                node.m_lostAt = std::chrono::steady_clock::now();
+                node.m_isSyncing = false;
+                LOG_ERR("ChatServer: node " << session.peerNodeId() << " disconnected");
+            }
+            return;
+        }
+        uint32_t userId = session.userId();
+        if (!m_users.contains(userId) || m_users[userId].m_session.get() != &session) {
+            return;
+        }
+
+        // Статус не меняем сразу: короткий обрыв закончится PacketResume без рассылки
+        LOG_DBG("Client " << m_users.name(userId) << " disconnected");
+        m_users[userId].m_session.reset();
+        m_users[userId].m_detachedAt = std::chrono::steady_clock::now();
+    }
+
+protected:
+    std::shared_ptr<TcpClientSession> createSession(StreamSocket&& socket) override {
+        auto session = std::make_shared<ChatSession>(std::move(socket), *this);
+        session->setCaptureId(++m_lastCaptureId);
+        return session;
     }
 
 private:
-    int m_nextClientId = 0;
-    std::map<int, std::shared_ptr<ChatSession>> m_sessions;
+    // Вход сразу, если есть токен и очередь пуста; иначе ожидание в ограниченной очереди
+    void admitLogin(ChatSession& session, user_chat::PacketResume&& packet) {
+        if (session.userId() != 0 || session.isLoginQueued()) {
+            return;
+        }
+        if (m_pendingLogins.empty() && m_loginBucket.tryConsume(m_loginLimit, monotonicNowNs())) {
+            onResume(session, packet);
+            return;
+        }
+        if (m_pendingLogins.size() >= m_settings.m_maxPendingLogins) {
+            rejectLogin(session);
+            return;
+        }
+
+        auto self = std::static_pointer_cast<ChatSession>(session.shared_from_this());
+        session.setLoginQueued(true);
+        m_pendingLogins.push_back(PendingLogin{self, std::move(packet), std::chrono::steady_clock::now()});
+        armLoginTimer(std::chrono::nanoseconds(m_loginBucket.waitTimeNs(m_loginLimit, monotonicNowNs())));
+    }
+
+    void processPendingLogins() {
+        auto now = std::chrono::steady_clock::now();
+        while (!m_pendingLogins.empty()) {
+            PendingLogin& login = m_pendingLogins.front();
+            auto session = login.m_session.lock();
+            if (!session) {
+                m_pendingLogins.pop_front(); // Клиент не дождался и отключился
+                continue;
+            }
+            if (now - login.m_queuedAt > m_settings.m_maxLoginWait) {
+                session->setLoginQueued(false);
+                rejectLogin(*session);
+                m_pendingLogins.pop_front();
+                continue;
+            }
+            if (!m_loginBucket.tryConsume(m_loginLimit, monotonicNowNs())) {
+                break;
+            }
+
+            user_chat::PacketResume packet = std::move(login.m_packet);
+            m_pendingLogins.pop_front();
+            session->setLoginQueued(false);
+            onResume(*session, packet);
+        }
+
+        if (!m_pendingLogins.empty()) {
+            armLoginTimer(std::chrono::nanoseconds(m_loginBucket.waitTimeNs(m_loginLimit, monotonicNowNs())));
+        }
+    }
+
+    void armLoginTimer(std::chrono::nanoseconds delay) {
+        if (m_isLoginTimerArmed) {
+            return;
+        }
+        m_isLoginTimerArmed = true;
+        m_loginTimer.expires_after(std::max(delay, std::chrono::nanoseconds(std::chrono::milliseconds(1))));
+        m_loginTimer.async_wait([this](const boost::system::error_code& ec) {
+            m_isLoginTimerArmed = false;
+            if (!ec) {
+                processPendingLogins();
+            }
+        });
+    }
+
+    // Клиент получает оценку, когда очередь рассосётся, и сам закрывает соединение
+    void rejectLogin(ChatSession& session) {
+        double rate = m_loginLimit.isUnlimited() ? 1000.0 : 1e9 / double(m_loginLimit.m_intervalNs);
+        uint64_t retryAfterMs = uint64_t(1000.0 * double(m_pendingLogins.size() + 1) / rate);
+
+        user_chat::ServerPacketServerBusy packet;
+        packet.m_retryAfterMs = uint32_t(std::clamp<uint64_t>(retryAfterMs, 100, 30000));
+        session.sendPacket(packet);
+    }
+
+    void onHi(ChatSession& session, user_chat::PacketHi& packet) {
+        if (session.userId() != 0) {
+            LOG_ERR("ChatServer: invalid PacketHi");
+            return;
+        }
+        // Имя - ключ в файле учётных данных и в снимке, его же видят другие пользователи
+        if (!user_chat::isValidUserName(packet.m_userName)) {
+            sendAuthError(session, packet.m_userName, user_chat::aer_invalid_name);
+            return;
+        }
+        if (m_credentials && session.authenticatedName() != packet.m_userName) {
+            sendAuthError(session, packet.m_userName, user_chat::aer_auth_required);
+            return;
+        }
+
+        uint32_t userId = m_users.find(packet.m_userName);
+        if (userId != 0 && (m_users[userId].m_session ||
+                            (m_users[userId].m_homeNode != 0 && m_users[userId].m_status != user_chat::cst_offline))) {
+            user_chat::ServerPacketUserAlreadyExists response;
+            session.sendPacket(response);
+            return;
+        }
+        if (userId == 0) {
+            userId = m_users.add(packet.m_userName);
+        }
+        // Пользователь другого узла, не в сети, входит здесь: узлы узнают об этом из рассылки присутствия
+        m_users[userId].m_homeNode = 0;
+        m_users[userId].m_messageIds.reset();
+
+        attachSession(session, userId);
+        sendUsersList(session, userId, false);
+    }
+
+    void onResume(ChatSession& session, user_chat::PacketResume& packet) {
+        if (session.userId() != 0) {
+            LOG_ERR("ChatServer: invalid PacketResume");
+            return;
+        }
+
+        uint32_t userId = m_users.find(packet.m_userName);
+        if (userId == 0 || packet.m_resumeToken == 0 || m_users[userId].m_resumeToken != packet.m_resumeToken) {
+            // Токен неизвестен или истёк - обычный вход с полным списком
+            user_chat::PacketHi hi{packet.m_userName};
+            onHi(session, hi);
+            return;
+        }
+
+        UserRecord& record = m_users[userId];
+        if (record.m_session) {
+            // Старое соединение ещё не заметило обрыв - новое его вытесняет
+            auto oldSession = std::move(record.m_session);
+            oldSession->setUserId(0);
+            oldSession->close();
+        }
+
+        attachSession(session, userId);
+
+        user_chat::ServerPacketPresenceDelta delta;
+        delta.m_fromVersion = packet.m_presenceVersion;
+        delta.m_toVersion = m_presence.version();
+        if (m_presence.changesSince(packet.m_presenceVersion, m_settings.m_maxDeltaChanges, delta.m_changes) &&
+            packetBodySize(delta) <= kMaxUsersListBytes) {
+            sendWelcome(session, userId, delta.m_toVersion, true);
+            session.sendPacket(delta);
+        } else {
+            sendUsersList(session, userId, true);
+        }
+    }
+
+    bool canStartAuth(ChatSession& session, const std::string& userName, const std::string& password) {
+        if (session.userId() != 0 || session.isAuthPending()) {
+            LOG_ERR("ChatServer: unexpected auth packet");
+            return false;
+        }
+        if (!user_chat::isValidUserName(userName) || password.empty() || password.size() > kMaxPasswordSize) {
+            sendAuthError(session, userName, user_chat::aer_invalid_name);
+            return false;
+        }
+        return true;
+    }
+
+    void onRegister(ChatSession& session, user_chat::PacketRegister& packet) {
+        if (!m_credentials) {
+            // Пароли не используются - как PacketHi
+            admitLogin(session, user_chat::PacketResume{packet.m_userName});
+            return;
+        }
+        if (!canStartAuth(session, packet.m_userName, packet.m_password)) {
+            return;
+        }
+        if (m_credentials->find(packet.m_userName) || m_pendingRegistrations.count(packet.m_userName)) {
+            sendAuthError(session, packet.m_userName, user_chat::aer_already_registered);
+            return;
+        }
+
+        auto credential = std::make_shared<Credential>();
+        bool isQueued = runAuth(session,
+                                [password = std::move(packet.m_password), credential] {
+                                    return PasswordHasher::create(password, *credential);
+                                },
+                                [this, userName = packet.m_userName, credential](const std::shared_ptr<ChatSession>& session, bool isOk) {
+                                    // Регистрация завершается, даже если клиент уже отключился
+                                    m_pendingRegistrations.erase(userName);
+                                    if (!isOk) {
+                                        LOG_ERR("ChatServer: password hashing failed");
+                                    } else {
+                                        m_credentials->add(userName, std::move(*credential));
+                                    }
+                                    if (session) {
+                                        completeAuth(*session, userName, isOk);
+                                    }
+                                });
+        if (isQueued) {
+            m_pendingRegistrations.insert(packet.m_userName);
+        }
+    }
+
+    void onLogin(ChatSession& session, user_chat::PacketLogin& packet) {
+        if (!m_credentials) {
+            admitLogin(session, user_chat::PacketResume{packet.m_userName});
+            return;
+        }
+        if (!canStartAuth(session, packet.m_userName, packet.m_password)) {
+            return;
+        }
+
+        const Credential* stored = m_credentials->find(packet.m_userName);
+        runAuth(session,
+                [password = std::move(packet.m_password), credential = stored ? *stored : m_unknownUserCredential] {
+                    return PasswordHasher::verify(password, credential);
+                },
+                [this, userName = packet.m_userName](const std::shared_ptr<ChatSession>& session, bool isOk) {
+                    if (session) {
+                        completeAuth(*session, userName, isOk);
+                    }
+                });
+    }
+
+    // work() выполняется в пуле, done() - снова в потоке io_context (session - nullptr, если клиент отключился).
+    // Сообщения уже вошедших пользователей не ждут хэширования: в потоке io_context остаются только постановка
+    // в очередь и ответ. Очередь пула полна - ServerPacketServerBusy.
+    template<class WorkT, class DoneT>
+    bool runAuth(ChatSession& session, WorkT&& work, DoneT&& done) {
+        std::weak_ptr<ChatSession> weakSession = std::static_pointer_cast<ChatSession>(session.shared_from_this());
+        boost::asio::io_context& context = this->context();
+        bool isQueued = m_authPool->tryPost([&context, weakSession, work = std::move(work), done = std::move(done)] {
+            bool isOk = work();
+            boost::asio::post(context, [weakSession, done, isOk] {
+                done(weakSession.lock(), isOk);
+            });
+        });
+        if (!isQueued) {
+            user_chat::ServerPacketServerBusy packet;
+            packet.m_retryAfterMs = 1000;
+            session.sendPacket(packet);
+            return false;
+        }
+        session.setAuthPending(true);
+        return true;
+    }
+
+    void completeAuth(ChatSession& session, const std::string& userName, bool isOk) {
+        session.setAuthPending(false);
+        if (!isOk) {
+            sendAuthError(session, userName, user_chat::aer_invalid_credentials);
+            return;
+        }
+        session.setAuthenticatedName(userName);
+        admitLogin(session, user_chat::PacketResume{userName});
+    }
+
+    void sendAuthError(ChatSession& session, const std::string& userName, user_chat::AuthError error) {
+        user_chat::ServerPacketAuthError packet;
+        packet.m_userName = userName;
+        packet.m_error = error;
+        session.sendPacket(packet);
+    }
+
+    // Больший пакет клиент считает испорченным и переподключается - в комнате это все участники
+    static bool isMessageTextAllowed(const std::string& text) {
+        if (text.size() > kMaxMessageText) {
+            LOG_ERR("ChatServer: message text too long: " << text.size());
+            return false;
+        }
+        return true;
+    }
+
+    void onMessage(ChatSession& session, user_chat::PacketMessage& packet) {
+        if (!isMessageTextAllowed(packet.getMessageText())) {
+            return;
+        }
+        uint32_t senderId = session.userId();
+        if (isDuplicateMessage(senderId, packet.getMessageId())) {
+            return;
+        }
+        packet.setSenderId(senderId);
+
+        uint32_t receiverId = packet.getReceiverId();
+        if (!m_users.contains(receiverId)) {
+            LOG_DBG("ChatServer: unknown receiver " << receiverId);
+            return;
+        }
+
+        // В истории остаются и сообщения отключившимся: отправитель увидит их при прокрутке
+        appendHistory(m_users.name(senderId), m_users.name(receiverId), packet.getMessageText());
+
+        if (m_users[receiverId].m_homeNode != 0) {
+            forwardMessage(senderId, receiverId, packet);
+            return;
+        }
+        if (!m_users[receiverId].m_session) {
+            LOG_DBG("ChatServer: receiver " << receiverId << " is offline");
+            return;
+        }
+
+        // Получатель должен узнать имя отправителя раньше, чем придёт сообщение с его id
+        if (m_users[senderId].m_introducedVersion > m_broadcastVersion) {
+            broadcastPresence();
+        }
+        m_users[receiverId].m_session->sendPacket(packet);
+    }
+
+    void appendHistory(const std::string& senderName, const std::string& receiverName, const std::string& messageText) {
+        if (!m_history) {
+            return;
+        }
+        uint64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        uint64_t messageId = m_history->append(senderName, receiverName, messageText, nowMs);
+        if (messageId != 0) {
+            m_search->add(messageId, senderName, receiverName, messageText);
+        }
+    }
+
+    // Без ограничения ведро всегда пусто: проверка та же, без отдельной ветки
+    bool consumeMessageToken(ChatSession& session, uint64_t nowNs) {
+        UserRecord& record = m_users[session.userId()];
+        if (record.m_messageBucket.tryConsume(m_messageLimit, nowNs)) {
+            record.m_isRateLimited = false;
+            return true;
+        }
+        m_rateLimitedMessages++;
+        if (!record.m_isRateLimited) {
+            record.m_isRateLimited = true;
+            uint64_t waitNs = record.m_messageBucket.waitTimeNs(m_messageLimit, nowNs);
+            user_chat::ServerPacketRateLimited packet{uint32_t((waitNs + 999999) / 1000000)};
+            session.sendPacket(packet);
+            LOG_DBG("ChatServer: user " << session.userId() << " is rate limited");
+        }
+        return false;
+    }
+
+    // Повтор после переподключения уже был разослан - второй раз не рассылаем и не пишем в историю
+    bool isDuplicateMessage(uint32_t senderId, uint64_t messageId) {
+        if (messageId == 0 || m_users[senderId].m_messageIds.accept(messageId)) {
+            return false;
+        }
+        m_duplicateMessages++;
+        LOG_DBG("ChatServer: duplicate message " << messageId << " from " << senderId);
+        return true;
+    }
+
+    // Сообщение пользователю другого узла: один пакет по постоянному соединению, без подтверждения
+    void forwardMessage(uint32_t senderId, uint32_t receiverId, user_chat::PacketMessage& packet) {
+        auto it = m_peers.find(m_users[receiverId].m_homeNode);
+        if (it == m_peers.end()) {
+            return;
+        }
+        user_chat::NodePacketMessage forwarded;
+        forwarded.m_senderName = m_users.name(senderId);
+        forwarded.m_receiverName = m_users.name(receiverId);
+        forwarded.m_messageText = packet.getMessageText();
+        if (packet.getSentAtUs() != 0) {
+            uint64_t nowUs = monotonicNowUs();
+            forwarded.m_ageUs = nowUs > packet.getSentAtUs() ? nowUs - packet.getSentAtUs() : 1;
+        }
+        forwarded.m_messageId = packet.getMessageId();
+        it->second.m_link->send(forwarded);
+    }
+
+    void onNodeHello(ChatSession& session, user_chat::NodePacketHello& packet) {
+        auto it = m_peers.find(packet.m_nodeId);
+        if (it == m_peers.end() || packet.m_clusterKey != m_settings.m_clusterKey) {
+            LOG_ERR("ChatServer: rejected node " << packet.m_nodeId);
+            session.close();
+            return;
+        }
+        session.setPeerNodeId(packet.m_nodeId);
+        it->second.m_inboundSessions++;
+        it->second.m_isLost = false;
+        LOG("ChatServer: node " << packet.m_nodeId << " connected");
+    }
+
+    void onNodePresence(ChatSession& session, user_chat::NodePacketPresence& packet) {
+        uint32_t nodeId = session.peerNodeId();
+        PeerNode& node = m_peers[nodeId];
+        if (packet.m_isFullSync && !node.m_isSyncing) {
+            node.m_isSyncing = true;
+            node.m_syncedUsers.clear();
+        }
+        for (const user_chat::NodeUserStatus& change : packet.m_changes) {
+            uint32_t userId = applyRemoteStatus(nodeId, change, packet.m_isFullSync);
+            if (packet.m_isFullSync && userId != 0) {
+                node.m_syncedUsers.insert(userId);
+            }
+        }
+        if (packet.m_isFullSync && !packet.m_hasMore) {
+            // Кого нет в полном списке, тот ушёл, пока соединения не было
+            setNodeOffline(nodeId, node.m_syncedUsers);
+            node.m_isSyncing = false;
+            node.m_syncedUsers.clear();
+        }
+    }
+
+    // Личное сообщение от пользователя другого узла
+    void onNodeMessage(ChatSession& session, user_chat::NodePacketMessage& packet) {
+        if (!isMessageTextAllowed(packet.m_messageText)) {
+            return;
+        }
+        uint32_t receiverId = m_users.find(packet.m_receiverName);
+        if (receiverId == 0 || m_users[receiverId].m_homeNode != 0) {
+            LOG_DBG("ChatServer: forwarded message to unknown receiver " << packet.m_receiverName);
+            return;
+        }
+        uint32_t senderId = m_users.find(packet.m_senderName);
+        if (senderId == 0 || m_users[senderId].m_homeNode != session.peerNodeId()) {
+            // Сообщение обогнало рассылку присутствия: отправитель точно в сети на своём узле
+            senderId = applyRemoteStatus(session.peerNodeId(), user_chat::NodeUserStatus{packet.m_senderName, user_chat::cst_online, 0}, false);
+            if (senderId == 0) {
+                return;
+            }
+        }
+        appendHistory(packet.m_senderName, packet.m_receiverName, packet.m_messageText);
+
+        if (!m_users[receiverId].m_session) {
+            return;
+        }
+        if (m_users[senderId].m_introducedVersion > m_broadcastVersion) {
+            broadcastPresence();
+        }
+        uint64_t sentAtUs = packet.m_ageUs == 0 ? 0 : monotonicNowUs() - packet.m_ageUs;
+        user_chat::PacketMessage message(senderId, receiverId, packet.m_messageText, sentAtUs, packet.m_messageId);
+        m_users[receiverId].m_session->sendPacket(message);
+    }
+
+    // Изменение присутствия пользователя узла nodeId. Имя переходит к узлу, где пользователь вошёл последним,
+    // но не у подключённого к этому узлу: такой конфликт остаётся за тем, кто вошёл первым.
+    // isForced - из полного списка: после перезапуска узла его версии начинаются заново
+    uint32_t applyRemoteStatus(uint32_t nodeId, const user_chat::NodeUserStatus& change, bool isForced) {
+        uint32_t userId = m_users.find(change.m_userName);
+        if (userId == 0) {
+            if (change.m_status == user_chat::cst_offline || !user_chat::isValidUserName(change.m_userName)) {
+                return 0;
+            }
+            userId = m_users.add(change.m_userName);
+        } else if (m_users[userId].m_homeNode != nodeId) {
+            UserRecord& record = m_users[userId];
+            if (change.m_status == user_chat::cst_offline) {
+                return 0; // Ушёл с узла, который им уже не владеет
+            }
+            if (record.m_session) {
+                LOG_ERR("ChatServer: " << change.m_userName << " is online here and on node " << nodeId);
+                return 0;
+            }
+            if (record.m_homeNode == 0) {
+                // Отключившийся здесь вошёл на другом узле - старая сессия не возобновится
+                record.m_resumeToken = 0;
+                std::vector<uint32_t> rooms = record.m_rooms;
+                for (uint32_t roomId : rooms) {
+                    leaveRoom(userId, roomId);
+                }
+            }
+        } else if (!isForced && change.m_version <= m_users[userId].m_remoteVersion) {
+            return userId;
+        }
+
+        UserRecord& record = m_users[userId];
+        record.m_homeNode = nodeId;
+        record.m_remoteVersion = change.m_version;
+        if (change.m_status == user_chat::cst_offline) {
+            record.m_detachedAt = std::chrono::steady_clock::now();
+        }
+        if (record.m_introducedVersion == 0) {
+            publishStatus(userId, change.m_status, true);
+        } else if (record.m_status != change.m_status) {
+            publishStatus(userId, change.m_status);
+        }
+        return userId;
+    }
+
+    // Все пользователи узла, кроме except, - offline
+    void setNodeOffline(uint32_t nodeId, const std::unordered_set<uint32_t>& except) {
+        auto now = std::chrono::steady_clock::now();
+        m_users.forEach([this, nodeId, &except, now](uint32_t userId, const std::string&, UserRecord& record) {
+            if (record.m_homeNode == nodeId && record.m_status != user_chat::cst_offline && !except.count(userId)) {
+                record.m_detachedAt = now;
+                publishStatus(userId, user_chat::cst_offline);
+            }
+        });
+    }
+
+    // Новое исходящее соединение: представиться и передать всех своих пользователей в сети.
+    // Версия полного списка - текущая: изменения, ещё ждущие рассылки, узел отбросит как более старые
+    void sendFullSync(uint32_t nodeId) {
+        NodeLink& link = *m_peers[nodeId].m_link;
+        user_chat::NodePacketHello hello{m_settings.m_nodeId, m_settings.m_clusterKey};
+        link.send(hello);
+
+        std::vector<user_chat::NodeUserStatus> users;
+        m_users.forEach([this, &users](uint32_t, const std::string& userName, UserRecord& record) {
+            if (record.m_homeNode == 0 && record.m_status != user_chat::cst_offline) {
+                users.push_back(user_chat::NodeUserStatus{userName, record.m_status, m_presence.version()});
+            }
+        });
+        sendPresenceChunks(users, true, [&link](user_chat::NodePacketPresence& packet) { link.send(packet); });
+    }
+
+    // Изменения своих пользователей уходят узлам той же пачкой, что и клиентам; пакет кодируется один раз
+    void sendGossip() {
+        if (m_pendingGossip.empty()) {
+            return;
+        }
+        sendPresenceChunks(m_pendingGossip, false, [this](user_chat::NodePacketPresence& packet) {
+            size_t packetSize;
+            const uint8_t* buffer = user_chat::createPacket(packet, packetSize);
+            OutgoingPacket outgoing{std::shared_ptr<const uint8_t[]>(buffer), packetSize};
+            for (auto& [nodeId, node] : m_peers) {
+                node.m_link->sendEncoded(outgoing);
+            }
+        });
+        m_pendingGossip.clear();
+    }
+
+    // Пачки не больше kMaxUsersListBytes; полный список - хотя бы один пакет, даже пустой
+    template<class SendT>
+    static void sendPresenceChunks(std::vector<user_chat::NodeUserStatus>& changes, bool isFullSync, SendT&& send) {
+        user_chat::NodePacketPresence packet;
+        packet.m_isFullSync = isFullSync;
+        size_t bytes = 0;
+        for (size_t i = 0; i < changes.size(); i++) {
+            bytes += elementSize(changes[i]);
+            packet.m_changes.push_back(std::move(changes[i]));
+            if (bytes >= kMaxUsersListBytes && i + 1 < changes.size()) {
+                packet.m_hasMore = true;
+                send(packet);
+                packet.m_changes.clear();
+                bytes = 0;
+            }
+        }
+        packet.m_hasMore = false;
+        if (!packet.m_changes.empty() || isFullSync) {
+            send(packet);
+        }
+    }
+
+    void onStatus(ChatSession& session, user_chat::PacketClientStatus& packet) {
+        uint32_t userId = session.userId();
+        if (m_users.contains(userId) && m_users[userId].m_status != packet.getStatus()) {
+            publishStatus(userId, packet.getStatus());
+        }
+    }
+
+    void onHistoryRequest(ChatSession& session, user_chat::PacketHistoryRequest& packet) {
+        user_chat::ServerPacketHistory response;
+        response.m_peerName = packet.m_peerName;
+        response.m_beforeMessageId = packet.m_beforeMessageId;
+
+        if (m_history) {
+            size_t count = std::min<size_t>(packet.m_count, kMaxHistoryPage);
+            response.m_hasMore = m_history->readBefore(m_users.name(session.userId()), packet.m_peerName,
+                                                       packet.m_beforeMessageId, count, kMaxHistoryBytes, m_historyPage);
+            for (const HistoryView& view : m_historyPage) {
+                // Одиночное сообщение длиннее страницы обрезается, чтобы пакет уместился в 16 КБ
+                response.m_messages.push_back(user_chat::HistoryMessage{view.m_messageId, view.m_timestampMs,
+                                                                        std::string(view.m_senderName),
+                                                                        std::string(user_chat::truncateUtf8(view.m_messageText, kMaxHistoryBytes))});
+            }
+        }
+        session.sendPacket(response);
+    }
+
+    void onRoomCreate(ChatSession& session, user_chat::PacketRoomCreate& packet) {
+        if (packet.m_roomName.empty() || packet.m_roomName.size() > kMaxRoomNameSize) {
+            sendRoomError(session, packet.m_roomName, 0, user_chat::rer_invalid_name);
+            return;
+        }
+        if (m_rooms.find(packet.m_roomName) != 0) {
+            sendRoomError(session, packet.m_roomName, 0, user_chat::rer_already_exists);
+            return;
+        }
+
+        uint32_t roomId = m_rooms.add(packet.m_roomName);
+        joinRoom(session, roomId);
+    }
+
+    void onRoomJoin(ChatSession& session, user_chat::PacketRoomJoin& packet) {
+        uint32_t roomId = m_rooms.find(packet.m_roomName);
+        if (roomId == 0) {
+            sendRoomError(session, packet.m_roomName, 0, user_chat::rer_not_found);
+            return;
+        }
+        joinRoom(session, roomId);
+    }
+
+    void onRoomLeave(ChatSession& session, user_chat::PacketRoomLeave& packet) {
+        if (!m_rooms.contains(packet.m_roomId) || !m_rooms[packet.m_roomId].contains(session.userId())) {
+            sendRoomError(session, {}, packet.m_roomId, user_chat::rer_not_member);
+            return;
+        }
+        leaveRoom(session.userId(), packet.m_roomId);
+    }
+
+    // Пакет кодируется один раз; на участника - только постановка указателя в очередь отправки
+    void onRoomMessage(ChatSession& session, user_chat::PacketRoomMessage& packet) {
+        uint32_t senderId = session.userId();
+        if (!m_rooms.contains(packet.m_roomId) || !m_rooms[packet.m_roomId].contains(senderId)) {
+            sendRoomError(session, {}, packet.m_roomId, user_chat::rer_not_member);
+            return;
+        }
+        if (!isMessageTextAllowed(packet.m_messageText) || isDuplicateMessage(senderId, packet.m_messageId)) {
+            return;
+        }
+        packet.m_senderId = senderId;
+
+        if (m_users[senderId].m_introducedVersion > m_broadcastVersion) {
+            broadcastPresence();
+        }
+
+        size_t packetSize;
+        const uint8_t* buffer = user_chat::createPacket(packet, packetSize);
+        OutgoingPacket outgoing{std::shared_ptr<const uint8_t[]>(buffer), packetSize};
+        for (uint32_t memberId : m_rooms[packet.m_roomId].m_members) {
+            if (ChatSession* member = m_users[memberId].m_session.get()) {
+                member->write(outgoing);
+            }
+        }
+    }
+
+    void joinRoom(ChatSession& session, uint32_t roomId) {
+        uint32_t userId = session.userId();
+        RoomRecord& room = m_rooms[roomId];
+        if (!room.contains(userId)) {
+            room.add(userId);
+            m_users[userId].m_rooms.push_back(roomId);
+        }
+
+        user_chat::ServerPacketRoomJoined response;
+        response.m_roomId = roomId;
+        response.m_roomName = m_rooms.name(roomId);
+        response.m_memberCount = uint32_t(room.m_members.size());
+        session.sendPacket(response);
+    }
+
+    // Участие сохраняется и без соединения; пустая комната удаляется
+    void leaveRoom(uint32_t userId, uint32_t roomId) {
+        RoomRecord& room = m_rooms[roomId];
+        room.remove(userId);
+        std::vector<uint32_t>& rooms = m_users[userId].m_rooms;
+        rooms.erase(std::find(rooms.begin(), rooms.end(), roomId));
+        if (room.m_members.empty()) {
+            m_rooms.remove(roomId);
+        }
+    }
+
+    void sendRoomError(ChatSession& session, const std::string& roomName, uint32_t roomId, user_chat::RoomError error) {
+        user_chat::ServerPacketRoomError response;
+        response.m_roomName = roomName;
+        response.m_roomId = roomId;
+        response.m_error = error;
+        session.sendPacket(response);
+    }
+
+    // Запрос выполняется в потоке индекса, ответ собирается снова в потоке сервера
+    void onSearchRequest(ChatSession& session, user_chat::PacketSearchRequest& packet) {
+        if (!m_search) {
+            user_chat::ServerPacketSearchResult response;
+            response.m_query = packet.m_query;
+            session.sendPacket(response);
+            return;
+        }
+
+        std::weak_ptr<ChatSession> weakSession = std::static_pointer_cast<ChatSession>(session.shared_from_this());
+        std::string userName = m_users.name(session.userId());
+        size_t maxHits = std::min<size_t>(packet.m_maxHits, kMaxSearchHits);
+        m_search->search(userName, packet.m_query, maxHits,
+                         [this, weakSession, userName, query = packet.m_query](std::vector<SearchIndex::Hit>&& hits) {
+            boost::asio::post(context(), [this, weakSession, userName, query, hits = std::move(hits)] {
+                if (auto session = weakSession.lock()) {
+                    sendSearchResult(*session, userName, query, hits);
+                }
+            });
+        });
+    }
+
+    void sendSearchResult(ChatSession& session, const std::string& userName, const std::string& query,
+                          const std::vector<SearchIndex::Hit>& hits) {
+        user_chat::ServerPacketSearchResult response;
+        response.m_query = query;
+        for (const SearchIndex::Hit& hit : hits) {
+            HistoryView view;
+            if (!m_history->readMessage(hit.m_messageId, view)) {
+                continue;
+            }
+            user_chat::SearchHit item;
+            item.m_peerName = std::string(view.m_senderName == userName ? view.m_receiverName : view.m_senderName);
+            item.m_message = user_chat::HistoryMessage{view.m_messageId, view.m_timestampMs, std::string(view.m_senderName),
+                                                       std::string(user_chat::truncateUtf8(view.m_messageText, kMaxSearchSnippet))};
+            response.m_hits.push_back(std::move(item));
+        }
+        session.sendPacket(response);
+    }
+
+    // Привязка сессии к пользователю с новым токеном возобновления
+    void attachSession(ChatSession& session, uint32_t userId) {
+        UserRecord& record = m_users[userId];
+        if (record.m_introducedVersion == 0) {
+            publishStatus(userId, user_chat::cst_online, true);
+        } else if (record.m_status == user_chat::cst_offline) {
+            publishStatus(userId, user_chat::cst_online);
+        }
+
+        record.m_session = std::static_pointer_cast<ChatSession>(session.shared_from_this());
+        record.m_resumeToken = newResumeToken();
+        session.setUserId(userId);
+        m_isSnapshotDirty = true;
+        if (m_capture) {
+            m_capture->recordUser(session.captureId(), userId, m_users.name(userId));
+        }
+    }
+
+    // Версия - та, которой соответствует следующий за Welcome список или дельта
+    void sendWelcome(ChatSession& session, uint32_t userId, uint64_t presenceVersion, bool isResumed) {
+        user_chat::ServerPacketWelcome welcome;
+        welcome.m_userId = userId;
+        welcome.m_resumeToken = m_users[userId].m_resumeToken;
+        welcome.m_presenceVersion = presenceVersion;
+        welcome.m_isResumed = isResumed;
+        welcome.m_lastMessageId = m_users[userId].m_messageIds.highestId();
+        session.sendPacket(welcome);
+    }
+
+    // isIntroduction - первое изменение после выдачи id: в дельту попадает имя
+    void publishStatus(uint32_t userId, user_chat::ClientStatus status, bool isIntroduction = false) {
+        UserRecord& record = m_users[userId];
+        record.m_status = status;
+        m_isSnapshotDirty = true;
+        if (isIntroduction) {
+            record.m_introducedVersion = m_presence.record(userId, status, m_users.name(userId));
+        } else {
+            m_presence.record(userId, status);
+        }
+        if (record.m_homeNode == 0 && !m_peers.empty()) {
+            m_pendingGossip.push_back(user_chat::NodeUserStatus{m_users.name(userId), status, m_presence.version()});
+        }
+
+        if (m_settings.m_presenceBatchDelay.count() == 0) {
+            broadcastPresence();
+        } else if (!m_isPresenceTimerArmed) {
+            // При шторме входов все изменения за интервал уходят одним пакетом на клиента
+            m_isPresenceTimerArmed = true;
+            m_presenceTimer.expires_after(m_settings.m_presenceBatchDelay);
+            m_presenceTimer.async_wait([this](const boost::system::error_code& ec) {
+                m_isPresenceTimerArmed = false;
+                if (!ec) {
+                    broadcastPresence();
+                }
+            });
+        }
+    }
+
+    // Рассылка неразосланных изменений; клиент пропускает уже известную ему часть дельты
+    void broadcastPresence() {
+        sendGossip();
+        if (!m_presence.covers(m_broadcastVersion)) {
+            LOG_ERR("ChatServer: presence log overflow, " << m_broadcastVersion << " is lost");
+            m_broadcastVersion = m_presence.version();
+            return;
+        }
+
+        while (m_broadcastVersion < m_presence.version()) {
+            user_chat::ServerPacketPresenceDelta delta;
+            delta.m_fromVersion = m_broadcastVersion;
+            delta.m_toVersion = m_presence.collectChanges(m_broadcastVersion, kMaxDeltaChangesPerPacket, delta.m_changes);
+            broadcast(delta);
+            m_broadcastVersion = delta.m_toVersion;
+        }
+        m_usersListCache.clear();
+    }
+
+    // Пакет кодируется один раз и рассылается всем подключённым
+    template<class PacketT>
+    void broadcast(PacketT& packet) {
+        size_t packetSize;
+        const uint8_t* buffer = user_chat::createPacket(packet, packetSize);
+        OutgoingPacket outgoing{std::shared_ptr<const uint8_t[]>(buffer), packetSize};
+
+        m_users.forEach([&outgoing](uint32_t, const std::string&, UserRecord& record) {
+            if (record.m_session) {
+                record.m_session->write(outgoing);
+            }
+        });
+    }
+
+    // Полный список кодируется один раз и раздаётся всем входящим до следующей рассылки присутствия.
+    // Изменения после версии кэша клиент получит очередной дельтой (она начинается не позже этой версии).
+    void sendUsersList(ChatSession& session, uint32_t userId, bool isResumed) {
+        if (m_usersListCache.empty()) {
+            buildUsersListCache();
+        }
+
+        sendWelcome(session, userId, m_usersListCacheVersion, isResumed);
+        for (const OutgoingPacket& packet : m_usersListCache) {
+            session.write(packet);
+        }
+    }
+
+    void buildUsersListCache() {
+        m_usersListCacheVersion = m_presence.version();
+
+        user_chat::ServerPacketUsersList packet;
+        size_t bytes = 0;
+        auto flushChunk = [this, &packet, &bytes](bool hasMore) {
+            packet.m_hasMore = hasMore;
+            size_t packetSize;
+            const uint8_t* buffer = user_chat::createPacket(packet, packetSize);
+            m_usersListCache.push_back(OutgoingPacket{std::shared_ptr<const uint8_t[]>(buffer), packetSize});
+            packet.m_usersList.clear();
+            bytes = 0;
+        };
+
+        // Полный список - единственное место, где клиент получает имена всех id сразу
+        m_users.forEach([&packet, &bytes, &flushChunk](uint32_t userId, const std::string& userName, UserRecord& record) {
+            packet.m_usersList.push_back(user_chat::UserStatus{userId, userName, record.m_status});
+            bytes += elementSize(packet.m_usersList.back());
+            if (bytes >= kMaxUsersListBytes) {
+                flushChunk(true);
+            }
+        });
+        flushChunk(false);
+    }
+
+    template<class PacketT>
+    static size_t packetBodySize(PacketT& packet) {
+        user_chat::PacketSizeCalculator calculator;
+        calculator.addSize(packet);
+        return calculator.getSize();
+    }
+
+    template<class T>
+    static size_t elementSize(T& element) {
+        user_chat::PacketSizeCalculator calculator;
+        calculator.addElementSize(element);
+        return calculator.getSize();
+    }
+
+    uint64_t newResumeToken() {
+        uint64_t token;
+        do {
+            token = m_tokenGenerator();
+        } while (token == 0);
+        return token;
+    }
+
+    // Публикация offline после m_offlineGrace и удаление записей с истёкшим токеном
+    void startSweepTimer() {
+        m_sweepTimer.expires_after(std::chrono::seconds(1));
+        m_sweepTimer.async_wait([this](const boost::system::error_code& ec) {
+            if (ec) {
+                return;
+            }
+            sweepDetachedUsers();
+            if (m_history) {
+                m_history->flush();
+            }
+            logLatency();
+            if (m_capture) {
+                m_capture->flush();
+            }
+            startSweepTimer();
+        });
+    }
+
+    // Пароль в запись не попадает: вход по паролю записывается как PacketHi с тем же именем
+    void captureFrame(ChatSession& session, uint16_t packetType, const uint8_t* data, size_t dataSize) {
+        if (packetType != user_chat::cpt_register && packetType != user_chat::cpt_login) {
+            m_capture->recordFrame(session.captureId(), data, dataSize);
+            return;
+        }
+        user_chat::PacketLogin login;
+        user_chat::PacketReader reader(data + sizeof(packetType), data + dataSize);
+        reader.read(login);
+
+        user_chat::PacketHi hi{login.m_userName};
+        size_t packetSize;
+        std::unique_ptr<uint8_t[]> packet(user_chat::createPacket(hi, packetSize));
+        m_capture->recordFrame(session.captureId(), packet.get() + sizeof(uint16_t), packetSize - sizeof(uint16_t));
+    }
+
+    void logLatency() {
+        auto now = std::chrono::steady_clock::now();
+        if (m_settings.m_latencyLogInterval.count() == 0 || now < m_latencyLogAt) {
+            return;
+        }
+        if (m_dwellHistogram.count() != 0 && m_latencyLogAt != std::chrono::steady_clock::time_point()) {
+            std::ostringstream stats;
+            m_dwellHistogram.print(stats);
+            LOG("ChatServer: packet dwell " << stats.str() << " duplicates=" << m_duplicateMessages << " rate_limited=" << m_rateLimitedMessages);
+            m_dwellHistogram.reset();
+        }
+        m_latencyLogAt = now + m_settings.m_latencyLogInterval;
+    }
+
+    void sweepDetachedUsers() {
+        auto now = std::chrono::steady_clock::now();
+        for (auto& [nodeId, node] : m_peers) {
+            if (node.m_inboundSessions == 0 && !node.m_isLost && now - node.m_lostAt >= m_settings.m_offlineGrace) {
+                setNodeOffline(nodeId, {});
+                node.m_isLost = true;
+            }
+        }
+
+        m_users.forEach([this, now](uint32_t userId, const std::string&, UserRecord& record) {
+            // Присутствием пользователей других узлов управляют их узлы
+            if (record.m_session || (record.m_homeNode != 0 && record.m_status != user_chat::cst_offline)) {
+                return;
+            }
+            if (record.m_status != user_chat::cst_offline && now - record.m_detachedAt >= m_settings.m_offlineGrace) {
+                publishStatus(userId, user_chat::cst_offline);
+            } else if (record.m_status == user_chat::cst_offline && now - record.m_detachedAt >= m_settings.m_resumeTtl) {
+                // id будет выдан другому пользователю - сначала убираем его из комнат
+                std::vector<uint32_t> rooms = record.m_rooms;
+                for (uint32_t roomId : rooms) {
+                    leaveRoom(userId, roomId);
+                }
+                m_users.remove(userId);
+                m_isSnapshotDirty = true;
+            }
+        });
+    }
+
+#ifdef CHAT_TRACE
+    void waitTraceSignal() {
+        m_traceSignal.async_wait([this](const boost::system::error_code& ec, int) {
+            if (ec) {
+                return;
+            }
+            if (TRACE_DUMP(m_settings.m_traceFile)) {
+                LOG("ChatServer: trace written to " << m_settings.m_traceFile);
+            } else {
+                LOG_ERR("ChatServer: cannot write trace " << m_settings.m_traceFile);
+            }
+            waitTraceSignal();
+        });
+    }
+#endif
+
+    // Восстановленные пользователи считаются только что отключившимися: кто не возобновит сессию
+    // за m_offlineGrace, будет разослан как offline, как после обычного обрыва
+    void restoreSnapshot() {
+        ServerSnapshot snapshot;
+        if (!snapshot.open(m_settings.m_snapshotFile)) {
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        bool isValid = true;
+        bool isRead = snapshot.forEachUser([this, now, &isValid](const ServerSnapshot::UserEntry& entry, std::string_view name) {
+            std::string userName(name);
+            if (entry.m_userId == 0 || m_users.contains(entry.m_userId) || m_users.find(userName) != 0 ||
+                entry.m_status > user_chat::cst_offline) {
+                isValid = false;
+                return;
+            }
+            UserRecord& record = m_users.restore(entry.m_userId, userName);
+            record.m_status = user_chat::ClientStatus(entry.m_status);
+            record.m_resumeToken = entry.m_resumeToken;
+            record.m_introducedVersion = entry.m_introducedVersion;
+            record.m_messageIds.restore(entry.m_lastMessageId);
+            record.m_homeNode = entry.m_homeNode;
+            record.m_detachedAt = now;
+        });
+        if (!isRead || !isValid) {
+            LOG_ERR("ChatServer: broken snapshot, starting cold");
+            m_users = UserRegistry<UserRecord>();
+            return;
+        }
+        m_users.rebuildFreeIds();
+
+        const ServerSnapshot::Header& header = snapshot.header();
+        if (header.m_isClean) {
+            // После снимка изменений не было: журнал продолжается, клиенты получат дельты
+            snapshot.forEachChange([this](const ServerSnapshot::ChangeEntry& entry, std::string_view name) {
+                m_presence.restore(entry.m_version, entry.m_userId, user_chat::ClientStatus(entry.m_status), std::string(name));
+            });
+            if (m_presence.version() != header.m_presenceVersion) {
+                m_presence.resetVersion(header.m_presenceVersion);
+            }
+        } else {
+            // Клиенты могли видеть версии новее снимка - их номера не должны совпасть с новыми изменениями
+            m_presence.resetVersion(header.m_presenceVersion + kSnapshotVersionGap);
+        }
+        m_broadcastVersion = m_presence.version();
+
+        LOG("ChatServer: restored " << m_users.size() << " users, presence version " << m_presence.version()
+            << (header.m_isClean ? "" : " (after unclean stop)"));
+    }
+
+    // Пользователи других узлов из снимка: если узел не подключится за m_offlineGrace, они будут
+    // разосланы как offline, как после обрыва связи с ним. Узла больше нет в настройках - пользователь
+    // считается отключившимся от этого узла
+    void expireRestoredRemoteUsers() {
+        auto now = std::chrono::steady_clock::now();
+        m_users.forEach([this, now](uint32_t, const std::string&, UserRecord& record) {
+            if (record.m_homeNode == 0) {
+                return;
+            }
+            auto it = m_peers.find(record.m_homeNode);
+            if (it == m_peers.end()) {
+                record.m_homeNode = 0;
+                return;
+            }
+            if (record.m_status != user_chat::cst_offline) {
+                it->second.m_isLost = false;
+                it->second.m_lostAt = now;
+            }
+        });
+    }
+
+    void captureSnapshot(ServerSnapshot& snapshot, bool isClean) {
+        snapshot.setPresenceVersion(m_presence.version(), isClean);
+        snapshot.reserve(m_users.size(), m_presence.size());
+        m_users.forEach([&snapshot](uint32_t userId, const std::string& userName, UserRecord& record) {
+            snapshot.addUser(userId, userName, record.m_status, record.m_resumeToken, record.m_introducedVersion,
+                             record.m_messageIds.highestId(), record.m_homeNode);
+        });
+        m_presence.forEach([&snapshot](uint64_t version, uint32_t userId, user_chat::ClientStatus status, const std::string& userName) {
+            snapshot.addChange(version, userId, status, userName);
+        });
+    }
+
+    // В потоке io_context - только копирование состояния; запись и fsync - в m_snapshotWriter
+    void startSnapshotTimer() {
+        m_snapshotTimer.expires_after(m_settings.m_snapshotInterval);
+        m_snapshotTimer.async_wait([this](const boost::system::error_code& ec) {
+            if (ec) {
+                return;
+            }
+            if (m_isSnapshotDirty) {
+                auto snapshot = std::make_shared<ServerSnapshot>();
+                captureSnapshot(*snapshot, false);
+                if (m_snapshotWriter->tryPost([snapshot, path = m_settings.m_snapshotFile] { snapshot->write(path); })) {
+                    m_isSnapshotDirty = false;
+                } else {
+                    LOG_ERR("ChatServer: previous snapshot is still being written");
+                }
+            }
+            startSnapshotTimer();
+        });
+    }
 };
 
+static_assert(sizeof(void*) != 8 || sizeof(ChatSession) <= 408, "ChatSession grew: idle sessions get more expensive");
+
+inline void ChatSession::onPacketReceived(const uint8_t* data, size_t dataSize) {
+    m_server.onPacketReceived(*this, data, dataSize);
+}
+
+inline void ChatSession::onDisconnected() {
+    m_server.onSessionClosed(*this);
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include "ChatClientPacketUtils.h"
+#include "TcpClient.h"
+#include <functional>
+#include <string>
+
+// Другой узел кластера
+struct ClusterPeer {
+    uint32_t m_nodeId = 0;
+    std::string m_host;
+    std::string m_port;
+};
+
+// Исходящее соединение к узлу кластера на io_context сервера. Постоянное: после обрыва
+// переподключается само, после каждого подключения сервер заново присылает полный список.
+// Пакеты идут в режиме low_latency без подтверждений: под нагрузкой, пока идёт запись,
+// следующие копятся и уходят одной записью, а одиночный пакет не ждёт таймера.
+// Соединение только пишет: в обратную сторону узел-получатель отправляет по своему исходящему.
+class NodeLink : public TcpClient {
+    uint32_t m_nodeId;
+    std::function<void()> m_onConnected;
+    bool m_isConnected = false;
+    uint64_t m_droppedPackets = 0;
+
+public:
+    NodeLink(boost::asio::io_context& context, uint32_t nodeId, std::function<void()> onConnected)
+        : TcpClient(context), m_nodeId(nodeId), m_onConnected(std::move(onConnected)) {
+        ReconnectPolicy policy;
+        policy.m_isEnabled = true;
+        policy.m_maxDelay = std::chrono::milliseconds(5000);
+        setReconnectPolicy(policy);
+    }
+
+    uint32_t nodeId() const { return m_nodeId; }
+    bool isConnected() const { return m_isConnected; }
+    uint64_t droppedPackets() const { return m_droppedPackets; }
+
+    // Без соединения пакет теряется: после переподключения узел получит полный список заново
+    template<class PacketT>
+    void send(PacketT& packet) {
+        if (!m_isConnected) {
+            m_droppedPackets++;
+            return;
+        }
+        size_t packetSize;
+        uint8_t* buffer = user_chat::createPacket(packet, packetSize);
+        sendPacket(buffer, packetSize);
+    }
+
+    // Один закодированный пакет для всех узлов
+    void sendEncoded(const OutgoingPacket& packet) {
+        if (!m_isConnected) {
+            m_droppedPackets++;
+            return;
+        }
+        sendPacket(packet);
+    }
+
+protected:
+    void onConnected(const boost::system::error_code& ec) override {
+        if (ec) {
+            return;
+        }
+        LOG("NodeLink: connected to node " << m_nodeId);
+        m_isConnected = true;
+        m_onConnected();
+    }
+
+    void onDisconnected() override {
+        LOG_ERR("NodeLink: lost node " << m_nodeId);
+        m_isConnected = false;
+    }
+
+    void onPacketReceived(const uint8_t*, size_t) override {}
+};
@@ -0,0 +1,141 @@
+#pragma once
+#include "Logs.h"
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+// Учётные данные пользователя: соль и хэш пароля scrypt с параметрами, с которыми он получен
+struct Credential {
+    static constexpr size_t kSaltSize = 16;
+    static constexpr size_t kHashSize = 32;
+
+    std::string m_salt; // kSaltSize байт
+    std::string m_hash; // kHashSize байт
+    uint64_t m_costN = 0;
+    uint32_t m_blockSize = 0;
+    uint32_t m_parallelism = 0;
+};
+
+// Хэширование паролей scrypt (OpenSSL). Функция намеренно дорогая по памяти и времени
+// (~16 МБ и десятки миллисекунд при параметрах по умолчанию) - вызывать только из WorkerPool.
+class PasswordHasher {
+public:
+    static constexpr uint64_t kCostN = 1 << 14;
+    static constexpr uint32_t kBlockSize = 8;
+    static constexpr uint32_t kParallelism = 1;
+
+    // Новая случайная соль и хэш пароля с параметрами по умолчанию
+    static bool create(const std::string& password, Credential& credential) {
+        credential.m_salt.resize(Credential::kSaltSize);
+        if (RAND_bytes(reinterpret_cast<unsigned char*>(&credential.m_salt[0]), int(Credential::kSaltSize)) != 1) {
+            return false;
+        }
+        credential.m_costN = kCostN;
+        credential.m_blockSize = kBlockSize;
+        credential.m_parallelism = kParallelism;
+        return hash(password, credential, credential.m_hash);
+    }
+
+    // Сравнение за постоянное время
+    static bool verify(const std::string& password, const Credential& credential) {
+        std::string computed;
+        return hash(password, credential, computed) && computed.size() == credential.m_hash.size() &&
+               CRYPTO_memcmp(computed.data(), credential.m_hash.data(), computed.size()) == 0;
+    }
+
+private:
+    static bool hash(const std::string& password, const Credential& credential, std::string& out) {
+        out.resize(Credential::kHashSize);
+        uint64_t maxMemory = 256 * credential.m_costN * credential.m_blockSize * credential.m_parallelism;
+        return EVP_PBE_scrypt(password.data(), password.size(),
+                              reinterpret_cast<const unsigned char*>(credential.m_salt.data()), credential.m_salt.size(),
+                              credential.m_costN, credential.m_blockSize, credential.m_parallelism, maxMemory,
+                              reinterpret_cast<unsigned char*>(&out[0]), out.size()) == 1;
+    }
+};
+
+// Зарегистрированные пользователи. Хранятся в текстовом файле, по строке на пользователя:
+// "имя соль хэш N r p" (соль и хэш в hex). Новые записи дописываются в конец файла.
+// Используется только из потока io_context.
+class CredentialStore {
+    std::unordered_map<std::string, Credential> m_credentials;
+    std::ofstream m_file;
+
+public:
+    bool open(const std::string& path) {
+        std::ifstream input(path);
+        std::string line;
+        while (std::getline(input, line)) {
+            std::istringstream stream(line);
+            std::string name, salt, hash;
+            Credential credential;
+            if (!(stream >> name >> salt >> hash >> credential.m_costN >> credential.m_blockSize >> credential.m_parallelism) ||
+                !fromHex(salt, credential.m_salt) || !fromHex(hash, credential.m_hash)) {
+                LOG_ERR("CredentialStore: skipping invalid line in " << path);
+                continue;
+            }
+            m_credentials[name] = std::move(credential);
+        }
+
+        m_file.open(path, std::ios::app);
+        if (!m_file) {
+            LOG_ERR("CredentialStore: cannot open " << path);
+            return false;
+        }
+        LOG("CredentialStore: " << m_credentials.size() << " users");
+        return true;
+    }
+
+    size_t size() const { return m_credentials.size(); }
+
+    const Credential* find(const std::string& name) const {
+        auto it = m_credentials.find(name);
+        return it == m_credentials.end() ? nullptr : &it->second;
+    }
+
+    // Имя не должно содержать пробельных символов (проверяется при регистрации)
+    bool add(const std::string& name, Credential&& credential) {
+        if (!m_credentials.emplace(name, credential).second) {
+            return false;
+        }
+        m_file << name << ' ' << toHex(credential.m_salt) << ' ' << toHex(credential.m_hash) << ' '
+               << credential.m_costN << ' ' << credential.m_blockSize << ' ' << credential.m_parallelism << std::endl;
+        return true;
+    }
+
+private:
+    static std::string toHex(const std::string& data) {
+        static const char digits[] = "0123456789abcdef";
+        std::string result;
+        result.reserve(data.size() * 2);
+        for (unsigned char c : data) {
+            result.push_back(digits[c >> 4]);
+            result.push_back(digits[c & 15]);
+        }
+        return result;
+    }
+
+    static bool fromHex(const std::string& hex, std::string& data) {
+        if (hex.size() % 2 != 0) {
+            return false;
+        }
+        auto digit = [](char c) {
+            return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        };
+        data.clear();
+        for (size_t i = 0; i < hex.size(); i += 2) {
+            int high = digit(hex[i]);
+            int low = digit(hex[i + 1]);
+            if (high < 0 || low < 0) {
+                return false;
+            }
+            data.push_back(char(high << 4 | low));
+        }
+        return true;
+    }
+};
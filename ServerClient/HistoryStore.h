@@ -0,0 +1,602 @@
+#pragma once
+#include "Logs.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Сообщение истории; строки указывают в отображённый сегмент и живут, пока жив HistoryStore
+struct HistoryView {
+    uint64_t m_messageId;
+    uint64_t m_timestampMs;
+    std::string_view m_senderName;
+    std::string_view m_receiverName;
+    std::string_view m_messageText;
+};
+
+// История сообщений на диске.
+//
+// Сообщения дописываются в сегменты NNNNNNNN.seg по времени (id сообщений растут), сегменты
+// отображаются в память целиком: запись - memcpy в отображение, чтение - без системных вызовов.
+// Каждая запись хранит положение предыдущей записи той же беседы, а в разреженном индексе беседы
+// есть каждая kIndexStride-я запись. Страница "N сообщений до X" - поиск в индексе и проход назад
+// по цепочке не дальше kIndexStride + N записей, независимо от объёма истории.
+//
+// index.dat - точки индекса всех бесед подряд; checkpoint.dat - хвосты бесед на момент смены сегмента,
+// после перезапуска сканируется только история после контрольной точки.
+// Отдельная "беседа" kAllMessages индексирует все сообщения по id для readMessage().
+class HistoryStore {
+    static constexpr uint32_t kIndexStride = 32;
+    static constexpr uint64_t kAllMessages = 0;
+    static constexpr char kSegmentMagic[8] = {'U', 'C', 'H', 'I', 'S', 'T', '0', '1'};
+    static constexpr char kCheckpointMagic[8] = {'U', 'C', 'C', 'H', 'K', 'P', '0', '1'};
+
+    // Положение записи: номер сегмента (с 1) в старших 32 битах, смещение - в младших; 0 - нет записи
+    using Location = uint64_t;
+
+    struct RecordHeader {
+        uint32_t m_size;          // Длина записи с выравниванием до 8; 0 - дальше данных нет
+        uint16_t m_senderSize;
+        uint16_t m_receiverSize;
+        uint64_t m_messageId;
+        uint64_t m_timestampMs;
+        uint64_t m_conversation;
+        Location m_prev;          // Предыдущая запись той же беседы
+        uint32_t m_textSize;
+        uint32_t m_reserved;
+    };
+
+    struct IndexEntry {
+        uint64_t m_conversation;
+        uint64_t m_messageId;
+        Location m_location;
+    };
+
+    struct IndexPoint {
+        uint64_t m_messageId;
+        Location m_location;
+    };
+
+    struct Conversation {
+        Location m_tail = 0;
+        uint64_t m_tailId = 0;
+        uint64_t m_count = 0;
+        std::vector<IndexPoint> m_index; // По возрастанию id
+    };
+
+    struct CheckpointHeader {
+        char m_magic[8];
+        Location m_scanFrom;      // Записи с этого места в контрольную точку не вошли
+        uint64_t m_nextMessageId;
+        uint64_t m_indexEntries;  // Сколько записей index.dat соответствует контрольной точке
+        uint64_t m_conversations;
+    };
+
+    struct CheckpointEntry {
+        uint64_t m_conversation;
+        Location m_tail;
+        uint64_t m_tailId;
+        uint64_t m_count;
+    };
+
+    class Segment {
+        int m_fd = -1;
+        uint8_t* m_data = nullptr;
+        size_t m_capacity = 0;
+
+    public:
+        size_t m_size = 0; // Записано байт (для последнего сегмента)
+
+        ~Segment() {
+            if (m_data) {
+                munmap(m_data, m_capacity);
+            }
+            if (m_fd >= 0) {
+                ::close(m_fd);
+            }
+        }
+
+        // Новый сегмент создаётся сразу размером capacity (разреженный файл)
+        bool open(const std::string& path, size_t capacity, bool isNew, bool isReadOnly = false) {
+            int flags = isNew ? O_RDWR | O_CREAT | O_EXCL : (isReadOnly ? O_RDONLY : O_RDWR);
+            m_fd = ::open(path.c_str(), flags, 0644);
+            if (m_fd < 0) {
+                return false;
+            }
+            if (isNew) {
+                if (ftruncate(m_fd, off_t(capacity)) != 0) {
+                    return false;
+                }
+            } else {
+                struct stat st;
+                if (fstat(m_fd, &st) != 0) {
+                    return false;
+                }
+                capacity = size_t(st.st_size);
+            }
+            if (capacity < sizeof(kSegmentMagic)) {
+                return false;
+            }
+
+            void* data = mmap(nullptr, capacity, isReadOnly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+            if (data == MAP_FAILED) {
+                return false;
+            }
+            m_data = static_cast<uint8_t*>(data);
+            m_capacity = capacity;
+
+            if (isNew) {
+                std::memcpy(m_data, kSegmentMagic, sizeof(kSegmentMagic));
+            } else if (std::memcmp(m_data, kSegmentMagic, sizeof(kSegmentMagic)) != 0) {
+                return false;
+            }
+            m_size = sizeof(kSegmentMagic);
+            return true;
+        }
+
+        uint8_t* data() const { return m_data; }
+        size_t capacity() const { return m_capacity; }
+
+        void sync() {
+            msync(m_data, m_capacity, MS_ASYNC);
+        }
+    };
+
+    std::filesystem::path m_dir;
+    size_t m_segmentSize;
+    std::vector<std::unique_ptr<Segment>> m_segments; // m_segments[i] - сегмент номер i + 1
+    std::unordered_map<uint64_t, Conversation> m_conversations;
+    uint64_t m_nextMessageId = 1;
+    std::FILE* m_indexFile = nullptr;
+    uint64_t m_indexEntries = 0;
+
+public:
+    explicit HistoryStore(size_t segmentSize = 256 * 1024 * 1024) : m_segmentSize(segmentSize) {}
+
+    ~HistoryStore() {
+        close();
+    }
+
+    HistoryStore(const HistoryStore&) = delete;
+    HistoryStore& operator=(const HistoryStore&) = delete;
+
+    // Открывает или создаёт историю в каталоге dir; false - история недоступна (причина в логе)
+    bool open(const std::string& dir) {
+        std::error_code ec;
+        m_dir = dir;
+        std::filesystem::create_directories(m_dir, ec);
+        if (ec) {
+            LOG_ERR("HistoryStore: cannot create " << dir << ": " << ec.message());
+            return false;
+        }
+
+        if (!openSegments() || !recover()) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (m_indexFile) {
+            writeCheckpoint(endLocation());
+            std::fclose(m_indexFile);
+            m_indexFile = nullptr;
+        }
+        m_segments.clear();
+        m_conversations.clear();
+    }
+
+    bool isOpen() const { return m_indexFile != nullptr; }
+    uint64_t lastMessageId() const { return m_nextMessageId - 1; }
+
+    // Сохраняет сообщение; возвращает его id (0 - не сохранено)
+    uint64_t append(const std::string& senderName, const std::string& receiverName, const std::string& messageText, uint64_t timestampMs) {
+        if (!isOpen() || senderName.size() > UINT16_MAX || receiverName.size() > UINT16_MAX) {
+            return 0;
+        }
+
+        size_t size = alignedSize(sizeof(RecordHeader) + senderName.size() + receiverName.size() + messageText.size());
+        Segment* segment = m_segments.back().get();
+        if (segment->m_size + size > segment->capacity()) {
+            segment = rollSegment(size);
+            if (!segment) {
+                return 0;
+            }
+        }
+
+        uint64_t key = conversationKey(senderName, receiverName);
+        Conversation& conversation = m_conversations[key];
+
+        RecordHeader header{};
+        header.m_senderSize = uint16_t(senderName.size());
+        header.m_receiverSize = uint16_t(receiverName.size());
+        header.m_messageId = m_nextMessageId++;
+        header.m_timestampMs = timestampMs;
+        header.m_conversation = key;
+        header.m_prev = conversation.m_tail;
+        header.m_textSize = uint32_t(messageText.size());
+
+        // Длина записывается последней: после падения недописанная запись выглядит как конец данных
+        uint8_t* record = segment->data() + segment->m_size;
+        uint8_t* ptr = record + sizeof(RecordHeader);
+        std::memcpy(ptr, senderName.data(), senderName.size());
+        ptr += senderName.size();
+        std::memcpy(ptr, receiverName.data(), receiverName.size());
+        ptr += receiverName.size();
+        std::memcpy(ptr, messageText.data(), messageText.size());
+        std::memcpy(record, &header, sizeof(header));
+        uint32_t recordSize = uint32_t(size);
+        std::memcpy(record, &recordSize, sizeof(recordSize));
+
+        Location location = makeLocation(uint32_t(m_segments.size()), segment->m_size);
+        segment->m_size += size;
+        addToConversation(key, conversation, header.m_messageId, location);
+        addToConversation(kAllMessages, m_conversations[kAllMessages], header.m_messageId, location);
+        return header.m_messageId;
+    }
+
+    // Сообщение по id: точка общего индекса и проход вперёд не больше kIndexStride записей
+    bool readMessage(uint64_t messageId, HistoryView& view) const {
+        auto it = m_conversations.find(kAllMessages);
+        if (it == m_conversations.end() || messageId == 0 || messageId >= m_nextMessageId) {
+            return false;
+        }
+
+        const std::vector<IndexPoint>& index = it->second.m_index;
+        auto point = std::upper_bound(index.begin(), index.end(), messageId,
+                                      [](uint64_t id, const IndexPoint& point) { return id < point.m_messageId; });
+        if (point == index.begin()) {
+            return false;
+        }
+
+        // Записи лежат подряд в порядке id, конец сегмента - переход к началу следующего
+        Location location = std::prev(point)->m_location;
+        for (uint32_t step = 0; step <= kIndexStride; step++) {
+            const RecordHeader* header = recordAt(location);
+            if (!header) {
+                location = makeLocation(uint32_t(location >> 32) + 1, sizeof(kSegmentMagic));
+                header = recordAt(location);
+                if (!header) {
+                    return false;
+                }
+            }
+            if (header->m_messageId >= messageId) {
+                if (header->m_messageId != messageId) {
+                    return false;
+                }
+                view = makeView(header);
+                return true;
+            }
+            location += header->m_size;
+        }
+        return false;
+    }
+
+    // Последовательное чтение истории из другого потока: сегменты отображаются заново только для чтения.
+    // Заканчивается на сообщении с id больше lastMessageId; func(const HistoryView&) возвращает false для остановки.
+    template<class FuncT>
+    static void scan(const std::string& dir, uint64_t lastMessageId, FuncT&& func) {
+        for (uint32_t number = 1; std::filesystem::exists(segmentPath(dir, number)); number++) {
+            Segment segment;
+            if (!segment.open(segmentPath(dir, number), 0, false, true)) {
+                LOG_ERR("HistoryStore: cannot open " << segmentPath(dir, number));
+                return;
+            }
+            size_t offset = sizeof(kSegmentMagic);
+            while (const RecordHeader* header = validRecord(segment, offset)) {
+                if (header->m_messageId > lastMessageId || !func(makeView(header))) {
+                    return;
+                }
+                offset += header->m_size;
+            }
+        }
+    }
+
+    // До maxCount сообщений беседы userA и userB раньше beforeId (0 - самые новые), по возрастанию id.
+    // Первое сообщение возвращается всегда, следующие - пока сумма длин не превышает maxBytes.
+    // Возвращает true, если есть ещё более ранние сообщения.
+    bool readBefore(const std::string& userA, const std::string& userB, uint64_t beforeId,
+                    size_t maxCount, size_t maxBytes, std::vector<HistoryView>& messages) const {
+        messages.clear();
+        auto it = m_conversations.find(conversationKey(userA, userB));
+        if (it == m_conversations.end() || maxCount == 0) {
+            return false;
+        }
+
+        const Conversation& conversation = it->second;
+        Location location = conversation.m_tail;
+        if (beforeId != 0 && beforeId <= conversation.m_tailId) {
+            // Ближайшая точка индекса не раньше beforeId: от неё до нужных записей меньше kIndexStride шагов
+            auto point = std::lower_bound(conversation.m_index.begin(), conversation.m_index.end(), beforeId,
+                                          [](const IndexPoint& point, uint64_t id) { return point.m_messageId < id; });
+            if (point != conversation.m_index.end()) {
+                location = point->m_location;
+            }
+        }
+
+        bool hasMore = false;
+        size_t bytes = 0;
+        while (location != 0) {
+            const RecordHeader* header = recordAt(location);
+            if (!header) {
+                LOG_ERR("HistoryStore: broken chain at " << location);
+                break;
+            }
+            location = header->m_prev;
+
+            HistoryView view = makeView(header);
+            if ((beforeId != 0 && view.m_messageId >= beforeId) || !isBetween(view, userA, userB)) {
+                continue; // Более новое сообщение или чужая беседа с тем же хешем
+            }
+
+            size_t viewBytes = view.m_senderName.size() + view.m_messageText.size();
+            if (messages.size() == maxCount || (!messages.empty() && bytes + viewBytes > maxBytes)) {
+                hasMore = true;
+                break;
+            }
+            messages.push_back(view);
+            bytes += viewBytes;
+        }
+
+        std::reverse(messages.begin(), messages.end());
+        return hasMore;
+    }
+
+    // Сброс буферов индекса; вызывается периодически
+    void flush() {
+        if (m_indexFile) {
+            std::fflush(m_indexFile);
+        }
+    }
+
+private:
+    static size_t alignedSize(size_t size) { return (size + 7) & ~size_t(7); }
+
+    static Location makeLocation(uint32_t segment, size_t offset) { return (uint64_t(segment) << 32) | uint64_t(offset); }
+
+    // Беседа не зависит от направления сообщения
+    static uint64_t conversationKey(const std::string& userA, const std::string& userB) {
+        const std::string& first = userA < userB ? userA : userB;
+        const std::string& second = userA < userB ? userB : userA;
+
+        uint64_t hash = 14695981039346656037ull; // FNV-1a
+        auto mix = [&hash](const std::string& value) {
+            for (unsigned char c : value) {
+                hash = (hash ^ c) * 1099511628211ull;
+            }
+            hash = (hash ^ 0xff) * 1099511628211ull;
+        };
+        mix(first);
+        mix(second);
+        return hash == kAllMessages ? 1 : hash;
+    }
+
+    static bool isBetween(const HistoryView& view, const std::string& userA, const std::string& userB) {
+        return (view.m_senderName == userA && view.m_receiverName == userB) ||
+               (view.m_senderName == userB && view.m_receiverName == userA);
+    }
+
+    static HistoryView makeView(const RecordHeader* header) {
+        const char* ptr = reinterpret_cast<const char*>(header + 1);
+        HistoryView view;
+        view.m_messageId = header->m_messageId;
+        view.m_timestampMs = header->m_timestampMs;
+        view.m_senderName = std::string_view(ptr, header->m_senderSize);
+        view.m_receiverName = std::string_view(ptr + header->m_senderSize, header->m_receiverSize);
+        view.m_messageText = std::string_view(ptr + header->m_senderSize + header->m_receiverSize, header->m_textSize);
+        return view;
+    }
+
+    // Проверенный заголовок записи или nullptr
+    const RecordHeader* recordAt(Location location) const {
+        uint32_t segmentNumber = uint32_t(location >> 32);
+        size_t offset = size_t(location & 0xffffffffu);
+        if (segmentNumber == 0 || segmentNumber > m_segments.size()) {
+            return nullptr;
+        }
+        return validRecord(*m_segments[segmentNumber - 1], offset);
+    }
+
+    static const RecordHeader* validRecord(const Segment& segment, size_t offset) {
+        if (offset % 8 != 0 || offset + sizeof(RecordHeader) > segment.capacity()) {
+            return nullptr;
+        }
+        const RecordHeader* header = reinterpret_cast<const RecordHeader*>(segment.data() + offset);
+        size_t contentSize = sizeof(RecordHeader) + header->m_senderSize + header->m_receiverSize + size_t(header->m_textSize);
+        if (header->m_size == 0 || header->m_size != alignedSize(contentSize) || offset + header->m_size > segment.capacity()) {
+            return nullptr;
+        }
+        return header;
+    }
+
+    std::string segmentPath(uint32_t number) const {
+        return segmentPath(m_dir, number);
+    }
+
+    static std::string segmentPath(const std::filesystem::path& dir, uint32_t number) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%08u.seg", number);
+        return (dir / name).string();
+    }
+
+    Location endLocation() const {
+        return m_segments.empty() ? 0 : makeLocation(uint32_t(m_segments.size()), m_segments.back()->m_size);
+    }
+
+    bool openSegments() {
+        for (uint32_t number = 1; std::filesystem::exists(segmentPath(number)); number++) {
+            auto segment = std::make_unique<Segment>();
+            if (!segment->open(segmentPath(number), 0, false)) {
+                LOG_ERR("HistoryStore: cannot open " << segmentPath(number));
+                return false;
+            }
+            m_segments.push_back(std::move(segment));
+        }
+        if (m_segments.empty()) {
+            auto segment = std::make_unique<Segment>();
+            if (!segment->open(segmentPath(1), m_segmentSize, true)) {
+                LOG_ERR("HistoryStore: cannot create " << segmentPath(1));
+                return false;
+            }
+            m_segments.push_back(std::move(segment));
+        }
+        return true;
+    }
+
+    // Состояние из контрольной точки и index.dat, затем досканирование записей после неё
+    bool recover() {
+        CheckpointHeader checkpoint{};
+        std::vector<CheckpointEntry> tails;
+        if (!readCheckpoint(checkpoint, tails)) {
+            checkpoint.m_scanFrom = makeLocation(1, sizeof(kSegmentMagic));
+            checkpoint.m_nextMessageId = 1;
+            checkpoint.m_indexEntries = 0;
+            tails.clear();
+        }
+
+        std::string indexPath = (m_dir / "index.dat").string();
+        std::error_code ec;
+        if (std::filesystem::exists(indexPath) &&
+            std::filesystem::file_size(indexPath, ec) > checkpoint.m_indexEntries * sizeof(IndexEntry)) {
+            // Точки после контрольной точки будут восстановлены сканированием
+            std::filesystem::resize_file(indexPath, checkpoint.m_indexEntries * sizeof(IndexEntry), ec);
+        }
+        m_indexFile = std::fopen(indexPath.c_str(), "a+b");
+        if (!m_indexFile) {
+            LOG_ERR("HistoryStore: cannot open " << indexPath);
+            return false;
+        }
+
+        std::fseek(m_indexFile, 0, SEEK_SET);
+        IndexEntry entry;
+        while (m_indexEntries < checkpoint.m_indexEntries && std::fread(&entry, sizeof(entry), 1, m_indexFile) == 1) {
+            m_conversations[entry.m_conversation].m_index.push_back(IndexPoint{entry.m_messageId, entry.m_location});
+            m_indexEntries++;
+        }
+        std::fseek(m_indexFile, 0, SEEK_END);
+
+        for (const CheckpointEntry& tail : tails) {
+            Conversation& conversation = m_conversations[tail.m_conversation];
+            conversation.m_tail = tail.m_tail;
+            conversation.m_tailId = tail.m_tailId;
+            conversation.m_count = tail.m_count;
+        }
+        m_nextMessageId = checkpoint.m_nextMessageId;
+
+        scanFrom(checkpoint.m_scanFrom);
+        return true;
+    }
+
+    void scanFrom(Location from) {
+        uint32_t first = std::max<uint32_t>(1, uint32_t(from >> 32));
+        size_t records = 0;
+        for (uint32_t number = first; number <= m_segments.size(); number++) {
+            Segment& segment = *m_segments[number - 1];
+            size_t offset = number == first ? std::max<size_t>(sizeof(kSegmentMagic), size_t(from & 0xffffffffu)) : sizeof(kSegmentMagic);
+            while (const RecordHeader* header = validRecord(segment, offset)) {
+                Conversation& conversation = m_conversations[header->m_conversation];
+                addToConversation(header->m_conversation, conversation, header->m_messageId, makeLocation(number, offset));
+                addToConversation(kAllMessages, m_conversations[kAllMessages], header->m_messageId, makeLocation(number, offset));
+                m_nextMessageId = std::max(m_nextMessageId, header->m_messageId + 1);
+                offset += header->m_size;
+                records++;
+            }
+            segment.m_size = offset;
+        }
+        if (records > 0) {
+            LOG("HistoryStore: recovered " << records << " messages after checkpoint");
+        }
+    }
+
+    void addToConversation(uint64_t key, Conversation& conversation, uint64_t messageId, Location location) {
+        if (conversation.m_count++ % kIndexStride == 0) {
+            IndexEntry entry{key, messageId, location};
+            std::fwrite(&entry, sizeof(entry), 1, m_indexFile);
+            m_indexEntries++;
+            conversation.m_index.push_back(IndexPoint{messageId, location});
+        }
+        conversation.m_tail = location;
+        conversation.m_tailId = messageId;
+    }
+
+    Segment* rollSegment(size_t recordSize) {
+        m_segments.back()->sync();
+        uint32_t number = uint32_t(m_segments.size() + 1);
+        auto segment = std::make_unique<Segment>();
+        if (!segment->open(segmentPath(number), std::max(m_segmentSize, recordSize + sizeof(kSegmentMagic)), true)) {
+            LOG_ERR("HistoryStore: cannot create " << segmentPath(number));
+            return nullptr;
+        }
+        m_segments.push_back(std::move(segment));
+        writeCheckpoint(endLocation());
+        return m_segments.back().get();
+    }
+
+    // Хвосты всех бесед; пишется во временный файл и подменяет старую точку целиком
+    void writeCheckpoint(Location scanFrom) {
+        std::fflush(m_indexFile);
+        for (auto& segment : m_segments) {
+            segment->sync();
+        }
+
+        std::string path = (m_dir / "checkpoint.dat").string();
+        std::string tmpPath = path + ".tmp";
+        std::FILE* file = std::fopen(tmpPath.c_str(), "wb");
+        if (!file) {
+            LOG_ERR("HistoryStore: cannot write " << tmpPath);
+            return;
+        }
+
+        CheckpointHeader header{};
+        std::memcpy(header.m_magic, kCheckpointMagic, sizeof(kCheckpointMagic));
+        header.m_scanFrom = scanFrom;
+        header.m_nextMessageId = m_nextMessageId;
+        header.m_indexEntries = m_indexEntries;
+        header.m_conversations = m_conversations.size();
+        bool isOk = std::fwrite(&header, sizeof(header), 1, file) == 1;
+        for (const auto& [key, conversation] : m_conversations) {
+            CheckpointEntry entry{key, conversation.m_tail, conversation.m_tailId, conversation.m_count};
+            isOk = isOk && std::fwrite(&entry, sizeof(entry), 1, file) == 1;
+        }
+        isOk = std::fclose(file) == 0 && isOk;
+
+        std::error_code ec;
+        if (isOk) {
+            std::filesystem::rename(tmpPath, path, ec);
+        }
+        if (!isOk || ec) {
+            LOG_ERR("HistoryStore: checkpoint failed");
+        }
+    }
+
+    bool readCheckpoint(CheckpointHeader& header, std::vector<CheckpointEntry>& tails) const {
+        std::string path = (m_dir / "checkpoint.dat").string();
+        std::FILE* file = std::fopen(path.c_str(), "rb");
+        if (!file) {
+            return false;
+        }
+
+        bool isOk = std::fread(&header, sizeof(header), 1, file) == 1 &&
+                    std::memcmp(header.m_magic, kCheckpointMagic, sizeof(kCheckpointMagic)) == 0;
+        if (isOk) {
+            tails.resize(header.m_conversations);
+            isOk = tails.empty() || std::fread(tails.data(), sizeof(CheckpointEntry), tails.size(), file) == tails.size();
+        }
+        std::fclose(file);
+        if (!isOk) {
+            LOG_ERR("HistoryStore: broken " << path << ", rescanning history");
+        }
+        return isOk;
+    }
+};
@@ -0,0 +1,89 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+inline uint64_t monotonicNowUs() {
+    return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Гистограмма задержек в микросекундах с логарифмическими корзинами: 16 корзин на каждую
+// степень двойки (погрешность перцентилей не больше 1/16). Запись - несколько инструкций
+// без выделения памяти, поэтому гистограмму можно вести постоянно, в том числе в продакшене.
+// Не потокобезопасна: каждый поток ведёт свою, при выводе их можно объединить через merge().
+class LatencyHistogram {
+    static constexpr uint32_t kSubBuckets = 16;
+    static constexpr uint32_t kSubBucketBits = 4;
+
+    std::array<uint64_t, 64 * kSubBuckets> m_counts{};
+    uint64_t m_count = 0;
+    uint64_t m_maxUs = 0;
+    uint64_t m_sumUs = 0;
+
+public:
+    void record(uint64_t valueUs) {
+        m_counts[bucketOf(valueUs)]++;
+        m_count++;
+        m_maxUs = std::max(m_maxUs, valueUs);
+        m_sumUs += valueUs;
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < m_counts.size(); i++) {
+            m_counts[i] += other.m_counts[i];
+        }
+        m_count += other.m_count;
+        m_maxUs = std::max(m_maxUs, other.m_maxUs);
+        m_sumUs += other.m_sumUs;
+    }
+
+    void reset() { *this = LatencyHistogram(); }
+
+    uint64_t count() const { return m_count; }
+    uint64_t maxUs() const { return m_maxUs; }
+    uint64_t meanUs() const { return m_count == 0 ? 0 : m_sumUs / m_count; }
+
+    // Верхняя граница корзины, в которую попал перцентиль p (0..1)
+    uint64_t percentileUs(double p) const {
+        if (m_count == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, uint64_t(p * double(m_count) + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < m_counts.size(); i++) {
+            seen += m_counts[i];
+            if (seen >= rank) {
+                return std::min(upperBoundOf(uint32_t(i)), m_maxUs);
+            }
+        }
+        return m_maxUs;
+    }
+
+    // "n=... p50=...us p90=... p99=... max=..."
+    void print(std::ostream& out) const {
+        out << "n=" << m_count << " p50=" << percentileUs(0.5) << "us p90=" << percentileUs(0.9)
+            << "us p99=" << percentileUs(0.99) << "us max=" << m_maxUs << "us";
+    }
+
+private:
+    // Значения меньше 16 - в своих корзинах, дальше - 16 корзин на степень двойки
+    static uint32_t bucketOf(uint64_t value) {
+        if (value < kSubBuckets) {
+            return uint32_t(value);
+        }
+        uint32_t exponent = 63 - uint32_t(__builtin_clzll(value));
+        uint32_t mantissa = uint32_t(value >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+        return (exponent - kSubBucketBits + 1) * kSubBuckets + mantissa;
+    }
+
+    static uint64_t upperBoundOf(uint32_t bucket) {
+        if (bucket < kSubBuckets) {
+            return bucket;
+        }
+        uint32_t exponent = bucket / kSubBuckets + kSubBucketBits - 1;
+        uint64_t mantissa = bucket % kSubBuckets;
+        return ((kSubBuckets + mantissa + 1) << (exponent - kSubBucketBits)) - 1;
+    }
+};
@@ -20,3 +20,12 @@ inline std::mutex gLogMutex;
         std::cerr << expr << std::endl; \
     }
 #endif
+
+// Подробный лог на каждый пакет - только в отладочной сборке с CHAT_DEBUG_LOGS
+#ifndef LOG_DBG
+    #ifdef CHAT_DEBUG_LOGS
+        #define LOG_DBG( expr ) LOG( expr )
+    #else
+        #define LOG_DBG( expr ) {}
+    #endif
+#endif
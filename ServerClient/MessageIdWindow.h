@@ -0,0 +1,69 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+// Подавление повторов сообщений одного отправителя по id, которые назначает клиент
+// (возрастающие номера, 0 - без id). Помнит последние kWindowSize номеров: бит на номер
+// относительно наибольшего принятого, как окно защиты от повторов в IPsec.
+// Память постоянна (40 байт на отправителя), проверка - сдвиг четырёх слов.
+// Номер старше окна считается повтором: клиент не держит неподтверждённых сообщений дольше окна.
+class MessageIdWindow {
+public:
+    static constexpr uint64_t kWindowSize = 256;
+
+private:
+    static constexpr uint32_t kWords = uint32_t(kWindowSize / 64);
+
+    std::array<uint64_t, kWords> m_bits{}; // Бит i - номер m_highestId - i
+    uint64_t m_highestId = 0;
+
+public:
+    // true - номер новый и запомнен, false - повтор
+    bool accept(uint64_t id) {
+        if (id > m_highestId) {
+            shift(id - m_highestId);
+            m_highestId = id;
+            m_bits[0] |= 1;
+            return true;
+        }
+        uint64_t offset = m_highestId - id;
+        if (offset >= kWindowSize) {
+            return false;
+        }
+        uint64_t mask = uint64_t(1) << (offset % 64);
+        uint64_t& word = m_bits[offset / 64];
+        if (word & mask) {
+            return false;
+        }
+        word |= mask;
+        return true;
+    }
+
+    uint64_t highestId() const { return m_highestId; }
+
+    // Восстановление из снимка: все номера до highestId считаются принятыми
+    void restore(uint64_t highestId) {
+        m_highestId = highestId;
+        m_bits.fill(highestId == 0 ? 0 : ~uint64_t(0));
+    }
+
+    void reset() { *this = MessageIdWindow(); }
+
+private:
+    // Сдвиг окна на count номеров вперёд
+    void shift(uint64_t count) {
+        if (count >= kWindowSize) {
+            m_bits.fill(0);
+            return;
+        }
+        uint32_t words = uint32_t(count / 64);
+        uint32_t bits = uint32_t(count % 64);
+        for (uint32_t i = kWords; i-- > 0;) {
+            uint64_t value = i >= words ? m_bits[i - words] << bits : 0;
+            if (bits != 0 && i > words) {
+                value |= m_bits[i - words - 1] >> (64 - bits);
+            }
+            m_bits[i] = value;
+        }
+    }
+};
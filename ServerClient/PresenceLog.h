@@ -0,0 +1,140 @@
+#pragma once
+
+#include "ChatClientPackets.h"
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace user_chat
+{
+
+// Журнал изменений присутствия с версиями.
+// Хранит последние m_capacity изменений, чтобы переподключившийся клиент получил только дельту.
+class PresenceLog
+{
+    struct Change
+    {
+        uint64_t        m_version;
+        uint32_t        m_userId;
+        ClientStatus    m_status;
+        std::string     m_userName;     // только при первом появлении id
+    };
+
+    uint64_t            m_version = 0;
+    std::deque<Change>  m_changes;
+    size_t              m_capacity;
+
+public:
+    PresenceLog( size_t capacity = 64 * 1024 ) : m_capacity(capacity) {}
+
+    uint64_t version() const { return m_version; }
+
+    // Продолжить нумерацию версий (например, после восстановления состояния сервера)
+    void resetVersion( uint64_t version )
+    {
+        m_version = version;
+        m_changes.clear();
+    }
+
+    // Восстановление журнала из снимка: изменения по возрастанию версий, без пропусков
+    void restore( uint64_t version, uint32_t userId, ClientStatus status, const std::string& introducedName )
+    {
+        if ( !m_changes.empty() && version != m_version + 1 )
+        {
+            m_changes.clear();
+        }
+        m_version = version;
+        m_changes.push_back( Change{ version, userId, status, introducedName } );
+        if ( m_changes.size() > m_capacity )
+        {
+            m_changes.pop_front();
+        }
+    }
+
+    // func(version, userId, status, introducedName) по возрастанию версий
+    template<class FuncT>
+    void forEach( FuncT&& func ) const
+    {
+        for ( const Change& change : m_changes )
+        {
+            func( change.m_version, change.m_userId, change.m_status, change.m_userName );
+        }
+    }
+
+    size_t size() const { return m_changes.size(); }
+
+    // introducedName - имя для пользователя, которому только что выдан id
+    uint64_t record( uint32_t userId, ClientStatus status, const std::string& introducedName = {} )
+    {
+        m_changes.push_back( Change{ ++m_version, userId, status, introducedName } );
+        if ( m_changes.size() > m_capacity )
+        {
+            m_changes.pop_front();
+        }
+        return m_version;
+    }
+
+    // Есть ли в журнале все изменения после version
+    bool covers( uint64_t version ) const
+    {
+        if ( version > m_version )
+        {
+            return false;   // версия из чужой эпохи сервера
+        }
+        return version == m_version || ( !m_changes.empty() && version + 1 >= m_changes.front().m_version );
+    }
+
+    // Изменения после knownVersion, последнее на каждого пользователя.
+    // false - журнал уже не покрывает knownVersion или изменений больше maxChanges, нужен полный список.
+    bool changesSince( uint64_t knownVersion, size_t maxChanges, std::vector<UserStatus>& changes ) const
+    {
+        changes.clear();
+        return covers( knownVersion ) && collectChanges( knownVersion, maxChanges, changes ) == m_version;
+    }
+
+    // Собирает изменения после fromVersion (последнее на пользователя), не больше maxChanges пользователей.
+    // Имя сохраняется, если пользователь появился внутри дельты.
+    // Возвращает версию, до которой изменения собраны; дельту (fromVersion, результат] можно отправлять частями.
+    uint64_t collectChanges( uint64_t fromVersion, size_t maxChanges, std::vector<UserStatus>& changes ) const
+    {
+        changes.clear();
+        if ( m_changes.empty() || fromVersion >= m_version )
+        {
+            return m_version;
+        }
+
+        // Версии в журнале идут подряд - начало дельты находится без поиска
+        uint64_t firstVersion = m_changes.front().m_version;
+        size_t first = fromVersion + 1 >= firstVersion ? size_t( fromVersion + 1 - firstVersion ) : 0;
+        uint64_t toVersion = first > 0 ? m_changes[first - 1].m_version : firstVersion - 1;
+
+        std::unordered_map<uint32_t, size_t> indexById;
+        for ( size_t i = first; i < m_changes.size(); i++ )
+        {
+            const Change& change = m_changes[i];
+            auto [it, isInserted] = indexById.emplace( change.m_userId, changes.size() );
+            if ( isInserted )
+            {
+                if ( changes.size() == maxChanges )
+                {
+                    break;
+                }
+                changes.push_back( UserStatus{ change.m_userId, change.m_userName, change.m_status } );
+            }
+            else
+            {
+                changes[it->second].m_status = change.m_status;
+                if ( !change.m_userName.empty() )
+                {
+                    changes[it->second].m_playerName = change.m_userName;
+                }
+            }
+            toVersion = change.m_version;
+        }
+        return toVersion;
+    }
+};
+
+}
@@ -0,0 +1,386 @@
+#pragma once
+#include "HistoryStore.h"
+#include "Logs.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Полнотекстовый поиск по истории: инвертированный индекс "термин -> сжатый список id сообщений".
+//
+// Индекс свой у каждого пользователя (сообщение попадает к отправителю и получателю), поэтому
+// поиск сразу ограничен его беседами. Списки хранят разности id и частоту термина в varint.
+// Индекс живёт в отдельном потоке: add() только кладёт сообщение в очередь, поток забирает
+// очередь пачками. Запросы выполняются тем же потоком, результат отдаётся в callback оттуда же.
+// При старте история индексируется заново в фоне, запросы обслуживаются между порциями.
+class SearchIndex {
+public:
+    struct Hit {
+        uint64_t m_messageId;
+        double m_score;
+    };
+
+    using SearchCallback = std::function<void(std::vector<Hit>&& hits)>;
+
+private:
+    static constexpr size_t kMaxTermSize = 64;
+    static constexpr size_t kMaxQueryTerms = 8;
+    static constexpr size_t kBatchSize = 1024;                 // Пачка будит поток раньше таймаута
+    static constexpr std::chrono::milliseconds kBatchDelay{50};
+    static constexpr size_t kRebuildSlice = 4096;              // Сообщений между проверками запросов при перестроении
+
+    struct PendingMessage {
+        uint64_t m_messageId;
+        std::string m_senderName;
+        std::string m_receiverName;
+        std::string m_messageText;
+    };
+
+    struct Query {
+        std::string m_userName;
+        std::string m_text;
+        size_t m_maxHits;
+        SearchCallback m_callback;
+    };
+
+    // Сжатый список: varint(id - предыдущий id), varint(частота термина)
+    struct PostingList {
+        std::vector<uint8_t> m_data;
+        uint64_t m_lastId = 0;
+        uint32_t m_count = 0;
+
+        void add(uint64_t messageId, uint32_t frequency) {
+            writeVarint(messageId - m_lastId);
+            writeVarint(frequency);
+            m_lastId = messageId;
+            m_count++;
+        }
+
+        void writeVarint(uint64_t value) {
+            while (value >= 0x80) {
+                m_data.push_back(uint8_t(value) | 0x80);
+                value >>= 7;
+            }
+            m_data.push_back(uint8_t(value));
+        }
+    };
+
+    class PostingReader {
+        const uint8_t* m_ptr;
+        const uint8_t* m_end;
+        uint64_t m_id = 0;
+        uint32_t m_frequency = 0;
+
+    public:
+        explicit PostingReader(const PostingList& list) : m_ptr(list.m_data.data()), m_end(list.m_data.data() + list.m_data.size()) {}
+
+        bool next() {
+            if (m_ptr == m_end) {
+                return false;
+            }
+            m_id += readVarint();
+            m_frequency = uint32_t(readVarint());
+            return true;
+        }
+
+        uint64_t id() const { return m_id; }
+        uint32_t frequency() const { return m_frequency; }
+
+    private:
+        uint64_t readVarint() {
+            uint64_t value = 0;
+            for (int shift = 0; m_ptr != m_end; shift += 7) {
+                uint8_t byte = *m_ptr++;
+                value |= uint64_t(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) {
+                    break;
+                }
+            }
+            return value;
+        }
+    };
+
+    struct UserIndex {
+        uint64_t m_messages = 0;
+        std::unordered_map<std::string, PostingList> m_terms;
+    };
+
+    // Общее с потоком индекса состояние
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    std::vector<PendingMessage> m_pending;
+    std::deque<Query> m_queries;
+    bool m_isStopped = false;
+
+    // Только поток индекса
+    std::unordered_map<std::string, UserIndex> m_users;
+    uint64_t m_indexedId = 0;
+    std::vector<std::string> m_terms;
+    std::thread m_thread;
+
+public:
+    SearchIndex() = default;
+
+    ~SearchIndex() {
+        stop();
+    }
+
+    SearchIndex(const SearchIndex&) = delete;
+    SearchIndex& operator=(const SearchIndex&) = delete;
+
+    // Запуск потока; история до lastMessageId включительно индексируется из historyDir в фоне
+    void start(const std::string& historyDir, uint64_t lastMessageId) {
+        m_thread = std::thread([this, historyDir, lastMessageId] {
+            rebuild(historyDir, lastMessageId);
+            run();
+        });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_isStopped = true;
+        }
+        m_wakeup.notify_one();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    // Вызывается из потока маршрутизации для каждого сохранённого сообщения
+    void add(uint64_t messageId, const std::string& senderName, const std::string& receiverName, const std::string& messageText) {
+        bool isBatchReady;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending.push_back(PendingMessage{messageId, senderName, receiverName, messageText});
+            isBatchReady = m_pending.size() == kBatchSize;
+        }
+        if (isBatchReady) {
+            m_wakeup.notify_one();
+        }
+    }
+
+    // Все слова запроса должны встретиться в сообщении; callback вызывается из потока индекса
+    void search(const std::string& userName, const std::string& text, size_t maxHits, SearchCallback callback) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queries.push_back(Query{userName, text, maxHits, std::move(callback)});
+        }
+        m_wakeup.notify_one();
+    }
+
+    // Слова в нижнем регистре: латиница и кириллица; прочие байты UTF-8 сохраняются как есть
+    static void tokenize(std::string_view text, std::vector<std::string>& terms) {
+        terms.clear();
+        std::string term;
+        auto flush = [&terms, &term] {
+            if (!term.empty() && term.size() <= kMaxTermSize) {
+                terms.push_back(term);
+            }
+            term.clear();
+        };
+
+        for (size_t i = 0; i < text.size(); i++) {
+            unsigned char c = text[i];
+            if (c < 0x80) {
+                if (std::isalnum(c)) {
+                    term.push_back(char(std::tolower(c)));
+                } else {
+                    flush();
+                }
+                continue;
+            }
+
+            // Заглавные А-Я (D0 90..AF) и Ё (D0 81) в строчные
+            unsigned char next = i + 1 < text.size() ? text[i + 1] : 0;
+            if (c == 0xD0 && next >= 0x90 && next <= 0x9F) {
+                term.push_back(char(0xD0));
+                term.push_back(char(next + 0x20));
+                i++;
+            } else if (c == 0xD0 && next >= 0xA0 && next <= 0xAF) {
+                term.push_back(char(0xD1));
+                term.push_back(char(next - 0x20));
+                i++;
+            } else if (c == 0xD0 && next == 0x81) {
+                term.push_back(char(0xD1));
+                term.push_back(char(0x91));
+                i++;
+            } else {
+                term.push_back(char(c));
+            }
+        }
+        flush();
+    }
+
+private:
+    void rebuild(const std::string& historyDir, uint64_t lastMessageId) {
+        if (lastMessageId == 0) {
+            return;
+        }
+
+        auto startedAt = std::chrono::steady_clock::now();
+        size_t count = 0;
+        bool isStopped = false;
+        HistoryStore::scan(historyDir, lastMessageId, [this, &count, &isStopped](const HistoryView& view) {
+            indexMessage(view.m_messageId, view.m_senderName, view.m_receiverName, view.m_messageText);
+            if (++count % kRebuildSlice == 0) {
+                isStopped = !serveQueries();
+            }
+            return !isStopped;
+        });
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startedAt);
+        LOG("SearchIndex: indexed " << count << " messages in " << elapsed.count() << "ms");
+    }
+
+    // false - индекс остановлен
+    bool serveQueries() {
+        std::deque<Query> queries;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_isStopped) {
+                return false;
+            }
+            queries.swap(m_queries);
+        }
+        for (Query& query : queries) {
+            query.m_callback(execute(query));
+        }
+        return true;
+    }
+
+    void run() {
+        std::vector<PendingMessage> batch;
+        std::deque<Query> queries;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wakeup.wait_for(lock, kBatchDelay, [this] {
+                    return m_isStopped || !m_queries.empty() || m_pending.size() >= kBatchSize;
+                });
+                if (m_isStopped) {
+                    return;
+                }
+                batch.swap(m_pending);
+                queries.swap(m_queries);
+            }
+
+            // Сначала пачка: запрос должен видеть уже отправленные сообщения
+            for (const PendingMessage& message : batch) {
+                indexMessage(message.m_messageId, message.m_senderName, message.m_receiverName, message.m_messageText);
+            }
+            batch.clear();
+
+            for (Query& query : queries) {
+                query.m_callback(execute(query));
+            }
+            queries.clear();
+        }
+    }
+
+    void indexMessage(uint64_t messageId, std::string_view senderName, std::string_view receiverName, std::string_view messageText) {
+        if (messageId <= m_indexedId) {
+            return; // Уже проиндексировано при перестроении
+        }
+        m_indexedId = messageId;
+
+        tokenize(messageText, m_terms);
+        std::sort(m_terms.begin(), m_terms.end());
+
+        auto addTo = [this, messageId](UserIndex& user) {
+            user.m_messages++;
+            for (size_t i = 0; i < m_terms.size();) {
+                size_t j = i;
+                while (j < m_terms.size() && m_terms[j] == m_terms[i]) {
+                    j++;
+                }
+                user.m_terms[m_terms[i]].add(messageId, uint32_t(j - i));
+                i = j;
+            }
+        };
+        addTo(m_users[std::string(senderName)]);
+        if (receiverName != senderName) {
+            addTo(m_users[std::string(receiverName)]);
+        }
+    }
+
+    // Пересечение списков по id и ранжирование BM25 (длина сообщения не учитывается), при равенстве - новее выше
+    std::vector<Hit> execute(const Query& query) {
+        std::vector<Hit> hits;
+        auto user = m_users.find(query.m_userName);
+        std::vector<std::string> terms;
+        tokenize(query.m_text, terms);
+        std::sort(terms.begin(), terms.end());
+        terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+        if (user == m_users.end() || terms.empty() || terms.size() > kMaxQueryTerms || query.m_maxHits == 0) {
+            return hits;
+        }
+
+        std::vector<const PostingList*> lists;
+        for (const std::string& term : terms) {
+            auto it = user->second.m_terms.find(term);
+            if (it == user->second.m_terms.end()) {
+                return hits;
+            }
+            lists.push_back(&it->second);
+        }
+        std::sort(lists.begin(), lists.end(), [](const PostingList* a, const PostingList* b) { return a->m_count < b->m_count; });
+
+        double messages = double(user->second.m_messages);
+        auto termScore = [messages](const PostingList& list, uint32_t frequency) {
+            constexpr double k1 = 1.2;
+            double idf = std::log(1.0 + (messages - list.m_count + 0.5) / (list.m_count + 0.5));
+            return idf * frequency * (k1 + 1) / (frequency + k1);
+        };
+
+        // Кандидаты - самый короткий список, остальные проходятся вперёд синхронно с ним
+        PostingReader first(*lists[0]);
+        std::vector<PostingReader> others;
+        for (size_t i = 1; i < lists.size(); i++) {
+            others.emplace_back(*lists[i]);
+            others.back().next();
+        }
+
+        while (first.next()) {
+            double score = termScore(*lists[0], first.frequency());
+            bool isMatch = true;
+            for (size_t i = 0; i < others.size() && isMatch; i++) {
+                PostingReader& reader = others[i];
+                bool hasMore = true;
+                while (reader.id() < first.id() && (hasMore = reader.next())) {
+                }
+                if (!hasMore) {
+                    return rank(hits, query.m_maxHits); // Один из списков кончился - совпадений больше нет
+                }
+                isMatch = reader.id() == first.id();
+                if (isMatch) {
+                    score += termScore(*lists[i + 1], reader.frequency());
+                }
+            }
+            if (isMatch) {
+                hits.push_back(Hit{first.id(), score});
+            }
+        }
+        return rank(hits, query.m_maxHits);
+    }
+
+    static std::vector<Hit> rank(std::vector<Hit>& hits, size_t maxHits) {
+        auto isBetter = [](const Hit& a, const Hit& b) {
+            return a.m_score != b.m_score ? a.m_score > b.m_score : a.m_messageId > b.m_messageId;
+        };
+        size_t count = std::min(maxHits, hits.size());
+        std::partial_sort(hits.begin(), hits.begin() + count, hits.end(), isBetter);
+        hits.resize(count);
+        return std::move(hits);
+    }
+};
@@ -0,0 +1,233 @@
+#pragma once
+#include "ChatClientPackets.h"
+#include "Logs.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Снимок состояния присутствия сервера для тёплого перезапуска: реестр пользователей с id
+// и токенами возобновления, версия присутствия и журнал изменений.
+//
+// Формат: заголовок, таблица пользователей и таблица изменений из записей фиксированного
+// размера, затем блок имён. Снимок собирается в буфер в потоке io_context (только копирование),
+// а пишется на диск в другом потоке: временный файл, fsync, rename. При старте файл
+// отображается в память и читается без разбора потока.
+class ServerSnapshot {
+public:
+    struct Header {
+        char m_magic[8];
+        uint64_t m_presenceVersion;
+        uint64_t m_writtenAtMs;     // Системное время записи
+        uint32_t m_userCount;
+        uint32_t m_changeCount;
+        uint32_t m_isClean;         // 1 - записан при остановке, после него изменений не было
+        uint32_t m_reserved;
+        uint64_t m_namesSize;
+    };
+
+    struct UserEntry {
+        uint32_t m_userId;
+        uint16_t m_status;
+        uint16_t m_nameSize;
+        uint64_t m_resumeToken;
+        uint64_t m_introducedVersion;
+        uint64_t m_lastMessageId;   // Наибольший принятый номер сообщения (MessageIdWindow)
+        uint32_t m_nameOffset;
+        uint32_t m_homeNode;        // Узел кластера, к которому подключён пользователь (0 - этот)
+    };
+
+    struct ChangeEntry {
+        uint64_t m_version;
+        uint32_t m_userId;
+        uint16_t m_status;
+        uint16_t m_nameSize;        // 0 - изменение без представления имени
+        uint32_t m_nameOffset;
+        uint32_t m_reserved;
+    };
+
+    static_assert(sizeof(Header) == 48, "snapshot layout");
+    static_assert(sizeof(UserEntry) == 40, "snapshot layout");
+    static_assert(sizeof(ChangeEntry) == 24, "snapshot layout");
+
+private:
+    static constexpr char kMagic[8] = {'U', 'C', 'S', 'N', 'A', 'P', '0', '3'};
+
+    Header m_header{};
+    std::vector<UserEntry> m_users;
+    std::vector<ChangeEntry> m_changes;
+    std::string m_names;
+
+    // Прочитанный файл
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+
+public:
+    ServerSnapshot() = default;
+    ServerSnapshot(const ServerSnapshot&) = delete;
+    ServerSnapshot& operator=(const ServerSnapshot&) = delete;
+
+    ~ServerSnapshot() {
+        if (m_data) {
+            munmap(const_cast<uint8_t*>(m_data), m_size);
+        }
+    }
+
+    // Сборка снимка
+
+    void setPresenceVersion(uint64_t version, bool isClean) {
+        m_header.m_presenceVersion = version;
+        m_header.m_isClean = isClean ? 1 : 0;
+    }
+
+    void reserve(size_t userCount, size_t changeCount) {
+        m_users.reserve(userCount);
+        m_changes.reserve(changeCount);
+        m_names.reserve(userCount * 16);
+    }
+
+    void addUser(uint32_t userId, const std::string& name, user_chat::ClientStatus status, uint64_t resumeToken, uint64_t introducedVersion,
+                 uint64_t lastMessageId, uint32_t homeNode) {
+        m_users.push_back(UserEntry{userId, uint16_t(status), uint16_t(name.size()), resumeToken, introducedVersion, lastMessageId, addName(name),
+                                    homeNode});
+    }
+
+    void addChange(uint64_t version, uint32_t userId, user_chat::ClientStatus status, const std::string& introducedName) {
+        m_changes.push_back(ChangeEntry{version, userId, uint16_t(status), uint16_t(introducedName.size()), addName(introducedName), 0});
+    }
+
+    // Запись во временный файл и атомарная замена; вызывается вне потока io_context
+    bool write(const std::string& path) {
+        std::memcpy(m_header.m_magic, kMagic, sizeof(kMagic));
+        m_header.m_writtenAtMs = uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+        m_header.m_userCount = uint32_t(m_users.size());
+        m_header.m_changeCount = uint32_t(m_changes.size());
+        m_header.m_namesSize = m_names.size();
+
+        // В снимке токены возобновления - файл доступен только владельцу
+        std::string tmpPath = path + ".tmp";
+        int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            LOG_ERR("ServerSnapshot: cannot write " << tmpPath);
+            return false;
+        }
+        bool isOk = writeAll(fd, &m_header, sizeof(m_header)) &&
+                    writeAll(fd, m_users.data(), m_users.size() * sizeof(UserEntry)) &&
+                    writeAll(fd, m_changes.data(), m_changes.size() * sizeof(ChangeEntry)) &&
+                    writeAll(fd, m_names.data(), m_names.size()) &&
+                    ::fsync(fd) == 0;
+        isOk = ::close(fd) == 0 && isOk;
+
+        std::error_code ec;
+        if (isOk) {
+            std::filesystem::rename(tmpPath, path, ec);
+        }
+        if (!isOk || ec) {
+            LOG_ERR("ServerSnapshot: write failed");
+            return false;
+        }
+        return true;
+    }
+
+    // Чтение снимка
+
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header)) {
+            ::close(fd);
+            return false;
+        }
+        void* data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+        m_data = static_cast<const uint8_t*>(data);
+        m_size = size_t(st.st_size);
+
+        std::memcpy(&m_header, m_data, sizeof(m_header));
+        size_t expectedSize = sizeof(Header) + size_t(m_header.m_userCount) * sizeof(UserEntry) +
+                              size_t(m_header.m_changeCount) * sizeof(ChangeEntry) + m_header.m_namesSize;
+        if (std::memcmp(m_header.m_magic, kMagic, sizeof(kMagic)) != 0 || expectedSize != m_size) {
+            LOG_ERR("ServerSnapshot: broken " << path);
+            return false;
+        }
+        return true;
+    }
+
+    const Header& header() const { return m_header; }
+
+    // func(const UserEntry&, std::string_view name); false - в снимке есть записи вне блока имён
+    template<class FuncT>
+    bool forEachUser(FuncT&& func) const {
+        const uint8_t* table = m_data + sizeof(Header);
+        for (uint32_t i = 0; i < m_header.m_userCount; i++) {
+            UserEntry entry;
+            std::memcpy(&entry, table + i * sizeof(UserEntry), sizeof(entry));
+            std::string_view name;
+            if (!readName(entry.m_nameOffset, entry.m_nameSize, name) || name.empty()) {
+                return false;
+            }
+            func(entry, name);
+        }
+        return true;
+    }
+
+    // func(const ChangeEntry&, std::string_view introducedName) по возрастанию версий
+    template<class FuncT>
+    bool forEachChange(FuncT&& func) const {
+        const uint8_t* table = m_data + sizeof(Header) + size_t(m_header.m_userCount) * sizeof(UserEntry);
+        for (uint32_t i = 0; i < m_header.m_changeCount; i++) {
+            ChangeEntry entry;
+            std::memcpy(&entry, table + i * sizeof(ChangeEntry), sizeof(entry));
+            std::string_view name;
+            if (!readName(entry.m_nameOffset, entry.m_nameSize, name)) {
+                return false;
+            }
+            func(entry, name);
+        }
+        return true;
+    }
+
+private:
+    uint32_t addName(const std::string& name) {
+        uint32_t offset = uint32_t(m_names.size());
+        m_names += name;
+        return offset;
+    }
+
+    bool readName(uint32_t offset, uint16_t size, std::string_view& name) const {
+        if (uint64_t(offset) + size > m_header.m_namesSize) {
+            return false;
+        }
+        const char* names = reinterpret_cast<const char*>(m_data + m_size - m_header.m_namesSize);
+        name = std::string_view(names + offset, size);
+        return true;
+    }
+
+    static bool writeAll(int fd, const void* data, size_t size) {
+        const char* ptr = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t written = ::write(fd, ptr, size);
+            if (written <= 0) {
+                return false;
+            }
+            ptr += written;
+            size -= size_t(written);
+        }
+        return true;
+    }
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+
+// Очередь без блокировок на одного писателя и одного читателя (например, сетевой поток -> GUI).
+// Кольцевой буфер фиксированного размера (степень двойки); при заполнении tryPush возвращает false.
+template<class T>
+class SpscQueue
+{
+    // Счётчики писателя и читателя в разных кэш-линиях, чтобы потоки не мешали друг другу
+    static constexpr size_t kCacheLine = 64;
+
+    struct Slot
+    {
+        alignas( T ) unsigned char m_storage[sizeof( T )];
+
+        T* value() { return std::launder( reinterpret_cast<T*>( m_storage ) ); }
+    };
+
+    const size_t                m_mask;
+    std::unique_ptr<Slot[]>     m_slots;
+
+    alignas( kCacheLine ) std::atomic<size_t> m_head{ 0 };  // следующий для чтения
+    size_t                      m_cachedTail = 0;           // копия m_tail у читателя
+    alignas( kCacheLine ) std::atomic<size_t> m_tail{ 0 };  // следующий для записи
+    size_t                      m_cachedHead = 0;           // копия m_head у писателя
+
+    static size_t roundUp( size_t value )
+    {
+        size_t result = 2;
+        while ( result < value )
+        {
+            result <<= 1;
+        }
+        return result;
+    }
+
+public:
+    explicit SpscQueue( size_t capacity ) : m_mask( roundUp( capacity ) - 1 ), m_slots( new Slot[m_mask + 1] ) {}
+
+    ~SpscQueue()
+    {
+        while ( tryPop() )
+        {
+        }
+    }
+
+    SpscQueue( const SpscQueue& ) = delete;
+    SpscQueue& operator=( const SpscQueue& ) = delete;
+
+    size_t capacity() const { return m_mask + 1; }
+
+    // Только писатель
+    template<class... Args>
+    bool tryPush( Args&&... args )
+    {
+        size_t tail = m_tail.load( std::memory_order_relaxed );
+        if ( tail - m_cachedHead > m_mask )
+        {
+            m_cachedHead = m_head.load( std::memory_order_acquire );
+            if ( tail - m_cachedHead > m_mask )
+            {
+                return false;
+            }
+        }
+        new ( m_slots[tail & m_mask].m_storage ) T( std::forward<Args>( args )... );
+        m_tail.store( tail + 1, std::memory_order_release );
+        return true;
+    }
+
+    // Только читатель
+    std::optional<T> tryPop()
+    {
+        size_t head = m_head.load( std::memory_order_relaxed );
+        if ( head == m_cachedTail )
+        {
+            m_cachedTail = m_tail.load( std::memory_order_acquire );
+            if ( head == m_cachedTail )
+            {
+                return std::nullopt;
+            }
+        }
+        T* value = m_slots[head & m_mask].value();
+        std::optional<T> result( std::move( *value ) );
+        value->~T();
+        m_head.store( head + 1, std::memory_order_release );
+        return result;
+    }
+
+    // Приблизительно (для статистики)
+    size_t sizeApprox() const
+    {
+        return m_tail.load( std::memory_order_acquire ) - m_head.load( std::memory_order_acquire );
+    }
+};
@@ -1,60 +1,247 @@
 #pragma once
 #include "ChatClientPackets.h"
 #include "Logs.h"
+#include "TcpTransport.h"
+#include "TlsStream.h"
 #include <boost/asio.hpp>
 #include <iostream>
 #include <memory>
+#include <random>
 #include <vector>
 
 using boost::asio::ip::tcp;
 
+// Переподключение: экспоненциальная задержка со случайным разбросом ("full jitter"),
+// чтобы после перезапуска сервера клиенты не приходили одной волной
+struct ReconnectPolicy
+{
+    bool                        m_isEnabled = false;
+    std::chrono::milliseconds   m_initialDelay{ 100 };
+    std::chrono::milliseconds   m_maxDelay{ 30000 };
+    double                      m_multiplier = 2.0;
+};
+
 class IAppliedTcpClient
 {
 public:
     virtual ~IAppliedTcpClient() = default;
     virtual void onConnected(const boost::system::error_code& ec) = 0;
-    virtual void onPacketReceived(uint8_t* buffer, size_t bufferSize) = 0;
+    virtual void onPacketReceived(const uint8_t* buffer, size_t bufferSize) = 0;
+    virtual void onDisconnected() {} // Соединение потеряно после успешного onConnected()
 
 };
 
 class TcpClient : public std::enable_shared_from_this<TcpClient>, public IAppliedTcpClient
 {
-    boost::asio::io_context m_context;
+    std::unique_ptr<boost::asio::io_context> m_ownContext;
+    boost::asio::io_context& m_context;
     tcp::resolver m_resolver;
-    tcp::socket m_socket;
+    StreamSocket m_socket;
+    std::string m_host;
+    std::string m_port;
+    std::string m_localPath; // Непусто - подключение к Unix-сокету сервера вместо m_host:m_port
+    SocketStream m_stream;
+    PacketSender<SocketStream> m_sender;
+    std::shared_ptr<TlsContext> m_tlsContext;
+    TlsSession m_tlsSession; // Билет последнего соединения: переподключение без полного рукопожатия
+    ReconnectPolicy m_reconnectPolicy;
+    boost::asio::steady_timer m_reconnectTimer;
+    uint32_t m_reconnectAttempt = 0;
+    uint64_t m_reconnectCount = 0;
+    bool m_isReconnectPending = false;
+    bool m_isStopped = false;
     uint16_t m_dataLength;
     std::vector<uint8_t> m_packetData;
 
 public:
     TcpClient()
-        : m_context(), m_resolver(m_context), m_socket(m_context), m_dataLength(0)
+        : m_ownContext(std::make_unique<boost::asio::io_context>()), m_context(*m_ownContext),
+          m_resolver(m_context), m_socket(m_context), m_stream(m_socket), m_sender(m_stream), m_reconnectTimer(m_context), m_dataLength(0)
+    {
+    }
+
+    // Клиент на общем io_context (например, много клиентов в одном потоке)
+    explicit TcpClient(boost::asio::io_context& context)
+        : m_context(context), m_resolver(m_context), m_socket(m_context), m_stream(m_socket), m_sender(m_stream), m_reconnectTimer(m_context), m_dataLength(0)
     {
     }
 
+    boost::asio::io_context& context() { return m_context; }
+
     void run(const std::string& host, const std::string& port)
     {
-        tcp::resolver::query query(host, port);
+        connect(host, port);
+        m_context.run();
+    }
+
+    // Асинхронное подключение без запуска io_context
+    void connect(const std::string& host, const std::string& port)
+    {
+        m_host = host;
+        m_port = port;
+        m_localPath.clear();
+        reconnect();
+    }
+
+    // Подключение к серверу на той же машине через Unix-сокет (TcpServer::listenLocal), без TLS
+    void connectLocal(const std::string& path)
+    {
+        m_localPath = path;
+        reconnect();
+    }
+
+    // Повторное подключение к последнему адресу
+    void reconnect()
+    {
+        m_isStopped = false;
+        m_isReconnectPending = false;
+        m_sender.clear();
+
+        if (!m_localPath.empty())
+        {
+            boost::system::error_code ec;
+            m_socket.close(ec);
+            m_socket.async_connect(boost::asio::local::stream_protocol::endpoint(m_localPath),
+                                   [self = shared_from_this()](const boost::system::error_code& ec) {
+                                       self->onConnect(ec);
+                                   });
+            return;
+        }
+
+        tcp::resolver::query query(m_host, m_port);
         m_resolver.async_resolve(query,
                                  [self = shared_from_this()](const boost::system::error_code& ec, tcp::resolver::iterator endpoint_iterator) {
                                      self->onResolve(ec, endpoint_iterator);
                                  });
+    }
 
-        m_context.run();
+    // Закрыть соединение без автоматического переподключения
+    bool isStopped() const { return m_isStopped; }
+
+    void close()
+    {
+        m_isStopped = true;
+        m_resolver.cancel();
+        m_reconnectTimer.cancel();
+        closeSocket();
+    }
+
+    void setReconnectPolicy(const ReconnectPolicy& policy) { m_reconnectPolicy = policy; }
+    uint64_t reconnectCount() const { return m_reconnectCount; }
+
+    // TLS для следующих подключений по TCP (nullptr - без TLS); имя сервера проверяется по host из connect()
+    void setTls(std::shared_ptr<TlsContext> context)
+    {
+        m_tlsContext = std::move(context);
+        m_tlsSession.reset();
+    }
+
+    // Текущее соединение возобновило сессию TLS по билету
+    bool isTlsResumed() const { return m_stream.tls() && m_stream.tls()->isResumed(); }
+
+    // Забыть билет: следующее подключение - с полным рукопожатием
+    void resetTlsSession() { m_tlsSession.reset(); }
+
+    void setTransportSettings(const TransportSettings& settings)
+    {
+        m_sender.setSettings(settings);
+        if (m_socket.is_open())
+        {
+            applySocketOptions();
+        }
+    }
+
+    void setTransportMode(TransportMode mode)
+    {
+        TransportSettings settings = m_sender.settings();
+        settings.m_mode = mode;
+        setTransportSettings(settings);
+    }
+
+    const TransportSettings& transportSettings() const { return m_sender.settings(); }
+    const SenderStats& senderStats() const { return m_sender.stats(); }
+
+    // Отправить накопленные пакеты (режим throughput)
+    void flush()
+    {
+        m_sender.flush(shared_from_this());
     }
 
 protected:
+    void closeSocket()
+    {
+        boost::system::error_code ec;
+        m_socket.close(ec);
+        m_sender.clear();
+    }
+
+    // Переподключение по политике, но не раньше minDelay (например, по подсказке сервера)
+    void scheduleReconnect(std::chrono::milliseconds minDelay = std::chrono::milliseconds(0))
+    {
+        if (!m_reconnectPolicy.m_isEnabled || m_isStopped || m_isReconnectPending)
+        {
+            return;
+        }
+
+        m_isReconnectPending = true;
+        m_reconnectTimer.expires_after(std::max(minDelay, nextReconnectDelay()) + jitter(minDelay));
+        m_reconnectTimer.async_wait([self = shared_from_this()](const boost::system::error_code& ec)
+                                    {
+                                        if (!ec && self->m_isReconnectPending)
+                                        {
+                                            self->m_reconnectCount++;
+                                            self->reconnect();
+                                        }
+                                    });
+    }
+
+    // Случайная задержка в [0, min(maxDelay, initialDelay * multiplier^attempt)]
+    std::chrono::milliseconds nextReconnectDelay()
+    {
+        double cap = double(m_reconnectPolicy.m_initialDelay.count());
+        for (uint32_t i = 0; i < m_reconnectAttempt && cap < m_reconnectPolicy.m_maxDelay.count(); i++)
+        {
+            cap *= m_reconnectPolicy.m_multiplier;
+        }
+        m_reconnectAttempt++;
+        return jitter(std::chrono::milliseconds(int64_t(std::min(cap, double(m_reconnectPolicy.m_maxDelay.count())))));
+    }
+
+    static std::chrono::milliseconds jitter(std::chrono::milliseconds range)
+    {
+        thread_local std::mt19937_64 generator(std::random_device{}());
+        if (range.count() <= 0)
+        {
+            return std::chrono::milliseconds(0);
+        }
+        return std::chrono::milliseconds(std::uniform_int_distribution<int64_t>(0, range.count())(generator));
+    }
+
+    void handleDisconnect()
+    {
+        onDisconnected();
+        scheduleReconnect();
+    }
+
     void onResolve(const boost::system::error_code& ec, tcp::resolver::iterator endpoint_iterator)
     {
         if (!ec)
         {
-            boost::asio::async_connect(m_socket, endpoint_iterator,
-                                       [self = shared_from_this()](const boost::system::error_code& ec, tcp::resolver::iterator) {
+            std::vector<StreamSocket::endpoint_type> endpoints;
+            for (; endpoint_iterator != tcp::resolver::iterator(); ++endpoint_iterator)
+            {
+                endpoints.emplace_back(endpoint_iterator->endpoint());
+            }
+            boost::asio::async_connect(m_socket, endpoints,
+                                       [self = shared_from_this()](const boost::system::error_code& ec, const StreamSocket::endpoint_type&) {
                                            self->onConnect(ec);
                                        });
         }
         else
         {
             LOG_ERR("Error resolving: " << ec.message());
+            onConnected(ec);
+            scheduleReconnect();
         }
     }
 
@@ -62,19 +249,62 @@ protected:
     {
         if (!ec)
         {
-            LOG("Successfully connected to the server!");
+            LOG_DBG("Successfully connected to the server!");
+            m_reconnectAttempt = 0;
+            applySocketOptions();
+            m_stream.setTls(nullptr);
+            if (m_tlsContext && m_localPath.empty())
+            {
+                startTls();
+                return;
+            }
             onConnected(ec);
             readPacketHeader();
         }
         else
         {
             LOG_ERR("Error connecting: " << ec.message());
+            onConnected(ec);
+            scheduleReconnect();
+        }
+    }
+
+    // Клиентское рукопожатие дешёвое - выполняется в потоке io_context
+    void startTls()
+    {
+        m_stream.setTls(std::make_shared<TlsStream>(m_socket, *m_tlsContext, &m_tlsSession, m_host));
+        m_stream.tls()->handshake(nullptr, [self = shared_from_this()](const boost::system::error_code& ec)
+                                  {
+                                      if (ec)
+                                      {
+                                          LOG_ERR("TLS handshake error: " << ec.message());
+                                          self->closeSocket();
+                                          self->onConnected(ec);
+                                          self->scheduleReconnect();
+                                          return;
+                                      }
+                                      self->onConnected(ec);
+                                      self->readPacketHeader();
+                                  });
+    }
+
+    void applySocketOptions()
+    {
+        if (!isTcpSocket(m_socket))
+        {
+            return;
+        }
+        boost::system::error_code ec;
+        m_socket.set_option(tcp::no_delay(m_sender.settings().noDelay()), ec);
+        if (ec)
+        {
+            LOG_ERR("TcpClient set_option(no_delay) error: " << ec.message());
         }
     }
 
     void readPacketHeader()
     {
-        boost::asio::async_read(m_socket, boost::asio::buffer(&m_dataLength, sizeof(m_dataLength)),
+        boost::asio::async_read(m_stream, boost::asio::buffer(&m_dataLength, sizeof(m_dataLength)),
                                 [self = shared_from_this()](const boost::system::error_code& error, size_t bytes_transferred) {
                                     self->onReadPacketHeader(error, bytes_transferred);
                                 });
@@ -82,27 +312,35 @@ protected:
 
     void onReadPacketHeader(const boost::system::error_code& error, size_t bytes_transferred)
     {
+        TRACE_SPAN("read_header");
         if (error)
         {
-            LOG_ERR("TcpClient read error: " << error.message());
+            if (!isDisconnectError(error))
+            {
+                LOG_ERR("TcpClient read error: " << error.message());
+            }
+            handleDisconnect();
             return;
         }
         if (bytes_transferred != sizeof(m_dataLength))
         {
             LOG_ERR("TcpClient read error (m_dataLength): " << bytes_transferred << " vs " << sizeof(m_dataLength));
+            handleDisconnect();
             return;
         }
 
-        LOG("TcpClient received: " << m_dataLength);
+        LOG_DBG("TcpClient received: " << m_dataLength);
 
         if (m_dataLength == 0 || m_dataLength > 16 * 1024)
         {
             LOG_ERR("TcpClient invalid dataLength: " << m_dataLength);
+            closeSocket();
+            handleDisconnect();
             return;
         }
 
         m_packetData.resize(m_dataLength);
-        boost::asio::async_read(m_socket, boost::asio::buffer(m_packetData.data(), m_dataLength),
+        boost::asio::async_read(m_stream, boost::asio::buffer(m_packetData.data(), m_dataLength),
                                 [self = shared_from_this()](const boost::system::error_code& error, size_t bytes_transferred) {
                                     self->readPacketData(error, bytes_transferred);
                                 });
@@ -110,33 +348,41 @@ protected:
 
     void readPacketData(const boost::system::error_code& error, size_t bytes_transferred)
     {
+        TRACE_SPAN("read_data");
         if (error)
         {
-            LOG_ERR("TcpClient read error: " << error.message());
+            if (!isDisconnectError(error))
+            {
+                LOG_ERR("TcpClient read error: " << error.message());
+            }
+            handleDisconnect();
             return;
         }
         if (bytes_transferred != m_dataLength)
         {
             LOG_ERR("TcpClient read error (bytes_transferred): " << bytes_transferred << " vs " << m_dataLength);
+            handleDisconnect();
             return;
         }
 
         // Обработка полученных данных
-       // user_chat::processPacket(m_packetData.data(), m_packetData.size());
+        onPacketReceived(m_packetData.data(), m_packetData.size());
 
         // Чтение следующего заголовка пакета
         readPacketHeader();
     }
+
+    // Забирает владение буфером (new[]); в режиме low_latency пакет уходит сразу
     void sendPacket( const uint8_t* message, size_t size )
     {
-        boost::asio::async_write(m_socket, boost::asio::buffer(message,size),
-                                 [message,self = this->shared_from_this()](const boost::system::error_code& ec, std::size_t length)
-                                 {
-                                     delete [] message;
-                                     if (!ec) {
-                                         std::cout << "Sent message: " << length << " bytes\n";
-                                     }
-                                 });
+        TRACE_SPAN("write");
+        m_sender.send(shared_from_this(), message, size);
+    }
+
+    void sendPacket( OutgoingPacket packet )
+    {
+        TRACE_SPAN("write");
+        m_sender.send(shared_from_this(), std::move(packet));
     }
 };
 
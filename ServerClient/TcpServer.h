@@ -1,107 +1,443 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <memory>
 #include <optional>
+#include <type_traits>
 #include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "Logs.h"
+#include "TcpTransport.h"
+#include "TlsStream.h"
+#include "TokenBucket.h"
+#include "Trace.h"
 
 class IAppliedTcpSession {
 public:
-    virtual void onPacketReceived(const std::vector<uint8_t>& packetData) = 0;
+    // data указывает в буфер чтения сессии и действителен только до возврата
+    virtual void onPacketReceived(const uint8_t* data, size_t dataSize) = 0;
+    virtual void onDisconnected() {} // Соединение закрыто (удалённой стороной, по ошибке или через close())
     virtual ~IAppliedTcpSession() = default; // Добавляем виртуальный деструктор
 };
 
+class TcpClientSession;
+
+// Буферы чтения, общие для сессий одного потока io_context (TransportSettings::m_isSlimIdle):
+// сессия берёт буфер, когда сокет готов к чтению, и возвращает, разобрав все пакеты.
+// Буферов в пуле не больше, чем сессий, одновременно занятых разбором, - не больше m_maxFree.
+class ReadBufferPool {
+    std::vector<std::vector<uint8_t>> m_free;
+    size_t m_maxFree;
+
+public:
+    static constexpr size_t kBufferSize = 16 * 1024;
+
+    explicit ReadBufferPool(size_t maxFree = 64) : m_maxFree(maxFree) {}
+
+    size_t freeBuffers() const { return m_free.size(); }
+
+    void acquire(std::vector<uint8_t>& buffer) {
+        if (m_free.empty()) {
+            buffer.resize(kBufferSize);
+            return;
+        }
+        buffer = std::move(m_free.back());
+        m_free.pop_back();
+    }
+
+    // Буфер, выросший под большой пакет, не возвращается в пул, а освобождается
+    void release(std::vector<uint8_t>& buffer) {
+        if (buffer.size() == kBufferSize && m_free.size() < m_maxFree) {
+            m_free.push_back(std::move(buffer));
+        }
+        std::vector<uint8_t>().swap(buffer);
+    }
+};
+
+// Сессии, исчерпавшие бюджет чтения, с уже прочитанными пакетами. Обслуживаются по кругу:
+// один бюджет одной сессии за обработчик, между ними io_context выполняет остальные события -
+// поэтому один болтливый клиент не задерживает тихих. Одна очередь на поток io_context.
+class ReadyQueue {
+    boost::asio::io_context& m_context;
+    std::deque<std::shared_ptr<TcpClientSession>> m_sessions;
+    bool m_isPosted = false;
+
+public:
+    explicit ReadyQueue(boost::asio::io_context& context) : m_context(context) {}
+
+    size_t size() const { return m_sessions.size(); }
+
+    void push(std::shared_ptr<TcpClientSession> session) {
+        m_sessions.push_back(std::move(session));
+        postNext();
+    }
+
+private:
+    void postNext() {
+        if (m_isPosted || m_sessions.empty()) {
+            return;
+        }
+        m_isPosted = true;
+        boost::asio::post(m_context, [this] {
+            m_isPosted = false;
+            std::shared_ptr<TcpClientSession> session = std::move(m_sessions.front());
+            m_sessions.pop_front();
+            runSession(*session);
+            postNext();
+        });
+    }
+
+    static void runSession(TcpClientSession& session);
+};
+
 class TcpClientSession : public std::enable_shared_from_this<TcpClientSession>, public IAppliedTcpSession {
+    // Буфер растёт под пакет, который в него не помещается, и возвращается к этому размеру после него
+    static constexpr size_t kReadBufferSize = ReadBufferPool::kBufferSize;
+
 protected:
-    boost::asio::ip::tcp::socket m_socket;
+    StreamSocket m_socket;
+    SocketStream m_stream; // Сокет или TLS поверх него (TcpServer::setTls)
+    PacketSender<SocketStream> m_sender;
 
-    uint16_t m_dataLength;
-    std::vector<uint8_t> m_packetData;
+    // Принятые байты [m_readStart, m_readEnd): за одно чтение может прийти много пакетов.
+    // Пакет разбирается прямо в буфере, без копии. В режиме m_isSlimIdle буфер пуст, пока сессия ждёт данных
+    std::vector<uint8_t> m_readBuffer;
+    uint32_t m_readStart = 0;
+    uint32_t m_readEnd = 0;
+    ReadyQueue* m_readyQueue = nullptr;
+    ReadBufferPool* m_bufferPool = nullptr;
 
 public:
-    TcpClientSession(boost::asio::ip::tcp::socket&& socket)
-        : m_socket(std::move(socket)) {}
+    TcpClientSession(StreamSocket&& socket)
+        : m_socket(std::move(socket)), m_stream(m_socket), m_sender(m_stream) {}
 
+    // Забирает владение буфером (new[]); в режиме low_latency пакет уходит сразу
     void write(const uint8_t* response, size_t dataSize) {
-        auto self = shared_from_this(); // Сохраняем shared_ptr
-        boost::asio::async_write(m_socket, boost::asio::buffer(response, dataSize),
-                                [self, response](const boost::system::error_code& error, std::size_t sentSize) {
-                                    LOG_ERR("TcpClientSession sentSize: " << sentSize);
-                                    delete[] response; // Освобождаем память, если выделено динамически
-                                    if (error) {
-                                        LOG_ERR("TcpClientSession async_send error: " << error.message());
-                                    }
-                                });
+        TRACE_SPAN("write");
+        m_sender.send(shared_from_this(), response, dataSize);
     }
 
-    void readPacketHeader() {
-        auto self = shared_from_this(); // Сохраняем shared_ptr
+    void write(OutgoingPacket packet) {
+        TRACE_SPAN("write");
+        m_sender.send(shared_from_this(), std::move(packet));
+    }
 
-        boost::asio::async_read(m_socket, boost::asio::buffer(&m_dataLength, sizeof(m_dataLength)),
-                                [self](const boost::system::error_code& error, std::size_t bytesTransferred) {
-                                    self->doReadPacketHeader(error, bytesTransferred);
-                                });
+    // Отправить накопленные пакеты, не дожидаясь порога (режим throughput)
+    void flush() {
+        m_sender.flush(shared_from_this());
     }
 
-    void doReadPacketHeader(const boost::system::error_code& error, std::size_t bytesTransferred) {
-        if (error) {
-            LOG_ERR("TcpClientSession read error: " << error.message());
+    void setTransportSettings(const TransportSettings& settings) {
+        m_sender.setSettings(settings);
+
+        if (!isTcpSocket(m_socket)) {
             return;
         }
-        if (bytesTransferred != sizeof(m_dataLength)) {
-            LOG_ERR("TcpClientSession read error (m_dataLength): " << bytesTransferred << " vs " << sizeof(m_dataLength));
+        boost::system::error_code ec;
+        m_socket.set_option(boost::asio::ip::tcp::no_delay(settings.noDelay()), ec);
+        if (ec) {
+            LOG_ERR("TcpClientSession set_option(no_delay) error: " << ec.message());
+        }
+    }
+
+    void setTransportMode(TransportMode mode) {
+        TransportSettings settings = m_sender.settings();
+        settings.m_mode = mode;
+        setTransportSettings(settings);
+    }
+
+    const TransportSettings& transportSettings() const { return m_sender.settings(); }
+    const SenderStats& senderStats() const { return m_sender.stats(); }
+
+    // Без очереди (nullptr) сессия, исчерпавшая бюджет, продолжает через boost::asio::post
+    void setReadyQueue(ReadyQueue* readyQueue) { m_readyQueue = readyQueue; }
+
+    // Без пула (nullptr) сессия держит свой буфер чтения и в режиме m_isSlimIdle
+    void setReadBufferPool(ReadBufferPool* bufferPool) { m_bufferPool = bufferPool; }
+
+    size_t readBufferCapacity() const { return m_readBuffer.capacity(); }
+
+    // Закрыть соединение; ожидающее чтение завершится с ошибкой и вызовет onDisconnected()
+    void close() {
+        boost::system::error_code ec;
+        m_socket.shutdown(StreamSocket::shutdown_both, ec);
+        m_socket.close(ec);
+        m_sender.clear();
+    }
+
+    void startReading() {
+        if (isSlimIdle() || isDrainSocket()) {
+            // Данные забираются синхронным чтением после готовности сокета - оно не должно блокировать
+            boost::system::error_code ec;
+            m_socket.non_blocking(true, ec);
+        }
+        readSome();
+    }
+
+    // Рукопожатие TLS перед чтением пакетов; шаги выполняет pool (nullptr - поток сессии)
+    void startTls(TlsContext& context, WorkerPool* pool, TlsStats& stats) {
+        m_stream.setTls(std::make_shared<TlsStream>(m_socket, context));
+        auto self = shared_from_this();
+        m_stream.tls()->handshake(pool, [self, &stats](const boost::system::error_code& ec) {
+            if (ec) {
+                LOG_DBG("TcpClientSession TLS handshake failed: " << ec.message());
+                stats.m_failed++;
+                self->close();
+                self->onDisconnected();
+                return;
+            }
+            stats.m_handshakes++;
+            stats.m_resumed += self->m_stream.tls()->isResumed() ? 1 : 0;
+            self->startReading();
+        });
+    }
+
+    // Реализация метода IAppliedTcpSession
+    void onPacketReceived(const uint8_t* data, size_t dataSize) override {
+        // Обработка полученного пакета
+        LOG("Packet received: " << std::string(data, data + dataSize));
+    }
+
+private:
+    friend class ReadyQueue;
+
+    // У TLS-сессии данные могут ждать в OpenSSL, а не в сокете - буфер остаётся за ней
+    bool isSlimIdle() const { return m_bufferPool != nullptr && m_sender.settings().m_isSlimIdle && !m_stream.tls(); }
+    bool isDrainSocket() const { return m_sender.settings().m_isDrainSocket && !m_stream.tls(); }
+
+    void readSome() {
+        if (m_readStart == m_readEnd && isSlimIdle()) {
+            waitReadable();
             return;
         }
+        auto self = shared_from_this();
+        m_stream.async_read_some(prepareReadBuffer(),
+                                 [self](const boost::system::error_code& error, std::size_t bytesTransferred) {
+                                     self->onRead(error, bytesTransferred);
+                                 });
+    }
+
+    // Свободная часть буфера под следующее чтение; неполный пакет переносится в начало
+    boost::asio::mutable_buffer prepareReadBuffer() {
+        if (m_readStart > 0) {
+            std::memmove(m_readBuffer.data(), m_readBuffer.data() + m_readStart, m_readEnd - m_readStart);
+            m_readEnd -= m_readStart;
+            m_readStart = 0;
+        }
+        size_t needed = kReadBufferSize;
+        if (m_readEnd >= sizeof(uint16_t)) {
+            needed = std::max(needed, sizeof(uint16_t) + (size_t(m_readBuffer[0]) | (size_t(m_readBuffer[1]) << 8)));
+        }
+        if (m_readBuffer.size() < needed) {
+            m_readBuffer.resize(needed);
+        } else if (needed == kReadBufferSize && m_readBuffer.size() > kReadBufferSize) {
+            m_readBuffer.resize(kReadBufferSize);
+            m_readBuffer.shrink_to_fit();
+        }
+        return boost::asio::buffer(m_readBuffer.data() + m_readEnd, m_readBuffer.size() - m_readEnd);
+    }
 
-        LOG("Received packet length: " << m_dataLength);
-        m_packetData.resize(m_dataLength);
+    // Всё разобрано: буфер уходит в пул, сокет ждёт данных без буфера (чтение нулевой длины)
+    void waitReadable() {
+        m_readStart = 0;
+        m_readEnd = 0;
+        m_bufferPool->release(m_readBuffer);
 
         auto self = shared_from_this();
-        boost::asio::async_read(m_socket, boost::asio::buffer(m_packetData.data(), m_dataLength),
-                                [self](const boost::system::error_code& error, std::size_t bytesTransferred) {
-                                    self->readPacketData(error, bytesTransferred);
-                                });
+        m_socket.async_wait(StreamSocket::wait_read, [self](const boost::system::error_code& error) {
+            self->onReadable(error);
+        });
     }
 
-    void readPacketData(const boost::system::error_code& error, std::size_t bytesTransferred) {
+    void onReadable(const boost::system::error_code& error) {
         if (error) {
-            LOG_ERR("TcpClientSession read error: " << error.message());
-            return; // Обрабатываем ошибку, но не останавливаем сервер
+            onRead(error, 0);
+            return;
+        }
+        m_bufferPool->acquire(m_readBuffer);
+        boost::system::error_code ec;
+        size_t bytesTransferred = m_socket.read_some(boost::asio::buffer(m_readBuffer), ec);
+        if (ec == boost::asio::error::would_block || ec == boost::asio::error::try_again) {
+            waitReadable();
+            return;
         }
-        if (bytesTransferred != m_dataLength) {
-            LOG_ERR("TcpClientSession read error (bytes_transferred): " << bytesTransferred << " vs " << m_dataLength);
-            return; // Обрабатываем ошибку, но не останавливаем сервер
+        onRead(ec, bytesTransferred);
+    }
+
+    void onRead(const boost::system::error_code& error, std::size_t bytesTransferred) {
+        TRACE_SPAN("read");
+        if (error) {
+            if (isDisconnectError(error)) {
+                LOG_DBG("TcpClientSession disconnected: " << error.message());
+            } else {
+                LOG_ERR("TcpClientSession read error: " << error.message());
+            }
+            onDisconnected();
+            return;
         }
+        m_readEnd += uint32_t(bytesTransferred);
+        processPackets();
+    }
+
+    // Разбор принятых пакетов в пределах бюджета; остаток - после других сессий
+    void processPackets() {
+        const TransportSettings& settings = m_sender.settings();
+        bool isDrain = isDrainSocket();
+        size_t packets = 0;
+        size_t bytes = 0;
+        for (;;) {
+            size_t available = m_readEnd - m_readStart;
+            const uint8_t* frame = m_readBuffer.data() + m_readStart;
+            size_t dataLength = available < sizeof(uint16_t) ? 0 : size_t(frame[0]) | (size_t(frame[1]) << 8);
+            if (available < sizeof(uint16_t) || available < sizeof(uint16_t) + dataLength) {
+                if (!isDrain) {
+                    break;
+                }
+                boost::system::error_code ec;
+                size_t bytesTransferred = m_socket.read_some(prepareReadBuffer(), ec);
+                if (ec == boost::asio::error::would_block || ec == boost::asio::error::try_again) {
+                    break;
+                }
+                if (ec) {
+                    onRead(ec, 0);
+                    return;
+                }
+                m_readEnd += uint32_t(bytesTransferred);
+                continue;
+            }
+            if (!isDrain && (packets >= settings.m_readBudgetPackets || bytes >= settings.m_readBudgetBytes)) {
+                yieldReading();
+                return;
+            }
 
-        onPacketReceived(m_packetData); // Вызываем обработчик пакета
+            LOG_DBG("Received packet length: " << dataLength);
+            m_readStart += uint32_t(sizeof(uint16_t) + dataLength);
+            packets++;
+            bytes += sizeof(uint16_t) + dataLength;
+
+            onPacketReceived(frame + sizeof(uint16_t), dataLength); // Вызываем обработчик пакета
+            if (!m_socket.is_open()) {
+                // Закрыта обработчиком: чтения нет, завершения с ошибкой не будет
+                onDisconnected();
+                return;
+            }
+        }
+        readSome();
+    }
 
-        readPacketHeader(); // Читаем следующий заголовок пакета
+    void yieldReading() {
+        if (m_readyQueue) {
+            m_readyQueue->push(shared_from_this());
+            return;
+        }
+        boost::asio::post(m_socket.get_executor(), [self = shared_from_this()] { self->resumeReading(); });
     }
 
-    // Реализация метода IAppliedTcpSession
-    void onPacketReceived(const std::vector<uint8_t>& packetData) override {
-        // Обработка полученного пакета
-        LOG("Packet received: " << std::string(packetData.begin(), packetData.end()));
+    void resumeReading() {
+        TRACE_SPAN("read_resume");
+        if (!m_socket.is_open()) {
+            onDisconnected();
+            return;
+        }
+        processPackets();
     }
 };
 
+// Размер сессии без буфера чтения - основная память простаивающего соединения (chat_load --scenario idle).
+// Проверяется для 64-битной сборки с Boost 1.74
+static_assert(sizeof(void*) != 8 || sizeof(TcpClientSession) <= 352, "TcpClientSession grew: idle sessions get more expensive");
+
+inline void ReadyQueue::runSession(TcpClientSession& session) {
+    session.resumeReading();
+}
+
 class TcpServer {
     boost::asio::io_context m_context;
     boost::asio::ip::tcp::endpoint m_endpoint;
     std::optional<boost::asio::ip::tcp::acceptor> m_acceptor;
+    TransportSettings m_transportSettings;
+
+    // Ограничение скорости приёма соединений (защита от шторма переподключений)
+    TokenBucketConfig m_acceptLimit;
+    TokenBucket m_acceptBucket;
+    boost::asio::steady_timer m_acceptTimer;
+
+    // Unix-сокет для клиентов на той же машине (listenLocal); ограничение скорости приёма - общее с TCP
+    std::optional<boost::asio::local::stream_protocol::acceptor> m_localAcceptor;
+    boost::asio::steady_timer m_localAcceptTimer;
+    std::string m_localPath;
+
+    ReadyQueue m_readyQueue; // Сессии с непрочитанными пакетами сверх бюджета
+    ReadBufferPool m_bufferPool;
+
+    static constexpr int kHandshakeNiceness = 5; // Рукопожатия не должны отнимать процессор у рассылки сообщений
+
+    std::shared_ptr<TlsContext> m_tlsContext;
+    TlsStats m_tlsStats;
+    std::unique_ptr<WorkerPool> m_handshakePool; // Последним: потоки пула останавливаются первыми
 
 public:
     TcpServer(const std::string& addr, const std::string& port)
         : m_context(),
-        m_acceptor(boost::asio::ip::tcp::acceptor(m_context, boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address(addr), std::stoi(port)))) {
+        m_acceptor(boost::asio::ip::tcp::acceptor(m_context, boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address(addr), std::stoi(port)))),
+        m_acceptTimer(m_context),
+        m_localAcceptTimer(m_context),
+        m_readyQueue(m_context) {
         LOG("TcpServer initialized on " << addr << ":" << port);
     }
 
+    virtual ~TcpServer() {
+        if (!m_localPath.empty()) {
+            ::unlink(m_localPath.c_str());
+        }
+    }
+
+    boost::asio::io_context& context() { return m_context; }
+
+    uint16_t localPort() const { return m_acceptor->local_endpoint().port(); }
+
+    // Принимать соединения и на Unix-сокете path (до run()): те же пакеты и сессии без стека TCP.
+    // TLS на нём не включается - доступ ограничивают права на файл. Сокет от прошлого запуска удаляется
+    void listenLocal(const std::string& path) {
+        removeStaleSocket(path);
+        m_localAcceptor.emplace(m_context, boost::asio::local::stream_protocol::endpoint(path));
+        m_localPath = path;
+        LOG("TcpServer listening on " << path);
+    }
+
+    // Режим передачи для новых сессий; сессия может сменить его сама
+    void setTransportSettings(const TransportSettings& settings) { m_transportSettings = settings; }
+
+    // Не больше perSecond новых соединений в секунду (с запасом burst); 0 - без ограничения.
+    // Непринятые соединения ждут в очереди listen() ядра.
+    void setAcceptRate(double perSecond, uint32_t burst) { m_acceptLimit = TokenBucketConfig::fromRate(perSecond, burst); }
+
+    size_t readyQueueSize() const { return m_readyQueue.size(); }
+
+    // TLS для новых соединений (nullptr - без TLS). Шаги рукопожатия выполняют handshakeThreads потоков,
+    // 0 - поток io_context; сверх maxPending ожидающих шагов новые соединения закрываются
+    void setTls(std::shared_ptr<TlsContext> context, size_t handshakeThreads, size_t maxPending = 1024) {
+        m_handshakePool.reset();
+        m_tlsContext = std::move(context);
+        if (m_tlsContext && handshakeThreads > 0) {
+            m_handshakePool = std::make_unique<WorkerPool>(handshakeThreads, maxPending, kHandshakeNiceness);
+        }
+    }
+
+    const TlsStats& tlsStats() const { return m_tlsStats; }
+
     void run() {
-        asyncAccept();
+        asyncAccept(*m_acceptor, m_acceptTimer);
+        if (m_localAcceptor) {
+            asyncAccept(*m_localAcceptor, m_localAcceptTimer);
+        }
         m_context.run();
     }
 
@@ -110,18 +446,77 @@ public:
         LOG("TcpServer shutdown");
     }
 
+protected:
+    // Создание сессии для принятого соединения; наследники возвращают свой тип сессии
+    virtual std::shared_ptr<TcpClientSession> createSession(StreamSocket&& socket) {
+        return std::make_shared<TcpClientSession>(std::move(socket));
+    }
+
 private:
-    void asyncAccept() {
-        m_acceptor->async_accept([this](boost::system::error_code errorCode, boost::asio::ip::tcp::socket socket) {
+    // Удаляется только сокет, к которому никто не подключён (ECONNREFUSED);
+    // обычный файл или сокет работающего сервера - ошибка конфигурации
+    void removeStaleSocket(const std::string& path) {
+        struct stat info;
+        if (::lstat(path.c_str(), &info) != 0) {
+            if (errno == ENOENT) {
+                return;
+            }
+            throw std::runtime_error("TcpServer: cannot stat " + path + ": " + std::strerror(errno));
+        }
+        if (!S_ISSOCK(info.st_mode)) {
+            throw std::runtime_error("TcpServer: " + path + " exists and is not a socket");
+        }
+        boost::asio::local::stream_protocol::socket probe(m_context);
+        boost::system::error_code ec;
+        probe.connect(boost::asio::local::stream_protocol::endpoint(path), ec);
+        if (ec != boost::asio::error::connection_refused) {
+            throw std::runtime_error("TcpServer: " + path + (ec ? " is not usable: " + ec.message() : " is in use by another server"));
+        }
+        if (::unlink(path.c_str()) != 0) {
+            throw std::runtime_error("TcpServer: cannot remove " + path + ": " + std::strerror(errno));
+        }
+    }
+
+    template<class AcceptorT>
+    void asyncAccept(AcceptorT& acceptor, boost::asio::steady_timer& timer) {
+        uint64_t now = monotonicNowNs();
+        if (!m_acceptBucket.tryConsume(m_acceptLimit, now)) {
+            acceptLater(acceptor, timer, std::chrono::nanoseconds(m_acceptBucket.waitTimeNs(m_acceptLimit, now)));
+            return;
+        }
+
+        acceptor.async_accept([this, &acceptor, &timer](boost::system::error_code errorCode, typename AcceptorT::protocol_type::socket socket) {
             if (errorCode) {
                 LOG_ERR("async_accept error: " << errorCode.message());
+                if (errorCode != boost::asio::error::operation_aborted) {
+                    // Например, закончились дескрипторы - не крутимся в цикле ошибок
+                    acceptLater(acceptor, timer, std::chrono::milliseconds(100));
+                }
+                return;
             } else {
-                LOG("New connection accepted");
-                auto session = std::make_shared<TcpClientSession>(std::move(socket));
-                session->readPacketHeader(); // Начинаем чтение заголовка пакета
+                LOG_DBG("New connection accepted");
+                auto session = createSession(StreamSocket(std::move(socket)));
+                session->setTransportSettings(m_transportSettings);
+                session->setReadyQueue(&m_readyQueue);
+                session->setReadBufferPool(&m_bufferPool);
+                bool isTcp = std::is_same_v<typename AcceptorT::protocol_type, boost::asio::ip::tcp>;
+                if (m_tlsContext && isTcp) {
+                    session->startTls(*m_tlsContext, m_handshakePool.get(), m_tlsStats);
+                } else {
+                    session->startReading();
+                }
             }
-            asyncAccept(); // Продолжаем принимать новые подключения
+            asyncAccept(acceptor, timer); // Продолжаем принимать новые подключения
         });
     }
-};
 
+    template<class AcceptorT>
+    void acceptLater(AcceptorT& acceptor, boost::asio::steady_timer& timer, std::chrono::nanoseconds delay) {
+        timer.expires_after(delay);
+        timer.async_wait([this, &acceptor, &timer](const boost::system::error_code& ec) {
+            if (!ec) {
+                asyncAccept(acceptor, timer);
+            }
+        });
+    }
+};
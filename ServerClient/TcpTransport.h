@@ -0,0 +1,236 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Logs.h"
+#include "Trace.h"
+
+// Режим передачи данных соединения
+enum class TransportMode : uint8_t
+{
+    low_latency,    // TCP_NODELAY, каждый пакет уходит сразу
+    throughput,     // пакеты копятся до порога по размеру или по времени
+};
+
+inline const char* toString( TransportMode mode )
+{
+    return mode == TransportMode::low_latency ? "low_latency" : "throughput";
+}
+
+struct TransportSettings
+{
+    TransportMode               m_mode = TransportMode::low_latency;
+    size_t                      m_flushThreshold = 16 * 1024;   // байт в очереди до принудительной отправки
+    std::chrono::microseconds   m_flushDelay{ 2000 };           // максимальная задержка пакета в режиме throughput
+
+    // Бюджет чтения сессии сервера за один подход: разобрав столько пакетов или байт, сессия
+    // встаёт в конец очереди готовых (ReadyQueue), и поток обслуживает остальных
+    size_t                      m_readBudgetPackets = 32;
+    size_t                      m_readBudgetBytes = 32 * 1024;
+    // Без бюджета: сессия дочитывает сокет до would_block за один подход (кроме TLS).
+    // Базовая линия для сравнения с бюджетом (chat_load --scenario noisy, unbounded)
+    bool                        m_isDrainSocket = false;
+
+    // Простаивающая сессия сервера не держит буфер чтения: ждёт готовности сокета без буфера
+    // и берёт буфер из общего пула потока (ReadBufferPool) только на время разбора.
+    // Куча сервера на простаивающее соединение: ~800 байт против ~17 КБ (chat_load --scenario idle)
+    bool                        m_isSlimIdle = false;
+
+    bool noDelay() const { return m_mode == TransportMode::low_latency; }
+};
+
+// Штатное закрытие соединения (своё или удалённой стороны) - не ошибка
+inline bool isDisconnectError( const boost::system::error_code& ec )
+{
+    return ec == boost::asio::error::eof
+        || ec == boost::asio::error::operation_aborted
+        || ec == boost::asio::error::bad_descriptor
+        || ec == boost::asio::error::connection_reset;
+}
+
+// Сокет соединения: TCP или Unix-сокет для клиентов на той же машине - пакеты и сессии одни и те же
+using StreamSocket = boost::asio::generic::stream_protocol::socket;
+
+// Параметры TCP (TCP_NODELAY) к Unix-сокету не применяются
+inline bool isTcpSocket( const StreamSocket& socket )
+{
+    boost::system::error_code ec;
+    int family = socket.local_endpoint( ec ).protocol().family();
+    return !ec && ( family == AF_INET || family == AF_INET6 );
+}
+
+// Готовый к отправке пакет (длина + тело); один буфер может уйти в несколько соединений
+struct OutgoingPacket
+{
+    std::shared_ptr<const uint8_t[]>    m_data;
+    size_t                              m_size = 0;
+};
+
+// Статистика отправки одного соединения
+struct SenderStats
+{
+    uint64_t m_packets = 0;
+    uint64_t m_bytes = 0;
+    uint64_t m_writes = 0;  // количество async_write (пакетов на одну запись = m_packets / m_writes)
+};
+
+// Очередь исходящих пакетов соединения.
+// Все вызовы должны происходить в потоке io_context этого соединения.
+// owner - shared_ptr владельца сокета, удерживается до завершения операций.
+template<class StreamT>
+class PacketSender
+{
+    StreamT&                                m_stream;
+    std::unique_ptr<boost::asio::steady_timer> m_flushTimer; // Создаётся при первой отложенной отправке (режим throughput)
+    TransportSettings                       m_settings;
+
+    std::vector<OutgoingPacket>             m_queued;
+    size_t                                  m_queuedBytes = 0;
+    std::vector<OutgoingPacket>             m_writing;
+    std::vector<boost::asio::const_buffer>  m_buffers;
+
+    bool                                    m_isWriting = false;
+    bool                                    m_isTimerArmed = false;
+    bool                                    m_isFlushRequested = false;
+
+    SenderStats                             m_stats;
+
+public:
+    PacketSender( StreamT& stream ) : m_stream(stream) {}
+
+    const TransportSettings& settings() const { return m_settings; }
+    void setSettings( const TransportSettings& settings ) { m_settings = settings; }
+
+    const SenderStats& stats() const { return m_stats; }
+
+    // Забирает владение буфером, выделенным через new[]
+    void send( const std::shared_ptr<void>& owner, const uint8_t* data, size_t size )
+    {
+        send( owner, OutgoingPacket{ std::shared_ptr<const uint8_t[]>( data ), size } );
+    }
+
+    void send( const std::shared_ptr<void>& owner, OutgoingPacket packet )
+    {
+        m_queuedBytes += packet.m_size;
+        m_queued.push_back( std::move(packet) );
+
+        if ( m_settings.m_mode == TransportMode::low_latency || m_queuedBytes >= m_settings.m_flushThreshold )
+        {
+            startWrite( owner );
+        }
+        else
+        {
+            armFlushTimer( owner );
+        }
+    }
+
+    // Отправить всё накопленное, не дожидаясь порога
+    void flush( const std::shared_ptr<void>& owner )
+    {
+        m_isFlushRequested = true;
+        startWrite( owner );
+    }
+
+    void clear()
+    {
+        m_queued.clear();
+        m_queuedBytes = 0;
+    }
+
+private:
+    void startWrite( const std::shared_ptr<void>& owner )
+    {
+        TRACE_SPAN( "start_write" );
+        if ( m_isWriting )
+        {
+            // Запись в процессе - всё накопленное уйдёт одним пакетом после её завершения
+            m_isFlushRequested = true;
+            return;
+        }
+        if ( m_queued.empty() )
+        {
+            return;
+        }
+
+        m_writing.swap( m_queued );
+        m_queuedBytes = 0;
+        m_isFlushRequested = false;
+
+        m_buffers.clear();
+        for ( const auto& packet : m_writing )
+        {
+            m_buffers.emplace_back( packet.m_data.get(), packet.m_size );
+        }
+
+        m_isWriting = true;
+        boost::asio::async_write( m_stream, m_buffers,
+                                  [this, owner]( const boost::system::error_code& ec, std::size_t length )
+                                  {
+                                      onWrite( owner, ec, length );
+                                  });
+    }
+
+    void onWrite( const std::shared_ptr<void>& owner, const boost::system::error_code& ec, std::size_t length )
+    {
+        TRACE_SPAN( "write_done" );
+        m_isWriting = false;
+
+        if ( ec )
+        {
+            if ( !isDisconnectError( ec ) )
+            {
+                LOG_ERR( "PacketSender async_write error: " << ec.message() );
+            }
+            m_writing.clear();
+            clear();
+            return;
+        }
+
+        m_stats.m_packets += m_writing.size();
+        m_stats.m_bytes += length;
+        m_stats.m_writes++;
+        m_writing.clear();
+
+        if ( m_queued.empty() )
+        {
+            return;
+        }
+
+        if ( m_settings.m_mode == TransportMode::low_latency || m_isFlushRequested || m_queuedBytes >= m_settings.m_flushThreshold )
+        {
+            startWrite( owner );
+        }
+        else
+        {
+            armFlushTimer( owner );
+        }
+    }
+
+    void armFlushTimer( const std::shared_ptr<void>& owner )
+    {
+        if ( m_isTimerArmed )
+        {
+            return;
+        }
+
+        // Таймер не отменяется: если очередь уже ушла, срабатывание ничего не сделает
+        if ( !m_flushTimer )
+        {
+            m_flushTimer = std::make_unique<boost::asio::steady_timer>( m_stream.get_executor() );
+        }
+        m_isTimerArmed = true;
+        m_flushTimer->expires_after( m_settings.m_flushDelay );
+        m_flushTimer->async_wait( [this, owner]( const boost::system::error_code& ec )
+                                  {
+                                      m_isTimerArmed = false;
+                                      if ( !ec )
+                                      {
+                                          startWrite( owner );
+                                      }
+                                  });
+    }
+};
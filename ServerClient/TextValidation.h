@@ -0,0 +1,348 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define USER_CHAT_X86_SIMD 1
+#endif
+
+// Проверка строк из пакетов: корректный UTF-8 без управляющих символов (кроме \t, \n, \r)
+// и правила для имён пользователей.
+//
+// UTF-8 проверяется векторно по алгоритму Keiser-Lemire ("Validating UTF-8 In Less Than
+// One Instruction Per Byte"): три табличных подстановки pshufb по полубайтам текущего и
+// предыдущего байта находят все ошибки двухбайтовых пар, длинные последовательности
+// проверяются по байтам за 2 и 3 позиции. Реализация (AVX2, SSE4.1 или скалярная)
+// выбирается при первом вызове по возможностям процессора.
+namespace user_chat {
+
+constexpr size_t kMaxUserNameSize = 64; // байт
+
+namespace text_validation {
+
+// Скалярная проверка; allowControls = false - запрещены C0 (кроме \t \n \r) и DEL
+template<bool allowControls>
+inline bool validateScalar(const uint8_t* data, size_t size) {
+    size_t i = 0;
+    while (i < size) {
+        uint8_t byte = data[i];
+        if (byte < 0x80) {
+            if (!allowControls && (byte == 0x7f || (byte < 0x20 && byte != '\t' && byte != '\n' && byte != '\r'))) {
+                return false;
+            }
+            i++;
+            continue;
+        }
+
+        size_t length;
+        uint32_t codePoint;
+        if ((byte & 0xe0) == 0xc0) {
+            length = 2;
+            codePoint = byte & 0x1f;
+        } else if ((byte & 0xf0) == 0xe0) {
+            length = 3;
+            codePoint = byte & 0x0f;
+        } else if ((byte & 0xf8) == 0xf0) {
+            length = 4;
+            codePoint = byte & 0x07;
+        } else {
+            return false;
+        }
+        if (size - i < length) {
+            return false;
+        }
+        for (size_t k = 1; k < length; k++) {
+            if ((data[i + k] & 0xc0) != 0x80) {
+                return false;
+            }
+            codePoint = (codePoint << 6) | (data[i + k] & 0x3f);
+        }
+        // Избыточная запись, суррогаты, больше U+10FFFF
+        static constexpr uint32_t kMinCodePoint[5] = {0, 0, 0x80, 0x800, 0x10000};
+        if (codePoint < kMinCodePoint[length] || (codePoint >= 0xd800 && codePoint <= 0xdfff) || codePoint > 0x10ffff) {
+            return false;
+        }
+        i += length;
+    }
+    return true;
+}
+
+#ifdef USER_CHAT_X86_SIMD
+
+// Таблицы ошибок: бит - класс ошибки, ошибка есть, если бит выставлен во всех трёх подстановках
+enum : uint8_t {
+    kTooShort = 1 << 0,     // 11______ 0_______ или 11______ 11______
+    kTooLong = 1 << 1,      // 0_______ 10______
+    kOverlong3 = 1 << 2,    // 11100000 100_____
+    kTooLarge = 1 << 3,     // 11110100 1001____ и выше
+    kSurrogate = 1 << 4,    // 11101101 101_____
+    kOverlong2 = 1 << 5,    // 1100000_ 10______
+    kTooLarge1000 = 1 << 6, // 11110101 1000____ и выше
+    kOverlong4 = 1 << 6,    // 11110000 1000____
+    kTwoConts = 1 << 7,     // 10______ 10______
+    kCarry = kTooShort | kTooLong | kTwoConts,
+};
+
+alignas(16) constexpr uint8_t kByte1High[16] = {
+    kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,
+    kTwoConts, kTwoConts, kTwoConts, kTwoConts,
+    kTooShort | kOverlong2,
+    kTooShort,
+    kTooShort | kOverlong3 | kSurrogate,
+    kTooShort | kTooLarge | kTooLarge1000 | kOverlong4,
+};
+
+alignas(16) constexpr uint8_t kByte1Low[16] = {
+    kCarry | kOverlong3 | kOverlong2 | kOverlong4,
+    kCarry | kOverlong2,
+    kCarry,
+    kCarry,
+    kCarry | kTooLarge,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000 | kSurrogate,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+};
+
+alignas(16) constexpr uint8_t kByte2High[16] = {
+    kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 | kOverlong4,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooShort, kTooShort, kTooShort, kTooShort,
+};
+
+// Последние байты блока, после которых последовательность не может оборваться
+alignas(16) constexpr uint8_t kIncompleteMax[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf,
+};
+
+template<bool allowControls>
+__attribute__((target("sse4.1"))) inline bool validateSse(const uint8_t* data, size_t size) {
+    const __m128i byte1High = _mm_load_si128(reinterpret_cast<const __m128i*>(kByte1High));
+    const __m128i byte1Low = _mm_load_si128(reinterpret_cast<const __m128i*>(kByte1Low));
+    const __m128i byte2High = _mm_load_si128(reinterpret_cast<const __m128i*>(kByte2High));
+    const __m128i incompleteMax = _mm_loadu_si128(reinterpret_cast<const __m128i*>(kIncompleteMax + 16));
+    const __m128i lowNibble = _mm_set1_epi8(0x0f);
+
+    __m128i error = _mm_setzero_si128();
+    __m128i previous = _mm_setzero_si128();
+    __m128i previousIncomplete = _mm_setzero_si128();
+
+    // Последний неполный блок дополняется пробелами - незаконченная последовательность даст ошибку
+    alignas(16) uint8_t tail[16];
+    for (size_t offset = 0; offset <= size; offset += 16) {
+        __m128i input;
+        if (size - offset >= 16) {
+            input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset));
+        } else {
+            std::memset(tail, ' ', sizeof(tail));
+            std::memcpy(tail, data + offset, size - offset);
+            input = _mm_load_si128(reinterpret_cast<const __m128i*>(tail));
+        }
+
+        if (!allowControls) {
+            // Байты до 0x1f, кроме \t \n \r, и 0x7f
+            __m128i isControl = _mm_cmpeq_epi8(_mm_min_epu8(input, _mm_set1_epi8(0x1f)), input);
+            __m128i isAllowed = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(input, _mm_set1_epi8('\t')),
+                                                          _mm_cmpeq_epi8(input, _mm_set1_epi8('\n'))),
+                                             _mm_cmpeq_epi8(input, _mm_set1_epi8('\r')));
+            error = _mm_or_si128(error, _mm_andnot_si128(isAllowed, isControl));
+            error = _mm_or_si128(error, _mm_cmpeq_epi8(input, _mm_set1_epi8(0x7f)));
+        }
+
+        if (_mm_movemask_epi8(input) == 0) {
+            // Только ASCII: ошибка, если предыдущий блок оборвался посреди последовательности
+            error = _mm_or_si128(error, previousIncomplete);
+        } else {
+            __m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+            __m128i prev2 = _mm_alignr_epi8(input, previous, 14);
+            __m128i prev3 = _mm_alignr_epi8(input, previous, 13);
+
+            __m128i special = _mm_and_si128(
+                _mm_and_si128(_mm_shuffle_epi8(byte1High, _mm_and_si128(_mm_srli_epi16(prev1, 4), lowNibble)),
+                              _mm_shuffle_epi8(byte1Low, _mm_and_si128(prev1, lowNibble))),
+                _mm_shuffle_epi8(byte2High, _mm_and_si128(_mm_srli_epi16(input, 4), lowNibble)));
+
+            // Третий и четвёртый байты должны быть продолжениями (бит 0x80 в special)
+            __m128i isThird = _mm_subs_epu8(prev2, _mm_set1_epi8(char(0xe0 - 0x80)));
+            __m128i isFourth = _mm_subs_epu8(prev3, _mm_set1_epi8(char(0xf0 - 0x80)));
+            __m128i must23 = _mm_and_si128(_mm_or_si128(isThird, isFourth), _mm_set1_epi8(char(0x80)));
+            error = _mm_or_si128(error, _mm_xor_si128(must23, special));
+
+            previousIncomplete = _mm_subs_epu8(input, incompleteMax);
+        }
+        previous = input;
+    }
+    return _mm_testz_si128(error, error);
+}
+
+template<bool allowControls>
+__attribute__((target("avx2"))) inline bool validateAvx2(const uint8_t* data, size_t size) {
+    const __m256i byte1High = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(kByte1High)));
+    const __m256i byte1Low = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(kByte1Low)));
+    const __m256i byte2High = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(kByte2High)));
+    const __m256i incompleteMax = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(kIncompleteMax));
+    const __m256i lowNibble = _mm256_set1_epi8(0x0f);
+
+    __m256i error = _mm256_setzero_si256();
+    __m256i previous = _mm256_setzero_si256();
+    __m256i previousIncomplete = _mm256_setzero_si256();
+
+    alignas(32) uint8_t tail[32];
+    for (size_t offset = 0; offset <= size; offset += 32) {
+        __m256i input;
+        if (size - offset >= 32) {
+            input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + offset));
+        } else {
+            std::memset(tail, ' ', sizeof(tail));
+            std::memcpy(tail, data + offset, size - offset);
+            input = _mm256_load_si256(reinterpret_cast<const __m256i*>(tail));
+        }
+
+        if (!allowControls) {
+            __m256i isControl = _mm256_cmpeq_epi8(_mm256_min_epu8(input, _mm256_set1_epi8(0x1f)), input);
+            __m256i isAllowed = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(input, _mm256_set1_epi8('\t')),
+                                                                _mm256_cmpeq_epi8(input, _mm256_set1_epi8('\n'))),
+                                                _mm256_cmpeq_epi8(input, _mm256_set1_epi8('\r')));
+            error = _mm256_or_si256(error, _mm256_andnot_si256(isAllowed, isControl));
+            error = _mm256_or_si256(error, _mm256_cmpeq_epi8(input, _mm256_set1_epi8(0x7f)));
+        }
+
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, previousIncomplete);
+        } else {
+            // Сдвиг на 1-3 байта через границу 128-битных половин
+            __m256i shifted = _mm256_permute2x128_si256(previous, input, 0x21);
+            __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+            __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+            __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+
+            __m256i special = _mm256_and_si256(
+                _mm256_and_si256(_mm256_shuffle_epi8(byte1High, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), lowNibble)),
+                                 _mm256_shuffle_epi8(byte1Low, _mm256_and_si256(prev1, lowNibble))),
+                _mm256_shuffle_epi8(byte2High, _mm256_and_si256(_mm256_srli_epi16(input, 4), lowNibble)));
+
+            __m256i isThird = _mm256_subs_epu8(prev2, _mm256_set1_epi8(char(0xe0 - 0x80)));
+            __m256i isFourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(char(0xf0 - 0x80)));
+            __m256i must23 = _mm256_and_si256(_mm256_or_si256(isThird, isFourth), _mm256_set1_epi8(char(0x80)));
+            error = _mm256_or_si256(error, _mm256_xor_si256(must23, special));
+
+            previousIncomplete = _mm256_subs_epu8(input, incompleteMax);
+        }
+        previous = input;
+    }
+    return _mm256_testz_si256(error, error);
+}
+
+#endif
+
+using ValidateFunc = bool (*)(const uint8_t*, size_t);
+
+struct Implementation {
+    const char* m_name;
+    ValidateFunc m_utf8;
+    ValidateFunc m_text;
+};
+
+inline Implementation selectImplementation() {
+#ifdef USER_CHAT_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return Implementation{"avx2", validateAvx2<true>, validateAvx2<false>};
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return Implementation{"sse4.1", validateSse<true>, validateSse<false>};
+    }
+#endif
+    return Implementation{"scalar", validateScalar<true>, validateScalar<false>};
+}
+
+inline const Implementation& implementation() {
+    static const Implementation selected = selectImplementation();
+    return selected;
+}
+
+// Короткие строки (имена, короткие сообщения) быстрее проверить без векторного пролога
+constexpr size_t kScalarMaxSize = 16;
+
+} // namespace text_validation
+
+inline bool isValidUtf8(std::string_view text) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(text.data());
+    if (text.size() <= text_validation::kScalarMaxSize) {
+        return text_validation::validateScalar<true>(data, text.size());
+    }
+    return text_validation::implementation().m_utf8(data, text.size());
+}
+
+// UTF-8 без управляющих символов, кроме \t, \n и \r
+inline bool isValidText(std::string_view text) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(text.data());
+    if (text.size() <= text_validation::kScalarMaxSize) {
+        return text_validation::validateScalar<false>(data, text.size());
+    }
+    return text_validation::implementation().m_text(data, text.size());
+}
+
+// Начало text не длиннее maxBytes без оборванной последовательности: отступает назад
+// с байтов продолжения (10xxxxxx), чтобы обрезанный корректный UTF-8 остался корректным
+inline std::string_view truncateUtf8(std::string_view text, size_t maxBytes) {
+    if (text.size() <= maxBytes) {
+        return text;
+    }
+    size_t size = maxBytes;
+    while (size > 0 && (uint8_t(text[size]) & 0xc0) == 0x80) {
+        size--;
+    }
+    return text.substr(0, size);
+}
+
+// Имя пользователя: 1..kMaxUserNameSize байт корректного UTF-8 без пробельных, управляющих
+// и невидимых символов, которыми можно выдать себя за другого (C1, NBSP, нулевой ширины,
+// переключатели направления письма, BOM)
+inline bool isValidUserName(std::string_view userName) {
+    if (userName.empty() || userName.size() > kMaxUserNameSize || !isValidUtf8(userName)) {
+        return false;
+    }
+    for (size_t i = 0; i < userName.size();) {
+        uint8_t byte = uint8_t(userName[i]);
+        if (byte < 0x80) {
+            if (byte <= ' ' || byte == 0x7f) {
+                return false;
+            }
+            i++;
+            continue;
+        }
+        size_t length = byte >= 0xf0 ? 4 : byte >= 0xe0 ? 3 : 2;
+        uint32_t codePoint = byte & (0x7f >> length);
+        for (size_t k = 1; k < length; k++) {
+            codePoint = (codePoint << 6) | (uint8_t(userName[i + k]) & 0x3f);
+        }
+        if ((codePoint >= 0x80 && codePoint <= 0xa0) ||       // C1, NBSP
+            codePoint == 0xad ||                                // мягкий перенос
+            (codePoint >= 0x2000 && codePoint <= 0x200f) ||     // пробелы, нулевая ширина, LRM/RLM
+            (codePoint >= 0x2028 && codePoint <= 0x202f) ||     // разделители строк, LRE..RLO, NNBSP
+            (codePoint >= 0x205f && codePoint <= 0x206f) ||     // MMSP, невидимые операторы, LRI..PDI
+            codePoint == 0x3000 || codePoint == 0xfeff ||       // идеографический пробел, BOM
+            (codePoint >= 0xfff0 && codePoint <= 0xffff)) {     // спецсимволы, U+FFFD
+            return false;
+        }
+        i += length;
+    }
+    return true;
+}
+
+} // namespace user_chat
@@ -0,0 +1,394 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl/error.hpp>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <climits>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Logs.h"
+#include "TcpTransport.h"
+#include "WorkerPool.h"
+
+// TLS поверх сокета соединения. OpenSSL работает с парой BIO в памяти, а сокет читает и пишет
+// сам, асинхронно: шифротекст идёт из сокета прямо в буфер BIO и из буфера BIO прямо в сокет
+// (BIO_nwrite0/BIO_nread0), открытый текст расшифровывается прямо в буфер чтения соединения,
+// где пакеты разбираются на месте. Шаги рукопожатия (асимметричная криптография) могут выполняться
+// в WorkerPool - поток io_context в это время обслуживает другие соединения.
+
+// Сессия TLS для возобновления по билету; клиент хранит её между переподключениями
+using TlsSession = std::shared_ptr<SSL_SESSION>;
+
+struct TlsStats {
+    uint64_t m_handshakes = 0; // Завершённых рукопожатий
+    uint64_t m_resumed = 0;    // Из них возобновлённых по билету (без проверки сертификата)
+    uint64_t m_failed = 0;
+};
+
+// Настройки TLS, общие для многих соединений (SSL_CTX)
+class TlsContext {
+    std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> m_context;
+
+    explicit TlsContext(SSL_CTX* context) : m_context(context, SSL_CTX_free) {
+        SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+        // Частичная запись - как у сокета; буферы записей OpenSSL освобождаются у простаивающих соединений
+        SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+        // Соединения закрываются без close_notify: пакеты разграничены своей длиной, обрыв - обычный eof
+        SSL_CTX_set_options(context, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    }
+
+public:
+    // Индекс ex_data SSL: куда клиенту сохранить полученный билет (TlsSession*)
+    static int sessionSlotIndex() {
+        static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    // Билеты шифруются ключом, который живёт, пока жив контекст: после перезапуска сервера - полное рукопожатие
+    static std::shared_ptr<TlsContext> createServer(const std::string& certificateFile, const std::string& privateKeyFile) {
+        std::shared_ptr<TlsContext> context(new TlsContext(SSL_CTX_new(TLS_server_method())));
+        if (SSL_CTX_use_certificate_chain_file(context->native(), certificateFile.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(context->native(), privateKeyFile.c_str(), SSL_FILETYPE_PEM) != 1) {
+            LOG_ERR("TlsContext: cannot load " << certificateFile << " / " << privateKeyFile << ": " << lastError());
+            return nullptr;
+        }
+        context->setupServer();
+        return context;
+    }
+
+    static std::shared_ptr<TlsContext> createServer(X509* certificate, EVP_PKEY* privateKey) {
+        std::shared_ptr<TlsContext> context(new TlsContext(SSL_CTX_new(TLS_server_method())));
+        if (SSL_CTX_use_certificate(context->native(), certificate) != 1 || SSL_CTX_use_PrivateKey(context->native(), privateKey) != 1) {
+            LOG_ERR("TlsContext: invalid certificate: " << lastError());
+            return nullptr;
+        }
+        context->setupServer();
+        return context;
+    }
+
+    // Сертификат сервера всегда проверяется: по caFile или по системному хранилищу (caFile пуст)
+    static std::shared_ptr<TlsContext> createClient(const std::string& caFile) {
+        std::shared_ptr<TlsContext> context(new TlsContext(SSL_CTX_new(TLS_client_method())));
+        SSL_CTX* native = context->native();
+        int result = caFile.empty() ? SSL_CTX_set_default_verify_paths(native) : SSL_CTX_load_verify_locations(native, caFile.c_str(), nullptr);
+        if (result != 1) {
+            LOG_ERR("TlsContext: cannot load CA " << caFile << ": " << lastError());
+            return nullptr;
+        }
+        SSL_CTX_set_verify(native, SSL_VERIFY_PEER, nullptr);
+        SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(native, onNewSession);
+        return context;
+    }
+
+    bool addTrustedCertificate(X509* certificate) {
+        return X509_STORE_add_cert(SSL_CTX_get_cert_store(native()), certificate) == 1;
+    }
+
+    SSL_CTX* native() const { return m_context.get(); }
+
+    static std::string lastError() {
+        char text[256];
+        ERR_error_string_n(ERR_get_error(), text, sizeof(text));
+        return text;
+    }
+
+private:
+    void setupServer() {
+        // Билет один: клиент держит одно соединение, второй билет - лишняя работа на каждом входе
+        SSL_CTX_set_num_tickets(native(), 1);
+    }
+
+    static int onNewSession(SSL* ssl, SSL_SESSION* session) {
+        auto* slot = static_cast<TlsSession*>(SSL_get_ex_data(ssl, sessionSlotIndex()));
+        if (slot == nullptr) {
+            return 0;
+        }
+        *slot = TlsSession(session, SSL_SESSION_free);
+        return 1; // Ссылка на session теперь наша
+    }
+};
+
+// Состояние TLS одного соединения. Все вызовы - в потоке io_context сокета; во время шага рукопожатия
+// в WorkerPool поток io_context этот объект не трогает (операция одна, следующая начинается после ответа).
+// Обработчики завершения держат владельца соединения, а операции - сам объект: после переподключения
+// клиента старый объект доживает до завершения своих операций с ошибкой.
+class TlsStream : public std::enable_shared_from_this<TlsStream> {
+public:
+    using Handler = std::function<void(const boost::system::error_code&, size_t)>;
+    using DoneHandler = std::function<void(const boost::system::error_code&)>;
+
+private:
+    static constexpr size_t kBioSize = 17 * 1024;      // Запись TLS целиком: 16 КБ данных и заголовки
+    static constexpr size_t kMaxPlainWrite = 16 * 1024;
+
+    StreamSocket& m_socket;
+    std::unique_ptr<SSL, decltype(&SSL_free)> m_ssl;
+    BIO* m_network = nullptr;           // Сторона пары BIO для сокета; вторую держит m_ssl
+    std::vector<uint8_t> m_plainOut;    // Пакеты очереди отправки, собранные в одну запись TLS
+    bool m_isWriting = false;           // Идёт запись шифротекста в сокет
+    DoneHandler m_afterWrite;           // Запись, ждущая окончания текущей
+
+public:
+    // Клиент: sessionSlot - сохранённая сессия (пустая - полное рукопожатие), туда же придёт новый билет
+    TlsStream(StreamSocket& socket, TlsContext& context, TlsSession* sessionSlot = nullptr, const std::string& host = {})
+        : m_socket(socket), m_ssl(SSL_new(context.native()), SSL_free) {
+        BIO* internal = nullptr;
+        BIO_new_bio_pair(&internal, kBioSize, &m_network, kBioSize);
+        SSL_set_bio(m_ssl.get(), internal, internal);
+        if (sessionSlot == nullptr) {
+            SSL_set_accept_state(m_ssl.get());
+            return;
+        }
+        SSL_set_connect_state(m_ssl.get());
+        SSL_set_ex_data(m_ssl.get(), TlsContext::sessionSlotIndex(), sessionSlot);
+        if (*sessionSlot) {
+            SSL_set_session(m_ssl.get(), sessionSlot->get());
+        }
+        boost::system::error_code ec;
+        boost::asio::ip::make_address(host, ec);
+        if (!ec) {
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(m_ssl.get()), host.c_str());
+        } else {
+            SSL_set_tlsext_host_name(m_ssl.get(), host.c_str());
+            SSL_set1_host(m_ssl.get(), host.c_str());
+        }
+    }
+
+    // Без отметки о shutdown OpenSSL считает сессию оборванной и запрещает возобновлять её по билету.
+    // После фатальной ошибки сессия уже помечена негодной самим OpenSSL
+    ~TlsStream() {
+        SSL_set_shutdown(m_ssl.get(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        BIO_free(m_network);
+    }
+
+    TlsStream(const TlsStream&) = delete;
+    TlsStream& operator=(const TlsStream&) = delete;
+
+    bool isResumed() const { return SSL_session_reused(m_ssl.get()) == 1; }
+
+    // Шаги SSL_do_handshake выполняет pool (nullptr - поток сокета). Пул переполнен - рукопожатие не начинается
+    void handshake(WorkerPool* pool, DoneHandler done) {
+        // Ссылки переезжают в post: последняя ссылка на соединение не должна освобождаться в потоке пула
+        auto step = [this, self = shared_from_this(), pool, done]() mutable {
+            ERR_clear_error();
+            int result = SSL_do_handshake(m_ssl.get());
+            int error = result == 1 ? SSL_ERROR_NONE : SSL_get_error(m_ssl.get(), result);
+            unsigned long sslError = error == SSL_ERROR_SSL ? ERR_get_error() : 0;
+            boost::asio::post(m_socket.get_executor(), [this, self = std::move(self), pool, done = std::move(done), error, sslError] {
+                onHandshakeStep(pool, done, error, sslError);
+            });
+        };
+        if (pool == nullptr) {
+            step();
+        } else if (!pool->tryPost(step)) {
+            boost::asio::post(m_socket.get_executor(), [done] { done(boost::asio::error::no_buffer_space); });
+        }
+    }
+
+    // Расшифровка прямо в buffer; за шифротекстом - в сокет, только когда OpenSSL нечего отдать
+    void asyncReadSome(boost::asio::mutable_buffer buffer, Handler handler) {
+        readSome(buffer, std::move(handler), false);
+    }
+
+    // Пакеты из очереди отправки собираются в одну запись TLS (до 16 КБ): одна запись и одна
+    // отправка в сокет на пачку вместо записи на пакет. Один буфер шифруется без копирования
+    template<class ConstBufferSequence>
+    void asyncWriteSome(const ConstBufferSequence& buffers, Handler handler) {
+        auto first = boost::asio::buffer_sequence_begin(buffers);
+        size_t totalSize = boost::asio::buffer_size(buffers);
+        if (first != boost::asio::buffer_sequence_end(buffers) && boost::asio::const_buffer(*first).size() == totalSize) {
+            boost::asio::const_buffer buffer(*first);
+            writePlain(static_cast<const uint8_t*>(buffer.data()), std::min(buffer.size(), kMaxPlainWrite), std::move(handler));
+            return;
+        }
+        m_plainOut.resize(kMaxPlainWrite);
+        size_t size = boost::asio::buffer_copy(boost::asio::buffer(m_plainOut), buffers);
+        writePlain(m_plainOut.data(), size, std::move(handler));
+    }
+
+private:
+    static boost::system::error_code sslError(unsigned long error) {
+        return boost::system::error_code(int(error != 0 ? error : SSL_R_UNEXPECTED_EOF_WHILE_READING), boost::asio::error::get_ssl_category());
+    }
+
+    // isInline - вызов из обработчика чтения сокета: результат отдаётся сразу, без лишнего post
+    void readSome(boost::asio::mutable_buffer buffer, Handler handler, bool isInline) {
+        boost::system::error_code ec;
+        size_t received = 0;
+        if (buffer.size() != 0) {
+            ERR_clear_error();
+            int result = SSL_read(m_ssl.get(), buffer.data(), int(std::min<size_t>(buffer.size(), INT_MAX)));
+            int error = result > 0 ? SSL_ERROR_NONE : SSL_get_error(m_ssl.get(), result);
+            // Ответы OpenSSL на служебные записи (например, KeyUpdate)
+            flushOutput(handler);
+            if (error == SSL_ERROR_WANT_READ) {
+                fillInput([this, self = shared_from_this(), buffer, handler = std::move(handler)](const boost::system::error_code& ec) mutable {
+                    if (ec) {
+                        handler(ec, 0);
+                        return;
+                    }
+                    readSome(buffer, std::move(handler), true);
+                });
+                return;
+            }
+            if (result > 0) {
+                received = size_t(result);
+            } else {
+                ec = error == SSL_ERROR_ZERO_RETURN ? boost::system::error_code(boost::asio::error::eof) : sslError(ERR_get_error());
+            }
+        }
+        if (isInline) {
+            handler(ec, received);
+            return;
+        }
+        boost::asio::post(m_socket.get_executor(), [handler = std::move(handler), ec, received] { handler(ec, received); });
+    }
+
+    void onHandshakeStep(WorkerPool* pool, const DoneHandler& done, int error, unsigned long sslErrorCode) {
+        // Сначала отправляем всё, что OpenSSL записал (ответ, билет), затем решаем, что дальше
+        startWrite([this, self = shared_from_this(), pool, done, error, sslErrorCode](const boost::system::error_code& ec) {
+            if (ec || error == SSL_ERROR_NONE) {
+                done(ec);
+                return;
+            }
+            if (error != SSL_ERROR_WANT_READ) {
+                done(sslError(sslErrorCode));
+                return;
+            }
+            fillInput([this, self = shared_from_this(), pool, done](const boost::system::error_code& ec) {
+                if (ec) {
+                    done(ec);
+                    return;
+                }
+                handshake(pool, done);
+            });
+        });
+    }
+
+    void writePlain(const uint8_t* data, size_t size, Handler handler) {
+        if (m_isWriting) {
+            m_afterWrite = [this, data, size, handler](const boost::system::error_code& ec) {
+                if (ec) {
+                    handler(ec, 0);
+                    return;
+                }
+                writePlain(data, size, handler);
+            };
+            return;
+        }
+        // Пара BIO пуста (предыдущая запись дошла до сокета), запись до 16 КБ помещается целиком
+        ERR_clear_error();
+        int result = SSL_write(m_ssl.get(), data, int(size));
+        if (result <= 0) {
+            boost::system::error_code ec = sslError(ERR_get_error());
+            boost::asio::post(m_socket.get_executor(), [handler, ec] { handler(ec, 0); });
+            return;
+        }
+        startWrite([handler, result](const boost::system::error_code& ec) { handler(ec, ec ? 0 : size_t(result)); });
+    }
+
+    // Шифротекст из BIO в сокет, пока BIO не опустеет
+    void startWrite(DoneHandler done) {
+        m_isWriting = true;
+        drainOutput([this, self = shared_from_this(), done = std::move(done)](const boost::system::error_code& ec) {
+            m_isWriting = false;
+            done(ec);
+            if (m_afterWrite && !m_isWriting) {
+                DoneHandler next = std::move(m_afterWrite);
+                m_afterWrite = nullptr;
+                next(ec);
+            }
+        });
+    }
+
+    void flushOutput(const Handler& owner) {
+        if (m_isWriting || BIO_ctrl_pending(m_network) == 0) {
+            return;
+        }
+        startWrite([owner](const boost::system::error_code&) {});
+    }
+
+    void drainOutput(DoneHandler done) {
+        char* data = nullptr;
+        int size = BIO_nread0(m_network, &data);
+        if (size <= 0) {
+            done({});
+            return;
+        }
+        boost::asio::async_write(m_socket, boost::asio::buffer(data, size_t(size)),
+                                 [this, self = shared_from_this(), done = std::move(done)](const boost::system::error_code& ec, size_t written) mutable {
+                                     if (ec) {
+                                         done(ec);
+                                         return;
+                                     }
+                                     char* consumed;
+                                     BIO_nread(m_network, &consumed, int(written));
+                                     drainOutput(std::move(done));
+                                 });
+    }
+
+    // Шифротекст из сокета прямо в свободное место BIO
+    void fillInput(DoneHandler done) {
+        char* space = nullptr;
+        int size = BIO_nwrite0(m_network, &space);
+        if (size <= 0) {
+            boost::asio::post(m_socket.get_executor(), [done = std::move(done)] { done(boost::asio::error::no_buffer_space); });
+            return;
+        }
+        m_socket.async_read_some(boost::asio::buffer(space, size_t(size)),
+                                 [this, self = shared_from_this(), done = std::move(done)](const boost::system::error_code& ec, size_t received) {
+                                     if (!ec) {
+                                         char* filled;
+                                         BIO_nwrite(m_network, &filled, int(received));
+                                     }
+                                     done(ec);
+                                 });
+    }
+};
+
+// Поток соединения для PacketSender и чтения: сам сокет или TLS поверх него
+class SocketStream {
+    StreamSocket& m_socket;
+    std::shared_ptr<TlsStream> m_tls;
+
+public:
+    using executor_type = StreamSocket::executor_type;
+
+    explicit SocketStream(StreamSocket& socket) : m_socket(socket) {}
+
+    executor_type get_executor() { return m_socket.get_executor(); }
+
+    TlsStream* tls() const { return m_tls.get(); }
+    void setTls(std::shared_ptr<TlsStream> tls) { m_tls = std::move(tls); }
+
+    template<class MutableBufferSequence, class ReadHandler>
+    void async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler) {
+        if (!m_tls) {
+            m_socket.async_read_some(buffers, std::forward<ReadHandler>(handler));
+            return;
+        }
+        boost::asio::mutable_buffer buffer;
+        for (auto it = boost::asio::buffer_sequence_begin(buffers); it != boost::asio::buffer_sequence_end(buffers); ++it) {
+            buffer = boost::asio::mutable_buffer(*it);
+            if (buffer.size() != 0) {
+                break;
+            }
+        }
+        m_tls->asyncReadSome(buffer, TlsStream::Handler(std::forward<ReadHandler>(handler)));
+    }
+
+    template<class ConstBufferSequence, class WriteHandler>
+    void async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler) {
+        if (!m_tls) {
+            m_socket.async_write_some(buffers, std::forward<WriteHandler>(handler));
+            return;
+        }
+        m_tls->asyncWriteSome(buffers, TlsStream::Handler(std::forward<WriteHandler>(handler)));
+    }
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+// Монотонное время в наносекундах
+inline uint64_t monotonicNowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// Параметры ограничения: один токен на m_intervalNs, запас m_burstNs (burst - 1 токенов).
+// Один набор параметров разделяется многими ведрами.
+struct TokenBucketConfig
+{
+    uint64_t m_intervalNs = 0;  // 0 - без ограничения
+    uint64_t m_burstNs = 0;
+
+    static TokenBucketConfig fromRate( double perSecond, uint32_t burst )
+    {
+        TokenBucketConfig config;
+        if ( perSecond > 0 )
+        {
+            config.m_intervalNs = uint64_t( 1e9 / perSecond );
+            config.m_burstNs = config.m_intervalNs * ( std::max<uint32_t>( burst, 1 ) - 1 );
+        }
+        return config;
+    }
+
+    bool isUnlimited() const { return m_intervalNs == 0; }
+};
+
+// Ведро токенов в форме GCRA: состояние - одно "теоретическое время прибытия",
+// проверка без выделений памяти и почти без ветвлений
+class TokenBucket
+{
+    uint64_t m_tat = 0;
+
+public:
+    bool tryConsume( const TokenBucketConfig& config, uint64_t nowNs )
+    {
+        uint64_t tat = std::max( m_tat, nowNs );
+        bool isAllowed = tat - nowNs <= config.m_burstNs;
+        m_tat = isAllowed ? tat + config.m_intervalNs : m_tat;
+        return isAllowed;
+    }
+
+    // Через сколько наносекунд появится следующий токен
+    uint64_t waitTimeNs( const TokenBucketConfig& config, uint64_t nowNs ) const
+    {
+        uint64_t ahead = std::max( m_tat, nowNs ) - nowNs;
+        return ahead > config.m_burstNs ? ahead - config.m_burstNs : 0;
+    }
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+// Трассировка конвейера пакетов: интервалы TRACE_SPAN("имя") до конца блока.
+// Без CHAT_TRACE макросы раскрываются в пустоту - ни кода, ни данных.
+// С CHAT_TRACE каждый поток пишет интервалы в свой кольцевой буфер (последние
+// kTraceBufferSize штук), Trace::dumpChromeJson() выводит все буферы в формате
+// Chrome trace events (chrome://tracing, Perfetto).
+
+#ifdef CHAT_TRACE
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace trace {
+
+constexpr size_t kTraceBufferSize = 64 * 1024;
+
+struct Event {
+    const char* m_name; // Строковый литерал
+    uint64_t m_startNs;
+    uint64_t m_durationNs;
+};
+
+inline uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Буфер одного потока. Мьютекс захватывает только dumpChromeJson(), в потоке-владельце он не оспаривается
+class ThreadBuffer {
+    std::mutex m_mutex;
+    std::vector<Event> m_events;
+    size_t m_next = 0;
+    uint32_t m_threadId;
+
+public:
+    explicit ThreadBuffer(uint32_t threadId) : m_events(kTraceBufferSize), m_threadId(threadId) {}
+
+    void record(const char* name, uint64_t startNs, uint64_t durationNs) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_events[m_next % kTraceBufferSize] = Event{name, startNs, durationNs};
+        m_next++;
+    }
+
+    void dump(std::ostream& out, bool& isFirst) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t first = m_next > kTraceBufferSize ? m_next - kTraceBufferSize : 0;
+        for (size_t i = first; i < m_next; i++) {
+            const Event& event = m_events[i % kTraceBufferSize];
+            out << (isFirst ? "\n" : ",\n") << "{\"name\":\"" << event.m_name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << m_threadId
+                << ",\"ts\":" << event.m_startNs / 1000 << '.' << digits3(event.m_startNs % 1000)
+                << ",\"dur\":" << event.m_durationNs / 1000 << '.' << digits3(event.m_durationNs % 1000) << '}';
+            isFirst = false;
+        }
+    }
+
+private:
+    static std::string digits3(uint64_t value) {
+        std::string result = std::to_string(value);
+        return std::string(3 - result.size(), '0') + result;
+    }
+};
+
+// Буферы всех потоков; живут до конца процесса, чтобы трассу можно было снять и после завершения потока
+class Registry {
+    std::mutex m_mutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> m_buffers;
+
+public:
+    static Registry& instance() {
+        static Registry registry;
+        return registry;
+    }
+
+    std::shared_ptr<ThreadBuffer> addThread() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_buffers.push_back(std::make_shared<ThreadBuffer>(uint32_t(m_buffers.size() + 1)));
+        return m_buffers.back();
+    }
+
+    void dumpChromeJson(std::ostream& out) {
+        std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            buffers = m_buffers;
+        }
+        bool isFirst = true;
+        out << "{\"traceEvents\":[";
+        for (auto& buffer : buffers) {
+            buffer->dump(out, isFirst);
+        }
+        out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    }
+};
+
+inline ThreadBuffer& threadBuffer() {
+    thread_local std::shared_ptr<ThreadBuffer> buffer = Registry::instance().addThread();
+    return *buffer;
+}
+
+class Span {
+    const char* m_name;
+    uint64_t m_startNs;
+
+public:
+    explicit Span(const char* name) : m_name(name), m_startNs(nowNs()) {}
+    ~Span() { threadBuffer().record(m_name, m_startNs, nowNs() - m_startNs); }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+};
+
+inline void dumpChromeJson(std::ostream& out) {
+    Registry::instance().dumpChromeJson(out);
+}
+
+inline bool dumpChromeJson(const std::string& path) {
+    std::ofstream out(path, std::ios::trunc);
+    dumpChromeJson(out);
+    return bool(out);
+}
+
+} // namespace trace
+
+#define TRACE_CONCAT_IMPL( a, b ) a##b
+#define TRACE_CONCAT( a, b ) TRACE_CONCAT_IMPL( a, b )
+#define TRACE_SPAN( name ) trace::Span TRACE_CONCAT( traceSpan, __LINE__ )( name )
+#define TRACE_DUMP( path ) trace::dumpChromeJson( std::string( path ) )
+
+#else
+
+#define TRACE_SPAN( name ) do {} while (0)
+#define TRACE_DUMP( path ) false
+
+#endif
@@ -0,0 +1,222 @@
+#pragma once
+#include "LatencyHistogram.h"
+#include "Logs.h"
+#include "WorkerPool.h"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Запись входящего трафика сервера для воспроизведения (chat_replay).
+//
+// Формат: "UCCAP001", затем записи подряд:
+//   [вид u8][varint мкс от предыдущей записи][varint id сессии] и далее по виду:
+//   rk_frame  - [varint размер][тело пакета: тип и поля, без длины]
+//   rk_user   - [varint id пользователя][varint размер][имя] - сессии выдан id
+//   rk_closed - ничего, соединение закрыто
+// Пароли в файл не попадают: PacketRegister/PacketLogin записываются как PacketHi.
+namespace traffic_capture {
+
+constexpr char kMagic[8] = {'U', 'C', 'C', 'A', 'P', '0', '0', '1'};
+
+enum RecordKind : uint8_t {
+    rk_frame,
+    rk_user,
+    rk_closed,
+};
+
+struct Record {
+    RecordKind m_kind = rk_frame;
+    uint64_t m_timeUs = 0;      // От начала записи
+    uint32_t m_sessionId = 0;
+    uint32_t m_userId = 0;      // rk_user
+    const uint8_t* m_data = nullptr; // rk_frame - тело пакета, rk_user - имя
+    size_t m_size = 0;
+};
+
+// Запись копится в буфере в потоке io_context, на диск уходит в отдельном потоке.
+// Если диск не успевает, буферы отбрасываются (droppedBytes()) - сервер не ждёт записи.
+class Writer {
+    static constexpr size_t kFlushSize = 256 * 1024;
+    static constexpr size_t kMaxQueuedBuffers = 64;
+
+    std::shared_ptr<int> m_fd;
+    std::vector<uint8_t> m_buffer;
+    uint64_t m_lastUs = 0;
+    uint64_t m_droppedBytes = 0;
+    std::unique_ptr<WorkerPool> m_writer;
+
+public:
+    ~Writer() {
+        if (m_writer) {
+            flush();
+            m_writer->stop(true);
+        }
+    }
+
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            LOG_ERR("TrafficCapture: cannot open " << path);
+            return false;
+        }
+        m_fd = std::shared_ptr<int>(new int(fd), [](int* fd) {
+            ::close(*fd);
+            delete fd;
+        });
+        m_writer = std::make_unique<WorkerPool>(1, kMaxQueuedBuffers);
+        m_buffer.reserve(kFlushSize + 64 * 1024);
+        m_buffer.insert(m_buffer.end(), kMagic, kMagic + sizeof(kMagic));
+        m_lastUs = monotonicNowUs();
+        return true;
+    }
+
+    uint64_t droppedBytes() const { return m_droppedBytes; }
+
+    void recordFrame(uint32_t sessionId, const uint8_t* data, size_t size) {
+        writeHeader(rk_frame, sessionId);
+        writeVarint(size);
+        m_buffer.insert(m_buffer.end(), data, data + size);
+        flushIfFull();
+    }
+
+    void recordUser(uint32_t sessionId, uint32_t userId, const std::string& userName) {
+        writeHeader(rk_user, sessionId);
+        writeVarint(userId);
+        writeVarint(userName.size());
+        m_buffer.insert(m_buffer.end(), userName.begin(), userName.end());
+        flushIfFull();
+    }
+
+    void recordClosed(uint32_t sessionId) {
+        writeHeader(rk_closed, sessionId);
+        flushIfFull();
+    }
+
+    // Отдать накопленное потоку записи
+    void flush() {
+        if (m_buffer.empty()) {
+            return;
+        }
+        auto buffer = std::make_shared<std::vector<uint8_t>>(std::move(m_buffer));
+        m_buffer = std::vector<uint8_t>();
+        m_buffer.reserve(kFlushSize + 64 * 1024);
+
+        bool isPosted = m_writer->tryPost([fd = m_fd, buffer] {
+            const uint8_t* ptr = buffer->data();
+            size_t size = buffer->size();
+            while (size > 0) {
+                ssize_t written = ::write(*fd, ptr, size);
+                if (written <= 0) {
+                    LOG_ERR("TrafficCapture: write failed");
+                    return;
+                }
+                ptr += written;
+                size -= size_t(written);
+            }
+        });
+        if (!isPosted) {
+            m_droppedBytes += buffer->size();
+        }
+    }
+
+private:
+    void writeHeader(RecordKind kind, uint32_t sessionId) {
+        uint64_t nowUs = monotonicNowUs();
+        m_buffer.push_back(kind);
+        writeVarint(nowUs - m_lastUs);
+        writeVarint(sessionId);
+        m_lastUs = nowUs;
+    }
+
+    void writeVarint(uint64_t value) {
+        while (value >= 0x80) {
+            m_buffer.push_back(uint8_t(value) | 0x80);
+            value >>= 7;
+        }
+        m_buffer.push_back(uint8_t(value));
+    }
+
+    void flushIfFull() {
+        if (m_buffer.size() >= kFlushSize) {
+            flush();
+        }
+    }
+};
+
+// Чтение записи целиком в память
+class Reader {
+    std::vector<uint8_t> m_data;
+    size_t m_offset = 0;
+    uint64_t m_timeUs = 0;
+
+public:
+    bool open(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        m_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (m_data.size() < sizeof(kMagic) || std::memcmp(m_data.data(), kMagic, sizeof(kMagic)) != 0) {
+            LOG_ERR("TrafficCapture: " << path << " is not a capture file");
+            return false;
+        }
+        m_offset = sizeof(kMagic);
+        return true;
+    }
+
+    // false - конец файла или обрезанная запись (последний буфер мог не дописаться)
+    bool next(Record& record) {
+        if (m_offset >= m_data.size()) {
+            return false;
+        }
+        uint8_t kind = m_data[m_offset++];
+        uint64_t deltaUs, sessionId;
+        if (kind > rk_closed || !readVarint(deltaUs) || !readVarint(sessionId)) {
+            return false;
+        }
+        m_timeUs += deltaUs;
+        record = Record();
+        record.m_kind = RecordKind(kind);
+        record.m_timeUs = m_timeUs;
+        record.m_sessionId = uint32_t(sessionId);
+
+        if (kind == rk_user) {
+            uint64_t userId;
+            if (!readVarint(userId)) {
+                return false;
+            }
+            record.m_userId = uint32_t(userId);
+        }
+        if (kind == rk_frame || kind == rk_user) {
+            uint64_t size;
+            if (!readVarint(size) || size > m_data.size() - m_offset) {
+                return false;
+            }
+            record.m_data = m_data.data() + m_offset;
+            record.m_size = size_t(size);
+            m_offset += size_t(size);
+        }
+        return true;
+    }
+
+private:
+    bool readVarint(uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (m_offset >= m_data.size()) {
+                return false;
+            }
+            uint8_t byte = m_data[m_offset++];
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+} // namespace traffic_capture
@@ -0,0 +1,103 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Таблица пользователей сервера: имя интернируется в компактный 32-битный id при входе.
+// id - индекс в плотном массиве записей, поэтому маршрутизация по id не требует поиска.
+// id 0 не выдаётся и означает "нет пользователя".
+template<class RecordT>
+class UserRegistry {
+    struct Slot {
+        std::string m_name; // Пусто - слот свободен
+        RecordT m_record;
+    };
+
+    // Освобождённый id выдаётся снова только после накопления стольких свободных,
+    // чтобы клиент успел получить смену имени дельтой, а не по старому id
+    static constexpr size_t kMinFreeIds = 1024;
+
+    std::vector<Slot> m_slots = std::vector<Slot>(1);
+    std::unordered_map<std::string, uint32_t> m_ids;
+    std::deque<uint32_t> m_freeIds;
+
+public:
+    static constexpr uint32_t kInvalidId = 0;
+
+    size_t size() const { return m_ids.size(); }
+
+    // Верхняя граница id (для массивов, индексируемых id)
+    uint32_t endId() const { return uint32_t(m_slots.size()); }
+
+    uint32_t find(const std::string& name) const {
+        auto it = m_ids.find(name);
+        return it == m_ids.end() ? kInvalidId : it->second;
+    }
+
+    bool contains(uint32_t id) const { return id < m_slots.size() && !m_slots[id].m_name.empty(); }
+
+    // Имя не должно быть пустым и не должно быть зарегистрировано
+    uint32_t add(const std::string& name) {
+        uint32_t id;
+        if (m_freeIds.size() > kMinFreeIds) {
+            id = m_freeIds.front();
+            m_freeIds.pop_front();
+        } else {
+            id = uint32_t(m_slots.size());
+            m_slots.emplace_back();
+        }
+
+        m_slots[id].m_name = name;
+        m_slots[id].m_record = RecordT();
+        m_ids.emplace(name, id);
+        return id;
+    }
+
+    // Восстановление с тем же id (например, из снимка); id должен быть свободен.
+    // После восстановления всех записей - rebuildFreeIds()
+    RecordT& restore(uint32_t id, const std::string& name) {
+        if (id >= m_slots.size()) {
+            m_slots.resize(id + 1);
+        }
+        m_slots[id].m_name = name;
+        m_slots[id].m_record = RecordT();
+        m_ids.emplace(name, id);
+        return m_slots[id].m_record;
+    }
+
+    void rebuildFreeIds() {
+        m_freeIds.clear();
+        for (uint32_t id = 1; id < m_slots.size(); id++) {
+            if (m_slots[id].m_name.empty()) {
+                m_freeIds.push_back(id);
+            }
+        }
+    }
+
+    void remove(uint32_t id) {
+        if (!contains(id)) {
+            return;
+        }
+        m_ids.erase(m_slots[id].m_name);
+        m_slots[id].m_name.clear();
+        m_slots[id].m_record = RecordT();
+        m_freeIds.push_back(id);
+    }
+
+    const std::string& name(uint32_t id) const { return m_slots[id].m_name; }
+
+    RecordT& operator[](uint32_t id) { return m_slots[id].m_record; }
+    const RecordT& operator[](uint32_t id) const { return m_slots[id].m_record; }
+
+    // func(id, name, record) для всех зарегистрированных; удалять записи внутри можно
+    template<class FuncT>
+    void forEach(FuncT&& func) {
+        for (uint32_t id = 1; id < m_slots.size(); id++) {
+            if (!m_slots[id].m_name.empty()) {
+                func(id, m_slots[id].m_name, m_slots[id].m_record);
+            }
+        }
+    }
+};
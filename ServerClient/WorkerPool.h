@@ -0,0 +1,103 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Пул потоков для тяжёлой работы вне потока io_context (например, хэширование паролей).
+// Очередь ограничена: tryPost() возвращает false, если задач уже m_maxQueued, - вызывающий
+// сам решает, что ответить клиенту. Результат задача отправляет обратно через boost::asio::post.
+class WorkerPool {
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<std::function<void()>> m_tasks;
+    std::vector<std::thread> m_threads;
+    size_t m_maxQueued;
+    bool m_isStopping = false;
+    bool m_isDraining = false;
+
+public:
+    // niceness > 0 - потоки пула уступают процессор потокам ввода-вывода (только Linux)
+    WorkerPool(size_t threadCount, size_t maxQueued, int niceness = 0) : m_maxQueued(maxQueued) {
+        for (size_t i = 0; i < std::max<size_t>(threadCount, 1); i++) {
+            m_threads.emplace_back([this, niceness] {
+#ifdef __linux__
+                if (niceness != 0) {
+                    setpriority(PRIO_PROCESS, pid_t(syscall(SYS_gettid)), niceness);
+                }
+#endif
+                run();
+            });
+        }
+    }
+
+    ~WorkerPool() {
+        stop();
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    size_t threadCount() const { return m_threads.size(); }
+
+    bool tryPost(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_isStopping || m_tasks.size() >= m_maxQueued) {
+                return false;
+            }
+            m_tasks.push_back(std::move(task));
+        }
+        m_condition.notify_one();
+        return true;
+    }
+
+    size_t queuedCount() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_tasks.size();
+    }
+
+    // Задачи из очереди отбрасываются (isDraining - выполняются), выполняемые - дожидаемся
+    void stop(bool isDraining = false) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_isStopping = true;
+            m_isDraining = isDraining;
+            if (!isDraining) {
+                m_tasks.clear();
+            }
+        }
+        m_condition.notify_all();
+        for (std::thread& thread : m_threads) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+    }
+
+private:
+    void run() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_condition.wait(lock, [this] { return m_isStopping || !m_tasks.empty(); });
+                if (m_tasks.empty() || (m_isStopping && !m_isDraining)) {
+                    return;
+                }
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
@@ -3,41 +3,31 @@
 #include "ChatClient.h"
 #include "ChatServer.h"
 
+#include <thread>
+
 // lvalue = rvalue (movable)
 // rvalue = std::move(lvalue)
 
-class ChatClientBase
-{
-public:
-    void initClient(){}
-protected:
-    virtual void doWrite( const uint8_t* message, size_t size ) = 0;
-
-};
 int main()
 {
     std::thread( []
                 {
-        TcpServer<ChatServer, ChatSession> server("0.0.0.0", "15001" );
+                    ChatServerSettings settings;
+                    settings.m_historyDir = "history";
+                    settings.m_snapshotFile = "presence.snapshot";
+                    ChatServer server("0.0.0.0", "15001", settings );
                     server.run();
                 }).detach();
 
+    sleep(1);
 
-    auto client = std::make_shared<TcpClient<ChatClientBase>>();
+    auto client = std::make_shared<user_chat::ChatClient>( "user" );
 
     std::thread clientThread( [&client]
                              {
                                  client->run( "localhost", "15001" );
                              });
 
-    sleep(1);
-
-    char *message = new char [100];
-    strcpy(message,"001234567890");
-    message[0] = 10;
-    message[1] = 0;
-    client->write( (uint8_t *)message, sizeof(message) );
-
     clientThread.join();
 
     return 0;
@@ -0,0 +1,292 @@
+#include "UsersFilterModel.h"
+#include "UsersListModel.h"
+
+#include <algorithm>
+
+UsersFilterModel::UsersFilterModel(UsersListModel *source, QObject *parent)
+    : QAbstractProxyModel(parent)
+    , m_source(source)
+{
+    setSourceModel(source);
+    refilter(QString());
+
+    connect(source, &QAbstractItemModel::rowsInserted, this, &UsersFilterModel::onRowsInserted);
+    connect(source, &QAbstractItemModel::rowsAboutToBeRemoved, this, &UsersFilterModel::onRowsAboutToBeRemoved);
+    connect(source, &QAbstractItemModel::rowsRemoved, this, &UsersFilterModel::onRowsRemoved);
+    connect(source, &QAbstractItemModel::dataChanged, this, &UsersFilterModel::onDataChanged);
+    connect(source, &QAbstractItemModel::modelAboutToBeReset, this, &UsersFilterModel::beginResetModel);
+    connect(source, &QAbstractItemModel::modelReset, this, [this]
+            {
+                m_rows.clear();
+                for (int row = 0, count = m_source->rowCount(); row < count; row++)
+                {
+                    if (accepts(row, m_filter))
+                    {
+                        m_rows.push_back(row);
+                    }
+                }
+                endResetModel();
+            });
+}
+
+QModelIndex UsersFilterModel::index(int row, int column, const QModelIndex &parent) const
+{
+    if (parent.isValid() || column != 0 || row < 0 || row >= int(m_rows.size()))
+    {
+        return QModelIndex();
+    }
+    return createIndex(row, column);
+}
+
+QModelIndex UsersFilterModel::parent(const QModelIndex &) const
+{
+    return QModelIndex();
+}
+
+int UsersFilterModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : int(m_rows.size());
+}
+
+int UsersFilterModel::columnCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : 1;
+}
+
+QModelIndex UsersFilterModel::mapToSource(const QModelIndex &proxyIndex) const
+{
+    if (!proxyIndex.isValid() || proxyIndex.row() >= int(m_rows.size()))
+    {
+        return QModelIndex();
+    }
+    return m_source->index(m_rows[size_t(proxyIndex.row())], 0);
+}
+
+QModelIndex UsersFilterModel::mapFromSource(const QModelIndex &sourceIndex) const
+{
+    if (!sourceIndex.isValid())
+    {
+        return QModelIndex();
+    }
+    auto it = std::lower_bound(m_rows.begin(), m_rows.end(), sourceIndex.row());
+    if (it == m_rows.end() || *it != sourceIndex.row())
+    {
+        return QModelIndex();
+    }
+    return createIndex(int(it - m_rows.begin()), 0);
+}
+
+void UsersFilterModel::setFilterText(const QString &text)
+{
+    QString filter = text.trimmed().toCaseFolded();
+    if (filter == m_filter)
+    {
+        return;
+    }
+
+    if (filter.contains(m_filter))
+    {
+        narrow(filter);
+    }
+    else if (m_filter.contains(filter))
+    {
+        widen(filter);
+    }
+    else
+    {
+        beginResetModel();
+        refilter(filter);
+        endResetModel();
+    }
+}
+
+bool UsersFilterModel::accepts(int sourceRow, const QString &filter) const
+{
+    return filter.isEmpty() || m_source->foldedNameAt(sourceRow).contains(filter);
+}
+
+// Уточнение: прошедшие новый фильтр строки - подмножество показанных
+void UsersFilterModel::narrow(const QString &filter)
+{
+    // Куски подряд идущих отсеянных строк [first, last] в координатах фильтра
+    std::vector<std::pair<int, int>> runs;
+    std::vector<int> rows;
+    rows.reserve(m_rows.size());
+    for (size_t i = 0; i < m_rows.size(); i++)
+    {
+        if (accepts(m_rows[i], filter))
+        {
+            rows.push_back(m_rows[i]);
+        }
+        else if (!runs.empty() && runs.back().second + 1 == int(i))
+        {
+            runs.back().second = int(i);
+        }
+        else
+        {
+            runs.emplace_back(int(i), int(i));
+        }
+    }
+    m_filter = filter;
+
+    if (runs.size() > kMaxPreciseRuns)
+    {
+        beginResetModel();
+        m_rows = std::move(rows);
+        endResetModel();
+        return;
+    }
+
+    // С конца, чтобы номера ещё не удалённых кусков не сдвигались
+    for (auto run = runs.rbegin(); run != runs.rend(); ++run)
+    {
+        beginRemoveRows(QModelIndex(), run->first, run->second);
+        m_rows.erase(m_rows.begin() + run->first, m_rows.begin() + run->second + 1);
+        endRemoveRows();
+    }
+}
+
+// Ослабление: показанные строки остаются, проверяются только скрытые
+void UsersFilterModel::widen(const QString &filter)
+{
+    struct Run
+    {
+        size_t              m_position; // куда вставить в m_rows
+        std::vector<int>    m_rows;
+    };
+    std::vector<Run> runs;
+
+    size_t position = 0;
+    int sourceCount = m_source->rowCount();
+    for (int row = 0; row < sourceCount; row++)
+    {
+        if (position < m_rows.size() && m_rows[position] == row)
+        {
+            position++;
+            continue;
+        }
+        if (!accepts(row, filter))
+        {
+            continue;
+        }
+        if (runs.empty() || runs.back().m_position != position)
+        {
+            runs.push_back(Run{position, {}});
+        }
+        runs.back().m_rows.push_back(row);
+    }
+    m_filter = filter;
+
+    if (runs.size() > kMaxPreciseRuns)
+    {
+        beginResetModel();
+        for (Run &run : runs)
+        {
+            m_rows.insert(m_rows.end(), run.m_rows.begin(), run.m_rows.end());
+        }
+        std::sort(m_rows.begin(), m_rows.end());
+        endResetModel();
+        return;
+    }
+
+    for (auto run = runs.rbegin(); run != runs.rend(); ++run)
+    {
+        int first = int(run->m_position);
+        beginInsertRows(QModelIndex(), first, first + int(run->m_rows.size()) - 1);
+        m_rows.insert(m_rows.begin() + first, run->m_rows.begin(), run->m_rows.end());
+        endInsertRows();
+    }
+}
+
+void UsersFilterModel::refilter(const QString &filter)
+{
+    m_filter = filter;
+    m_rows.clear();
+    for (int row = 0, count = m_source->rowCount(); row < count; row++)
+    {
+        if (accepts(row, m_filter))
+        {
+            m_rows.push_back(row);
+        }
+    }
+}
+
+void UsersFilterModel::onRowsInserted(const QModelIndex &parent, int first, int last)
+{
+    if (parent.isValid())
+    {
+        return;
+    }
+
+    // Строки исходной модели после вставки сдвигаются, номера строк фильтра - нет
+    int count = last - first + 1;
+    auto position = std::lower_bound(m_rows.begin(), m_rows.end(), first);
+    for (auto it = position; it != m_rows.end(); ++it)
+    {
+        *it += count;
+    }
+
+    std::vector<int> accepted;
+    for (int row = first; row <= last; row++)
+    {
+        if (accepts(row, m_filter))
+        {
+            accepted.push_back(row);
+        }
+    }
+    if (accepted.empty())
+    {
+        return;
+    }
+
+    int proxyFirst = int(position - m_rows.begin());
+    beginInsertRows(QModelIndex(), proxyFirst, proxyFirst + int(accepted.size()) - 1);
+    m_rows.insert(m_rows.begin() + proxyFirst, accepted.begin(), accepted.end());
+    endInsertRows();
+}
+
+void UsersFilterModel::onRowsAboutToBeRemoved(const QModelIndex &parent, int first, int last)
+{
+    if (parent.isValid())
+    {
+        return;
+    }
+
+    auto begin = std::lower_bound(m_rows.begin(), m_rows.end(), first);
+    auto end = std::upper_bound(begin, m_rows.end(), last);
+    if (begin == end)
+    {
+        return;
+    }
+
+    int proxyFirst = int(begin - m_rows.begin());
+    beginRemoveRows(QModelIndex(), proxyFirst, proxyFirst + int(end - begin) - 1);
+    m_rows.erase(begin, end);
+    endRemoveRows();
+}
+
+void UsersFilterModel::onRowsRemoved(const QModelIndex &parent, int first, int last)
+{
+    if (parent.isValid())
+    {
+        return;
+    }
+
+    int count = last - first + 1;
+    for (auto it = std::lower_bound(m_rows.begin(), m_rows.end(), first); it != m_rows.end(); ++it)
+    {
+        *it -= count;
+    }
+}
+
+// Имя пользователя не меняется, поэтому изменение данных не влияет на фильтр
+void UsersFilterModel::onDataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight, const QVector<int> &roles)
+{
+    auto begin = std::lower_bound(m_rows.begin(), m_rows.end(), topLeft.row());
+    auto end = std::upper_bound(begin, m_rows.end(), bottomRight.row());
+    if (begin == end)
+    {
+        return;
+    }
+    emit dataChanged(createIndex(int(begin - m_rows.begin()), 0), createIndex(int(end - m_rows.begin()) - 1, 0), roles);
+}
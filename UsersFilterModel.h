@@ -0,0 +1,51 @@
+#pragma once
+
+#include <QAbstractProxyModel>
+#include <QString>
+
+#include <vector>
+
+class UsersListModel;
+
+// Фильтр UsersListModel по подстроке имени (без учёта регистра).
+// В отличие от QSortFilterProxyModel не проверяет весь список на каждое нажатие клавиши:
+// если новый фильтр уточняет прежний, проверяются только показанные строки,
+// если ослабляет - только скрытые. Изменения исходной модели переносятся точными сигналами.
+class UsersFilterModel : public QAbstractProxyModel
+{
+    Q_OBJECT
+
+public:
+    explicit UsersFilterModel(UsersListModel *source, QObject *parent = nullptr);
+
+    QModelIndex index(int row, int column, const QModelIndex &parent = QModelIndex()) const override;
+    QModelIndex parent(const QModelIndex &child) const override;
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const override;
+
+    QModelIndex mapToSource(const QModelIndex &proxyIndex) const override;
+    QModelIndex mapFromSource(const QModelIndex &sourceIndex) const override;
+
+    const QString &filterText() const { return m_filter; }
+
+public slots:
+    void setFilterText(const QString &text);
+
+private:
+    // Больше разрозненных кусков - дешевле сбросить модель, чем слать сигнал на каждый
+    static constexpr size_t kMaxPreciseRuns = 64;
+
+    bool accepts(int sourceRow, const QString &filter) const;
+    void narrow(const QString &filter);
+    void widen(const QString &filter);
+    void refilter(const QString &filter);
+
+    void onRowsInserted(const QModelIndex &parent, int first, int last);
+    void onRowsAboutToBeRemoved(const QModelIndex &parent, int first, int last);
+    void onRowsRemoved(const QModelIndex &parent, int first, int last);
+    void onDataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight, const QVector<int> &roles);
+
+    UsersListModel     *m_source;
+    QString             m_filter;     // в нижнем регистре
+    std::vector<int>    m_rows;       // строки исходной модели по возрастанию
+};
@@ -0,0 +1,304 @@
+#include "UsersListModel.h"
+
+#include <algorithm>
+
+UsersListModel::UsersListModel(QObject *parent)
+    : QAbstractListModel(parent)
+{
+}
+
+int UsersListModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : int(m_rows.size());
+}
+
+QVariant UsersListModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= int(m_rows.size()))
+    {
+        return QVariant();
+    }
+
+    quint32 userId = m_rows[size_t(index.row())];
+    const User &user = m_users[userId];
+    switch (role)
+    {
+    case Qt::DisplayRole:
+        return user.m_name;
+    case Qt::ToolTipRole:
+        return user.m_status == user_chat::cst_not_disturb ? tr("Do not disturb") : tr("Online");
+    case UserIdRole:
+        return userId;
+    case StatusRole:
+        return int(user.m_status);
+    default:
+        return QVariant();
+    }
+}
+
+QHash<int, QByteArray> UsersListModel::roleNames() const
+{
+    QHash<int, QByteArray> roles = QAbstractListModel::roleNames();
+    roles[UserIdRole] = "userId";
+    roles[StatusRole] = "status";
+    return roles;
+}
+
+void UsersListModel::setUsers(const std::vector<user_chat::UserStatus> &users)
+{
+    std::vector<User> table;
+    for (const user_chat::UserStatus &status : users)
+    {
+        if (status.m_userId >= table.size())
+        {
+            table.resize(status.m_userId + 1);
+        }
+        User &user = table[status.m_userId];
+        user.m_name = QString::fromStdString(status.m_playerName);
+        user.m_foldedName = user.m_name.toCaseFolded();
+        user.m_status = status.m_status;
+        user.m_isListed = status.m_status != user_chat::cst_offline;
+    }
+
+    if (m_rows.empty())
+    {
+        beginResetModel();
+        m_users = std::move(table);
+        rebuildRows();
+        endResetModel();
+        return;
+    }
+    reconcileRows(std::move(table));
+}
+
+void UsersListModel::applyChanges(const std::vector<user_chat::UserStatus> &changes)
+{
+    if (changes.size() <= kMaxPreciseChanges)
+    {
+        for (const user_chat::UserStatus &change : changes)
+        {
+            applyChange(change);
+        }
+        return;
+    }
+
+    beginResetModel();
+    for (const user_chat::UserStatus &change : changes)
+    {
+        User &user = userFor(change);
+        user.m_status = change.m_status;
+        user.m_isListed = change.m_status != user_chat::cst_offline;
+    }
+    rebuildRows();
+    endResetModel();
+}
+
+void UsersListModel::clear()
+{
+    beginResetModel();
+    m_users.clear();
+    m_rows.clear();
+    endResetModel();
+}
+
+std::vector<user_chat::UserStatus> UsersListModel::users() const
+{
+    std::vector<user_chat::UserStatus> users;
+    users.reserve(m_rows.size());
+    for (quint32 userId : m_rows)
+    {
+        const User &user = m_users[userId];
+        users.push_back(user_chat::UserStatus{userId, user.m_name.toStdString(), user.m_status});
+    }
+    return users;
+}
+
+int UsersListModel::rowOf(quint32 userId) const
+{
+    if (userId >= m_users.size() || !m_users[userId].m_isListed)
+    {
+        return -1;
+    }
+    return int(lowerBound(userId));
+}
+
+void UsersListModel::applyChange(const user_chat::UserStatus &change)
+{
+    User &user = userFor(change);
+    bool isListed = change.m_status != user_chat::cst_offline;
+
+    if (user.m_isListed && isListed)
+    {
+        if (user.m_status != change.m_status)
+        {
+            user.m_status = change.m_status;
+            QModelIndex index = createIndex(int(lowerBound(change.m_userId)), 0);
+            emit dataChanged(index, index, {Qt::ToolTipRole, StatusRole});
+        }
+        return;
+    }
+
+    user.m_status = change.m_status;
+    if (isListed)
+    {
+        int row = int(lowerBound(change.m_userId));
+        beginInsertRows(QModelIndex(), row, row);
+        m_rows.insert(m_rows.begin() + row, change.m_userId);
+        user.m_isListed = true;
+        endInsertRows();
+    }
+    else if (user.m_isListed)
+    {
+        int row = int(lowerBound(change.m_userId));
+        beginRemoveRows(QModelIndex(), row, row);
+        m_rows.erase(m_rows.begin() + row);
+        user.m_isListed = false;
+        endRemoveRows();
+    }
+}
+
+// Сверка по имени с новой таблицей, id в которой могут не совпадать с прежними
+void UsersListModel::reconcileRows(std::vector<User> &&users)
+{
+    std::vector<quint32> rows;
+    QHash<QString, quint32> idByName;
+    for (quint32 userId = 0; userId < users.size(); userId++)
+    {
+        if (users[userId].m_isListed)
+        {
+            rows.push_back(userId);
+            if (!users[userId].m_name.isEmpty())
+            {
+                idByName.insert(users[userId].m_name, userId);
+            }
+        }
+    }
+
+    // Строки с новыми id; пропавшие пользователи временно дописываются в конец таблицы
+    std::vector<bool> isChanged(m_rows.size());
+    size_t removedCount = 0;
+    quint32 newEnd = quint32(users.size());
+    for (size_t row = 0; row < m_rows.size(); row++)
+    {
+        User &old = m_users[m_rows[row]];
+        auto it = idByName.constFind(old.m_name);
+        if (it != idByName.constEnd() && !old.m_name.isEmpty())
+        {
+            isChanged[row] = it.value() != m_rows[row] || users[it.value()].m_status != old.m_status;
+            m_rows[row] = it.value();
+            continue;
+        }
+        m_rows[row] = quint32(users.size());
+        users.push_back(std::move(old));
+        removedCount++;
+    }
+    size_t insertedCount = rows.size() - (m_rows.size() - removedCount);
+
+    m_users = std::move(users);
+    std::sort(rows.begin(), rows.end(), [this](quint32 left, quint32 right)
+              {
+                  return isBefore(left, right);
+              });
+
+    if (removedCount + insertedCount > kMaxPreciseChanges)
+    {
+        beginResetModel();
+        m_rows = std::move(rows);
+        m_users.resize(newEnd);
+        endResetModel();
+        return;
+    }
+
+    // Обе последовательности упорядочены одинаково: слияние даёт точные вставки и удаления
+    size_t row = 0;
+    size_t next = 0;
+    int firstChanged = -1;
+    int lastChanged = -1;
+    while (row < m_rows.size() || next < rows.size())
+    {
+        if (row < m_rows.size() && m_rows[row] >= newEnd)
+        {
+            beginRemoveRows(QModelIndex(), int(row), int(row));
+            m_rows.erase(m_rows.begin() + row);
+            isChanged.erase(isChanged.begin() + row);
+            endRemoveRows();
+        }
+        else if (row < m_rows.size() && m_rows[row] == rows[next])
+        {
+            if (isChanged[row])
+            {
+                firstChanged = firstChanged < 0 ? int(row) : firstChanged;
+                lastChanged = int(row);
+            }
+            row++;
+            next++;
+        }
+        else
+        {
+            beginInsertRows(QModelIndex(), int(row), int(row));
+            m_rows.insert(m_rows.begin() + row, rows[next]);
+            isChanged.insert(isChanged.begin() + row, false);
+            endInsertRows();
+            row++;
+            next++;
+        }
+    }
+    m_users.resize(newEnd);
+
+    // Смена id и статусов оставшихся строк - одним сигналом
+    if (firstChanged >= 0)
+    {
+        emit dataChanged(createIndex(firstChanged, 0), createIndex(lastChanged, 0), {Qt::ToolTipRole, UserIdRole, StatusRole});
+    }
+}
+
+UsersListModel::User &UsersListModel::userFor(const user_chat::UserStatus &status)
+{
+    if (status.m_userId >= m_users.size())
+    {
+        m_users.resize(status.m_userId + 1);
+    }
+    User &user = m_users[status.m_userId];
+    if (user.m_name.isEmpty() && !status.m_playerName.empty())
+    {
+        user.m_name = QString::fromStdString(status.m_playerName);
+        user.m_foldedName = user.m_name.toCaseFolded();
+    }
+    return user;
+}
+
+// При равных именах без учёта регистра - по точному имени, чтобы порядок не зависел от id
+bool UsersListModel::isBefore(quint32 left, quint32 right) const
+{
+    int order = m_users[left].m_foldedName.compare(m_users[right].m_foldedName);
+    if (order == 0)
+    {
+        order = m_users[left].m_name.compare(m_users[right].m_name);
+    }
+    return order != 0 ? order < 0 : left < right;
+}
+
+size_t UsersListModel::lowerBound(quint32 userId) const
+{
+    auto it = std::lower_bound(m_rows.begin(), m_rows.end(), userId, [this](quint32 left, quint32 right)
+                               {
+                                   return isBefore(left, right);
+                               });
+    return size_t(it - m_rows.begin());
+}
+
+void UsersListModel::rebuildRows()
+{
+    m_rows.clear();
+    for (quint32 userId = 0; userId < m_users.size(); userId++)
+    {
+        if (m_users[userId].m_isListed)
+        {
+            m_rows.push_back(userId);
+        }
+    }
+    std::sort(m_rows.begin(), m_rows.end(), [this](quint32 left, quint32 right)
+              {
+                  return isBefore(left, right);
+              });
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "ChatClientPackets.h"
+
+#include <QAbstractListModel>
+#include <QString>
+
+#include <vector>
+
+// Список пользователей в сети, отсортированный по имени без учёта регистра.
+// Изменения статусов применяются по одному: строка ищется двоичным поиском,
+// модель получает точные rowsInserted/rowsRemoved/dataChanged.
+// Порядок зависит только от имени, поэтому смена статуса строку не перемещает.
+// Пользователь со статусом cst_offline из списка убирается.
+class UsersListModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+public:
+    enum Roles
+    {
+        UserIdRole = Qt::UserRole + 1,
+        StatusRole,
+    };
+
+    explicit UsersListModel(QObject *parent = nullptr);
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+    QHash<int, QByteArray> roleNames() const override;
+
+    // Полный список (вход или переподключение). Если модель уже заполнена (например, из кэша
+    // с прежними id), строки сверяются по имени: меняются только отличающиеся
+    void setUsers(const std::vector<user_chat::UserStatus> &users);
+
+    // Дельта присутствия; имена уже заполнены ChatClient
+    void applyChanges(const std::vector<user_chat::UserStatus> &changes);
+
+    void clear();
+
+    // Список в порядке строк (для кэша)
+    std::vector<user_chat::UserStatus> users() const;
+
+    // -1, если пользователя нет в списке. O(log n)
+    int rowOf(quint32 userId) const;
+
+    quint32 userIdAt(int row) const { return m_rows[size_t(row)]; }
+
+    // Имя в нижнем регистре - для сортировки и фильтра
+    const QString &foldedNameAt(int row) const { return m_users[m_rows[size_t(row)]].m_foldedName; }
+
+private:
+    struct User
+    {
+        QString                 m_name;
+        QString                 m_foldedName;
+        user_chat::ClientStatus m_status = user_chat::cst_offline;
+        bool                    m_isListed = false;
+    };
+
+    // Больше изменений за раз - дешевле перестроить список, чем слать сигнал на каждую строку
+    static constexpr size_t kMaxPreciseChanges = 256;
+
+    User &userFor(const user_chat::UserStatus &status);
+    bool isBefore(quint32 left, quint32 right) const;
+    size_t lowerBound(quint32 userId) const;
+    void applyChange(const user_chat::UserStatus &change);
+    void rebuildRows();
+    void reconcileRows(std::vector<User> &&users);
+
+    std::vector<User>       m_users; // по id пользователя (id плотные)
+    std::vector<quint32>    m_rows;  // id в порядке строк
+};
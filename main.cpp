@@ -5,7 +5,16 @@
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
+
+    // UserChat [имя [сервер [порт]]]
+    QStringList args = a.arguments();
+    QString userName = args.size() > 1 ? args[1] : QString::fromLocal8Bit(qgetenv("USER"));
+    QString host = args.size() > 2 ? args[2] : QStringLiteral("localhost");
+    QString port = args.size() > 3 ? args[3] : QStringLiteral("15001");
+
+    // Окно заполняется из кэша состояния и показывается до запроса пароля
     MainWindow w;
     w.show();
+    w.signIn(host, port, userName);
     return a.exec();
 }